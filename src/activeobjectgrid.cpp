@@ -0,0 +1,134 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "activeobjectgrid.h"
+#include <math.h>
+
+ActiveObjectGrid::ActiveObjectGrid(f32 cell_size):
+	m_cell_size(cell_size)
+{
+}
+
+void ActiveObjectGrid::insert(u16 id, v3f pos)
+{
+	if(m_object_cells.find(id) != m_object_cells.end())
+	{
+		update(id, pos);
+		return;
+	}
+	v3s16 cell = getCell(pos);
+	m_object_cells[id] = cell;
+	m_cells[cell].push_back(id);
+}
+
+void ActiveObjectGrid::remove(u16 id)
+{
+	std::map<u16, v3s16>::iterator i = m_object_cells.find(id);
+	if(i == m_object_cells.end())
+		return;
+
+	std::map<v3s16, std::vector<u16> >::iterator c = m_cells.find(i->second);
+	if(c != m_cells.end())
+	{
+		std::vector<u16> &ids = c->second;
+		for(u32 j=0; j<ids.size(); j++)
+		{
+			if(ids[j] != id)
+				continue;
+			ids[j] = ids.back();
+			ids.pop_back();
+			break;
+		}
+		if(ids.empty())
+			m_cells.erase(c);
+	}
+	m_object_cells.erase(i);
+}
+
+void ActiveObjectGrid::update(u16 id, v3f pos)
+{
+	std::map<u16, v3s16>::iterator i = m_object_cells.find(id);
+	if(i == m_object_cells.end())
+		return;
+	v3s16 cell = getCell(pos);
+	if(cell == i->second)
+		return;
+	remove(id);
+	m_object_cells[id] = cell;
+	m_cells[cell].push_back(id);
+}
+
+void ActiveObjectGrid::clear()
+{
+	m_cells.clear();
+	m_object_cells.clear();
+}
+
+void ActiveObjectGrid::getNear(v3f pos, f32 radius,
+		std::vector<u16> &dest) const
+{
+	v3s16 min = getCell(pos - v3f(radius, radius, radius));
+	v3s16 max = getCell(pos + v3f(radius, radius, radius));
+
+	// Huge radii cover more cells than there are; go through them all
+	f32 volume = (f32)(max.X - min.X + 1) * (max.Y - min.Y + 1)
+			* (max.Z - min.Z + 1);
+	if(volume > m_cells.size())
+	{
+		for(std::map<v3s16, std::vector<u16> >::const_iterator
+				i = m_cells.begin(); i != m_cells.end(); ++i)
+		{
+			const v3s16 &c = i->first;
+			if(c.X < min.X || c.X > max.X || c.Y < min.Y || c.Y > max.Y
+					|| c.Z < min.Z || c.Z > max.Z)
+				continue;
+			dest.insert(dest.end(), i->second.begin(), i->second.end());
+		}
+		return;
+	}
+
+	v3s16 c;
+	for(c.Z=min.Z; c.Z<=max.Z; c.Z++)
+	for(c.Y=min.Y; c.Y<=max.Y; c.Y++)
+	for(c.X=min.X; c.X<=max.X; c.X++)
+	{
+		std::map<v3s16, std::vector<u16> >::const_iterator
+				i = m_cells.find(c);
+		if(i != m_cells.end())
+			dest.insert(dest.end(), i->second.begin(), i->second.end());
+	}
+}
+
+// Also keeps NaN from being converted
+static s16 clampCell(f32 c)
+{
+	if(!(c > -32767))
+		return -32767;
+	if(!(c < 32767))
+		return 32767;
+	return c;
+}
+
+v3s16 ActiveObjectGrid::getCell(v3f pos) const
+{
+	return v3s16(
+			clampCell(floor(pos.X / m_cell_size)),
+			clampCell(floor(pos.Y / m_cell_size)),
+			clampCell(floor(pos.Z / m_cell_size)));
+}
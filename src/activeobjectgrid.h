@@ -0,0 +1,66 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ACTIVEOBJECTGRID_HEADER
+#define ACTIVEOBJECTGRID_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <map>
+#include <vector>
+
+/*
+	Spatial index of active object ids by position, for radius queries
+	that don't have to look at every object.
+
+	Objects are kept in cubic cells of a fixed size. An object is only
+	moved between cells when it crosses a cell border, so updating an
+	object that stays in its cell is a single lookup.
+*/
+class ActiveObjectGrid
+{
+public:
+	ActiveObjectGrid(f32 cell_size);
+
+	void insert(u16 id, v3f pos);
+	void remove(u16 id);
+	// Does nothing if the object is not in the grid
+	void update(u16 id, v3f pos);
+	void clear();
+
+	/*
+		Adds the objects in the cells touching the box around the
+		sphere; these are a superset of the objects inside the radius,
+		so the caller has to check the distance.
+	*/
+	void getNear(v3f pos, f32 radius, std::vector<u16> &dest) const;
+
+	u32 size() const
+	{
+		return m_object_cells.size();
+	}
+
+private:
+	v3s16 getCell(v3f pos) const;
+
+	f32 m_cell_size;
+	std::map<v3s16, std::vector<u16> > m_cells;
+	std::map<u16, v3s16> m_object_cells;
+};
+
+#endif
@@ -0,0 +1,262 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "blocksendset.h"
+#include "util/numeric.h"
+
+BlockSendSet::BlockSendSet():
+	m_center(0,0,0),
+	m_radius(-1),
+	m_width(0),
+	m_counts_valid(false)
+{
+}
+
+void BlockSendSet::setCenter(v3s16 center, s16 radius)
+{
+	if(radius < 0)
+		radius = 0;
+
+	if(radius != m_radius)
+	{
+		m_radius = radius;
+		m_width = 2 * radius + 1;
+		m_flags.assign((u32)m_width * m_width * m_width, 0);
+		m_unsent_count.assign(radius + 1, 0);
+		m_skipped.clear();
+		m_deferred.clear();
+		m_center = center;
+		refresh(center, true);
+		m_counts_valid = false;
+		return;
+	}
+
+	if(center == m_center)
+		return;
+
+	// What was skipped depended on the old center
+	clearFlag(m_skipped, FLAG_SKIPPED);
+	clearFlag(m_deferred, FLAG_DEFERRED);
+
+	v3s16 old_center = m_center;
+	m_center = center;
+	refresh(old_center, false);
+	m_counts_valid = false;
+}
+
+bool BlockSendSet::isSent(v3s16 p) const
+{
+	if(inCube(p, m_center))
+		return m_flags[cellIndex(p)] & FLAG_SENT;
+	return m_sent.find(p) != m_sent.end();
+}
+
+void BlockSendSet::setSent(v3s16 p)
+{
+	m_sent.insert(p);
+
+	if(!inCube(p, m_center))
+		return;
+	u8 &f = m_flags[cellIndex(p)];
+	if(f == 0)
+		countChanged(p, -1);
+	f = FLAG_SENT;
+}
+
+void BlockSendSet::setNotSent(v3s16 p)
+{
+	m_sent.erase(p);
+
+	if(!inCube(p, m_center))
+		return;
+	u8 &f = m_flags[cellIndex(p)];
+	if(f != 0)
+		countChanged(p, 1);
+	f = 0;
+}
+
+void BlockSendSet::setSkipped(v3s16 p)
+{
+	setFlag(p, FLAG_SKIPPED);
+}
+
+void BlockSendSet::clearSkipped()
+{
+	clearFlag(m_skipped, FLAG_SKIPPED);
+}
+
+void BlockSendSet::setDeferred(v3s16 p)
+{
+	setFlag(p, FLAG_DEFERRED);
+}
+
+u32 BlockSendSet::clearDeferred()
+{
+	return clearFlag(m_deferred, FLAG_DEFERRED);
+}
+
+u32 BlockSendSet::getUnsentCount(s16 d) const
+{
+	if(d < 0 || d > m_radius)
+		return 0;
+	if(!m_counts_valid)
+		recount();
+	return m_unsent_count[d];
+}
+
+s16 BlockSendSet::findUnsentDistance(s16 d) const
+{
+	if(d < 0)
+		d = 0;
+	if(!m_counts_valid)
+		recount();
+	for(; d <= m_radius; d++)
+		if(m_unsent_count[d] != 0)
+			return d;
+	return m_radius + 1;
+}
+
+void BlockSendSet::getUnsent(s16 d, std::list<v3s16> &dest) const
+{
+	if(getUnsentCount(d) == 0)
+		return;
+
+	// Walk the faces of the box shell; inner rows only have their ends
+	for(s16 y=-d; y<=d; y++)
+	for(s16 z=-d; z<=d; z++)
+	{
+		bool whole_row = (y == -d || y == d || z == -d || z == d);
+		s16 step = whole_row ? 1 : 2 * d;
+		for(s16 x=-d; x<=d; x+=step)
+		{
+			v3s16 p = m_center + v3s16(x,y,z);
+			if(m_flags[cellIndex(p)] == 0)
+				dest.push_back(v3s16(x,y,z));
+		}
+	}
+}
+
+bool BlockSendSet::inCube(v3s16 p, v3s16 center) const
+{
+	return m_radius >= 0
+			&& abs(p.X - center.X) <= m_radius
+			&& abs(p.Y - center.Y) <= m_radius
+			&& abs(p.Z - center.Z) <= m_radius;
+}
+
+u32 BlockSendSet::cellIndex(v3s16 p) const
+{
+	s32 x = p.X % m_width;
+	s32 y = p.Y % m_width;
+	s32 z = p.Z % m_width;
+	if(x < 0) x += m_width;
+	if(y < 0) y += m_width;
+	if(z < 0) z += m_width;
+	return ((u32)z * m_width + y) * m_width + x;
+}
+
+void BlockSendSet::setFlag(v3s16 p, u8 flag)
+{
+	if(!inCube(p, m_center))
+		return;
+	u8 &f = m_flags[cellIndex(p)];
+	if(f != 0)
+		return;
+	countChanged(p, -1);
+	f = flag;
+	if(flag == FLAG_DEFERRED)
+		m_deferred.push_back(p);
+	else
+		m_skipped.push_back(p);
+}
+
+u32 BlockSendSet::clearFlag(std::vector<v3s16> &list, u8 flag)
+{
+	u32 count = 0;
+	for(u32 i=0; i<list.size(); i++)
+	{
+		v3s16 p = list[i];
+		if(!inCube(p, m_center))
+			continue;
+		u8 &f = m_flags[cellIndex(p)];
+		// Sent or marked not sent since
+		if(!(f & flag))
+			continue;
+		f = 0;
+		countChanged(p, 1);
+		count++;
+	}
+	list.clear();
+	return count;
+}
+
+s16 BlockSendSet::distance(v3s16 p) const
+{
+	v3s16 r = p - m_center;
+	return MYMAX(MYMAX(abs(r.X), abs(r.Y)), abs(r.Z));
+}
+
+void BlockSendSet::refresh(v3s16 old_center, bool all)
+{
+	s16 r = m_radius;
+	v3s16 p;
+	for(p.Z=m_center.Z-r; p.Z<=m_center.Z+r; p.Z++)
+	for(p.Y=m_center.Y-r; p.Y<=m_center.Y+r; p.Y++)
+	{
+		if(all || abs(p.Z - old_center.Z) > r || abs(p.Y - old_center.Y) > r)
+		{
+			for(p.X=m_center.X-r; p.X<=m_center.X+r; p.X++)
+				fillCell(p);
+			continue;
+		}
+		// The row was in the old cube except for what is past its ends
+		for(p.X=m_center.X-r; p.X<=m_center.X+r && p.X<old_center.X-r; p.X++)
+			fillCell(p);
+		for(p.X=MYMAX(m_center.X-r, old_center.X+r+1); p.X<=m_center.X+r; p.X++)
+			fillCell(p);
+	}
+}
+
+void BlockSendSet::fillCell(v3s16 p)
+{
+	m_flags[cellIndex(p)] = (m_sent.find(p) != m_sent.end()) ? FLAG_SENT : 0;
+}
+
+void BlockSendSet::countChanged(v3s16 p, s32 change)
+{
+	if(m_counts_valid)
+		m_unsent_count[distance(p)] += change;
+}
+
+void BlockSendSet::recount() const
+{
+	for(s16 d=0; d<=m_radius; d++)
+		m_unsent_count[d] = 0;
+
+	v3s16 p;
+	for(p.Z=m_center.Z-m_radius; p.Z<=m_center.Z+m_radius; p.Z++)
+	for(p.Y=m_center.Y-m_radius; p.Y<=m_center.Y+m_radius; p.Y++)
+	for(p.X=m_center.X-m_radius; p.X<=m_center.X+m_radius; p.X++)
+	{
+		if(m_flags[cellIndex(p)] == 0)
+			m_unsent_count[distance(p)]++;
+	}
+	m_counts_valid = true;
+}
@@ -0,0 +1,113 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef BLOCKSENDSET_HEADER
+#define BLOCKSENDSET_HEADER
+
+#include "irrlichttypes.h"
+#include "irr_v3d.h"
+#include <list>
+#include <set>
+#include <vector>
+
+/*
+	Keeps track of the blocks that have been sent to a client.
+
+	All sent positions are kept in a set. In addition the cube of
+	blocks within the send radius around the client is mirrored in a
+	ring buffer of flags, addressed by position modulo the cube size, so
+	moving the center only refills the cells that enter the cube.
+	Per distance (the "d" of RemoteClient::GetNextBlocks, a box shell
+	around the center) it counts the blocks that still need to be
+	looked at, so shells with nothing left to send are passed in O(1).
+	Moving changes the distance of every cell, so the counts are redone
+	with one walk of the cube when they are next needed.
+
+	A block can also be marked skipped: not sent, but not worth looking
+	at again until the center moves or the block is marked not sent.
+	Deferred blocks are the same, except that they are kept apart so
+	they can be brought back with clearDeferred() once everything else
+	has been sent.
+*/
+class BlockSendSet
+{
+public:
+	BlockSendSet();
+
+	// Moves the tracked cube; cheap if neither argument changed
+	void setCenter(v3s16 center, s16 radius);
+
+	bool isSent(v3s16 p) const;
+	void setSent(v3s16 p);
+	void setNotSent(v3s16 p);
+	void setSkipped(v3s16 p);
+	// Makes all skipped blocks candidates again
+	void clearSkipped();
+	void setDeferred(v3s16 p);
+	// Makes all deferred blocks candidates again, returns their number
+	u32 clearDeferred();
+
+	// Number of blocks at distance d that are neither sent nor skipped
+	u32 getUnsentCount(s16 d) const;
+	// Nearest distance >= d with a block to look at, radius + 1 if none
+	s16 findUnsentDistance(s16 d) const;
+	// Adds the positions counted by getUnsentCount(d), relative to center
+	void getUnsent(s16 d, std::list<v3s16> &dest) const;
+
+	u32 size() const
+	{
+		return m_sent.size();
+	}
+
+private:
+	enum {
+		FLAG_SENT = 1,
+		FLAG_SKIPPED = 2,
+		FLAG_DEFERRED = 4
+	};
+
+	bool inCube(v3s16 p, v3s16 center) const;
+	u32 cellIndex(v3s16 p) const;
+	s16 distance(v3s16 p) const;
+	// Only marks unsent blocks that are neither skipped nor deferred
+	void setFlag(v3s16 p, u8 flag);
+	// Clears flag from the cells of the listed positions
+	u32 clearFlag(std::vector<v3s16> &list, u8 flag);
+	// Fills the cells that are not in the old cube
+	void refresh(v3s16 old_center, bool all);
+	void fillCell(v3s16 p);
+	// Counts are kept up to date once made
+	void countChanged(v3s16 p, s32 change);
+	void recount() const;
+
+	std::set<v3s16> m_sent;
+
+	v3s16 m_center;
+	// -1 until setCenter() is called
+	s16 m_radius;
+	s16 m_width;
+	std::vector<u8> m_flags;
+	// Positions set skipped or deferred, some may since have changed
+	std::vector<v3s16> m_skipped;
+	std::vector<v3s16> m_deferred;
+	mutable std::vector<u32> m_unsent_count;
+	mutable bool m_counts_valid;
+};
+
+#endif
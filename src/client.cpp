@@ -66,7 +66,9 @@ static std::string getMediaCacheDir()
 QueuedMeshUpdate::QueuedMeshUpdate():
 	p(-1337,-1337,-1337),
 	data(NULL),
-	ack_block_to_server(false)
+	ack_block_to_server(false),
+	urgent(false),
+	priority(0)
 {
 }
 
@@ -80,7 +82,8 @@ QueuedMeshUpdate::~QueuedMeshUpdate()
 	MeshUpdateQueue
 */
 	
-MeshUpdateQueue::MeshUpdateQueue()
+MeshUpdateQueue::MeshUpdateQueue():
+	m_center(0,0,0)
 {
 	m_mutex.Init();
 }
@@ -89,11 +92,11 @@ MeshUpdateQueue::~MeshUpdateQueue()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	for(std::vector<QueuedMeshUpdate*>::iterator
+	for(std::map<v3s16, QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
+		QueuedMeshUpdate *q = i->second;
 		delete q;
 	}
 }
@@ -109,27 +112,27 @@ void MeshUpdateQueue::addBlock(v3s16 p, MeshMakeData *data, bool ack_block_to_se
 
 	JMutexAutoLock lock(m_mutex);
 
-	if(urgent)
-		m_urgents.insert(p);
-
 	/*
 		Find if block is already in queue.
 		If it is, update the data and quit.
 	*/
-	for(std::vector<QueuedMeshUpdate*>::iterator
-			i = m_queue.begin();
-			i != m_queue.end(); i++)
-	{
-		QueuedMeshUpdate *q = *i;
-		if(q->p == p)
+	std::map<v3s16, QueuedMeshUpdate*>::iterator i = m_queue.find(p);
+	if(i != m_queue.end())
+	{
+		QueuedMeshUpdate *q = i->second;
+		if(q->data)
+			delete q->data;
+		q->data = data;
+		if(ack_block_to_server)
+			q->ack_block_to_server = true;
+		if(urgent && !q->urgent)
 		{
-			if(q->data)
-				delete q->data;
-			q->data = data;
-			if(ack_block_to_server)
-				q->ack_block_to_server = true;
-			return;
+			m_order.erase(std::make_pair(q->priority, p));
+			q->urgent = true;
+			q->priority = getPriority(p, true);
+			m_order.insert(std::make_pair(q->priority, p));
 		}
+		return;
 	}
 	
 	/*
@@ -139,30 +142,74 @@ void MeshUpdateQueue::addBlock(v3s16 p, MeshMakeData *data, bool ack_block_to_se
 	q->p = p;
 	q->data = data;
 	q->ack_block_to_server = ack_block_to_server;
-	m_queue.push_back(q);
+	q->urgent = urgent;
+	q->priority = getPriority(p, urgent);
+	m_queue[p] = q;
+	m_order.insert(std::make_pair(q->priority, p));
+
+	m_event.signal();
 }
 
-// Returned pointer must be deleted
-// Returns NULL if queue is empty
-QueuedMeshUpdate * MeshUpdateQueue::pop()
+void MeshUpdateQueue::setCenter(v3s16 center)
 {
 	JMutexAutoLock lock(m_mutex);
 
-	bool must_be_urgent = !m_urgents.empty();
-	for(std::vector<QueuedMeshUpdate*>::iterator
+	if(center == m_center)
+		return;
+	m_center = center;
+
+	m_order.clear();
+	for(std::map<v3s16, QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
-		if(must_be_urgent && m_urgents.count(q->p) == 0)
+		QueuedMeshUpdate *q = i->second;
+		q->priority = getPriority(q->p, q->urgent);
+		m_order.insert(std::make_pair(q->priority, q->p));
+	}
+}
+
+QueuedMeshUpdate * MeshUpdateQueue::pop()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(std::set<std::pair<u32, v3s16> >::iterator
+			i = m_order.begin();
+			i != m_order.end(); i++)
+	{
+		v3s16 p = i->second;
+		if(m_updating.count(p) != 0)
 			continue;
-		m_queue.erase(i);
-		m_urgents.erase(q->p);
+		m_order.erase(i);
+		std::map<v3s16, QueuedMeshUpdate*>::iterator n = m_queue.find(p);
+		QueuedMeshUpdate *q = n->second;
+		m_queue.erase(n);
+		m_updating.insert(p);
+		// Wake up another thread for the rest
+		if(!m_order.empty())
+			m_event.signal();
 		return q;
 	}
 	return NULL;
 }
 
+void MeshUpdateQueue::done(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_updating.erase(p);
+}
+
+u32 MeshUpdateQueue::getPriority(v3s16 p, bool urgent)
+{
+	if(urgent)
+		return 0;
+	s32 dx = p.X - m_center.X;
+	s32 dy = p.Y - m_center.Y;
+	s32 dz = p.Z - m_center.Z;
+	return 1 + dx * dx + dy * dy + dz * dz;
+}
+
 /*
 	MeshUpdateThread
 */
@@ -171,7 +218,7 @@ void * MeshUpdateThread::Thread()
 {
 	ThreadStarted();
 
-	log_register_thread("MeshUpdateThread");
+	log_register_thread("MeshUpdateThread" + itos(m_id));
 
 	DSTACK(__FUNCTION_NAME);
 	
@@ -179,23 +226,15 @@ void * MeshUpdateThread::Thread()
 
 	while(getRun())
 	{
-		/*// Wait for output queue to flush.
-		// Allow 2 in queue, this makes less frametime jitter.
-		// Umm actually, there is no much difference
-		if(m_queue_out.size() >= 2)
-		{
-			sleep_ms(3);
-			continue;
-		}*/
-
-		QueuedMeshUpdate *q = m_queue_in.pop();
+		QueuedMeshUpdate *q = m_queue_in->pop();
 		if(q == NULL)
 		{
-			sleep_ms(3);
+			m_queue_in->wait();
 			continue;
 		}
 
-		ScopeProfiler sp(g_profiler, "Client: Mesh making");
+		ScopeProfiler sp(g_profiler, q->data->m_low_detail ?
+				"Client: Mesh making (low detail)" : "Client: Mesh making");
 
 		MapBlockMesh *mesh_new = new MapBlockMesh(q->data);
 		if(mesh_new->getMesh()->getMeshBufferCount() == 0)
@@ -213,16 +252,85 @@ void * MeshUpdateThread::Thread()
 				<<"("<<q->p.X<<","<<q->p.Y<<","<<q->p.Z<<")"
 				<<std::endl;*/
 
-		m_queue_out.push_back(r);
+		m_queue_out->push_back(r);
+		m_queue_in->done(q->p);
 
 		delete q;
 	}
 
 	END_DEBUG_EXCEPTION_HANDLER(errorstream)
 
+	// The other threads wait on the same event, and signals can merge
+	// into one wakeup, so pass it on to the next thread that is stopping
+	m_queue_in->signal();
+
 	return NULL;
 }
 
+/*
+	MeshUpdateManager
+*/
+
+MeshUpdateManager::MeshUpdateManager()
+{
+}
+
+MeshUpdateManager::~MeshUpdateManager()
+{
+	stop();
+}
+
+void MeshUpdateManager::start()
+{
+	assert(m_threads.empty());
+
+	int nthreads;
+	if (g_settings->get("num_mesh_threads").empty()) {
+		int nprocs = porting::getNumberOfProcessors();
+		// leave a proc for the main thread
+		nthreads = (nprocs > 1) ? nprocs - 1 : 1;
+	} else {
+		nthreads = g_settings->getU16("num_mesh_threads");
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+
+	for (int i = 0; i != nthreads; i++) {
+		MeshUpdateThread *thread = new MeshUpdateThread(&m_queue_in,
+				&m_queue_out, i);
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+
+	infostream << "MeshUpdateManager: using " << nthreads << " threads" << std::endl;
+}
+
+void MeshUpdateManager::stop()
+{
+	for (unsigned int i = 0; i != m_threads.size(); i++)
+		m_threads[i]->setRun(false);
+	// Each thread signals again when it exits, see MeshUpdateThread::Thread()
+	m_queue_in.signal();
+	for (unsigned int i = 0; i != m_threads.size(); i++) {
+		m_threads[i]->stop();
+		delete m_threads[i];
+	}
+	m_threads.clear();
+
+	while(!m_queue_out.empty()) {
+		MeshUpdateResult r = m_queue_out.pop_front();
+		delete r.mesh;
+	}
+}
+
+bool MeshUpdateManager::isRunning()
+{
+	for (unsigned int i = 0; i != m_threads.size(); i++)
+		if (m_threads[i]->IsRunning())
+			return true;
+	return false;
+}
+
 void * MediaFetchThread::Thread()
 {
 	ThreadStarted();
@@ -283,7 +391,7 @@ Client::Client(
 	m_nodedef(nodedef),
 	m_sound(sound),
 	m_event(event),
-	m_mesh_update_thread(this),
+	m_mesh_update_manager(),
 	m_env(
 		new ClientMap(this, this, control,
 			device->getSceneManager()->getRootSceneNode(),
@@ -345,13 +453,7 @@ Client::~Client()
 		m_con.Disconnect();
 	}
 
-	m_mesh_update_thread.setRun(false);
-	while(m_mesh_update_thread.IsRunning())
-		sleep_ms(100);
-	while(!m_mesh_update_thread.m_queue_out.empty()) {
-		MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_front();
-		delete r.mesh;
-	}
+	m_mesh_update_manager.stop();
 
 
 	delete m_inventory_from_server;
@@ -607,6 +709,8 @@ void Client::step(float dtime)
 		/*if(deleted_blocks.size() > 0)
 			infostream<<"Client: Unloaded "<<deleted_blocks.size()
 					<<" unused blocks"<<std::endl;*/
+		if(deleted_blocks.size() > 0)
+			m_env.getClientMap().invalidateOcclusionCache();
 			
 		/*
 			Send info to server
@@ -738,18 +842,23 @@ void Client::step(float dtime)
 	{
 		//JMutexAutoLock lock(m_env_mutex); //bulk comment-out
 
+		// Make the blocks nearest to the player first
+		v3s16 player_blockpos = getNodeBlockPos(
+				floatToInt(m_env.getLocalPlayer()->getPosition(), BS));
+		m_mesh_update_manager.m_queue_in.setCenter(player_blockpos);
+
 		//TimeTaker timer("** Processing mesh update result queue");
 		// 0ms
 		
 		/*infostream<<"Mesh update result queue size is "
-				<<m_mesh_update_thread.m_queue_out.size()
+				<<m_mesh_update_manager.m_queue_out.size()
 				<<std::endl;*/
 		
 		int num_processed_meshes = 0;
-		while(!m_mesh_update_thread.m_queue_out.empty())
+		while(!m_mesh_update_manager.m_queue_out.empty())
 		{
 			num_processed_meshes++;
-			MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_front();
+			MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_front();
 			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(r.p);
 			if(block)
 			{
@@ -791,7 +900,10 @@ void Client::step(float dtime)
 			}
 		}
 		if(num_processed_meshes > 0)
+		{
 			g_profiler->graphAdd("num_processed_meshes", num_processed_meshes);
+			m_env.getClientMap().invalidateOcclusionCache();
+		}
 	}
 
 	/*
@@ -1654,9 +1766,9 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		std::string datastring((char*)&data[2], datasize-2);
 		std::istringstream is(datastring, std::ios_base::binary);
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		int num_files = readU16(is);
 		
@@ -1783,9 +1895,9 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		if (num_files == 0)
 			return;
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		for(u32 i=0; i<num_files; i++){
 			assert(m_media_received_count < m_media_count);
@@ -1840,9 +1952,9 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		infostream<<"Client: Received node definitions: packet size: "
 				<<datasize<<std::endl;
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress node definitions
 		std::string datastring((char*)&data[2], datasize-2);
@@ -1865,9 +1977,9 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		infostream<<"Client: Received item definitions: packet size: "
 				<<datasize<<std::endl;
 
-		// Mesh update thread must be stopped while
+		// Mesh update threads must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress item definitions
 		std::string datastring((char*)&data[2], datasize-2);
@@ -2799,17 +2911,34 @@ void Client::addUpdateMeshTask(v3s16 p, bool ack_to_server, bool urgent)
 		// Debug: 1-6ms, avg=2ms
 		data->fill(b);
 		data->setCrack(m_crack_level, m_crack_pos);
-		data->setSmoothLighting(g_settings->getBool("smooth_lighting"));
+		static SettingHandle<bool> smooth_lighting(g_settings,
+				"smooth_lighting");
+		static SettingHandle<float> low_detail_mesh_distance(g_settings,
+				"low_detail_mesh_distance");
+		data->setSmoothLighting(smooth_lighting.get());
+
+		// Blocks far away get a simpler mesh. ClientMap::updateDrawList()
+		// makes them again when the distance changes; both measure it
+		// from the camera.
+		float low_detail_distance = low_detail_mesh_distance.get();
+		if(low_detail_distance > 0)
+		{
+			v3f center = intToFloat(p * MAP_BLOCKSIZE
+					+ v3s16(1,1,1) * (MAP_BLOCKSIZE/2), BS);
+			f32 d = center.getDistanceFrom(
+					m_env.getClientMap().getCameraPosition());
+			data->setLowDetail(d > low_detail_distance * BS);
+		}
 	}
 
 	// Debug wait
-	//while(m_mesh_update_thread.m_queue_in.size() > 0) sleep_ms(10);
+	//while(m_mesh_update_manager.m_queue_in.size() > 0) sleep_ms(10);
 	
 	// Add task to queue
-	m_mesh_update_thread.m_queue_in.addBlock(p, data, ack_to_server, urgent);
+	m_mesh_update_manager.m_queue_in.addBlock(p, data, ack_to_server, urgent);
 
 	/*infostream<<"Mesh update input queue size is "
-			<<m_mesh_update_thread.m_queue_in.size()
+			<<m_mesh_update_manager.m_queue_in.size()
 			<<std::endl;*/
 }
 
@@ -2948,10 +3077,10 @@ void Client::afterContentReceived(IrrlichtDevice *device, gui::IGUIFont* font)
 		delete[] text;
 	}
 
-	// Start mesh update thread after setting up content definitions
-	infostream<<"- Starting mesh update thread"<<std::endl;
+	// Start mesh update threads after setting up content definitions
+	infostream<<"- Starting mesh update threads"<<std::endl;
 	if (!no_output)
-		m_mesh_update_thread.Start();
+		m_mesh_update_manager.start();
 	
 	infostream<<"Client::afterContentReceived() done"<<std::endl;
 }
@@ -63,13 +63,18 @@ struct QueuedMeshUpdate
 	v3s16 p;
 	MeshMakeData *data;
 	bool ack_block_to_server;
+	bool urgent;
+	// Key in MeshUpdateQueue::m_order, lower is updated first
+	u32 priority;
 
 	QueuedMeshUpdate();
 	~QueuedMeshUpdate();
 };
 
 /*
-	A thread-safe queue of mesh update tasks
+	A thread-safe queue of mesh update tasks, shared by the
+	MeshUpdateThreads. Urgent blocks are updated first, then the ones
+	nearest to the camera.
 */
 class MeshUpdateQueue
 {
@@ -84,9 +89,26 @@ class MeshUpdateQueue
 	void addBlock(v3s16 p, MeshMakeData *data,
 			bool ack_block_to_server, bool urgent);
 
-	// Returned pointer must be deleted
-	// Returns NULL if queue is empty
+	// Sets the position of the camera in blocks and reorders the queue
+	void setCenter(v3s16 center);
+
+	// Returned pointer must be deleted and done() called for it.
+	// Blocks that are being updated by another thread are not returned
+	// until they are done, so that meshes are finished in order.
+	// Returns NULL if there is nothing to do.
 	QueuedMeshUpdate * pop();
+	void done(v3s16 p);
+
+	// Waits until there may be something to pop()
+	void wait()
+	{
+		m_event.wait();
+	}
+	// Wakes up a thread in wait()
+	void signal()
+	{
+		m_event.signal();
+	}
 
 	u32 size()
 	{
@@ -95,9 +117,15 @@ class MeshUpdateQueue
 	}
 	
 private:
-	std::vector<QueuedMeshUpdate*> m_queue;
-	std::set<v3s16> m_urgents;
+	u32 getPriority(v3s16 p, bool urgent);
+
+	std::map<v3s16, QueuedMeshUpdate*> m_queue;
+	std::set<std::pair<u32, v3s16> > m_order;
+	// Blocks popped and not done yet
+	std::set<v3s16> m_updating;
+	v3s16 m_center;
 	JMutex m_mutex;
+	Event m_event;
 };
 
 struct MeshUpdateResult
@@ -118,18 +146,42 @@ class MeshUpdateThread : public SimpleThread
 {
 public:
 
-	MeshUpdateThread(IGameDef *gamedef):
-		m_gamedef(gamedef)
+	MeshUpdateThread(MeshUpdateQueue *queue_in,
+			MutexedQueue<MeshUpdateResult> *queue_out, int id):
+		m_queue_in(queue_in),
+		m_queue_out(queue_out),
+		m_id(id)
 	{
 	}
 
 	void * Thread();
 
+private:
+	MeshUpdateQueue *m_queue_in;
+	MutexedQueue<MeshUpdateResult> *m_queue_out;
+	int m_id;
+};
+
+/*
+	Makes the meshes of the blocks in m_queue_in in num_mesh_threads
+	MeshUpdateThreads and puts them in m_queue_out.
+*/
+class MeshUpdateManager
+{
+public:
+	MeshUpdateManager();
+	~MeshUpdateManager();
+
+	void start();
+	void stop();
+	bool isRunning();
+
 	MeshUpdateQueue m_queue_in;
 
 	MutexedQueue<MeshUpdateResult> m_queue_out;
 
-	IGameDef *m_gamedef;
+private:
+	std::vector<MeshUpdateThread*> m_threads;
 };
 
 class MediaFetchThread : public SimpleThread
@@ -491,7 +543,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	ISoundManager *m_sound;
 	MtEventManager *m_event;
 
-	MeshUpdateThread m_mesh_update_thread;
+	MeshUpdateManager m_mesh_update_manager;
 	std::list<MediaFetchThread*> m_media_fetch_threads;
 	ClientEnvironment m_env;
 	con::Connection m_con;
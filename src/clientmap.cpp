@@ -48,7 +48,8 @@ ClientMap::ClientMap(
 	m_control(control),
 	m_camera_position(0,0,0),
 	m_camera_direction(0,0,1),
-	m_camera_fov(M_PI)
+	m_camera_fov(M_PI),
+	m_occlusion_serial(1)
 {
 	m_camera_mutex.Init();
 	assert(m_camera_mutex.IsInitialized());
@@ -158,6 +159,34 @@ static bool isOccluded(Map *map, v3s16 p0, v3s16 p1, float step, float stepfac,
 	return false;
 }
 
+/*
+	Adds the blocks of the sector from y_min to y_max that may be in sight
+	to dest. The range is tested as a whole and halved until it is short
+	enough that testing the blocks one by one is cheaper.
+*/
+void ClientMap::cullSectorBlocks(MapSector *sector, s16 y_min, s16 y_max,
+		v3f camera_position, v3f camera_direction, f32 camera_fov,
+		f32 range, u32 &ranges_tested, std::vector<MapBlock*> &dest)
+{
+	if(y_max - y_min < 4)
+	{
+		sector->getBlocks(y_min, y_max, dest);
+		return;
+	}
+
+	ranges_tested++;
+	v2s16 sp = sector->getPos();
+	if(isBlockAreaInSight(v3s16(sp.X, y_min, sp.Y), v3s16(sp.X, y_max, sp.Y),
+			camera_position, camera_direction, camera_fov, range) == false)
+		return;
+
+	s16 y_mid = y_min + (y_max - y_min) / 2;
+	cullSectorBlocks(sector, y_min, y_mid, camera_position,
+			camera_direction, camera_fov, range, ranges_tested, dest);
+	cullSectorBlocks(sector, y_mid + 1, y_max, camera_position,
+			camera_direction, camera_fov, range, ranges_tested, dest);
+}
+
 void ClientMap::updateDrawList(video::IVideoDriver* driver)
 {
 	ScopeProfiler sp(g_profiler, "CM::updateDrawList()", SPT_AVG);
@@ -202,7 +231,8 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 	
 	// Number of blocks in rendering range
 	u32 blocks_in_range = 0;
-	// Number of blocks occlusion culled
+	// Number of blocks occlusion tested and culled
+	u32 blocks_occlusion_tested = 0;
 	u32 blocks_occlusion_culled = 0;
 	// Number of blocks in rendering range but don't have a mesh
 	u32 blocks_in_range_without_mesh = 0;
@@ -218,24 +248,80 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 	// Distance to farthest drawn block
 	float farthest_drawn = 0;
 
-	for(std::map<v2s16, MapSector*>::iterator
-			si = m_sectors.begin();
-			si != m_sectors.end(); ++si)
+	float range = 100000 * BS;
+	if(m_control.range_all == false)
+		range = m_control.wanted_range * BS;
+
+	static SettingHandle<float> low_detail_mesh_distance(g_settings,
+			"low_detail_mesh_distance");
+	static SettingHandle<bool> free_move(g_settings, "free_move");
+
+	// See Client::addUpdateMeshTask()
+	float low_detail_distance = low_detail_mesh_distance.get() * BS;
+	// Number of meshes queued to change their level of detail
+	u32 detail_updates = 0;
+
+	// No occlusion culling when free_move is on and camera is
+	// inside ground
+	bool occlusion_culling_enabled = true;
+	if(free_move.get()){
+		MapNode n = getNodeNoEx(cam_pos_nodes);
+		if(n.getContent() == CONTENT_IGNORE ||
+				nodemgr->get(n).solidness == 2)
+			occlusion_culling_enabled = false;
+	}
+
+	/*
+		Get the sectors in range, a row of the sector map at a time
+	*/
+	std::vector<MapSector*> sectors;
+	if(m_control.range_all)
+	{
+		for(std::map<v2s16, MapSector*>::iterator
+				si = m_sectors.begin();
+				si != m_sectors.end(); ++si)
+			sectors.push_back(si->second);
+	}
+	else
 	{
-		MapSector *sector = si->second;
+		for(s16 x = p_blocks_min.X; x <= p_blocks_max.X; x++)
+		{
+			std::map<v2s16, MapSector*>::iterator
+					si = m_sectors.lower_bound(v2s16(x, p_blocks_min.Z));
+			for(; si != m_sectors.end() && si->first.X == x
+					&& si->first.Y <= p_blocks_max.Z; ++si)
+				sectors.push_back(si->second);
+		}
+	}
+
+	// Number of ranges of blocks tested as a whole
+	u32 ranges_tested = 0;
+	// Number of blocks tested one by one
+	u32 blocks_tested = 0;
+
+	std::vector<MapBlock*> sectorblocks;
+	for(std::vector<MapSector*>::iterator
+			si = sectors.begin();
+			si != sectors.end(); ++si)
+	{
+		MapSector *sector = *si;
 		v2s16 sp = sector->getPos();
-		
+
+		s16 y_min, y_max;
+		if(sector->getBlockRange(y_min, y_max) == false)
+			continue;
 		if(m_control.range_all == false)
 		{
-			if(sp.X < p_blocks_min.X
-			|| sp.X > p_blocks_max.X
-			|| sp.Y < p_blocks_min.Z
-			|| sp.Y > p_blocks_max.Z)
+			y_min = MYMAX(y_min, p_blocks_min.Y);
+			y_max = MYMIN(y_max, p_blocks_max.Y);
+			if(y_min > y_max)
 				continue;
 		}
 
-		std::list< MapBlock * > sectorblocks;
-		sector->getBlocks(sectorblocks);
+		sectorblocks.clear();
+		cullSectorBlocks(sector, y_min, y_max, camera_position,
+				camera_direction, camera_fov, range, ranges_tested,
+				sectorblocks);
 		
 		/*
 			Loop through blocks in sector
@@ -243,8 +329,9 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 
 		u32 sector_blocks_drawn = 0;
 		
-		std::list< MapBlock * >::iterator i;
-		for(i=sectorblocks.begin(); i!=sectorblocks.end(); i++)
+		for(std::vector<MapBlock*>::iterator
+				i = sectorblocks.begin();
+				i != sectorblocks.end(); ++i)
 		{
 			MapBlock *block = *i;
 
@@ -253,10 +340,7 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 				if not seen on display
 			*/
 			
-			float range = 100000 * BS;
-			if(m_control.range_all == false)
-				range = m_control.wanted_range * BS;
-
+			blocks_tested++;
 			float d = 0.0;
 			if(isBlockInSight(block->getPos(), camera_position,
 					camera_direction, camera_fov,
@@ -285,49 +369,47 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 			}
 
 			/*
-				Occlusion culling
+				Occlusion culling, reusing the last result while the
+				camera stays in the same node and the map is the same
 			*/
 
-			// No occlusion culling when free_move is on and camera is
-			// inside ground
-			bool occlusion_culling_enabled = true;
-			if(g_settings->getBool("free_move")){
-				MapNode n = getNodeNoEx(cam_pos_nodes);
-				if(n.getContent() == CONTENT_IGNORE ||
-						nodemgr->get(n).solidness == 2)
-					occlusion_culling_enabled = false;
+			if(occlusion_culling_enabled &&
+					(block->occluded_serial != m_occlusion_serial ||
+					block->occluded_camera_pos != cam_pos_nodes))
+			{
+				v3s16 cpn = block->getPos() * MAP_BLOCKSIZE;
+				cpn += v3s16(MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2);
+				float step = BS*1;
+				float stepfac = 1.1;
+				float startoff = BS*1;
+				float endoff = -BS*MAP_BLOCKSIZE*1.42*1.42;
+				v3s16 spn = cam_pos_nodes + v3s16(0,0,0);
+				s16 bs2 = MAP_BLOCKSIZE/2 + 1;
+				u32 needed_count = 1;
+				block->occluded =
+					isOccluded(this, spn, cpn + v3s16(0,0,0),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(bs2,bs2,bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(bs2,bs2,-bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(bs2,-bs2,bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(bs2,-bs2,-bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(-bs2,bs2,bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(-bs2,bs2,-bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr) &&
+					isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,-bs2),
+						step, stepfac, startoff, endoff, needed_count, nodemgr);
+				block->occluded_camera_pos = cam_pos_nodes;
+				block->occluded_serial = m_occlusion_serial;
+				blocks_occlusion_tested++;
 			}
-
-			v3s16 cpn = block->getPos() * MAP_BLOCKSIZE;
-			cpn += v3s16(MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2, MAP_BLOCKSIZE/2);
-			float step = BS*1;
-			float stepfac = 1.1;
-			float startoff = BS*1;
-			float endoff = -BS*MAP_BLOCKSIZE*1.42*1.42;
-			v3s16 spn = cam_pos_nodes + v3s16(0,0,0);
-			s16 bs2 = MAP_BLOCKSIZE/2 + 1;
-			u32 needed_count = 1;
-			if(
-				occlusion_culling_enabled &&
-				isOccluded(this, spn, cpn + v3s16(0,0,0),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,-bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(bs2,-bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr) &&
-				isOccluded(this, spn, cpn + v3s16(-bs2,-bs2,-bs2),
-					step, stepfac, startoff, endoff, needed_count, nodemgr)
-			)
+			if(occlusion_culling_enabled && block->occluded)
 			{
 				blocks_occlusion_culled++;
 				continue;
@@ -352,6 +434,25 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 			if(d/BS > farthest_drawn)
 				farthest_drawn = d/BS;
 
+			/*
+				Make the mesh again if it has the wrong level of detail,
+				with a block of slack to not do it back and forth. The
+				old mesh is drawn until the new one is done.
+			*/
+			MapBlockMesh *mesh = block->mesh;
+			if(mesh->detailUpdateRequested || detail_updates >= 16)
+				continue;
+			float slack = MAP_BLOCKSIZE * BS;
+			if(mesh->isLowDetail() ? (low_detail_distance <= 0 ||
+						d < low_detail_distance - slack) :
+					(low_detail_distance > 0 &&
+						d > low_detail_distance + slack))
+			{
+				mesh->detailUpdateRequested = true;
+				m_client->addUpdateMeshTask(block->getPos());
+				detail_updates++;
+			}
+
 		} // foreach sectorblocks
 
 		if(sector_blocks_drawn != 0)
@@ -362,12 +463,17 @@ void ClientMap::updateDrawList(video::IVideoDriver* driver)
 	m_control.blocks_drawn = blocks_drawn;
 	m_control.farthest_drawn = farthest_drawn;
 
+	g_profiler->avg("CM: sectors in range", sectors.size());
+	g_profiler->avg("CM: block ranges tested", ranges_tested);
+	g_profiler->avg("CM: blocks tested", blocks_tested);
 	g_profiler->avg("CM: blocks in range", blocks_in_range);
+	g_profiler->avg("CM: blocks occlusion tested", blocks_occlusion_tested);
 	g_profiler->avg("CM: blocks occlusion culled", blocks_occlusion_culled);
 	if(blocks_in_range != 0)
 		g_profiler->avg("CM: blocks in range without mesh (frac)",
 				(float)blocks_in_range_without_mesh/blocks_in_range);
 	g_profiler->avg("CM: blocks drawn", blocks_drawn);
+	g_profiler->avg("CM: mesh detail updates", detail_updates);
 	g_profiler->avg("CM: farthest drawn", farthest_drawn);
 	g_profiler->avg("CM: wanted max blocks", m_control.wanted_max_blocks);
 }
@@ -424,9 +530,13 @@ void ClientMap::renderMap(video::IVideoDriver* driver, s32 pass)
 		m_last_drawn_sectors.clear();
 	}
 
-	bool use_trilinear_filter = g_settings->getBool("trilinear_filter");
-	bool use_bilinear_filter = g_settings->getBool("bilinear_filter");
-	bool use_anisotropic_filter = g_settings->getBool("anisotropic_filter");
+	static SettingHandle<bool> trilinear_filter(g_settings, "trilinear_filter");
+	static SettingHandle<bool> bilinear_filter(g_settings, "bilinear_filter");
+	static SettingHandle<bool> anisotropic_filter(g_settings,
+			"anisotropic_filter");
+	bool use_trilinear_filter = trilinear_filter.get();
+	bool use_bilinear_filter = bilinear_filter.get();
+	bool use_anisotropic_filter = anisotropic_filter.get();
 
 	/*
 		Get time for measuring timeout.
@@ -871,7 +981,8 @@ void ClientMap::renderPostFx()
 	// - If the player is in liquid, draw a semi-transparent overlay.
 	const ContentFeatures& features = nodemgr->get(n);
 	video::SColor post_effect_color = features.post_effect_color;
-	if(features.solidness == 2 && !(g_settings->getBool("noclip") && m_gamedef->checkLocalPrivilege("noclip")))
+	static SettingHandle<bool> noclip(g_settings, "noclip");
+	if(features.solidness == 2 && !(noclip.get() && m_gamedef->checkLocalPrivilege("noclip")))
 	{
 		post_effect_color = video::SColor(255, 0, 0, 0);
 	}
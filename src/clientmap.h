@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include <set>
 #include <map>
+#include <vector>
 
 struct MapDrawControl
 {
@@ -94,6 +95,12 @@ class ClientMap : public Map, public scene::ISceneNode
 		m_camera_fov = fov;
 	}
 
+	v3f getCameraPosition()
+	{
+		JMutexAutoLock lock(m_camera_mutex);
+		return m_camera_position;
+	}
+
 	/*
 		Forcefully get a sector from somewhere
 	*/
@@ -122,6 +129,12 @@ class ClientMap : public Map, public scene::ISceneNode
 	}
 	
 	void updateDrawList(video::IVideoDriver* driver);
+	// Makes updateDrawList() test occlusion again; called when the
+	// map has changed
+	void invalidateOcclusionCache()
+	{
+		m_occlusion_serial++;
+	}
 	void renderMap(video::IVideoDriver* driver, s32 pass);
 
 	int getBackgroundBrightness(float max_d, u32 daylight_factor,
@@ -139,6 +152,10 @@ class ClientMap : public Map, public scene::ISceneNode
 	}
 	
 private:
+	void cullSectorBlocks(MapSector *sector, s16 y_min, s16 y_max,
+			v3f camera_position, v3f camera_direction, f32 camera_fov,
+			f32 range, u32 &ranges_tested, std::vector<MapBlock*> &dest);
+
 	Client *m_client;
 	
 	core::aabbox3d<f32> m_box;
@@ -150,6 +167,8 @@ class ClientMap : public Map, public scene::ISceneNode
 	f32 m_camera_fov;
 	JMutex m_camera_mutex;
 
+	u32 m_occlusion_serial;
+
 	std::map<v3s16, MapBlock*> m_drawlist;
 	
 	std::set<v2s16> m_last_drawn_sectors;
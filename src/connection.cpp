@@ -62,86 +62,40 @@ BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 			protocol_id, sender_peer_id, channel);
 }
 
-SharedBuffer<u8> makeOriginalPacket(
-		SharedBuffer<u8> data)
+void makeAutoSplitPacket(u16 peer_id, u8 channelnum,
+		SharedBuffer<u8> data, bool reliable,
+		u32 chunksize_max, u16 &split_seqnum,
+		std::list<OutgoingPacket> &dest)
 {
-	u32 header_size = 1;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
-
-	writeU8(&b[0], TYPE_ORIGINAL);
-
-	memcpy(&b[header_size], *data, data.getSize());
-
-	return b;
-}
-
-std::list<SharedBuffer<u8> > makeSplitPacket(
-		SharedBuffer<u8> data,
-		u32 chunksize_max,
-		u16 seqnum)
-{
-	// Chunk packets, containing the TYPE_SPLIT header
-	std::list<SharedBuffer<u8> > chunks;
-	
-	u32 chunk_header_size = 7;
-	u32 maximum_data_size = chunksize_max - chunk_header_size;
-	u32 start = 0;
-	u32 end = 0;
-	u32 chunk_num = 0;
-	u16 chunk_count = 0;
-	do{
-		end = start + maximum_data_size - 1;
-		if(end > data.getSize() - 1)
-			end = data.getSize() - 1;
-		
-		u32 payload_size = end - start + 1;
-		u32 packet_size = chunk_header_size + payload_size;
-
-		SharedBuffer<u8> chunk(packet_size);
-		
-		writeU8(&chunk[0], TYPE_SPLIT);
-		writeU16(&chunk[1], seqnum);
-		// [3] u16 chunk_count is written at next stage
-		writeU16(&chunk[5], chunk_num);
-		memcpy(&chunk[chunk_header_size], &data[start], payload_size);
-
-		chunks.push_back(chunk);
-		chunk_count++;
-		
-		start = end + 1;
-		chunk_num++;
-	}
-	while(end != data.getSize() - 1);
+	OutgoingPacket packet(peer_id, channelnum, data, reliable);
 
-	for(std::list<SharedBuffer<u8> >::iterator i = chunks.begin();
-		i != chunks.end(); ++i)
+	if(data.getSize() + ORIGINAL_HEADER_SIZE <= chunksize_max)
 	{
-		// Write chunk_count
-		writeU16(&((*i)[3]), chunk_count);
+		writeU8(&packet.header[0], TYPE_ORIGINAL);
+		packet.header_size = ORIGINAL_HEADER_SIZE;
+		dest.push_back(packet);
+		return;
 	}
 
-	return chunks;
-}
+	u32 maximum_data_size = chunksize_max - SPLIT_HEADER_SIZE;
+	u16 chunk_count = (data.getSize() + maximum_data_size - 1)
+			/ maximum_data_size;
 
-std::list<SharedBuffer<u8> > makeAutoSplitPacket(
-		SharedBuffer<u8> data,
-		u32 chunksize_max,
-		u16 &split_seqnum)
-{
-	u32 original_header_size = 1;
-	std::list<SharedBuffer<u8> > list;
-	if(data.getSize() + original_header_size > chunksize_max)
-	{
-		list = makeSplitPacket(data, chunksize_max, split_seqnum);
-		split_seqnum++;
-		return list;
-	}
-	else
+	writeU8(&packet.header[0], TYPE_SPLIT);
+	writeU16(&packet.header[1], split_seqnum);
+	writeU16(&packet.header[3], chunk_count);
+	packet.header_size = SPLIT_HEADER_SIZE;
+
+	for(u16 chunk_num=0; chunk_num<chunk_count; chunk_num++)
 	{
-		list.push_back(makeOriginalPacket(data));
+		writeU16(&packet.header[5], chunk_num);
+		packet.offset = chunk_num * maximum_data_size;
+		packet.size = MYMIN(maximum_data_size,
+				data.getSize() - packet.offset);
+		dest.push_back(packet);
 	}
-	return list;
+
+	split_seqnum++;
 }
 
 SharedBuffer<u8> makeReliablePacket(
@@ -170,70 +124,71 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
-ReliablePacketBuffer::ReliablePacketBuffer(): m_list_size(0) {}
-
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_slots(16, NULL),
+	m_first(0),
+	m_last(0),
+	m_size(0)
+{
+}
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	for(u32 i=0; i<m_slots.size(); i++)
+		delete m_slots[i];
+}
 void ReliablePacketBuffer::print()
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
+	if(empty())
+		return;
+	for(u16 s = m_first;; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		dout_con<<s<<" ";
+		if(m_slots[getSlot(s)] != NULL)
+			dout_con<<s<<" ";
+		if(s == m_last)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
-	return m_list.empty();
+	return m_size == 0;
 }
 u32 ReliablePacketBuffer::size()
 {
-	return m_list_size;
+	return m_size;
 }
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+BufferedPacket* ReliablePacketBuffer::findPacket(u16 seqnum)
 {
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
-	}
-	return i;
-}
-RPBSearchResult ReliablePacketBuffer::notFound()
-{
-	return m_list.end();
+	if(empty())
+		return NULL;
+	// Outside of the seqnums in the ring
+	if((u16)(seqnum - m_first) > (u16)(m_last - m_first))
+		return NULL;
+	return m_slots[getSlot(seqnum)];
 }
 bool ReliablePacketBuffer::getFirstSeqnum(u16 *result)
 {
 	if(empty())
 		return false;
-	BufferedPacket p = *m_list.begin();
-	*result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	*result = m_first;
 	return true;
 }
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
+	BufferedPacket p = *m_slots[getSlot(m_first)];
+	remove(m_first);
 	return p;
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	BufferedPacket *r = findPacket(seqnum);
+	if(r == NULL){
 		dout_con<<"Not found"<<std::endl;
 		throw NotFoundException("seqnum not found in buffer");
 	}
 	BufferedPacket p = *r;
-	m_list.erase(r);
-	--m_list_size;
+	remove(seqnum);
 	return p;
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p)
@@ -243,84 +198,127 @@ void ReliablePacketBuffer::insert(BufferedPacket &p)
 	assert(type == TYPE_RELIABLE);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
 
-	++m_list_size;
-	// Find the right place for the packet and insert it there
-
-	// If list is empty, just add it
-	if(m_list.empty())
+	if(empty())
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
+		m_first = seqnum;
+		m_last = seqnum;
 	}
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	for(; i != m_list.end(); ++i){
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		if(s == seqnum){
-			--m_list_size;
+	else
+	{
+		if(findPacket(seqnum) != NULL)
 			throw AlreadyExistsException("Same seqnum in list");
-		}
-		if(seqnum_higher(s, seqnum)){
-			break;
-		}
+		if(seqnum_higher(m_first, seqnum))
+			m_first = seqnum;
+		if(seqnum_higher(seqnum, m_last))
+			m_last = seqnum;
+		// The slots of the old packets are found from the new range
+		while((u32)(u16)(m_last - m_first) >= m_slots.size())
+			grow();
 	}
-	// If we're at the end of the list, add the packet to the
-	// end of the list
-	if(i == m_list.end())
-	{
-		m_list.push_back(p);
-		// Done.
+	m_slots[getSlot(seqnum)] = new BufferedPacket(p);
+	++m_size;
+}
+
+void ReliablePacketBuffer::remove(u16 seqnum)
+{
+	u32 i = getSlot(seqnum);
+	delete m_slots[i];
+	m_slots[i] = NULL;
+	--m_size;
+	if(empty())
 		return;
-	}
-	// Insert before i
-	m_list.insert(i, p);
+	// Move the ends over the removed packets
+	if(seqnum == m_first)
+		while(m_slots[getSlot(m_first)] == NULL)
+			m_first++;
+	if(seqnum == m_last)
+		while(m_slots[getSlot(m_last)] == NULL)
+			m_last--;
 }
 
-void ReliablePacketBuffer::incrementTimeouts(float dtime)
+void ReliablePacketBuffer::grow()
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	std::vector<BufferedPacket*> slots(m_slots.size() * 2, NULL);
+	for(u32 i=0; i<m_slots.size(); i++)
 	{
-		i->time += dtime;
-		i->totaltime += dtime;
+		BufferedPacket *p = m_slots[i];
+		if(p == NULL)
+			continue;
+		u16 seqnum = readU16(&(p->data[BASE_HEADER_SIZE+1]));
+		slots[seqnum & (slots.size() - 1)] = p;
 	}
+	m_slots.swap(slots);
 }
 
-void ReliablePacketBuffer::resetTimedOuts(float timeout)
+void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	for(u32 i=0; i<m_slots.size(); i++)
 	{
-		if(i->time >= timeout)
-			i->time = 0.0;
+		BufferedPacket *p = m_slots[i];
+		if(p == NULL)
+			continue;
+		p->time += dtime;
+		p->totaltime += dtime;
 	}
 }
 
 bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	for(u32 i=0; i<m_slots.size(); i++)
 	{
-		if(i->totaltime >= timeout)
+		BufferedPacket *p = m_slots[i];
+		if(p != NULL && p->totaltime >= timeout)
 			return true;
 	}
 	return false;
 }
 
-std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
+std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
+		u32 max_count)
 {
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return timed_outs;
+	u32 count = 0;
+	for(u16 s = m_first; count < max_count; s++)
 	{
-		if(i->time >= timeout)
-			timed_outs.push_back(*i);
+		BufferedPacket *p = m_slots[getSlot(s)];
+		if(p != NULL && p->time >= timeout)
+		{
+			p->time = 0.0;
+			p->resend_count++;
+			p->later_acks = 0;
+			timed_outs.push_back(*p);
+			count++;
+		}
+		if(s == m_last)
+			break;
 	}
 	return timed_outs;
 }
 
+std::list<BufferedPacket> ReliablePacketBuffer::getOvertaken(u16 seqnum,
+		float time, u16 ack_count)
+{
+	std::list<BufferedPacket> overtaken;
+	if(empty())
+		return overtaken;
+	for(u16 s = m_first; seqnum_higher(seqnum, s); s++)
+	{
+		BufferedPacket *p = m_slots[getSlot(s)];
+		if(p != NULL && p->time > time && ++p->later_acks == ack_count)
+		{
+			p->time = 0.0;
+			p->resend_count++;
+			p->later_acks = 0;
+			overtaken.push_back(*p);
+		}
+		if(s == m_last)
+			break;
+	}
+	return overtaken;
+}
+
 /*
 	IncomingSplitBuffer
 */
@@ -467,10 +465,14 @@ Peer::Peer(u16 a_id, Address a_address):
 	m_max_packets_per_second(10),
 	m_num_sent(0),
 	m_max_num_sent(0),
+	m_congestion_window(CONGESTION_WINDOW_INITIAL),
+	m_slow_start_threshold(CONGESTION_WINDOW_MAX),
+	m_loss_timer(0.0),
 	congestion_control_aim_rtt(0.2),
 	congestion_control_max_rate(400),
 	congestion_control_min_rate(10)
 {
+	m_mutex.Init();
 }
 Peer::~Peer()
 {
@@ -478,20 +480,6 @@ Peer::~Peer()
 
 void Peer::reportRTT(float rtt)
 {
-	if(rtt >= 0.0){
-		if(rtt < 0.01){
-			if(m_max_packets_per_second < congestion_control_max_rate)
-				m_max_packets_per_second += 10;
-		} else if(rtt < congestion_control_aim_rtt){
-			if(m_max_packets_per_second < congestion_control_max_rate)
-				m_max_packets_per_second += 2;
-		} else {
-			m_max_packets_per_second *= 0.8;
-			if(m_max_packets_per_second < congestion_control_min_rate)
-				m_max_packets_per_second = congestion_control_min_rate;
-		}
-	}
-
 	if(rtt < -0.999)
 	{}
 	else if(avg_rtt < 0.0)
@@ -516,7 +504,106 @@ void Peer::reportRTT(float rtt)
 		timeout = RESEND_TIMEOUT_MAX;
 	resend_timeout = timeout;
 }
+
+void Peer::reportAck(float rtt)
+{
+	if(rtt >= 0.0)
+		reportRTT(rtt);
+
+	if(rtt > congestion_control_aim_rtt){
+		// Packets are queueing up somewhere, back off by a packet
+		// per window of ACKs
+		m_congestion_window -= 1.0 / m_congestion_window;
+	} else if(m_congestion_window < m_slow_start_threshold){
+		m_congestion_window += 1.0;
+	} else {
+		m_congestion_window += 1.0 / m_congestion_window;
+	}
+	m_congestion_window = rangelim(m_congestion_window,
+			CONGESTION_WINDOW_MIN, CONGESTION_WINDOW_MAX);
+	updateSendRate();
+}
+
+void Peer::reportLoss()
+{
+	// The packets lost within a round trip are from the same congestion
+	if(m_loss_timer < avg_rtt)
+		return;
+	m_loss_timer = 0.0;
+	m_slow_start_threshold = MYMAX(m_congestion_window / 2,
+			CONGESTION_WINDOW_MIN);
+	m_congestion_window = m_slow_start_threshold;
+	updateSendRate();
+}
+
+u32 Peer::getReliablesInFlight()
+{
+	u32 count = 0;
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+	{
+		Channel *channel = &channels[i];
+		u16 firstseqnum;
+		if(channel->outgoing_reliables.getFirstSeqnum(&firstseqnum))
+			count += (u16)(channel->next_outgoing_seqnum - firstseqnum);
+	}
+	return count;
+}
+
+void Peer::updateSendRate()
+{
+	float rtt = MYMAX(avg_rtt, 0.01);
+	m_max_packets_per_second = rangelim(m_congestion_window / rtt,
+			congestion_control_min_rate, congestion_control_max_rate);
+}
 				
+/*
+	ConnectionWorker
+*/
+
+ConnectionWorker::ConnectionWorker(Connection *con, int id):
+	SimpleThread(),
+	m_con(con),
+	m_id(id)
+{
+	m_queue_mutex.Init();
+}
+
+void * ConnectionWorker::Thread()
+{
+	ThreadStarted();
+	log_register_thread("ConnectionWorker" + itos(m_id));
+
+	while(getRun())
+	{
+		m_queue_event.wait();
+
+		std::list<ReceivedPacket> packets;
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			packets.swap(m_queue);
+		}
+
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		for(std::list<ReceivedPacket>::iterator i = packets.begin();
+				i != packets.end(); ++i)
+			m_con->processReceived(*i);
+
+		END_DEBUG_EXCEPTION_HANDLER(derr_con);
+	}
+
+	return NULL;
+}
+
+void ConnectionWorker::putPacket(const ReceivedPacket &packet)
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		m_queue.push_back(packet);
+	}
+	m_queue_event.signal();
+}
+
 /*
 	Connection
 */
@@ -533,6 +620,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_indentation(0)
 {
 	m_socket.setTimeoutMs(5);
+	m_peers_mutex.Init();
+	createWorkers();
 
 	Start();
 }
@@ -549,6 +638,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_indentation(0)
 {
 	m_socket.setTimeoutMs(5);
+	m_peers_mutex.Init();
+	createWorkers();
 
 	Start();
 }
@@ -557,6 +648,12 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 Connection::~Connection()
 {
 	stop();
+	for(u32 i=0; i<m_workers.size(); i++){
+		m_workers[i]->setRun(false);
+		m_workers[i]->m_queue_event.signal();
+		m_workers[i]->stop();
+		delete m_workers[i];
+	}
 	// Delete peers
 	for(std::map<u16, Peer*>::iterator
 			j = m_peers.begin();
@@ -568,6 +665,16 @@ Connection::~Connection()
 
 /* Internal stuff */
 
+void Connection::createWorkers()
+{
+	u16 count = g_settings->getU16("num_connection_threads");
+	for(u16 i=0; i<count; i++){
+		ConnectionWorker *worker = new ConnectionWorker(this, i);
+		worker->Start();
+		m_workers.push_back(worker);
+	}
+}
+
 void * Connection::Thread()
 {
 	ThreadStarted();
@@ -654,260 +761,292 @@ void Connection::send(float dtime)
 			j != m_peers.end(); ++j)
 	{
 		Peer *peer = j->second;
+		JMutexAutoLock peerlock(peer->m_mutex);
 		peer->m_sendtime_accu += dtime;
 		peer->m_num_sent = 0;
 		peer->m_max_num_sent = peer->m_sendtime_accu *
 				peer->m_max_packets_per_second;
-	}
-	Queue<OutgoingPacket> postponed_packets;
-	while(!m_outgoing_queue.empty()){
-		OutgoingPacket packet = m_outgoing_queue.pop_front();
-		Peer *peer = getPeerNoEx(packet.peer_id);
-		if(!peer)
-			continue;
-		if(peer->channels[packet.channelnum].outgoing_reliables.size() >= 5){
-			postponed_packets.push_back(packet);
-		} else if(peer->m_num_sent < peer->m_max_num_sent){
-			rawSendAsPacket(packet.peer_id, packet.channelnum,
-					packet.data, packet.reliable);
-			peer->m_num_sent++;
-		} else {
-			postponed_packets.push_back(packet);
-		}
-	}
-	while(!postponed_packets.empty()){
-		m_outgoing_queue.push_back(postponed_packets.pop_front());
-	}
-	for(std::map<u16, Peer*>::iterator
-			j = m_peers.begin();
-			j != m_peers.end(); ++j)
-	{
-		Peer *peer = j->second;
+
+		/*
+			Take a packet from each queue in turn so that a flood on
+			one channel doesn't hold up the others
+		*/
+		int num_sent_before;
+		do{
+			num_sent_before = peer->m_num_sent;
+			for(u16 i=0; i<CHANNEL_COUNT; i++)
+			{
+				Channel *channel = &peer->channels[i];
+				if(peer->m_num_sent < peer->m_max_num_sent &&
+						!channel->queued_unreliables.empty())
+					sendQueued(peer, channel->queued_unreliables);
+				if(peer->m_num_sent < peer->m_max_num_sent &&
+						!channel->queued_reliables.empty() &&
+						peer->getReliablesInFlight() < peer->m_congestion_window)
+					sendQueued(peer, channel->queued_reliables);
+			}
+		}while(peer->m_num_sent != num_sent_before);
+
 		peer->m_sendtime_accu -= (float)peer->m_num_sent /
 				peer->m_max_packets_per_second;
 		if(peer->m_sendtime_accu > 10. / peer->m_max_packets_per_second)
 			peer->m_sendtime_accu = 10. / peer->m_max_packets_per_second;
 	}
+
+	sendBatch();
 }
 
-// Receive packets from the network and buffers and create ConnectionEvents
+// Receive packets from the network and pass them on to processReceived()
 void Connection::receive()
 {
 	u32 datasize = m_max_packet_size * 2;  // Double it just to be safe
 	// TODO: We can not know how many layers of header there are.
 	// For now, just assume there are no other than the base headers.
 	u32 packet_maxsize = datasize + BASE_HEADER_SIZE;
-	SharedBuffer<u8> packetdata(packet_maxsize);
+	if(m_receive_buffer.getSize() == 0)
+		m_receive_buffer = Buffer<u8>(packet_maxsize * UDP_BATCH_MAX);
+	Address senders[UDP_BATCH_MAX];
+	int sizes[UDP_BATCH_MAX];
 
-	bool single_wait_done = false;
-	
-	for(u32 loop_i=0; loop_i<1000; loop_i++) // Limit in case of DoS
+	for(u32 loop_i=0; loop_i<1000; ) // Limit in case of DoS
 	{
-	try{
-		/* Check if some buffer has relevant data */
+		// Only the first call waits for data
+		if(loop_i != 0 && m_socket.WaitData(0) == false)
+			break;
+
+		int count = m_socket.ReceiveMany(senders, sizes, *m_receive_buffer,
+				packet_maxsize, UDP_BATCH_MAX);
+		for(int i=0; i<count; i++)
 		{
-			u16 peer_id;
-			SharedBuffer<u8> resultdata;
-			bool got = getFromBuffers(peer_id, resultdata);
-			if(got){
-				ConnectionEvent e;
-				e.dataReceived(peer_id, resultdata);
-				putEvent(e);
-				continue;
+			try{
+				receivePacket(senders[i],
+						&m_receive_buffer[i * packet_maxsize], sizes[i]);
+			}catch(InvalidIncomingDataException &e){
 			}
 		}
-		
-		if(single_wait_done){
-			if(m_socket.WaitData(0) == false)
-				break;
-		}
-		
-		single_wait_done = true;
-
-		Address sender;
-		s32 received_size = m_socket.Receive(sender, *packetdata, packet_maxsize);
 
-		if(received_size < 0)
+		// Less than asked for means there is no more
+		if(count < UDP_BATCH_MAX)
 			break;
-		if(received_size < BASE_HEADER_SIZE)
-			continue;
-		if(readU32(&packetdata[0]) != m_protocol_id)
-			continue;
-		
-		u16 peer_id = readPeerId(*packetdata);
-		u8 channelnum = readChannel(*packetdata);
-		if(channelnum > CHANNEL_COUNT-1){
-			PrintInfo(derr_con);
-			derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
-			throw InvalidIncomingDataException("Channel doesn't exist");
-		}
+		loop_i += count;
+	}
+}
 
-		if(peer_id == PEER_ID_INEXISTENT)
-		{
-			/*
-				Somebody is trying to send stuff to us with no peer id.
-				
-				Check if the same address and port was added to our peer
-				list before.
-				Allow only entries that have has_sent_with_id==false.
-			*/
+void Connection::receivePacket(const Address &sender, u8 *packetdata,
+		s32 received_size)
+{
+	if(received_size < BASE_HEADER_SIZE)
+		return;
+	if(readU32(&packetdata[0]) != m_protocol_id)
+		return;
+	
+	u16 peer_id = readPeerId(packetdata);
+	u8 channelnum = readChannel(packetdata);
+	if(channelnum > CHANNEL_COUNT-1){
+		PrintInfo(derr_con);
+		derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
+		throw InvalidIncomingDataException("Channel doesn't exist");
+	}
 
-			std::map<u16, Peer*>::iterator j;
-			j = m_peers.begin();
-			for(; j != m_peers.end(); ++j)
-			{
-				Peer *peer = j->second;
-				if(peer->has_sent_with_id)
-					continue;
-				if(peer->address == sender)
-					break;
-			}
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		/*
+			Somebody is trying to send stuff to us with no peer id.
 			
-			/*
-				If no peer was found with the same address and port,
-				we shall assume it is a new peer and create an entry.
-			*/
-			if(j == m_peers.end())
-			{
-				// Pass on to adding the peer
-			}
-			// Else: A peer was found.
-			else
-			{
-				Peer *peer = j->second;
-				peer_id = peer->id;
-				PrintInfo(derr_con);
-				derr_con<<"WARNING: Assuming unknown peer to be "
-						<<"peer_id="<<peer_id<<std::endl;
-			}
+			Check if the same address and port was added to our peer
+			list before.
+			Allow only entries that have has_sent_with_id==false.
+		*/
+
+		std::map<u16, Peer*>::iterator j;
+		j = m_peers.begin();
+		for(; j != m_peers.end(); ++j)
+		{
+			Peer *peer = j->second;
+			if(peer->has_sent_with_id)
+				continue;
+			if(peer->address == sender)
+				break;
 		}
 		
 		/*
-			The peer was not found in our lists. Add it.
+			If no peer was found with the same address and port,
+			we shall assume it is a new peer and create an entry.
 		*/
-		if(peer_id == PEER_ID_INEXISTENT)
+		if(j == m_peers.end())
 		{
-			// Somebody wants to make a new connection
-
-			// Get a unique peer id (2 or higher)
-			u16 peer_id_new = 2;
-			/*
-				Find an unused peer id
-			*/
-			bool out_of_ids = false;
-			for(;;)
-			{
-				// Check if exists
-				if(m_peers.find(peer_id_new) == m_peers.end())
-					break;
-				// Check for overflow
-				if(peer_id_new == 65535){
-					out_of_ids = true;
-					break;
-				}
-				peer_id_new++;
-			}
-			if(out_of_ids){
-				errorstream<<getDesc()<<" ran out of peer ids"<<std::endl;
-				continue;
-			}
-
-			PrintInfo();
-			dout_con<<"Receive(): Got a packet with peer_id=PEER_ID_INEXISTENT,"
-					" giving peer_id="<<peer_id_new<<std::endl;
-
-			// Create a peer
-			Peer *peer = new Peer(peer_id_new, sender);
-			m_peers[peer->id] = peer;
-			
-			// Create peer addition event
-			ConnectionEvent e;
-			e.peerAdded(peer_id_new, sender);
-			putEvent(e);
-			
-			// Create CONTROL packet to tell the peer id to the new peer.
-			SharedBuffer<u8> reply(4);
-			writeU8(&reply[0], TYPE_CONTROL);
-			writeU8(&reply[1], CONTROLTYPE_SET_PEER_ID);
-			writeU16(&reply[2], peer_id_new);
-			sendAsPacket(peer_id_new, 0, reply, true);
-			
-			// We're now talking to a valid peer_id
-			peer_id = peer_id_new;
-
-			// Go on and process whatever it sent
+			// Pass on to adding the peer
 		}
-
-		std::map<u16, Peer*>::iterator node = m_peers.find(peer_id);
-
-		if(node == m_peers.end())
+		// Else: A peer was found.
+		else
 		{
-			// Peer not found
-			// This means that the peer id of the sender is not PEER_ID_INEXISTENT
-			// and it is invalid.
+			Peer *peer = j->second;
+			peer_id = peer->id;
 			PrintInfo(derr_con);
-			derr_con<<"Receive(): Peer not found"<<std::endl;
-			throw InvalidIncomingDataException("Peer not found (possible timeout)");
+			derr_con<<"WARNING: Assuming unknown peer to be "
+					<<"peer_id="<<peer_id<<std::endl;
 		}
+	}
+	
+	/*
+		The peer was not found in our lists. Add it.
+	*/
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		// Somebody wants to make a new connection
 
-		Peer *peer = node->second;
+		// Get a unique peer id (2 or higher)
+		u16 peer_id_new = 2;
+		/*
+			Find an unused peer id
+		*/
+		bool out_of_ids = false;
+		for(;;)
+		{
+			// Check if exists
+			if(m_peers.find(peer_id_new) == m_peers.end())
+				break;
+			// Check for overflow
+			if(peer_id_new == 65535){
+				out_of_ids = true;
+				break;
+			}
+			peer_id_new++;
+		}
+		if(out_of_ids){
+			errorstream<<getDesc()<<" ran out of peer ids"<<std::endl;
+			return;
+		}
 
-		// Validate peer address
-		if(peer->address != sender)
+		PrintInfo();
+		dout_con<<"Receive(): Got a packet with peer_id=PEER_ID_INEXISTENT,"
+				" giving peer_id="<<peer_id_new<<std::endl;
+
+		// Create a peer
+		Peer *peer = new Peer(peer_id_new, sender);
 		{
-			PrintInfo(derr_con);
-			derr_con<<"Peer "<<peer_id<<" sending from different address."
-					" Ignoring."<<std::endl;
-			continue;
+			JMutexAutoLock peerlock(m_peers_mutex);
+			m_peers[peer->id] = peer;
 		}
 		
-		peer->timeout_counter = 0.0;
-
-		Channel *channel = &(peer->channels[channelnum]);
+		// Create peer addition event
+		ConnectionEvent e;
+		e.peerAdded(peer_id_new, sender);
+		putEvent(e);
 		
-		// Throw the received packet to channel->processPacket()
-
-		// Make a new SharedBuffer from the data without the base headers
-		SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-				strippeddata.getSize());
+		// Create CONTROL packet to tell the peer id to the new peer.
+		SharedBuffer<u8> reply(4);
+		writeU8(&reply[0], TYPE_CONTROL);
+		writeU8(&reply[1], CONTROLTYPE_SET_PEER_ID);
+		writeU16(&reply[2], peer_id_new);
+		sendAsPacket(peer_id_new, 0, reply, true);
 		
+		// We're now talking to a valid peer_id
+		peer_id = peer_id_new;
+
+		// Go on and process whatever it sent
+	}
+
+	std::map<u16, Peer*>::iterator node = m_peers.find(peer_id);
+
+	if(node == m_peers.end())
+	{
+		// Peer not found
+		// This means that the peer id of the sender is not PEER_ID_INEXISTENT
+		// and it is invalid.
+		PrintInfo(derr_con);
+		derr_con<<"Receive(): Peer not found"<<std::endl;
+		throw InvalidIncomingDataException("Peer not found (possible timeout)");
+	}
+
+	Peer *peer = node->second;
+
+	// Validate peer address
+	if(peer->address != sender)
+	{
+		PrintInfo(derr_con);
+		derr_con<<"Peer "<<peer_id<<" sending from different address."
+				" Ignoring."<<std::endl;
+		return;
+	}
+	
+	ReceivedPacket received(peer_id, channelnum,
+			&packetdata[BASE_HEADER_SIZE],
+			received_size - BASE_HEADER_SIZE);
+	if(m_workers.empty())
+		processReceived(received);
+	else
+		m_workers[peer_id % m_workers.size()]->putPacket(received);
+}
+
+void Connection::processReceived(ReceivedPacket &packet)
+{
+	m_peers_mutex.Lock();
+	Peer *peer = getPeerNoEx(packet.peer_id);
+	if(peer == NULL){
+		// Deleted after the packet was received
+		m_peers_mutex.Unlock();
+		return;
+	}
+	JMutexAutoLock peerlock(peer->m_mutex);
+	m_peers_mutex.Unlock();
+
+	peer->timeout_counter = 0.0;
+
+	Channel *channel = &(peer->channels[packet.channelnum]);
+
+	try{
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata = processPacket(peer, channel,
+				packet.data, packet.channelnum, false);
+
+		PrintInfo();
+		dout_con<<"ProcessPacket returned data of size "
+				<<resultdata.getSize()<<std::endl;
+
+		ConnectionEvent e;
+		e.dataReceived(peer->id, resultdata);
+		putEvent(e);
+	}catch(InvalidIncomingDataException &e){
+	}
+	catch(ProcessedSilentlyException &e){
+	}
+
+	// A reliable packet may have been the one that the packets buffered
+	// after it were waiting for
+	for(;;){
 		try{
-			// Process it (the result is some data with no headers made by us)
-			SharedBuffer<u8> resultdata = processPacket
-					(channel, strippeddata, peer_id, channelnum, false);
-			
-			PrintInfo();
-			dout_con<<"ProcessPacket returned data of size "
-					<<resultdata.getSize()<<std::endl;
-			
+			SharedBuffer<u8> resultdata;
+			if(!checkIncomingBuffers(peer, channel, resultdata))
+				break;
 			ConnectionEvent e;
-			e.dataReceived(peer_id, resultdata);
+			e.dataReceived(peer->id, resultdata);
 			putEvent(e);
-			continue;
-		}catch(ProcessedSilentlyException &e){
+		}catch(InvalidIncomingDataException &e){
+		}
+		catch(ProcessedSilentlyException &e){
 		}
-	}catch(InvalidIncomingDataException &e){
-	}
-	catch(ProcessedSilentlyException &e){
 	}
-	} // for
 }
 
 void Connection::runTimeouts(float dtime)
 {
-	float congestion_control_aim_rtt
-			= g_settings->getFloat("congestion_control_aim_rtt");
-	float congestion_control_max_rate
-			= g_settings->getFloat("congestion_control_max_rate");
-	float congestion_control_min_rate
-			= g_settings->getFloat("congestion_control_min_rate");
+	static SettingHandle<float> aim_rtt_setting(g_settings,
+			"congestion_control_aim_rtt");
+	static SettingHandle<float> max_rate_setting(g_settings,
+			"congestion_control_max_rate");
+	static SettingHandle<float> min_rate_setting(g_settings,
+			"congestion_control_min_rate");
+	float congestion_control_aim_rtt = aim_rtt_setting.get();
+	float congestion_control_max_rate = max_rate_setting.get();
+	float congestion_control_min_rate = min_rate_setting.get();
 
 	std::list<u16> timeouted_peers;
 	for(std::map<u16, Peer*>::iterator j = m_peers.begin();
 		j != m_peers.end(); ++j)
 	{
 		Peer *peer = j->second;
+		JMutexAutoLock peerlock(peer->m_mutex);
 
 		// Update congestion control values
 		peer->congestion_control_aim_rtt = congestion_control_aim_rtt;
@@ -931,7 +1070,13 @@ void Connection::runTimeouts(float dtime)
 			continue;
 		}
 
+		peer->m_loss_timer += dtime;
+
 		float resend_timeout = peer->resend_timeout;
+		// Re-sending more than a window at once would only make the
+		// congestion worse; the rest are sent in the next rounds
+		u32 resend_max = peer->m_congestion_window;
+		bool resent = false;
 		for(u16 i=0; i<CHANNEL_COUNT; i++)
 		{
 			std::list<BufferedPacket> timed_outs;
@@ -961,9 +1106,7 @@ void Connection::runTimeouts(float dtime)
 			// Re-send timed out outgoing reliables
 			
 			timed_outs = channel->
-					outgoing_reliables.getTimedOuts(resend_timeout);
-
-			channel->outgoing_reliables.resetTimedOuts(resend_timeout);
+					outgoing_reliables.getTimedOuts(resend_timeout, resend_max);
 
 			for(std::list<BufferedPacket>::iterator j = timed_outs.begin();
 				j != timed_outs.end(); ++j)
@@ -981,15 +1124,19 @@ void Connection::runTimeouts(float dtime)
 						<<", seqnum="<<seqnum
 						<<std::endl;
 
-				rawSend(*j);
-
-				// Enlarge avg_rtt and resend_timeout:
-				// The rtt will be at least the timeout.
-				// NOTE: This won't affect the timeout of the next
-				// checked channel because it was cached.
-				peer->reportRTT(resend_timeout);
+				m_send_batch.push_back(*j);
+				resend_max--;
+				resent = true;
 			}
 		}
+
+		if(resent)
+		{
+			// Enlarge avg_rtt and resend_timeout:
+			// The rtt will be at least the timeout.
+			peer->reportRTT(resend_timeout);
+			peer->reportLoss();
+		}
 		
 		/*
 			Send pings
@@ -1001,7 +1148,7 @@ void Connection::runTimeouts(float dtime)
 			SharedBuffer<u8> data(2);
 			writeU8(&data[0], TYPE_CONTROL);
 			writeU8(&data[1], CONTROLTYPE_PING);
-			rawSendAsPacket(peer->id, 0, data, true);
+			rawSendAsPacket(peer, OutgoingPacket(peer->id, 0, data, true));
 
 			peer->ping_timer = 0.0;
 		}
@@ -1010,6 +1157,8 @@ void Connection::runTimeouts(float dtime)
 		continue;
 	}
 
+	sendBatch();
+
 	// Remove timed out peers
 	for(std::list<u16>::iterator i = timeouted_peers.begin();
 		i != timeouted_peers.end(); ++i)
@@ -1046,7 +1195,10 @@ void Connection::connect(Address address)
 	}
 
 	Peer *peer = new Peer(PEER_ID_SERVER, address);
-	m_peers[peer->id] = peer;
+	{
+		JMutexAutoLock peerlock(m_peers_mutex);
+		m_peers[peer->id] = peer;
+	}
 
 	// Create event
 	ConnectionEvent e;
@@ -1075,7 +1227,8 @@ void Connection::disconnect()
 		j != m_peers.end(); ++j)
 	{
 		Peer *peer = j->second;
-		rawSendAsPacket(peer->id, 0, data, false);
+		JMutexAutoLock peerlock(peer->m_mutex);
+		rawSendAsPacket(peer, OutgoingPacket(peer->id, 0, data, false));
 	}
 }
 
@@ -1099,51 +1252,75 @@ void Connection::send(u16 peer_id, u8 channelnum,
 	Peer *peer = getPeerNoEx(peer_id);
 	if(peer == NULL)
 		return;
+	JMutexAutoLock peerlock(peer->m_mutex);
 	Channel *channel = &(peer->channels[channelnum]);
 
 	u32 chunksize_max = m_max_packet_size - BASE_HEADER_SIZE;
 	if(reliable)
 		chunksize_max -= RELIABLE_HEADER_SIZE;
 
-	std::list<SharedBuffer<u8> > originals;
-	originals = makeAutoSplitPacket(data, chunksize_max,
-			channel->next_outgoing_split_seqnum);
-	
-	for(std::list<SharedBuffer<u8> >::iterator i = originals.begin();
-		i != originals.end(); ++i)
-	{
-		SharedBuffer<u8> original = *i;
-		
-		sendAsPacket(peer_id, channelnum, original, reliable);
-	}
+	// The packets are queued with parts of data, not copies
+	makeAutoSplitPacket(peer_id, channelnum, data, reliable,
+			chunksize_max, channel->next_outgoing_split_seqnum,
+			reliable ? channel->queued_reliables
+			: channel->queued_unreliables);
 }
 
 void Connection::sendAsPacket(u16 peer_id, u8 channelnum,
 		SharedBuffer<u8> data, bool reliable)
-{
-	OutgoingPacket packet(peer_id, channelnum, data, reliable);
-	m_outgoing_queue.push_back(packet);
-}
-
-void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
-		SharedBuffer<u8> data, bool reliable)
 {
 	Peer *peer = getPeerNoEx(peer_id);
 	if(!peer)
 		return;
+	JMutexAutoLock peerlock(peer->m_mutex);
 	Channel *channel = &(peer->channels[channelnum]);
-
+	OutgoingPacket packet(peer_id, channelnum, data, reliable);
 	if(reliable)
+		channel->queued_reliables.push_back(packet);
+	else
+		channel->queued_unreliables.push_back(packet);
+}
+
+void Connection::sendQueued(Peer *peer, std::list<OutgoingPacket> &queue)
+{
+	OutgoingPacket &packet = queue.front();
+	rawSendAsPacket(peer, packet, true);
+	queue.pop_front();
+	peer->m_num_sent++;
+}
+
+void Connection::rawSendAsPacket(Peer *peer, const OutgoingPacket &packet,
+		bool batched)
+{
+	Channel *channel = &(peer->channels[packet.channelnum]);
+
+	// Only the headers are put together; the data is sent from where
+	// it is
+	u32 headers_size = BASE_HEADER_SIZE + packet.header_size;
+	if(packet.reliable)
+		headers_size += RELIABLE_HEADER_SIZE;
+	BufferedPacket p(headers_size);
+	p.address = peer->address;
+	writeU32(&p.data[0], m_protocol_id);
+	writeU16(&p.data[4], m_peer_id);
+	writeU8(&p.data[6], packet.channelnum);
+	u32 pos = BASE_HEADER_SIZE;
+	if(packet.reliable)
+	{
+		writeU8(&p.data[pos], TYPE_RELIABLE);
+		writeU16(&p.data[pos+1], channel->next_outgoing_seqnum);
+		pos += RELIABLE_HEADER_SIZE;
+	}
+	memcpy(&p.data[pos], packet.header, packet.header_size);
+	p.payload = packet.data;
+	p.payload_offset = packet.offset;
+	p.payload_size = packet.size;
+
+	if(packet.reliable)
 	{
 		u16 seqnum = channel->next_outgoing_seqnum;
 		channel->next_outgoing_seqnum++;
 
-		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
-
-		// Add base headers and make a packet
-		BufferedPacket p = makePacket(peer->address, reliable,
-				m_protocol_id, m_peer_id, channelnum);
-		
 		try{
 			// Buffer the packet
 			channel->outgoing_reliables.insert(p);
@@ -1156,25 +1333,45 @@ void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
 					"in outgoing buffer"<<std::endl;
 			//assert(0);
 		}
-		
-		// Send the packet
-		rawSend(p);
 	}
-	else
-	{
-		// Add base headers and make a packet
-		BufferedPacket p = makePacket(peer->address, data,
-				m_protocol_id, m_peer_id, channelnum);
 
-		// Send the packet
+	// Send the packet
+	if(batched)
+		m_send_batch.push_back(p);
+	else
 		rawSend(p);
+}
+
+void Connection::sendBatch()
+{
+	UDPPacket packets[UDP_BATCH_MAX];
+	for(u32 i=0; i<m_send_batch.size(); i+=UDP_BATCH_MAX)
+	{
+		u32 count = MYMIN(UDP_BATCH_MAX, m_send_batch.size() - i);
+		for(u32 j=0; j<count; j++)
+		{
+			const BufferedPacket &p = m_send_batch[i + j];
+			packets[j].address = p.address;
+			packets[j].header = *p.data;
+			packets[j].header_size = p.data.getSize();
+			packets[j].data = *p.payload + p.payload_offset;
+			packets[j].size = p.payload_size;
+		}
+		try{
+			m_socket.SendMany(packets, count);
+		} catch(SendFailedException &e){
+			derr_con<<"Connection::sendBatch(): SendFailedException"
+					<<std::endl;
+		}
 	}
+	m_send_batch.clear();
 }
 
 void Connection::rawSend(const BufferedPacket &packet)
 {
 	try{
-		m_socket.Send(packet.address, *packet.data, packet.data.getSize());
+		m_socket.Send(packet.address, *packet.data, packet.data.getSize(),
+				*packet.payload + packet.payload_offset, packet.payload_size);
 	} catch(SendFailedException &e){
 		derr_con<<"Connection::rawSend(): SendFailedException: "
 				<<packet.address.serializeString()<<std::endl;
@@ -1221,27 +1418,7 @@ std::list<Peer*> Connection::getPeers()
 	return list;
 }
 
-bool Connection::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst)
-{
-	for(std::map<u16, Peer*>::iterator j = m_peers.begin();
-		j != m_peers.end(); ++j)
-	{
-		Peer *peer = j->second;
-		for(u16 i=0; i<CHANNEL_COUNT; i++)
-		{
-			Channel *channel = &peer->channels[i];
-			SharedBuffer<u8> resultdata;
-			bool got = checkIncomingBuffers(channel, peer_id, resultdata);
-			if(got){
-				dst = resultdata;
-				return true;
-			}
-		}
-	}
-	return false;
-}
-
-bool Connection::checkIncomingBuffers(Channel *channel, u16 &peer_id,
+bool Connection::checkIncomingBuffers(Peer *peer, Channel *channel,
 		SharedBuffer<u8> &dst)
 {
 	u16 firstseqnum = 0;
@@ -1263,14 +1440,13 @@ bool Connection::checkIncomingBuffers(Channel *channel, u16 &peer_id,
 		{
 			BufferedPacket p = channel->incoming_reliables.popFirst();
 			
-			peer_id = readPeerId(*p.data);
 			u8 channelnum = readChannel(*p.data);
 			u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
 
 			PrintInfo();
 			dout_con<<"UNBUFFERING TYPE_RELIABLE"
 					<<" seqnum="<<seqnum
-					<<" peer_id="<<peer_id
+					<<" peer_id="<<peer->id
 					<<" channel="<<((int)channelnum&0xff)
 					<<std::endl;
 
@@ -1281,17 +1457,18 @@ bool Connection::checkIncomingBuffers(Channel *channel, u16 &peer_id,
 			SharedBuffer<u8> payload(p.data.getSize() - headers_size);
 			memcpy(*payload, &p.data[headers_size], payload.getSize());
 
-			dst = processPacket(channel, payload, peer_id, channelnum, true);
+			dst = processPacket(peer, channel, payload, channelnum, true);
 			return true;
 		}
 	}
 	return false;
 }
 
-SharedBuffer<u8> Connection::processPacket(Channel *channel,
-		SharedBuffer<u8> packetdata, u16 peer_id,
-		u8 channelnum, bool reliable)
+SharedBuffer<u8> Connection::processPacket(Peer *peer, Channel *channel,
+		SharedBuffer<u8> packetdata, u8 channelnum, bool reliable)
 {
+	u16 peer_id = peer->id;
+
 	IndentationRaiser iraiser(&(m_indentation));
 
 	if(packetdata.getSize() < 1)
@@ -1320,13 +1497,32 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 
 			try{
 				BufferedPacket p = channel->outgoing_reliables.popSeqnum(seqnum);
-				// Get round trip time
-				float rtt = p.totaltime;
+				// Get round trip time; it is not known which of the
+				// sends of a re-sent packet got ACKed
+				float rtt = p.resend_count == 0 ? p.totaltime : -1.0;
 
 				// Let peer calculate stuff according to it
-				// (avg_rtt and resend_timeout)
-				Peer *peer = getPeer(peer_id);
-				peer->reportRTT(rtt);
+				// (avg_rtt, resend_timeout and congestion window)
+				peer->reportAck(rtt);
+
+				/*
+					Fast retransmit: packets that enough packets sent
+					after them have overtaken are most likely lost
+				*/
+				std::list<BufferedPacket> lost = channel->
+						outgoing_reliables.getOvertaken(seqnum, p.time,
+						FAST_RETRANSMIT_ACKS);
+				for(std::list<BufferedPacket>::iterator i = lost.begin();
+						i != lost.end(); ++i)
+				{
+					PrintInfo(derr_con);
+					derr_con<<"RE-SENDING lost RELIABLE seqnum="
+							<<readU16(&(i->data[BASE_HEADER_SIZE+1]))
+							<<std::endl;
+					rawSend(*i);
+				}
+				if(!lost.empty())
+					peer->reportLoss();
 
 				//PrintInfo(dout_con);
 				//dout_con<<"RTT = "<<rtt<<std::endl;
@@ -1381,12 +1577,11 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 			// the timeout counter
 			PrintInfo();
 			dout_con<<"DISCO: Removing peer "<<(peer_id)<<std::endl;
-			
-			if(deletePeer(peer_id, false) == false)
-			{
-				PrintInfo(derr_con);
-				derr_con<<"DISCO: Peer not found"<<std::endl;
-			}
+
+			// The peer is locked here; the Connection thread removes it
+			ConnectionCommand c;
+			c.deletePeer(peer_id);
+			putCommand(c);
 
 			throw ProcessedSilentlyException("Got a DISCO");
 		}
@@ -1415,7 +1610,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		// We have to create a packet again for buffering
 		// This isn't actually too bad an idea.
 		BufferedPacket packet = makePacket(
-				getPeer(peer_id)->address,
+				peer->address,
 				packetdata,
 				GetProtocolID(),
 				peer_id,
@@ -1447,6 +1642,12 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 
 		bool is_future_packet = seqnum_higher(seqnum, channel->next_incoming_seqnum);
 		bool is_old_packet = seqnum_higher(channel->next_incoming_seqnum, seqnum);
+
+		// Don't buffer what no sender can have in flight; without an
+		// ACK it is sent again later
+		if(is_future_packet && (u16)(seqnum - channel->next_incoming_seqnum)
+				> RELIABLE_INCOMING_AHEAD_MAX)
+			throw InvalidIncomingDataException("Reliable packet too far ahead");
 		
 		PrintInfo();
 		if(is_future_packet)
@@ -1469,7 +1670,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		writeU8(&reply[0], TYPE_CONTROL);
 		writeU8(&reply[1], CONTROLTYPE_ACK);
 		writeU16(&reply[2], seqnum);
-		rawSendAsPacket(peer_id, channelnum, reply, false);
+		rawSendAsPacket(peer, OutgoingPacket(peer_id, channelnum, reply, false));
 
 		//if(seqnum_higher(seqnum, channel->next_incoming_seqnum))
 		if(is_future_packet)
@@ -1482,7 +1683,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 			// Actually we have to make a packet to buffer one.
 			// Well, we have all the ingredients, so just do it.
 			BufferedPacket packet = makePacket(
-					getPeer(peer_id)->address,
+					peer->address,
 					packetdata,
 					GetProtocolID(),
 					peer_id,
@@ -1514,7 +1715,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		SharedBuffer<u8> payload(packetdata.getSize() - RELIABLE_HEADER_SIZE);
 		memcpy(*payload, &packetdata[RELIABLE_HEADER_SIZE], payload.getSize());
 
-		return processPacket(channel, payload, peer_id, channelnum, true);
+		return processPacket(peer, channel, payload, channelnum, true);
 	}
 	else
 	{
@@ -1532,18 +1733,27 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 
 bool Connection::deletePeer(u16 peer_id, bool timeout)
 {
-	if(m_peers.find(peer_id) == m_peers.end())
-		return false;
-	
-	Peer *peer = m_peers[peer_id];
+	Peer *peer;
+	{
+		JMutexAutoLock peerlock(m_peers_mutex);
+		std::map<u16, Peer*>::iterator node = m_peers.find(peer_id);
+		if(node == m_peers.end())
+			return false;
+		peer = node->second;
+		m_peers.erase(node);
+	}
+
+	// Wait for a worker that is still processing a packet of the peer;
+	// its data is put before the removal event
+	peer->m_mutex.Lock();
+	peer->m_mutex.Unlock();
 
 	// Create event
 	ConnectionEvent e;
 	e.peerRemoved(peer_id, timeout, peer->address);
 	putEvent(e);
 
-	delete m_peers[peer_id];
-	m_peers.erase(peer_id);
+	delete peer;
 	return true;
 }
 
@@ -1625,7 +1835,7 @@ u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
 			throw NoIncomingDataException("No incoming data");
 		case CONNEVENT_DATA_RECEIVED:
 			peer_id = e.peer_id;
-			data = SharedBuffer<u8>(e.data);
+			data = e.data;
 			return e.data.getSize();
 		case CONNEVENT_PEER_ADDED: {
 			Peer tmp(e.peer_id, e.address);
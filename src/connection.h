@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <map>
+#include <vector>
 
 namespace con
 {
@@ -113,23 +114,36 @@ class ProcessedSilentlyException : public BaseException
 #define SEQNUM_MAX 65535
 inline bool seqnum_higher(u16 higher, u16 lower)
 {
+	// Seqnums wrap around; compare them the nearer way
 	if(lower > higher && lower - higher > SEQNUM_MAX/2){
 		return true;
 	}
+	if(higher > lower && higher - lower > SEQNUM_MAX/2){
+		return false;
+	}
 	return (higher > lower);
 }
 
 struct BufferedPacket
 {
 	BufferedPacket(u8 *a_data, u32 a_size):
-		data(a_data, a_size), time(0.0), totaltime(0.0)
+		data(a_data, a_size), payload_offset(0), payload_size(0),
+		time(0.0), totaltime(0.0), resend_count(0), later_acks(0)
 	{}
 	BufferedPacket(u32 a_size):
-		data(a_size), time(0.0), totaltime(0.0)
+		data(a_size), payload_offset(0), payload_size(0),
+		time(0.0), totaltime(0.0), resend_count(0), later_acks(0)
 	{}
 	SharedBuffer<u8> data; // Data of the packet, including headers
+	// Outgoing packets have only the headers in data; they are sent
+	// followed by this part of payload, which is not copied
+	SharedBuffer<u8> payload;
+	u32 payload_offset;
+	u32 payload_size;
 	float time; // Seconds from buffering the packet or re-sending
 	float totaltime; // Seconds from buffering the packet
+	u16 resend_count; // Times the packet has been re-sent
+	u16 later_acks; // ACKs for packets sent after this one was sent
 	Address address; // Sender or destination
 };
 
@@ -139,23 +153,6 @@ BufferedPacket makePacket(Address &address, u8 *data, u32 datasize,
 BufferedPacket makePacket(Address &address, SharedBuffer<u8> &data,
 		u32 protocol_id, u16 sender_peer_id, u8 channel);
 
-// Add the TYPE_ORIGINAL header to the data
-SharedBuffer<u8> makeOriginalPacket(
-		SharedBuffer<u8> data);
-
-// Split data in chunks and add TYPE_SPLIT headers to them
-std::list<SharedBuffer<u8> > makeSplitPacket(
-		SharedBuffer<u8> data,
-		u32 chunksize_max,
-		u16 seqnum);
-
-// Depending on size, make a TYPE_ORIGINAL or TYPE_SPLIT packet
-// Increments split_seqnum if a split packet is made
-std::list<SharedBuffer<u8> > makeAutoSplitPacket(
-		SharedBuffer<u8> data,
-		u32 chunksize_max,
-		u16 &split_seqnum);
-
 // Add the TYPE_RELIABLE header to the data
 SharedBuffer<u8> makeReliablePacket(
 		SharedBuffer<u8> data,
@@ -248,6 +245,7 @@ data.
 	[5] u16 chunk_num
 */
 #define TYPE_SPLIT 2
+#define SPLIT_HEADER_SIZE 7
 /*
 RELIABLE: Delivery of all RELIABLE packets shall be forced by ACKs,
 and they shall be delivered in the same order as sent. This is done
@@ -265,33 +263,61 @@ with a buffer in the receiving and transmitting end.
 #define SEQNUM_INITIAL 65500
 
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
+	A buffer which stores reliable packets in a ring indexed by seqnum.
+	Finding, inserting and removing a packet is O(1); the ring grows to
+	cover the seqnums between the first and the last packet.
 */
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
-
 class ReliablePacketBuffer
 {
 public:
 	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 	void print();
 	bool empty();
 	u32 size();
-	RPBSearchResult findPacket(u16 seqnum);
-	RPBSearchResult notFound();
+	// Returns NULL if not found
+	BufferedPacket* findPacket(u16 seqnum);
 	bool getFirstSeqnum(u16 *result);
 	BufferedPacket popFirst();
 	BufferedPacket popSeqnum(u16 seqnum);
 	void insert(BufferedPacket &p);
 	void incrementTimeouts(float dtime);
-	void resetTimedOuts(float timeout);
 	bool anyTotaltimeReached(float timeout);
-	std::list<BufferedPacket> getTimedOuts(float timeout);
+	/*
+		Returns at most max_count of the packets that have waited
+		for timeout seconds, first seqnum first, and counts them
+		as re-sent: their time is reset and resend_count increased.
+	*/
+	std::list<BufferedPacket> getTimedOuts(float timeout, u32 max_count);
+	/*
+		Counts the ACK of a packet for the packets before it that were
+		sent earlier than it; time is the time of the ACKed packet.
+		Returns the ones overtaken by ack_count ACKs and counts them
+		as re-sent like getTimedOuts().
+	*/
+	std::list<BufferedPacket> getOvertaken(u16 seqnum, float time,
+			u16 ack_count);
 
 private:
-	std::list<BufferedPacket> m_list;
-	u16 m_list_size;
+	u32 getSlot(u16 seqnum)
+	{
+		return seqnum & (m_slots.size() - 1);
+	}
+	void remove(u16 seqnum);
+	// Doubles the ring
+	void grow();
+
+	// Size is a power of two
+	std::vector<BufferedPacket*> m_slots;
+	// Seqnums of the first and last packet if not empty
+	u16 m_first;
+	u16 m_last;
+	u32 m_size;
+
+	// Not copyable
+	ReliablePacketBuffer(const ReliablePacketBuffer &);
+	ReliablePacketBuffer &operator=(const ReliablePacketBuffer &);
 };
 
 /*
@@ -317,6 +343,45 @@ class IncomingSplitBuffer
 
 class Connection;
 
+/*
+	Data to be sent in one packet: a TYPE_ORIGINAL or TYPE_SPLIT header,
+	if any, followed by a part of data. The part is not copied, so the
+	chunks of a split packet and the packets of the same data to
+	different peers all share it.
+*/
+struct OutgoingPacket
+{
+	u16 peer_id;
+	u8 channelnum;
+	bool reliable;
+	u8 header[SPLIT_HEADER_SIZE];
+	u8 header_size;
+	SharedBuffer<u8> data;
+	u32 offset;
+	u32 size;
+
+	// All of data, without a header
+	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
+			bool reliable_):
+		peer_id(peer_id_),
+		channelnum(channelnum_),
+		reliable(reliable_),
+		header_size(0),
+		data(data_),
+		offset(0),
+		size(data_.getSize())
+	{
+	}
+};
+
+// Depending on size, make a TYPE_ORIGINAL packet or TYPE_SPLIT chunks
+// of data and add them to dest
+// Increments split_seqnum if a split packet is made
+void makeAutoSplitPacket(u16 peer_id, u8 channelnum,
+		SharedBuffer<u8> data, bool reliable,
+		u32 chunksize_max, u16 &split_seqnum,
+		std::list<OutgoingPacket> &dest);
+
 struct Channel
 {
 	Channel();
@@ -334,6 +399,11 @@ struct Channel
 	ReliablePacketBuffer outgoing_reliables;
 
 	IncomingSplitBuffer incoming_splits;
+
+	// Packets waiting for Connection::send(); reliable ones are only
+	// sent when the congestion window of the peer allows
+	std::list<OutgoingPacket> queued_reliables;
+	std::list<OutgoingPacket> queued_unreliables;
 };
 
 class Peer;
@@ -374,6 +444,21 @@ class Peer
 	*/
 	void reportRTT(float rtt);
 
+	/*
+		Congestion control. The window is how many reliable packets
+		may be sent ahead of the first one that is not ACKed. It grows
+		with the ACKs as long as the RTT stays below
+		congestion_control_aim_rtt and is halved when packets are
+		lost. The send rate is the window per RTT.
+
+		rtt=-1 is an ACK for a re-sent packet, which has no usable RTT
+	*/
+	void reportAck(float rtt);
+	void reportLoss();
+	// Reliable packets sent ahead of the first not ACKed one, summed
+	// over the channels
+	u32 getReliablesInFlight();
+
 	Channel channels[CHANNEL_COUNT];
 
 	// Address of the peer
@@ -397,34 +482,31 @@ class Peer
 	int m_num_sent;
 	int m_max_num_sent;
 
+	float m_congestion_window;
+	float m_slow_start_threshold;
+	// Seconds from the last reportLoss() that shrank the window
+	float m_loss_timer;
+
 	// Updated from configuration by Connection
 	float congestion_control_aim_rtt;
 	float congestion_control_max_rate;
 	float congestion_control_min_rate;
+
+	/*
+		Received packets are decoded in the ConnectionWorkers while
+		the Connection thread sends and runs the timeouts, so the
+		channels and everything above except the address and the id
+		are only used with this locked.
+	*/
+	JMutex m_mutex;
 private:
+	void updateSendRate();
 };
 
 /*
 	Connection
 */
 
-struct OutgoingPacket
-{
-	u16 peer_id;
-	u8 channelnum;
-	SharedBuffer<u8> data;
-	bool reliable;
-
-	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
-			bool reliable_):
-		peer_id(peer_id_),
-		channelnum(channelnum_),
-		data(data_),
-		reliable(reliable_)
-	{
-	}
-};
-
 enum ConnectionEventType{
 	CONNEVENT_NONE,
 	CONNEVENT_DATA_RECEIVED,
@@ -437,7 +519,7 @@ struct ConnectionEvent
 {
 	enum ConnectionEventType type;
 	u16 peer_id;
-	Buffer<u8> data;
+	SharedBuffer<u8> data;
 	bool timeout;
 	Address address;
 
@@ -502,7 +584,7 @@ struct ConnectionCommand
 	Address address;
 	u16 peer_id;
 	u8 channelnum;
-	Buffer<u8> data;
+	SharedBuffer<u8> data;
 	bool reliable;
 	
 	ConnectionCommand(): type(CONNCMD_NONE) {}
@@ -544,6 +626,47 @@ struct ConnectionCommand
 	}
 };
 
+/*
+	A received packet on its way from the Connection thread to a
+	ConnectionWorker
+*/
+struct ReceivedPacket
+{
+	u16 peer_id;
+	u8 channelnum;
+	SharedBuffer<u8> data;
+
+	ReceivedPacket(u16 peer_id_, u8 channelnum_, const u8 *data_, u32 size):
+		peer_id(peer_id_),
+		channelnum(channelnum_),
+		data(data_, size)
+	{
+	}
+};
+
+/*
+	Decodes the received packets of a share of the peers: ACKs,
+	reliable packet ordering and split packet reassembly. A peer always
+	goes to the same worker, so its data is passed on in order.
+*/
+class ConnectionWorker: public SimpleThread
+{
+public:
+	ConnectionWorker(Connection *con, int id);
+	void * Thread();
+
+	void putPacket(const ReceivedPacket &packet);
+
+	// Signaled for every putPacket() and for stopping
+	Event m_queue_event;
+
+private:
+	Connection *m_con;
+	int m_id;
+	std::list<ReceivedPacket> m_queue;
+	JMutex m_queue_mutex;
+};
+
 class Connection: public SimpleThread
 {
 public:
@@ -560,6 +683,9 @@ class Connection: public SimpleThread
 	void putCommand(ConnectionCommand &c);
 	
 	void SetTimeoutMs(int timeout){ m_bc_receive_timeout = timeout; }
+	// Simulates a lossy network, see UDPSocket::setPacketLoss()
+	void SetPacketLoss(int one_in, int seed = 0)
+			{ m_socket.setPacketLoss(one_in, seed); }
 	void Serve(unsigned short port);
 	void Connect(Address address);
 	bool Connected();
@@ -572,12 +698,20 @@ class Connection: public SimpleThread
 	Address GetPeerAddress(u16 peer_id);
 	float GetPeerAvgRTT(u16 peer_id);
 	void DeletePeer(u16 peer_id);
+
+	// Called by the ConnectionWorkers, or by the Connection thread if
+	// there are none
+	void processReceived(ReceivedPacket &packet);
 	
 private:
+	void createWorkers();
 	void putEvent(ConnectionEvent &e);
 	void processCommand(ConnectionCommand &c);
 	void send(float dtime);
 	void receive();
+	// Handles a packet from receive() in the Connection thread
+	void receivePacket(const Address &sender, u8 *packetdata,
+			s32 received_size);
 	void runTimeouts(float dtime);
 	void serve(u16 port);
 	void connect(Address address);
@@ -586,32 +720,41 @@ class Connection: public SimpleThread
 	void send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void sendAsPacket(u16 peer_id, u8 channelnum,
 			SharedBuffer<u8> data, bool reliable);
-	void rawSendAsPacket(u16 peer_id, u8 channelnum,
-			SharedBuffer<u8> data, bool reliable);
+	// The peer must be locked. If batched, the packet is sent by the
+	// next sendBatch(), which only the Connection thread may call.
+	void rawSendAsPacket(Peer *peer, const OutgoingPacket &packet,
+			bool batched=false);
+	// Sends m_send_batch with as few system calls as possible
+	void sendBatch();
+	// Sends the first packet of a Channel queue
+	void sendQueued(Peer *peer, std::list<OutgoingPacket> &queue);
 	void rawSend(const BufferedPacket &packet);
 	Peer* getPeer(u16 peer_id);
 	Peer* getPeerNoEx(u16 peer_id);
 	std::list<Peer*> getPeers();
-	bool getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst);
 	// Returns next data from a buffer if possible
-	// If found, returns true; if not, false.
-	// If found, sets peer_id and dst
-	bool checkIncomingBuffers(Channel *channel, u16 &peer_id,
+	// If found, returns true and sets dst; if not, false.
+	// The peer must be locked
+	bool checkIncomingBuffers(Peer *peer, Channel *channel,
 			SharedBuffer<u8> &dst);
 	/*
 		Processes a packet with the basic header stripped out.
+		The peer must be locked.
 		Parameters:
+			peer: sender of the packet in question
 			packetdata: Data in packet (with no base headers)
-			peer_id: peer id of the sender of the packet in question
 			channelnum: channel on which the packet was sent
 			reliable: true if recursing into a reliable packet
 	*/
-	SharedBuffer<u8> processPacket(Channel *channel,
-			SharedBuffer<u8> packetdata, u16 peer_id,
-			u8 channelnum, bool reliable);
+	SharedBuffer<u8> processPacket(Peer *peer, Channel *channel,
+			SharedBuffer<u8> packetdata, u8 channelnum, bool reliable);
 	bool deletePeer(u16 peer_id, bool timeout);
 	
-	Queue<OutgoingPacket> m_outgoing_queue;
+	/*
+		Filled by the workers and the Connection thread, emptied by
+		Receive(). Receive() waits on it with a timeout, so it needs the
+		semaphore anyway, and the mutex is only held for a list push or pop.
+	*/
 	MutexedQueue<ConnectionEvent> m_event_queue;
 	MutexedQueue<ConnectionCommand> m_command_queue;
 	
@@ -621,9 +764,20 @@ class Connection: public SimpleThread
 	UDPSocket m_socket;
 	u16 m_peer_id;
 	
+	// Only changed by the Connection thread, with m_peers_mutex locked.
+	// Other threads look up peers with it locked and lock the peer
+	// before unlocking it, so a peer is not deleted under them.
 	std::map<u16, Peer*> m_peers;
 	JMutex m_peers_mutex;
 
+	// Peers are assigned to them by peer_id % m_workers.size()
+	std::vector<ConnectionWorker*> m_workers;
+
+	// For receive(), room for UDP_BATCH_MAX packets
+	Buffer<u8> m_receive_buffer;
+	// Packets sent by the Connection thread in send() and runTimeouts()
+	std::vector<BufferedPacket> m_send_batch;
+
 	// Backwards compatibility
 	PeerHandler *m_bc_peerhandler;
 	int m_bc_receive_timeout;
@@ -48,6 +48,18 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // resend_timeout = avg_rtt * this
 #define RESEND_TIMEOUT_FACTOR 4
 
+// Congestion window in reliable packets; the minimum leaves room
+// for the ACKs needed for a fast retransmit
+#define CONGESTION_WINDOW_MIN 8
+#define CONGESTION_WINDOW_INITIAL 16
+#define CONGESTION_WINDOW_MAX 512
+// A packet is re-sent without waiting for the timeout when this many
+// later packets have been ACKed
+#define FAST_RETRANSMIT_ACKS 3
+// Incoming reliable packets further ahead of the expected one are
+// dropped without an ACK; no sender has that many in flight
+#define RELIABLE_INCOMING_AHEAD_MAX 1024
+
 /*
     Server
 */
@@ -41,9 +41,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 //              the faces in the list is up-down-right-left-back-front
 //              (compatible with ContentFeatures). If you specified 0,0,1,1
 //              for each face, that would be the same as passing NULL.
+//  faces     - bit i set for each face i (in the order above) to draw
 void makeCuboid(MeshCollector *collector, const aabb3f &box,
 	TileSpec *tiles, int tilecount,
-	video::SColor &c, const f32* txc)
+	video::SColor &c, const f32* txc, u8 faces=0x3f)
 {
 	assert(tilecount >= 1 && tilecount <= 6);
 
@@ -159,6 +160,8 @@ void makeCuboid(MeshCollector *collector, const aabb3f &box,
 	// Add to mesh collector
 	for(s32 j=0; j<24; j+=4)
 	{
+		if((faces & (1 << (j/4))) == 0)
+			continue;
 		int tileindex = MYMIN(j/4, tilecount-1);
 		collector->append(tiles[tileindex],
 				vertices+j, 4, indices, 6);
@@ -553,6 +556,13 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 		// Only solidness=0 stuff is drawn here
 		if(f.solidness != 0)
 			continue;
+
+		// Far away, leave out small things
+		if(data->m_low_detail && (f.drawtype == NDT_TORCHLIKE
+				|| f.drawtype == NDT_SIGNLIKE
+				|| f.drawtype == NDT_PLANTLIKE
+				|| f.drawtype == NDT_RAILLIKE))
+			continue;
 		
 		switch(f.drawtype){
 		default:
@@ -1260,11 +1270,29 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 			u16 l = getInteriorLight(n, 1, data);
 			video::SColor c = MapBlock_LightColor(255, l, decode_light(f.light_source));
 
+			// Far away, leave out the faces between leaves
+			u8 faces = 0x3f;
+			if(data->m_low_detail)
+			{
+				static const v3s16 face_dirs[6] = {
+					v3s16(0,1,0), v3s16(0,-1,0),
+					v3s16(1,0,0), v3s16(-1,0,0),
+					v3s16(0,0,1), v3s16(0,0,-1)
+				};
+				for(u16 i=0; i<6; i++)
+				{
+					MapNode n2 = data->m_vmanip.getNodeNoEx(
+							blockpos_nodes + p + face_dirs[i]);
+					if(n2.getContent() == n.getContent())
+						faces &= ~(1 << i);
+				}
+			}
+
 			v3f pos = intToFloat(p, BS);
 			aabb3f box(-BS/2,-BS/2,-BS/2,BS/2,BS/2,BS/2);
 			box.MinEdge += pos;
 			box.MaxEdge += pos;
-			makeCuboid(&collector, box, &tile_leaves, 1, c, NULL);
+			makeCuboid(&collector, box, &tile_leaves, 1, c, NULL, faces);
 		break;}
 		case NDT_ALLFACES_OPTIONAL:
 			// This is always pre-converted to something else
@@ -732,7 +732,7 @@ void LuaEntitySAO::setPos(v3f pos)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
 	sendPosition(false, true);
 }
 
@@ -740,7 +740,7 @@ void LuaEntitySAO::moveTo(v3f pos, bool continuous)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	setBasePosition(pos);
 	if(!continuous)
 		sendPosition(true, true);
 }
@@ -1035,7 +1035,9 @@ bool PlayerSAO::isStaticAllowed() const
 
 bool PlayerSAO::unlimitedTransferDistance() const
 {
-	return g_settings->getBool("unlimited_player_transfer_distance");
+	static SettingHandle<bool> unlimited_player_transfer_distance(g_settings,
+			"unlimited_player_transfer_distance");
+	return unlimited_player_transfer_distance.get();
 }
 
 std::string PlayerSAO::getClientInitializationData(u16 protocol_version)
@@ -1465,9 +1467,11 @@ std::string PlayerSAO::getPropertyPacket()
 
 bool PlayerSAO::checkMovementCheat()
 {
+	static SettingHandle<bool> disable_anticheat(g_settings,
+			"disable_anticheat");
+
 	bool cheated = false;
-	if(isAttached() || m_is_singleplayer ||
-			g_settings->getBool("disable_anticheat"))
+	if(isAttached() || m_is_singleplayer || disable_anticheat.get())
 	{
 		m_last_good_position = m_player->getPosition();
 	}
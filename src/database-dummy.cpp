@@ -45,37 +45,10 @@ int Database_Dummy::Initialized(void)
 void Database_Dummy::beginSave() {}
 void Database_Dummy::endSave() {}
 
-void Database_Dummy::saveBlock(MapBlock *block)
+bool Database_Dummy::saveBlock(v3s16 blockpos, const std::string &data)
 {
-	DSTACK(__FUNCTION_NAME);
-	/*
-		Dummy blocks are not written
-	*/
-	if(block->isDummy())
-	{
-		return;
-	}
-
-	// Format used for writing
-	u8 version = SER_FMT_VER_HIGHEST_WRITE;
-	// Get destination
-	v3s16 p3d = block->getPos();
-
-	/*
-		[0] u8 serialization version
-		[1] data
-	*/
-
-	std::ostringstream o(std::ios_base::binary);
-	o.write((char*)&version, 1);
-	// Write basic data
-	block->serialize(o, version, true);
-	// Write block to database
-	std::string tmp = o.str();
-
-	m_database[getBlockAsInteger(p3d)] = tmp;
-	// We just wrote it to the disk so clear modified flag
-	block->resetModified();
+	m_database[getBlockAsInteger(blockpos)] = data;
+	return true;
 }
 
 MapBlock* Database_Dummy::loadBlock(v3s16 blockpos)
@@ -149,6 +122,19 @@ MapBlock* Database_Dummy::loadBlock(v3s16 blockpos)
 	return(NULL);
 }
 
+void Database_Dummy::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::map<v3s16, std::string> &dst)
+{
+	for(std::vector<v3s16>::const_iterator
+			i = blockpos.begin(); i != blockpos.end(); ++i)
+	{
+		std::map<unsigned long long, std::string>::iterator n =
+				m_database.find(getBlockAsInteger(*i));
+		if(n != m_database.end())
+			dst[*i] = n->second;
+	}
+}
+
 void Database_Dummy::listAllLoadableBlocks(std::list<v3s16> &dst)
 {
 	for(std::map<unsigned long long, std::string>::iterator x = m_database.begin(); x != m_database.end(); ++x)
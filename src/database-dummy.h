@@ -32,8 +32,10 @@ class Database_Dummy : public Database
 	Database_Dummy(ServerMap *map);
 	virtual void beginSave();
 	virtual void endSave();
-        virtual void saveBlock(MapBlock *block);
+        virtual bool saveBlock(v3s16 blockpos, const std::string &data);
         virtual MapBlock* loadBlock(v3s16 blockpos);
+        virtual void loadBlocks(const std::vector<v3s16> &blockpos,
+                        std::map<v3s16, std::string> &dst);
         virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
         virtual int Initialized(void);
 	~Database_Dummy();
@@ -27,6 +27,7 @@ LevelDB databases
 
 #include "database-leveldb.h"
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 
 #include "map.h"
 #include "mapsector.h"
@@ -53,38 +54,32 @@ int Database_LevelDB::Initialized(void)
 void Database_LevelDB::beginSave() {}
 void Database_LevelDB::endSave() {}
 
-void Database_LevelDB::saveBlock(MapBlock *block)
+bool Database_LevelDB::saveBlock(v3s16 blockpos, const std::string &data)
 {
-	DSTACK(__FUNCTION_NAME);
-	/*
-		Dummy blocks are not written
-	*/
-	if(block->isDummy())
-	{
-		return;
+	leveldb::Status status = m_database->Put(leveldb::WriteOptions(),
+			i64tos(getBlockAsInteger(blockpos)), data);
+	if(!status.ok()){
+		errorstream<<"WARNING: Saving block ("<<blockpos.X<<", "
+				<<blockpos.Y<<", "<<blockpos.Z<<") failed: "
+				<<status.ToString()<<std::endl;
+		return false;
 	}
+	return true;
+}
 
-	// Format used for writing
-	u8 version = SER_FMT_VER_HIGHEST_WRITE;
-	// Get destination
-	v3s16 p3d = block->getPos();
-
-	/*
-		[0] u8 serialization version
-		[1] data
-	*/
-
-	std::ostringstream o(std::ios_base::binary);
-	o.write((char*)&version, 1);
-	// Write basic data
-	block->serialize(o, version, true);
-	// Write block to database
-	std::string tmp = o.str();
-
-	m_database->Put(leveldb::WriteOptions(), i64tos(getBlockAsInteger(p3d)), tmp);
-
-	// We just wrote it to the disk so clear modified flag
-	block->resetModified();
+bool Database_LevelDB::saveBlocks(const std::map<v3s16, std::string> &blocks)
+{
+	leveldb::WriteBatch batch;
+	for(std::map<v3s16, std::string>::const_iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+		batch.Put(i64tos(getBlockAsInteger(i->first)), i->second);
+	leveldb::Status status = m_database->Write(leveldb::WriteOptions(), &batch);
+	if(!status.ok()){
+		errorstream<<"WARNING: Saving "<<blocks.size()<<" blocks failed: "
+				<<status.ToString()<<std::endl;
+		return false;
+	}
+	return true;
 }
 
 MapBlock* Database_LevelDB::loadBlock(v3s16 blockpos)
@@ -170,6 +165,24 @@ MapBlock* Database_LevelDB::loadBlock(v3s16 blockpos)
 	return NULL;
 }
 
+void Database_LevelDB::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::map<v3s16, std::string> &dst)
+{
+	// Read all of them from the same state of the database
+	leveldb::ReadOptions options;
+	options.snapshot = m_database->GetSnapshot();
+	for(std::vector<v3s16>::const_iterator
+			i = blockpos.begin(); i != blockpos.end(); ++i)
+	{
+		std::string datastr;
+		leveldb::Status s = m_database->Get(options,
+				i64tos(getBlockAsInteger(*i)), &datastr);
+		if(s.ok() && !datastr.empty())
+			dst[*i] = datastr;
+	}
+	m_database->ReleaseSnapshot(options.snapshot);
+}
+
 void Database_LevelDB::listAllLoadableBlocks(std::list<v3s16> &dst)
 {
 	leveldb::Iterator* it = m_database->NewIterator(leveldb::ReadOptions());
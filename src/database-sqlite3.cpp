@@ -44,6 +44,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h"
 #include "settings.h"
 #include "log.h"
+#include <algorithm>
+
+static bool sortBlocksByKey(
+		const std::pair<long long, std::map<v3s16, std::string>::const_iterator> &a,
+		const std::pair<long long, std::map<v3s16, std::string>::const_iterator> &b)
+{
+	return a.first < b.first;
+}
 
 Database_SQLite3::Database_SQLite3(ServerMap *map, std::string savedir)
 {
@@ -51,8 +59,11 @@ Database_SQLite3::Database_SQLite3(ServerMap *map, std::string savedir)
 	m_database_read = NULL;
 	m_database_write = NULL;
 	m_database_list = NULL;
+	m_database_read_range = NULL;
 	m_savedir = savedir;
 	srvmap = map;
+	m_open_mutex.Init();
+	m_read_range_mutex.Init();
 }
 
 int Database_SQLite3::Initialized(void)
@@ -67,9 +78,16 @@ void Database_SQLite3::beginSave() {
 }
 
 void Database_SQLite3::endSave() {
+	commit();
+}
+
+bool Database_SQLite3::commit() {
 	verifyDatabase();
-	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK){
 		infostream<<"WARNING: endSave() failed, map might not have saved.";
+		return false;
+	}
+	return true;
 }
 
 void Database_SQLite3::createDirs(std::string path)
@@ -83,6 +101,9 @@ void Database_SQLite3::createDirs(std::string path)
 }
 
 void Database_SQLite3::verifyDatabase() {
+	// The map saver thread and the emerge threads may get here at once
+	JMutexAutoLock lock(m_open_mutex);
+
 	if(m_database)
 		return;
 	
@@ -135,74 +156,98 @@ void Database_SQLite3::verifyDatabase() {
 			infostream<<"WARNING: SQLite3 database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
 			throw FileNotGoodException("Cannot prepare read statement");
 		}
+
+		d = sqlite3_prepare(m_database, "SELECT `pos`, `data` FROM `blocks` WHERE `pos` BETWEEN ? AND ?", -1, &m_database_read_range, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: SQLite3 database range read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare read statement");
+		}
 		
 		infostream<<"ServerMap: SQLite3 database opened"<<std::endl;
 	}
 }
 
-void Database_SQLite3::saveBlock(MapBlock *block)
+bool Database_SQLite3::saveBlock(v3s16 blockpos, const std::string &data)
 {
 	DSTACK(__FUNCTION_NAME);
-	/*
-		Dummy blocks are not written
-	*/
-	if(block->isDummy())
-	{
-		/*v3s16 p = block->getPos();
-		infostream<<"Database_SQLite3::saveBlock(): WARNING: Not writing dummy block "
-				<<"("<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
-		return;
-	}
-
-	// Format used for writing
-	u8 version = SER_FMT_VER_HIGHEST_WRITE;
-	// Get destination
-	v3s16 p3d = block->getPos();
-	
-	
-#if 0
-	v2s16 p2d(p3d.X, p3d.Z);
-	std::string sectordir = getSectorDir(p2d);
-
-	createDirs(sectordir);
 
-	std::string fullpath = sectordir+DIR_DELIM+getBlockFilename(p3d);
-	std::ofstream o(fullpath.c_str(), std::ios_base::binary);
-	if(o.good() == false)
-		throw FileNotGoodException("Cannot open block data");
-#endif
-	/*
-		[0] u8 serialization version
-		[1] data
-	*/
-	
 	verifyDatabase();
-	
-	std::ostringstream o(std::ios_base::binary);
-	
-	o.write((char*)&version, 1);
-	
-	// Write basic data
-	block->serialize(o, version, true);
-	
-	// Write block to database
-	
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
-	
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
+
+	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
 		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) // TODO this mught not be the right length
+	if(sqlite3_bind_blob(m_database_write, 2, (void *)data.c_str(), data.size(), NULL) != SQLITE_OK)
 		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
 	int written = sqlite3_step(m_database_write);
 	if(written != SQLITE_DONE)
-		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
+		infostream<<"WARNING: Block failed to save ("<<blockpos.X<<", "<<blockpos.Y<<", "<<blockpos.Z<<") "
 		<<sqlite3_errmsg(m_database)<<std::endl;
 	// Make ready for later reuse
 	sqlite3_reset(m_database_write);
-	
-	// We just wrote it to the disk so clear modified flag
-	block->resetModified();
+	return written == SQLITE_DONE;
+}
+
+bool Database_SQLite3::saveBlocks(const std::map<v3s16, std::string> &blocks)
+{
+	// Write in key order; neighbouring rows end up on the same pages
+	std::vector<std::pair<long long, std::map<v3s16, std::string>::const_iterator> > sorted;
+	sorted.reserve(blocks.size());
+	for(std::map<v3s16, std::string>::const_iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+		sorted.push_back(std::make_pair(getBlockAsInteger(i->first), i));
+	std::sort(sorted.begin(), sorted.end(), sortBlocksByKey);
+
+	bool ok = true;
+	beginSave();
+	for(u32 i = 0; i < sorted.size(); i++)
+		if(!saveBlock(sorted[i].second->first, sorted[i].second->second))
+			ok = false;
+	if(!commit())
+		ok = false;
+	return ok;
+}
+
+void Database_SQLite3::loadBlocks(const std::vector<v3s16> &blockpos,
+		std::map<v3s16, std::string> &dst)
+{
+	if(blockpos.empty())
+		return;
+
+	verifyDatabase();
+
+	std::vector<long long> keys;
+	keys.reserve(blockpos.size());
+	for(std::vector<v3s16>::const_iterator
+			i = blockpos.begin(); i != blockpos.end(); ++i)
+		keys.push_back(getBlockAsInteger(*i));
+	std::sort(keys.begin(), keys.end());
+
+	JMutexAutoLock lock(m_read_range_mutex);
+
+	/*
+		Blocks along the X axis have consecutive keys, so a run of them
+		(eg. a row of a MapChunk) is read with a single range query.
+	*/
+	for(u32 first = 0; first < keys.size();)
+	{
+		u32 last = first;
+		while(last + 1 < keys.size() && keys[last + 1] <= keys[last] + 1)
+			last++;
+
+		sqlite3_bind_int64(m_database_read_range, 1, keys[first]);
+		sqlite3_bind_int64(m_database_read_range, 2, keys[last]);
+		while(sqlite3_step(m_database_read_range) == SQLITE_ROW)
+		{
+			sqlite3_int64 key = sqlite3_column_int64(m_database_read_range, 0);
+			const char *data = (const char *)sqlite3_column_blob(m_database_read_range, 1);
+			size_t len = sqlite3_column_bytes(m_database_read_range, 1);
+			if(data == NULL || len == 0)
+				continue;
+			dst[getIntegerAsBlock(key)] = std::string(data, len);
+		}
+		sqlite3_reset(m_database_read_range);
+
+		first = last + 1;
+	}
 }
 
 MapBlock* Database_SQLite3::loadBlock(v3s16 blockpos)
@@ -345,6 +390,10 @@ Database_SQLite3::~Database_SQLite3()
 		sqlite3_finalize(m_database_read);
 	if(m_database_write)
 		sqlite3_finalize(m_database_write);
+	if(m_database_list)
+		sqlite3_finalize(m_database_list);
+	if(m_database_read_range)
+		sqlite3_finalize(m_database_read_range);
 	if(m_database)
 		sqlite3_close(m_database);
 }
@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define DATABASE_SQLITE3_HEADER
 
 #include "database.h"
+#include "jthread/jmutex.h"
+#include "jthread/jmutexautolock.h"
 #include <string>
 
 extern "C" {
@@ -36,8 +38,11 @@ class Database_SQLite3 : public Database
         virtual void beginSave();
         virtual void endSave();
 
-        virtual void saveBlock(MapBlock *block);
+        virtual bool saveBlock(v3s16 blockpos, const std::string &data);
+        virtual bool saveBlocks(const std::map<v3s16, std::string> &blocks);
         virtual MapBlock* loadBlock(v3s16 blockpos);
+        virtual void loadBlocks(const std::vector<v3s16> &blockpos,
+                        std::map<v3s16, std::string> &dst);
         virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
         virtual int Initialized(void);
 	~Database_SQLite3();
@@ -48,9 +53,15 @@ class Database_SQLite3 : public Database
 	sqlite3_stmt *m_database_read;
 	sqlite3_stmt *m_database_write;
 	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_read_range;
+	JMutex m_open_mutex;
+	// loadBlocks() can be called from many emerge threads at once
+	JMutex m_read_range_mutex;
 
 	// Create the database structure
 	void createDatabase();
+	// endSave(); returns false if it failed
+	bool commit();
         // Verify we can read/write to the database
         void verifyDatabase();
         void createDirs(std::string path);
@@ -19,6 +19,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "database.h"
 #include "irrlichttypes.h"
+#include "mapblock.h"
+#include "serialization.h"
+#include "debug.h"
+#include <sstream>
 
 static s32 unsignedToSigned(s32 i, s32 max_positive)
 {
@@ -50,3 +54,55 @@ v3s16 Database::getIntegerAsBlock(long long i) {
 	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
 	return v3s16(x,y,z);
 }
+
+std::string Database::serializeBlock(MapBlock *block)
+{
+	/*
+		Dummy blocks are not written
+	*/
+	if(block->isDummy())
+		return "";
+
+	// Format used for writing
+	MapBlockDiskCopy copy;
+	block->copyForDisk(copy, SER_FMT_VER_HIGHEST_WRITE);
+	return serializeBlock(copy);
+}
+
+std::string Database::serializeBlock(const MapBlockDiskCopy &copy)
+{
+	/*
+		[0] u8 serialization version
+		[1] data
+	*/
+	std::ostringstream o(std::ios_base::binary);
+	o.write((char*)&copy.version, 1);
+	// Write basic data
+	MapBlock::serializeDiskCopy(o, copy);
+	return o.str();
+}
+
+void Database::saveBlock(MapBlock *block)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::string data = serializeBlock(block);
+	if(data.empty())
+		return;
+
+	// We just wrote it to the disk so clear modified flag
+	if(saveBlock(block->getPos(), data))
+		block->resetModified();
+}
+
+bool Database::saveBlocks(const std::map<v3s16, std::string> &blocks)
+{
+	bool ok = true;
+	beginSave();
+	for(std::map<v3s16, std::string>::const_iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+		if(!saveBlock(i->first, i->second))
+			ok = false;
+	endSave();
+	return ok;
+}
@@ -21,9 +21,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define DATABASE_HEADER
 
 #include <list>
+#include <map>
+#include <string>
+#include <vector>
 #include "irr_v3d.h"
 
 class MapBlock;
+struct MapBlockDiskCopy;
 
 class Database
 {
@@ -31,10 +35,26 @@ class Database
 	virtual void beginSave()=0;
 	virtual void endSave()=0;
 
-	virtual void saveBlock(MapBlock *block)=0;
+	// Serializes the block and writes it; resets its modified state
+	// if it was written
+	virtual void saveBlock(MapBlock *block);
+	// Writes data made by serializeBlock(); returns false if it failed
+	virtual bool saveBlock(v3s16 blockpos, const std::string &data)=0;
+	// Writes many blocks in one transaction; returns false if any of
+	// them failed
+	virtual bool saveBlocks(const std::map<v3s16, std::string> &blocks);
 	virtual MapBlock* loadBlock(v3s16 blockpos)=0;
+	// Reads the data of those of the blocks that exist, without
+	// deserializing it; see ServerMap::loadBlock(std::string*, ...)
+	virtual void loadBlocks(const std::vector<v3s16> &blockpos,
+			std::map<v3s16, std::string> &dst)=0;
 	long long getBlockAsInteger(const v3s16 pos);
 	v3s16 getIntegerAsBlock(long long i);
+	// Returns the block in the format stored in the database,
+	// or an empty string for dummy blocks (which are not written)
+	static std::string serializeBlock(MapBlock *block);
+	// The same from a copy of the block, see MapBlockDiskCopy
+	static std::string serializeBlock(const MapBlockDiskCopy &copy);
 	virtual void listAllLoadableBlocks(std::list<v3s16> &dst)=0;
 	virtual int Initialized(void)=0;
 	virtual ~Database() {};
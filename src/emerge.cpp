@@ -57,15 +57,21 @@ class EmergeThread : public SimpleThread
 	int id;
 	
 	Event qevent;
-	std::queue<v3s16> blockqueue;
+	BlockEmergeQueue blockqueue;
+	// Set while waiting for qevent with nothing to do in any queue
+	MutexedVariable<bool> idle;
 	
-	EmergeThread(Server *server, int ethreadid):
+	EmergeThread(Server *server, int ethreadid, EmergeQueueCounts *counts):
 		SimpleThread(),
 		m_server(server),
 		map(NULL),
 		emerge(NULL),
 		mapgen(NULL),
-		id(ethreadid)
+		id(ethreadid),
+		blockqueue(counts),
+		idle(false),
+		m_chunks_generated(0),
+		m_chunks_timer(0)
 	{
 	}
 
@@ -83,9 +89,141 @@ class EmergeThread : public SimpleThread
 	bool popBlockEmerge(v3s16 *pos, u8 *flags);
 	bool getBlockOrStartGen(v3s16 p, MapBlock **b,
 			BlockMakeData *data, bool allow_generate);
+
+private:
+	// Per-thread statistics for the profiler
+	void profileChunk(u32 generate_us, u32 lighting_us,
+			u32 finish_us, u32 on_generated_us);
+	std::string m_profiler_prefix;
+	u32 m_chunks_generated;
+	u32 m_chunks_timer;
 };
 
 
+///////////////////////////// Block Emerge Queue //////////////////////////////
+
+EmergeQueueCounts::EmergeQueueCounts():
+	m_total(0)
+{
+	m_mutex.Init();
+}
+
+
+bool EmergeQueueCounts::add(u16 peer_id, u16 limit_total, u16 limit_peer) {
+	JMutexAutoLock lock(m_mutex);
+
+	if (m_total >= limit_total)
+		return false;
+	u16 &count = m_peer_count[peer_id];
+	if (count >= limit_peer)
+		return false;
+	count++;
+	m_total++;
+	return true;
+}
+
+
+void EmergeQueueCounts::remove(u16 peer_id) {
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<u16, u16>::iterator iter = m_peer_count.find(peer_id);
+	assert(iter != m_peer_count.end() && iter->second > 0);
+	if (--iter->second == 0)
+		m_peer_count.erase(iter);
+	m_total--;
+}
+
+
+BlockEmergeQueue::BlockEmergeQueue(EmergeQueueCounts *counts):
+	m_counts(counts)
+{
+	m_mutex.Init();
+}
+
+
+bool BlockEmergeQueue::push(u16 peer_id, v3s16 p, u8 flags, u16 priority,
+		u16 limit_total, u16 limit_peer) {
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<v3s16, BlockEmergeData>::iterator iter = m_blocks.find(p);
+	if (iter != m_blocks.end()) {
+		BlockEmergeData &bedata = iter->second;
+		bedata.flags |= flags;
+		if (peer_id != bedata.peer_requested)
+			bedata.shared = true;
+		if (priority < bedata.priority) {
+			m_order.erase(std::make_pair(bedata.priority, p));
+			m_order.insert(std::make_pair(priority, p));
+			bedata.priority = priority;
+		}
+		return true;
+	}
+
+	if (!m_counts->add(peer_id, limit_total, limit_peer))
+		return false;
+
+	BlockEmergeData bedata;
+	bedata.peer_requested = peer_id;
+	bedata.shared = false;
+	bedata.flags = flags;
+	bedata.priority = priority;
+	m_blocks[p] = bedata;
+	m_order.insert(std::make_pair(priority, p));
+
+	return true;
+}
+
+
+bool BlockEmergeQueue::pop(v3s16 *pos, u8 *flags) {
+	JMutexAutoLock lock(m_mutex);
+
+	if (m_order.empty())
+		return false;
+	v3s16 p = m_order.begin()->second;
+	m_order.erase(m_order.begin());
+
+	std::map<v3s16, BlockEmergeData>::iterator iter = m_blocks.find(p);
+	assert(iter != m_blocks.end());
+
+	*pos = p;
+	*flags = iter->second.flags;
+
+	m_counts->remove(iter->second.peer_requested);
+	m_blocks.erase(iter);
+
+	return true;
+}
+
+
+u32 BlockEmergeQueue::cancel(u16 peer_id, v3s16 center, s16 max_d) {
+	JMutexAutoLock lock(m_mutex);
+
+	u32 cancelled = 0;
+	for (std::map<v3s16, BlockEmergeData>::iterator
+			iter = m_blocks.begin(); iter != m_blocks.end();) {
+		BlockEmergeData &bedata = iter->second;
+		v3s16 d = iter->first - center;
+		if (bedata.peer_requested != peer_id || bedata.shared ||
+				(abs(d.X) <= max_d && abs(d.Y) <= max_d && abs(d.Z) <= max_d)) {
+			++iter;
+			continue;
+		}
+		m_order.erase(std::make_pair(bedata.priority, iter->first));
+		m_counts->remove(peer_id);
+		m_blocks.erase(iter++);
+		cancelled++;
+	}
+
+	return cancelled;
+}
+
+
+u32 BlockEmergeQueue::size() {
+	JMutexAutoLock lock(m_mutex);
+	return m_blocks.size();
+}
+
+
 /////////////////////////////// Emerge Manager ////////////////////////////////
 
 EmergeManager::EmergeManager(IGameDef *gamedef) {
@@ -106,8 +244,6 @@ EmergeManager::EmergeManager(IGameDef *gamedef) {
 	
 	mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
 
-	queuemutex.Init();
-	
 	int nthreads;
 	if (g_settings->get("num_emerge_threads").empty()) {
 		int nprocs = porting::getNumberOfProcessors();
@@ -128,7 +264,8 @@ EmergeManager::EmergeManager(IGameDef *gamedef) {
 		g_settings->getU16("emergequeue_limit_generate");
 	
 	for (int i = 0; i != nthreads; i++)
-		emergethread.push_back(new EmergeThread((Server *)gamedef, i));
+		emergethread.push_back(new EmergeThread((Server *)gamedef, i,
+				&queue_counts));
 		
 	infostream << "EmergeManager: using " << nthreads << " threads" << std::endl;
 }
@@ -229,60 +366,58 @@ void EmergeManager::triggerAllThreads() {
 		emergethread[i]->trigger();
 }
 
-bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate) {
-	std::map<v3s16, BlockEmergeData *>::const_iterator iter;
-	BlockEmergeData *bedata;
-	u16 count;
+bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p,
+		bool allow_generate, u16 distance) {
 	u8 flags = 0;
-	int idx = 0;
-	
 	if (allow_generate)
 		flags |= BLOCK_EMERGE_ALLOWGEN;
 
-	{
-		JMutexAutoLock queuelock(queuemutex);
-		
-		count = blocks_enqueued.size();
-		if (count >= qlimit_total)
-			return false;
+	// Blocks that can only be loaded are quick, do them first
+	u16 priority = distance * 2 + (allow_generate ? 1 : 0);
 
-		count = peer_queue_count[peer_id];
-		u16 qlimit_peer = allow_generate ? qlimit_generate : qlimit_diskonly;
-		if (count >= qlimit_peer)
-			return false;
-		
-		iter = blocks_enqueued.find(p);
-		if (iter != blocks_enqueued.end()) {
-			bedata = iter->second;
-			bedata->flags |= flags;
-			return true;
-		}
+	/*
+		All blocks of a MapChunk go to the same thread, so that two
+		threads don't end up generating the same chunk
+	*/
+	v3s16 chunkpos = p;
+	if (params) {
+		s16 chunksize = params->chunksize;
+		s16 coffset = -chunksize / 2;
+		chunkpos = getContainerPos(p - v3s16(coffset, coffset, coffset),
+				chunksize);
+	}
+	u32 nthreads = emergethread.size();
+	u32 idx = ((u32)chunkpos.X * 73856093 ^ (u32)chunkpos.Y * 19349663 ^
+			(u32)chunkpos.Z * 83492791) % nthreads;
+
+	// The limits count the blocks in the queues of all the threads
+	u16 qlimit_peer = allow_generate ? qlimit_generate : qlimit_diskonly;
+	if (!emergethread[idx]->blockqueue.push(peer_id, p, flags, priority,
+			qlimit_total, qlimit_peer))
+		return false;
 
-		bedata = new BlockEmergeData;
-		bedata->flags = flags;
-		bedata->peer_requested = peer_id;
-		blocks_enqueued.insert(std::make_pair(p, bedata));
-		
-		peer_queue_count[peer_id] = count + 1;
-		
-		// insert into the EmergeThread queue with the least items
-		int lowestitems = emergethread[0]->blockqueue.size();
-		for (unsigned int i = 1; i != emergethread.size(); i++) {
-			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
-				idx = i;
-				lowestitems = nitems;
-			}
+	emergethread[idx]->qevent.signal();
+
+	// Let an idle thread help if the thread is busy
+	for (unsigned int i = 0; i != nthreads; i++) {
+		if (i != idx && emergethread[i]->idle.get()) {
+			emergethread[i]->qevent.signal();
+			break;
 		}
-		
-		emergethread[idx]->blockqueue.push(p);
 	}
-	emergethread[idx]->qevent.signal();
-	
 	return true;
 }
 
 
+void EmergeManager::cancelBlockEmerges(u16 peer_id, v3s16 center, s16 max_d) {
+	u32 cancelled = 0;
+	for (unsigned int i = 0; i != emergethread.size(); i++)
+		cancelled += emergethread[i]->blockqueue.cancel(peer_id, center, max_d);
+	if (cancelled)
+		g_profiler->add("Emerge: cancelled blocks", cancelled);
+}
+
+
 int EmergeManager::getGroundLevelAtPoint(v2s16 p) {
 	if (mapgen.size() == 0 || !mapgen[0]) {
 		errorstream << "EmergeManager: getGroundLevelAtPoint() called"
@@ -388,38 +523,79 @@ void EmergeManager::registerMapgen(std::string mgname, MapgenFactory *mgfactory)
 ////////////////////////////// Emerge Thread ////////////////////////////////// 
 
 bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
-	std::map<v3s16, BlockEmergeData *>::iterator iter;
-	JMutexAutoLock queuelock(emerge->queuemutex);
+	idle.set(false);
+	if (blockqueue.pop(pos, flags))
+		return true;
 
-	if (blockqueue.empty())
-		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
-	
-	*pos = p;
-	
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end()) 
-		return false; //uh oh, queue and map out of sync!!
+	/*
+		Nothing to do; take work from the other threads.
+		idle is set before looking so that a block queued after it was
+		looked at wakes this thread up.
+	*/
+	idle.set(true);
+	unsigned int nthreads = emerge->emergethread.size();
+	for (unsigned int i = 1; i != nthreads; i++) {
+		EmergeThread *other = emerge->emergethread[(id + i) % nthreads];
+		if (other->blockqueue.pop(pos, flags)) {
+			idle.set(false);
+			g_profiler->add("Emerge: stolen blocks", 1);
+			return true;
+		}
+	}
+	return false;
+}
 
-	BlockEmergeData *bedata = iter->second;
-	*flags = bedata->flags;
-	
-	emerge->peer_queue_count[bedata->peer_requested]--;
 
-	delete bedata;
-	emerge->blocks_enqueued.erase(iter);
-	
-	return true;
+void EmergeThread::profileChunk(u32 generate_us, u32 lighting_us,
+		u32 finish_us, u32 on_generated_us) {
+	if (m_profiler_prefix.empty())
+		m_profiler_prefix = "EmergeThread" + itos(id) + ": ";
+
+	g_profiler->avg(m_profiler_prefix + "generate (ms)", generate_us / 1000.0);
+	g_profiler->avg(m_profiler_prefix + "lighting (ms)", lighting_us / 1000.0);
+	g_profiler->avg(m_profiler_prefix + "finishBlockMake (ms)",
+			finish_us / 1000.0);
+	g_profiler->avg(m_profiler_prefix + "on_generated (ms)",
+			on_generated_us / 1000.0);
+
+	m_chunks_generated++;
+	u32 time_ms = porting::getTimeMs();
+	if (m_chunks_timer == 0) {
+		m_chunks_timer = time_ms;
+	} else if (time_ms - m_chunks_timer >= 1000) {
+		g_profiler->avg(m_profiler_prefix + "chunks/s",
+				m_chunks_generated * 1000.0 / (time_ms - m_chunks_timer));
+		m_chunks_generated = 0;
+		m_chunks_timer = time_ms;
+	}
 }
 
 
 bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b, 
 									BlockMakeData *data, bool allow_gen) {
 	v2s16 p2d(p.X, p.Z);
+
+	/*
+		Read the whole chunk of the block from the database at once,
+		without holding the envlock
+	*/
+	std::vector<v3s16> toread;
+	u32 save_serial;
+	{
+		JMutexAutoLock envlock(m_server->m_env_mutex);
+		map->listChunkBlocksToRead(p, toread);
+		save_serial = map->getSaveSerial();
+	}
+	std::map<v3s16, std::string> prefetched;
+	if (!toread.empty())
+		map->readBlocks(toread, prefetched);
+
 	//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
 	JMutexAutoLock envlock(m_server->m_env_mutex); 
 	
+	if (!toread.empty())
+		map->loadBlocks(p, prefetched, save_serial);
+
 	// Load sector if it isn't loaded
 	if (map->getSectorNoGenerateNoEx(p2d) == NULL)
 		map->loadSectorMeta(p2d);
@@ -436,9 +612,21 @@ bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 	// If could not load and allowed to generate,
 	// start generation inside this same envlock
 	if (allow_gen && (block == NULL || !block->isGenerated())) {
-		EMERGE_DBG_OUT("generating");
 		*b = block;
-		return map->initBlockMake(data, p);
+
+		// The block will be there when the other thread is done
+		v3s16 chunk_min, chunk_max;
+		map->getChunkArea(p, chunk_min, chunk_max);
+		if (emerge->chunks_generating.count(chunk_min)) {
+			EMERGE_DBG_OUT("chunk already being generated");
+			return false;
+		}
+
+		EMERGE_DBG_OUT("generating");
+		if (!map->initBlockMake(data, p))
+			return false;
+		emerge->chunks_generating.insert(data->blockpos_min);
+		return true;
 	}
 	
 	*b = block;
@@ -484,12 +672,19 @@ void *EmergeThread::Thread() {
 		std::map<v3s16, MapBlock *> modified_blocks;
 		
 		if (getBlockOrStartGen(p, &block, &data, allow_generate)) {
+			u32 generate_us = 0, lighting_us = 0;
+			u32 finish_us = 0, on_generated_us = 0;
 			{
 				ScopeProfiler sp(g_profiler, "EmergeThread: Mapgen::makeChunk", SPT_AVG);
 				TimeTaker t("mapgen::make_block()");
+				TimeTaker t_generate("makeChunk", &generate_us, PRECISION_MICRO);
+				u32 lighting_us_before = mapgen->lighting_time_us;
 
 				mapgen->makeChunk(&data);
 
+				t_generate.stop();
+				lighting_us = mapgen->lighting_time_us - lighting_us_before;
+				generate_us -= MYMIN(generate_us, lighting_us);
 				if (enable_mapgen_debug_info == false)
 					t.stop(true); // Hide output
 			}
@@ -500,7 +695,10 @@ void *EmergeThread::Thread() {
 				ScopeProfiler sp(g_profiler, "EmergeThread: after "
 						"Mapgen::makeChunk (envlock)", SPT_AVG);
 
+				TimeTaker t_finish("finishBlockMake", &finish_us, PRECISION_MICRO);
 				map->finishBlockMake(&data, modified_blocks);
+				emerge->chunks_generating.erase(data.blockpos_min);
+				t_finish.stop();
 				
 				block = map->getBlockNoCreateNoEx(p);
 				if (block) {
@@ -517,6 +715,8 @@ void *EmergeThread::Thread() {
 						ign(&m_server->m_ignore_map_edit_events_area,
 						VoxelArea(minp, maxp));
 					{  // takes about 90ms with -O1 on an e3-1230v2
+						TimeTaker t_on_generated("on_generated",
+								&on_generated_us, PRECISION_MICRO);
 						m_server->getScriptIface()->environment_OnGenerated(
 								minp, maxp, emerge->getBlockSeed(minp));
 					}
@@ -526,6 +726,8 @@ void *EmergeThread::Thread() {
 					m_server->m_env->activateBlock(block, 0);
 				}
 			}
+
+			profileChunk(generate_us, lighting_us, finish_us, on_generated_us);
 		}
 
 		/*
@@ -21,8 +21,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define EMERGE_HEADER
 
 #include <map>
+#include <set>
 #include "irr_v3d.h"
 #include "util/container.h"
+#include "jthread/jmutex.h"
 #include "map.h" // for ManualMapVoxelManipulator
 
 #define MGPARAMS_SET_MGNAME      1
@@ -68,7 +70,61 @@ struct BlockMakeData {
 
 struct BlockEmergeData {
 	u16 peer_requested;
+	// Requested by other peers too; not cancelled with peer_requested's
+	bool shared;
 	u8 flags;
+	// Lower is emerged first
+	u16 priority;
+};
+
+/*
+	The number of blocks in all the BlockEmergeQueues, in total and by
+	the peer that requested them, so that the emergequeue_limit_*
+	settings apply to all the threads together. It is locked while a
+	queue is locked, never the other way round.
+*/
+class EmergeQueueCounts {
+public:
+	EmergeQueueCounts();
+
+	// Counts a block; returns false and doesn't count it if a limit
+	// has been reached
+	bool add(u16 peer_id, u16 limit_total, u16 limit_peer);
+	void remove(u16 peer_id);
+
+private:
+	JMutex m_mutex;
+	u32 m_total;
+	std::map<u16, u16> m_peer_count;
+};
+
+/*
+	The blocks queued for one EmergeThread, ordered by priority.
+	There is one of these per thread, each with its own mutex, so that
+	enqueuing only contends with the thread the block goes to.
+	The queue has to merge requests for the same block, keep per-peer
+	counts and cancel by distance, which an atomic counter or a simple
+	lock-free list can't do, so the mutex stays.
+*/
+class BlockEmergeQueue {
+public:
+	BlockEmergeQueue(EmergeQueueCounts *counts);
+
+	// Returns false if the limits of counts are reached
+	bool push(u16 peer_id, v3s16 p, u8 flags, u16 priority,
+			u16 limit_total, u16 limit_peer);
+	bool pop(v3s16 *pos, u8 *flags);
+	// Removes the blocks queued only for the peer that are farther than
+	// max_d blocks from center. Returns the number of blocks removed.
+	u32 cancel(u16 peer_id, v3s16 center, s16 max_d);
+	u32 size();
+
+private:
+	JMutex m_mutex;
+	std::map<v3s16, BlockEmergeData> m_blocks;
+	std::set<std::pair<u16, v3s16> > m_order;
+	// Shared by the queues of all the threads
+	EmergeQueueCounts *m_counts;
 };
 
 class IBackgroundBlockEmerger
@@ -76,8 +132,12 @@ class IBackgroundBlockEmerger
 public:
 	ServerEnvironment *env;
 
+	/*
+		distance is the distance of the block in blocks from the player
+		that needs it; nearer blocks are emerged first.
+	*/
 	virtual bool enqueueBlockEmerge(u16 peer_id, v3s16 p,
-			bool allow_generate) = 0;
+			bool allow_generate, u16 distance=0) = 0;
 	virtual ~IBackgroundBlockEmerger() {}
 };
 
@@ -95,16 +155,19 @@ class EmergeManager : public IBackgroundBlockEmerger {
 	u16 qlimit_total;
 	u16 qlimit_diskonly;
 	u16 qlimit_generate;
+	// Blocks in the queues of all the threads
+	EmergeQueueCounts queue_counts;
+	
+	/*
+		MapChunks being generated, by blockpos_min; guarded by the
+		envlock. Their blocks are not started by other threads.
+	*/
+	std::set<v3s16> chunks_generating;
 	
 	MapgenParams *luaoverride_params;
 	u32 luaoverride_params_modified;
 	u32 luaoverride_flagmask;
 	
-	//block emerge queue data structures
-	JMutex queuemutex;
-	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
-	std::map<u16, u16> peer_queue_count;
-
 	//Mapgen-related structures
 	BiomeDefManager *biomedef;
 	std::vector<Ore *> ores;
@@ -119,7 +182,10 @@ class EmergeManager : public IBackgroundBlockEmerger {
 						MapgenParams *mgparams);
 	MapgenParams *createMapgenParams(std::string mgname);
 	void triggerAllThreads();
-	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate,
+			u16 distance=0);
+	// Called when the player of the peer has moved to center
+	void cancelBlockEmerges(u16 peer_id, v3s16 center, s16 max_d);
 	
 	void registerMapgen(std::string name, MapgenFactory *mgfactory);
 	MapgenParams *getParamsFromSettings(Settings *settings);
@@ -42,6 +42,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "emerge.h"
 #include "util/serialize.h"
+#include "util/string.h"
+#include "util/thread.h"
+#include "noise.h" // PseudoRandom
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -307,6 +310,461 @@ void ActiveBlockList::update(std::list<v3s16> &active_positions,
 	ServerEnvironment
 */
 
+struct ActiveABM
+{
+	ActiveBlockModifier *abm;
+	int chance;
+	int neighbors_range;
+	std::set<content_t> required_neighbors;
+};
+
+/*
+	A block and its 26 neighbors, looked up once for all of its nodes
+*/
+struct ABMBlocks
+{
+	v3s16 pos;
+	MapBlock *blocks[3][3][3];
+
+	void fill(Map *map, v3s16 blockpos)
+	{
+		pos = blockpos;
+		for(s16 x=-1; x<=1; x++)
+		for(s16 y=-1; y<=1; y++)
+		for(s16 z=-1; z<=1; z++)
+		{
+			blocks[x+1][y+1][z+1] = map->getBlockNoCreateNoEx(
+					blockpos + v3s16(x,y,z));
+		}
+	}
+	MapBlock * center()
+	{
+		return blocks[1][1][1];
+	}
+	// Returns false if p is not in the blocks or the block is not loaded
+	bool getNode(v3s16 p, MapNode &n)
+	{
+		v3s16 blockpos = getNodeBlockPos(p);
+		v3s16 d = blockpos - pos;
+		if(d.X < -1 || d.X > 1 || d.Y < -1 || d.Y > 1 || d.Z < -1 || d.Z > 1)
+			return false;
+		MapBlock *block = blocks[d.X+1][d.Y+1][d.Z+1];
+		if(block == NULL)
+			return false;
+		if(block->isDummy())
+			n = MapNode(CONTENT_IGNORE);
+		else
+			n = block->getNodeNoCheck(p - blockpos * MAP_BLOCKSIZE);
+		return true;
+	}
+};
+
+/*
+	A node that passed the chance and neighbor checks of an ABM in
+	ABMHandler::scan(); the ABM is triggered by ABMHandler::applyScanned().
+*/
+struct ABMCandidate
+{
+	ActiveABM *aabm;
+	v3s16 p;
+	content_t content;
+	MapNode neighbor;
+	// The neighbors are out of the ABMBlocks and have to be checked
+	// from the map
+	bool check_neighbors;
+};
+
+struct ABMScanJob
+{
+	ABMBlocks blocks;
+	int seed;
+	std::vector<ABMCandidate> candidates;
+};
+
+class ABMHandler
+{
+private:
+	ServerEnvironment *m_env;
+	// Indexed by content; empty for contents that trigger nothing
+	std::vector<std::list<ActiveABM> > m_aabms;
+	bool m_empty;
+
+	bool isTriggerContent(content_t c)
+	{
+		return c < m_aabms.size() && !m_aabms[c].empty();
+	}
+	bool hasTriggerContent(MapBlock *block)
+	{
+		const std::vector<content_t> &contents = block->getContents();
+		for(u32 i=0; i<contents.size(); i++){
+			if(isTriggerContent(contents[i]))
+				return true;
+		}
+		return false;
+	}
+	/*
+		Finds a required neighbor of p for the ABM.
+		If map is NULL, only the ABMBlocks are looked at and *unknown is
+		set if some of the neighbors are not in them.
+	*/
+	bool findNeighbor(ActiveABM &aabm, v3s16 p, ABMBlocks &blocks,
+			Map *map, MapNode &neighbor, bool *unknown)
+	{
+		v3s16 p1;
+		int neighbors_range = aabm.neighbors_range;
+		for(p1.X = p.X - neighbors_range; p1.X <= p.X + neighbors_range; ++p1.X)
+		for(p1.Y = p.Y - neighbors_range; p1.Y <= p.Y + neighbors_range; ++p1.Y)
+		for(p1.Z = p.Z - neighbors_range; p1.Z <= p.Z + neighbors_range; ++p1.Z)
+		{
+			if(p1 == p)
+				continue;
+			MapNode n;
+			if(!blocks.getNode(p1, n)){
+				if(map == NULL){
+					*unknown = true;
+					continue;
+				}
+				n = map->getNodeNoEx(p1);
+			}
+			content_t c = n.getContent();
+			std::set<content_t>::const_iterator k;
+			k = aabm.required_neighbors.find(c);
+			if(k != aabm.required_neighbors.end()){
+				neighbor = n;
+				return true;
+			}
+		}
+		return false;
+	}
+	void trigger(ActiveABM &aabm, ABMBlocks &blocks, v3s16 p, MapNode n,
+			MapNode neighbor)
+	{
+		// Find out how many objects the block contains
+		u32 active_object_count =
+				blocks.center()->m_static_objects.m_active.size();
+		// Find out how many objects this and all the neighbors contain
+		u32 active_object_count_wider = 0;
+		for(s16 x=0; x<3; x++)
+		for(s16 y=0; y<3; y++)
+		for(s16 z=0; z<3; z++)
+		{
+			MapBlock *block2 = blocks.blocks[x][y][z];
+			if(block2==NULL)
+				continue;
+			active_object_count_wider +=
+					block2->m_static_objects.m_active.size()
+					+ block2->m_static_objects.m_stored.size();
+		}
+
+		// Call trigger
+		aabm.abm->trigger(m_env, p, n,
+				active_object_count, active_object_count_wider, neighbor);
+	}
+public:
+	ABMHandler(std::list<ABMWithState> &abms,
+			float dtime_s, ServerEnvironment *env,
+			bool use_timers):
+		m_env(env),
+		m_empty(true)
+	{
+		if(dtime_s < 0.001)
+			return;
+		INodeDefManager *ndef = env->getGameDef()->ndef();
+		for(std::list<ABMWithState>::iterator
+				i = abms.begin(); i != abms.end(); ++i){
+			ActiveBlockModifier *abm = i->abm;
+			float trigger_interval = abm->getTriggerInterval();
+			if(trigger_interval < 0.001)
+				trigger_interval = 0.001;
+			float actual_interval = dtime_s;
+			if(use_timers){
+				i->timer += dtime_s;
+				if(i->timer < trigger_interval)
+					continue;
+				i->timer -= trigger_interval;
+				if (i->timer > trigger_interval*2)
+					i->timer = 0;
+				actual_interval = trigger_interval;
+			}
+			float intervals = actual_interval / trigger_interval;
+			if(intervals == 0)
+				continue;
+			float chance = abm->getTriggerChance();
+			if(chance == 0)
+				chance = 1;
+			ActiveABM aabm;
+			aabm.abm = abm;
+			aabm.neighbors_range = abm->getNeighborsRange();
+			aabm.chance = chance / intervals;
+			if(aabm.chance == 0)
+				aabm.chance = 1;
+			// Trigger neighbors
+			std::set<std::string> required_neighbors_s
+					= abm->getRequiredNeighbors();
+			for(std::set<std::string>::iterator
+					i = required_neighbors_s.begin();
+					i != required_neighbors_s.end(); i++)
+			{
+				ndef->getIds(*i, aabm.required_neighbors);
+			}
+			// Trigger contents
+			std::set<std::string> contents_s = abm->getTriggerContents();
+			for(std::set<std::string>::iterator
+					i = contents_s.begin(); i != contents_s.end(); i++)
+			{
+				std::set<content_t> ids;
+				ndef->getIds(*i, ids);
+				for(std::set<content_t>::const_iterator k = ids.begin();
+						k != ids.end(); k++)
+				{
+					content_t c = *k;
+					if(c >= m_aabms.size())
+						m_aabms.resize(c + 1);
+					m_aabms[c].push_back(aabm);
+					m_empty = false;
+				}
+			}
+		}
+	}
+	bool empty()
+	{
+		return m_empty;
+	}
+	void apply(MapBlock *block)
+	{
+		if(m_empty)
+			return;
+
+		// Skip blocks that have none of the trigger contents
+		if(!hasTriggerContent(block)){
+			g_profiler->add("ABM skipped blocks", 1);
+			return;
+		}
+
+		ScopeProfiler sp(g_profiler, "ABM apply", SPT_ADD);
+
+		ServerMap *map = &m_env->getServerMap();
+
+		ABMBlocks blocks;
+		blocks.fill(map, block->getPos());
+
+		v3s16 p0;
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+		{
+			MapNode n = block->getNodeNoEx(p0);
+			content_t c = n.getContent();
+			if(!isTriggerContent(c))
+				continue;
+			v3s16 p = p0 + block->getPosRelative();
+
+			std::list<ActiveABM> &aabms = m_aabms[c];
+			for(std::list<ActiveABM>::iterator
+					i = aabms.begin(); i != aabms.end(); i++)
+			{
+				if(myrand() % i->chance != 0)
+					continue;
+
+				// Check neighbors
+				MapNode neighbor;
+				if(!i->required_neighbors.empty() &&
+						!findNeighbor(*i, p, blocks, map, neighbor, NULL))
+					continue;
+
+				trigger(*i, blocks, p, n, neighbor);
+			}
+		}
+	}
+	/*
+		Parallel version of apply(), in two parts:
+		- scan() does the node scanning, chance rolling and neighbor
+		  checking of a block without modifying anything. It can be run
+		  in other threads while the map is not being modified.
+		- applyScanned() triggers the found ABMs in the server thread.
+	*/
+	void scan(ABMScanJob &job)
+	{
+		MapBlock *block = job.blocks.center();
+		if(m_empty || block == NULL || block->isDummy())
+			return;
+		if(!hasTriggerContent(block))
+			return;
+
+		PseudoRandom pr(job.seed);
+
+		v3s16 p0;
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+		{
+			content_t c = block->getNodeNoCheck(p0).getContent();
+			if(!isTriggerContent(c))
+				continue;
+			v3s16 p = p0 + block->getPosRelative();
+
+			std::list<ActiveABM> &aabms = m_aabms[c];
+			for(std::list<ActiveABM>::iterator
+					i = aabms.begin(); i != aabms.end(); i++)
+			{
+				if(pr.next() % i->chance != 0)
+					continue;
+
+				ABMCandidate candidate;
+				candidate.aabm = &(*i);
+				candidate.p = p;
+				candidate.content = c;
+				candidate.check_neighbors = false;
+				bool unknown = false;
+				if(!i->required_neighbors.empty() &&
+						!findNeighbor(*i, p, job.blocks, NULL,
+						candidate.neighbor, &unknown)){
+					// Not found yet, but might be in the unknown ones
+					if(!unknown)
+						continue;
+					candidate.check_neighbors = true;
+				}
+				job.candidates.push_back(candidate);
+			}
+		}
+	}
+	void applyScanned(ABMScanJob &job)
+	{
+		if(job.candidates.empty())
+			return;
+
+		ScopeProfiler sp(g_profiler, "ABM apply", SPT_ADD);
+
+		ServerMap *map = &m_env->getServerMap();
+		MapBlock *block = job.blocks.center();
+
+		for(std::vector<ABMCandidate>::iterator
+				i = job.candidates.begin();
+				i != job.candidates.end(); ++i)
+		{
+			// Previous triggers may have changed the node
+			MapNode n = block->getNodeNoEx(i->p - block->getPosRelative());
+			if(n.getContent() != i->content)
+				continue;
+
+			MapNode neighbor = i->neighbor;
+			if(i->check_neighbors &&
+					!findNeighbor(*i->aabm, i->p, job.blocks, map, neighbor, NULL))
+				continue;
+
+			trigger(*i->aabm, job.blocks, i->p, n, neighbor);
+		}
+	}
+};
+
+/*
+	Runs ABMHandler::scan() for a list of jobs in the calling thread and
+	in the ABMScanThreads.
+*/
+class ABMScanner
+{
+public:
+	ABMScanner():
+		m_handler(NULL),
+		m_jobs(NULL),
+		m_next(0),
+		m_running(0)
+	{
+		m_mutex.Init();
+	}
+
+	void setJobs(ABMHandler *handler, std::vector<ABMScanJob> *jobs,
+			u32 threadcount)
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_handler = handler;
+		m_jobs = jobs;
+		m_next = 0;
+		m_running = threadcount;
+	}
+
+	// Scans jobs until there are none left
+	void run()
+	{
+		for(;;){
+			ABMScanJob *job;
+			{
+				JMutexAutoLock lock(m_mutex);
+				if(m_jobs == NULL || m_next >= m_jobs->size())
+					return;
+				job = &(*m_jobs)[m_next++];
+			}
+			m_handler->scan(*job);
+		}
+	}
+
+	// Called by each of the threads when run() returns
+	void threadDone()
+	{
+		JMutexAutoLock lock(m_mutex);
+		assert(m_running > 0);
+		m_running--;
+		if(m_running == 0)
+			m_done.signal();
+	}
+
+	// Waits for the threads given to setJobs()
+	void waitThreads(u32 threadcount)
+	{
+		if(threadcount != 0)
+			m_done.wait();
+		JMutexAutoLock lock(m_mutex);
+		m_handler = NULL;
+		m_jobs = NULL;
+	}
+
+private:
+	ABMHandler *m_handler;
+	std::vector<ABMScanJob> *m_jobs;
+	u32 m_next;
+	u32 m_running;
+	JMutex m_mutex;
+	Event m_done;
+};
+
+class ABMScanThread : public SimpleThread
+{
+public:
+	ABMScanThread(ABMScanner *scanner, int id):
+		SimpleThread(),
+		m_scanner(scanner),
+		m_id(id)
+	{
+	}
+
+	void *Thread()
+	{
+		ThreadStarted();
+		log_register_thread("ABMScanThread" + itos(m_id));
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		while(getRun())
+		{
+			m_start.wait();
+			if(!getRun())
+				break;
+			m_scanner->run();
+			m_scanner->threadDone();
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		return NULL;
+	}
+
+	// Signaled once for every setJobs() and for stopping
+	Event m_start;
+
+private:
+	ABMScanner *m_scanner;
+	int m_id;
+};
+
 ServerEnvironment::ServerEnvironment(ServerMap *map,
 		GameScripting *scriptIface,
 		IGameDef *gamedef, IBackgroundBlockEmerger *emerger):
@@ -314,6 +772,7 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_script(scriptIface),
 	m_gamedef(gamedef),
 	m_emerger(emerger),
+	m_active_object_grid(MAP_BLOCKSIZE * BS),
 	m_random_spawn_timer(3),
 	m_send_recommended_timer(0),
 	m_active_objects_last(0),
@@ -327,10 +786,26 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 {
 	m_use_weather = g_settings->getBool("weather");
 	emerger->env = this;
+
+	m_abm_scanner = new ABMScanner();
+	u16 abm_threads = g_settings->getU16("num_abm_threads");
+	for(u16 i=0; i<abm_threads; i++){
+		ABMScanThread *thread = new ABMScanThread(m_abm_scanner, i);
+		thread->Start();
+		m_abm_scan_threads.push_back(thread);
+	}
 }
 
 ServerEnvironment::~ServerEnvironment()
 {
+	for(u32 i=0; i<m_abm_scan_threads.size(); i++){
+		m_abm_scan_threads[i]->setRun(false);
+		m_abm_scan_threads[i]->m_start.signal();
+		m_abm_scan_threads[i]->stop();
+		delete m_abm_scan_threads[i];
+	}
+	delete m_abm_scanner;
+
 	// Clear active block list.
 	// This makes the next one delete all active objects.
 	m_active_blocks.clear();
@@ -633,174 +1108,6 @@ void ServerEnvironment::loadMeta(const std::string &savedir)
 	}
 }
 
-struct ActiveABM
-{
-	ActiveBlockModifier *abm;
-	int chance;
-	int neighbors_range;
-	std::set<content_t> required_neighbors;
-};
-
-class ABMHandler
-{
-private:
-	ServerEnvironment *m_env;
-	std::map<content_t, std::list<ActiveABM> > m_aabms;
-public:
-	ABMHandler(std::list<ABMWithState> &abms,
-			float dtime_s, ServerEnvironment *env,
-			bool use_timers):
-		m_env(env)
-	{
-		if(dtime_s < 0.001)
-			return;
-		INodeDefManager *ndef = env->getGameDef()->ndef();
-		for(std::list<ABMWithState>::iterator
-				i = abms.begin(); i != abms.end(); ++i){
-			ActiveBlockModifier *abm = i->abm;
-			float trigger_interval = abm->getTriggerInterval();
-			if(trigger_interval < 0.001)
-				trigger_interval = 0.001;
-			float actual_interval = dtime_s;
-			if(use_timers){
-				i->timer += dtime_s;
-				if(i->timer < trigger_interval)
-					continue;
-				i->timer -= trigger_interval;
-				if (i->timer > trigger_interval*2)
-					i->timer = 0;
-				actual_interval = trigger_interval;
-			}
-			float intervals = actual_interval / trigger_interval;
-			if(intervals == 0)
-				continue;
-			float chance = abm->getTriggerChance();
-			if(chance == 0)
-				chance = 1;
-			ActiveABM aabm;
-			aabm.abm = abm;
-			aabm.neighbors_range = abm->getNeighborsRange();
-			aabm.chance = chance / intervals;
-			if(aabm.chance == 0)
-				aabm.chance = 1;
-			// Trigger neighbors
-			std::set<std::string> required_neighbors_s
-					= abm->getRequiredNeighbors();
-			for(std::set<std::string>::iterator
-					i = required_neighbors_s.begin();
-					i != required_neighbors_s.end(); i++)
-			{
-				ndef->getIds(*i, aabm.required_neighbors);
-			}
-			// Trigger contents
-			std::set<std::string> contents_s = abm->getTriggerContents();
-			for(std::set<std::string>::iterator
-					i = contents_s.begin(); i != contents_s.end(); i++)
-			{
-				std::set<content_t> ids;
-				ndef->getIds(*i, ids);
-				for(std::set<content_t>::const_iterator k = ids.begin();
-						k != ids.end(); k++)
-				{
-					content_t c = *k;
-					std::map<content_t, std::list<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::list<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
-				}
-			}
-		}
-	}
-	void apply(MapBlock *block)
-	{
-		if(m_aabms.empty())
-			return;
-
-		ScopeProfiler sp(g_profiler, "ABM apply", SPT_ADD);
-
-		ServerMap *map = &m_env->getServerMap();
-
-		v3s16 p0;
-		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-		{
-			MapNode n = block->getNodeNoEx(p0);
-			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
-
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
-				continue;
-
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
-			{
-				if(myrand() % i->chance != 0)
-					continue;
-
-				// Check neighbors
-				MapNode neighbor;
-				if(!i->required_neighbors.empty())
-				{
-					v3s16 p1;
-					int neighbors_range = i->neighbors_range;
-					for(p1.X = p.X - neighbors_range; p1.X <= p.X + neighbors_range; ++p1.X)
-					for(p1.Y = p.Y - neighbors_range; p1.Y <= p.Y + neighbors_range; ++p1.Y)
-					for(p1.Z = p.Z - neighbors_range; p1.Z <= p.Z + neighbors_range; ++p1.Z)
-					{
-						if(p1 == p)
-							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
-						std::set<content_t>::const_iterator k;
-						k = i->required_neighbors.find(c);
-						if(k != i->required_neighbors.end()){
-							neighbor = n;
-							goto neighbor_found;
-						}
-					}
-					// No required neighbor found
-					continue;
-				}
-neighbor_found:
-
-				// Find out how many objects the block contains
-				u32 active_object_count = block->m_static_objects.m_active.size();
-				// Find out how many objects this and all the neighbors contain
-				u32 active_object_count_wider = 0;
-				//u32 wider_unknown_count = 0;
-				for(s16 x=-1; x<=1; x++)
-				for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
-				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block->getPos() + v3s16(x,y,z));
-					if(block2==NULL){
-						//wider_unknown_count = 0;
-						continue;
-					}
-					active_object_count_wider +=
-							block2->m_static_objects.m_active.size()
-							+ block2->m_static_objects.m_stored.size();
-				}
-				// Extrapolate
-				//u32 wider_known_count = 3*3*3; // - wider_unknown_count;
-				//active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
-				
-				// Call trigger
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider, neighbor);
-			}
-		}
-	}
-};
-
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 {
 	// Get time difference
@@ -845,6 +1152,52 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	abmhandler.apply(block);
 }
 
+u32 ServerEnvironment::applyABMsParallel(ABMHandler &abmhandler)
+{
+	std::vector<ABMScanJob> jobs;
+	u32 calls = 0;
+	for(std::set<v3s16>::iterator
+			i = m_active_blocks.m_list.begin();
+			i != m_active_blocks.m_list.end(); ++i)
+	{
+		MapBlock *block = m_map->getBlockNoCreateNoEx(*i);
+		if(block==NULL)
+			continue;
+		++calls;
+
+		// Set current time as timestamp
+		block->setTimestampNoChangedFlag(m_game_time);
+
+		if(abmhandler.empty())
+			continue;
+		jobs.push_back(ABMScanJob());
+		ABMScanJob &job = jobs.back();
+		job.blocks.fill(m_map, *i);
+		job.seed = myrand();
+	}
+	if(jobs.empty())
+		return calls;
+
+	/*
+		The map is not modified while the threads are scanning; they only
+		read it, and this thread helps them until all jobs are taken.
+	*/
+	{
+		ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg", SPT_AVG);
+		u32 threadcount = m_abm_scan_threads.size();
+		m_abm_scanner->setJobs(&abmhandler, &jobs, threadcount);
+		for(u32 i=0; i<threadcount; i++)
+			m_abm_scan_threads[i]->m_start.signal();
+		m_abm_scanner->run();
+		m_abm_scanner->waitThreads(threadcount);
+	}
+
+	for(u32 i=0; i<jobs.size(); i++)
+		abmhandler.applyScanned(jobs[i]);
+
+	return calls;
+}
+
 void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
 {
 	m_abms.push_back(ABMWithState(abm));
@@ -891,21 +1244,31 @@ bool ServerEnvironment::removeNode(v3s16 p)
 
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
+	std::vector<u16> near;
+	m_active_object_grid.getNear(pos, radius, near);
+
 	std::set<u16> objects;
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(u32 i=0; i<near.size(); i++)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+		ServerActiveObject *obj = getActiveObject(near[i]);
+		if(obj == NULL)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
-		objects.insert(id);
+		objects.insert(near[i]);
 	}
 	return objects;
 }
 
+void ServerEnvironment::updateActiveObjectPosition(ServerActiveObject *obj)
+{
+	// Objects that have not been added yet may already have an id
+	if(getActiveObject(obj->getId()) != obj)
+		return;
+	m_active_object_grid.update(obj->getId(), obj->getBasePosition());
+}
+
 void ServerEnvironment::clearAllObjects()
 {
 	infostream<<"ServerEnvironment::clearAllObjects(): "
@@ -952,6 +1315,7 @@ void ServerEnvironment::clearAllObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 
 	// Get list of loaded blocks
@@ -1047,13 +1411,20 @@ void ServerEnvironment::step(float dtime)
 	
 	//TimeTaker timer("ServerEnv step");
 
+	static SettingHandle<float> dedicated_server_step(g_settings,
+			"dedicated_server_step");
+	static SettingHandle<s16> active_block_range_setting(g_settings,
+			"active_block_range");
+	static SettingHandle<bool> only_peaceful_mobs_setting(g_settings,
+			"only_peaceful_mobs");
+
 	/* Step time of day */
 	stepTimeOfDay(dtime);
 
 	// Update this one
 	// NOTE: This is kind of funny on a singleplayer game, but doesn't
 	// really matter that much.
-	m_recommended_send_interval = g_settings->getFloat("dedicated_server_step");
+	m_recommended_send_interval = dedicated_server_step.get();
 
 	/*
 		Increment game time
@@ -1110,7 +1481,7 @@ void ServerEnvironment::step(float dtime)
 		/*
 			Update list of active blocks, collecting changes
 		*/
-		const s16 active_block_range = g_settings->getS16("active_block_range");
+		const s16 active_block_range = active_block_range_setting.get();
 		std::set<v3s16> blocks_removed;
 		std::set<v3s16> blocks_added;
 		m_active_blocks.update(players_blockpos, active_block_range,
@@ -1145,7 +1516,7 @@ void ServerEnvironment::step(float dtime)
 		*/
 
 		u32 n = 0, calls = 0, 
-			end_ms = porting::getTimeMs() + 1000 * g_settings->getFloat("dedicated_server_step");
+			end_ms = porting::getTimeMs() + 1000 * dedicated_server_step.get();
 		for(std::set<v3s16>::iterator
 				i = blocks_added.begin();
 				i != blocks_added.end(); ++i)
@@ -1189,7 +1560,7 @@ void ServerEnvironment::step(float dtime)
 		float dtime = 1.0;
 
 		u32 n = 0, calls = 0, 
-			end_ms = porting::getTimeMs() + 1000 * g_settings->getFloat("dedicated_server_step");
+			end_ms = porting::getTimeMs() + 1000 * dedicated_server_step.get();
 		for(std::set<v3s16>::iterator
 				i = m_active_blocks.m_list.begin();
 				i != m_active_blocks.m_list.end(); ++i)
@@ -1249,12 +1620,19 @@ void ServerEnvironment::step(float dtime)
 	{
 		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
 		TimeTaker timer("modify in active blocks");
-		u32 max_time_ms = 1000 * g_settings->getFloat("dedicated_server_step");
+		u32 max_time_ms = 1000 * dedicated_server_step.get();
 		
 		// Initialize handling of ActiveBlockModifiers
 		ABMHandler abmhandler(m_abms, abm_interval, this, true);
 
 		u32 n = 0, calls = 0;
+		if(!m_abm_scan_threads.empty())
+		{
+			// All blocks are handled at once, no need for the loop breaker
+			calls = applyABMsParallel(abmhandler);
+			m_active_block_abm_last = 0;
+		}
+		else
 		for(std::set<v3s16>::iterator
 				i = m_active_blocks.m_list.begin();
 				i != m_active_blocks.m_list.end(); ++i)
@@ -1322,9 +1700,9 @@ void ServerEnvironment::step(float dtime)
 			}
 			send_recommended = true;
 		}
-		bool only_peaceful_mobs = g_settings->getBool("only_peaceful_mobs");
+		bool only_peaceful_mobs = only_peaceful_mobs_setting.get();
 		u32 n = 0, calls = 0, 
-			end_ms = porting::getTimeMs() + 1000 * g_settings->getFloat("dedicated_server_step");
+			end_ms = porting::getTimeMs() + 1000 * dedicated_server_step.get();
 		for(std::map<u16, ServerActiveObject*>::iterator
 				i = m_active_objects.begin();
 				i != m_active_objects.end(); ++i)
@@ -1345,6 +1723,8 @@ void ServerEnvironment::step(float dtime)
 				continue;
 			// Step object
 			obj->step(dtime, send_recommended);
+			// Objects mostly move themselves without setBasePosition()
+			m_active_object_grid.update(obj->getId(), obj->getBasePosition());
 			// Read messages from object
 			while(!obj->m_messages_out.empty())
 			{
@@ -1472,19 +1852,29 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
 	/*
-		Go through the object list,
+		Go through the objects near the position and the players, who
+		are the only objects that can have an unlimited transfer
+		distance,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	std::vector<u16> candidates;
+	m_active_object_grid.getNear(pos_f, radius_f, candidates);
+	for(std::list<Player*>::iterator i = m_players.begin();
+			i != m_players.end(); ++i)
 	{
-		u16 id = i->first;
+		PlayerSAO *sao = (*i)->getPlayerSAO();
+		if(sao && sao->unlimitedTransferDistance())
+			candidates.push_back(sao->getId());
+	}
+
+	for(u32 i=0; i<candidates.size(); i++)
+	{
+		u16 id = candidates[i];
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if(object == NULL)
 			continue;
 		// Discard if removed or deactivating
@@ -1606,6 +1996,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects[object->getId()] = object;
+	m_active_object_grid.insert(object->getId(), object->getBasePosition());
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1733,6 +2124,7 @@ void ServerEnvironment::removeRemovedObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -1784,7 +2176,9 @@ void ServerEnvironment::activateObjects(MapBlock *block, u32 dtime_s)
 			<<"activating objects of block "<<PP(block->getPos())
 			<<" ("<<block->m_static_objects.m_stored.size()
 			<<" objects)"<<std::endl;
-	bool large_amount = (block->m_static_objects.m_stored.size() > g_settings->getU16("max_objects_per_block"));
+	static SettingHandle<u16> max_objects_per_block(g_settings,
+			"max_objects_per_block");
+	bool large_amount = (block->m_static_objects.m_stored.size() > max_objects_per_block.get());
 	if(large_amount){
 		errorstream<<"suspiciously large amount of objects detected: "
 				<<block->m_static_objects.m_stored.size()<<" in "
@@ -1874,6 +2268,9 @@ void ServerEnvironment::activateObjects(MapBlock *block, u32 dtime_s)
 */
 void ServerEnvironment::deactivateFarObjects(bool force_delete)
 {
+	static SettingHandle<u16> max_objects_per_block(g_settings,
+			"max_objects_per_block");
+
 	std::list<u16> objects_to_remove;
 	for(std::map<u16, ServerActiveObject*>::iterator
 			i = m_active_objects.begin();
@@ -2017,7 +2414,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 
 			if(block)
 			{
-				if(block->m_static_objects.m_stored.size() >= g_settings->getU16("max_objects_per_block")){
+				if(block->m_static_objects.m_stored.size() >= max_objects_per_block.get()){
 					errorstream<<"ServerEnv: Trying to store id="<<obj->getId()
 							<<" statically but block "<<PP(blockpos)
 							<<" already contains "
@@ -2099,6 +2496,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_grid.remove(*i);
 	}
 }
 
@@ -2185,7 +2583,8 @@ void ClientEnvironment::step(float dtime)
 
 	// Get some settings
 	bool fly_allowed = m_gamedef->checkLocalPrivilege("fly");
-	bool free_move = fly_allowed && g_settings->getBool("free_move");
+	static SettingHandle<bool> free_move_setting(g_settings, "free_move");
+	bool free_move = fly_allowed && free_move_setting.get();
 
 	// Get local player
 	LocalPlayer *lplayer = getLocalPlayer();
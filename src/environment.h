@@ -33,11 +33,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <vector>
 #include "irr_v3d.h"
 #include "activeobject.h"
 #include "util/numeric.h"
 #include "mapnode.h"
 #include "mapblock.h"
+#include "activeobjectgrid.h"
 
 class ServerEnvironment;
 class ActiveBlockModifier;
@@ -50,6 +52,9 @@ class ServerMap;
 class ClientMap;
 class GameScripting;
 class Player;
+class ABMHandler;
+class ABMScanner;
+class ABMScanThread;
 
 class Environment
 {
@@ -290,6 +295,9 @@ class ServerEnvironment : public Environment
 	
 	// Find all active objects inside a radius around a point
 	std::set<u16> getObjectsInsideRadius(v3f pos, float radius);
+
+	// Called by ServerActiveObject::setBasePosition()
+	void updateActiveObjectPosition(ServerActiveObject *obj);
 	
 	// Clear all objects, loading and going through every MapBlock
 	void clearAllObjects();
@@ -348,6 +356,12 @@ class ServerEnvironment : public Environment
 	*/
 	void deactivateFarObjects(bool force_delete);
 
+	/*
+		Scans the active blocks for ABMs in m_abm_scan_threads and then
+		triggers them. Returns the number of blocks handled.
+	*/
+	u32 applyABMsParallel(ABMHandler &abmhandler);
+
 	/*
 		Member variables
 	*/
@@ -362,6 +376,8 @@ class ServerEnvironment : public Environment
 	IBackgroundBlockEmerger *m_emerger;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// The same objects by position
+	ActiveObjectGrid m_active_object_grid;
 	// Outgoing network message buffer for active objects
 	std::list<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -378,6 +394,9 @@ class ServerEnvironment : public Environment
 	u32 m_active_block_abm_last;
 	u32 m_active_block_timer_last;
 	u32 m_blocks_added_last;
+	// Threads for scanning active blocks for ABMs; none if disabled
+	ABMScanner *m_abm_scanner;
+	std::vector<ABMScanThread*> m_abm_scan_threads;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
@@ -2344,11 +2344,10 @@ void the_game(
 				}
 				else if(event.type == CE_SPAWN_PARTICLE)
 				{
-					LocalPlayer* player = client.getEnv().getLocalPlayer();
 					video::ITexture *texture =
 						gamedef->tsrc()->getTexture(*(event.spawn_particle.texture));
 
-					new Particle(gamedef, smgr, player, client.getEnv(),
+					addParticle(gamedef, smgr, client.getEnv(),
 						*event.spawn_particle.pos,
 						*event.spawn_particle.vel,
 						*event.spawn_particle.acc,
@@ -79,6 +79,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverlist.h"
 #include "guiEngine.h"
 #include "mapsector.h"
+#include "noise.h"
+#include "socket.h"
+#include "util/serialize.h"
+#include <ctime>
 
 #include "database-sqlite3.h"
 #ifdef USE_LEVELDB
@@ -722,6 +726,290 @@ void SpeedTests()
 		infostream<<"Done. "<<dtime<<"ms, "
 				<<per_ms<<"/ms"<<std::endl;
 	}
+
+	{
+		infostream<<"Testing map database batch speed"<<std::endl;
+
+		std::string dir = fs::TempPath() + DIR_DELIM + "minetest_speedtest_db";
+		fs::RecursiveDelete(dir);
+		fs::CreateAllDirs(dir);
+		{
+			Database_SQLite3 db(NULL, dir);
+
+			// Four MapChunks worth of made up block data
+			std::map<v3s16, std::string> blocks;
+			std::vector<v3s16> positions;
+			for(s16 z=0; z<10; z++)
+			for(s16 y=0; y<5; y++)
+			for(s16 x=0; x<10; x++){
+				v3s16 p(x,y,z);
+				blocks[p] = std::string(2000 + x * 10, 'a' + y);
+				positions.push_back(p);
+			}
+
+			{
+				TimeTaker timer("Saving blocks with saveBlock");
+				db.beginSave();
+				for(std::map<v3s16, std::string>::iterator
+						i = blocks.begin(); i != blocks.end(); ++i)
+					db.saveBlock(i->first, i->second);
+				db.endSave();
+			}
+			{
+				TimeTaker timer("Saving blocks with saveBlocks");
+				db.saveBlocks(blocks);
+			}
+
+			u32 found = 0;
+			{
+				TimeTaker timer("Loading blocks one at a time");
+				for(u32 i=0; i<positions.size(); i++){
+					std::vector<v3s16> one(1, positions[i]);
+					std::map<v3s16, std::string> dst;
+					db.loadBlocks(one, dst);
+					found += dst.size();
+				}
+			}
+			{
+				TimeTaker timer("Loading blocks with loadBlocks");
+				std::map<v3s16, std::string> dst;
+				db.loadBlocks(positions, dst);
+				found += dst.size();
+			}
+			infostream<<"Loaded "<<found<<"/"<<(positions.size() * 2)
+					<<" blocks"<<std::endl;
+		}
+		fs::RecursiveDelete(dir);
+	}
+
+	{
+		infostream<<"Testing noise map speed"<<std::endl;
+
+		// MapChunk sized maps, like the mapgens use
+		NoiseParams np = {0, 1, v3f(100, 50, 100), 6345, 1, 0.6};
+		const u32 maps3d = 10;
+		const u32 maps2d = 400;
+		NoiseSimdLevel level = noise_get_simd_level();
+		for(int l = NOISE_SIMD_NONE; l <= noise_get_max_simd_level(); l++){
+			noise_set_simd_level((NoiseSimdLevel)l);
+			for(int octaves = 1; octaves <= 6; octaves++){
+				np.octaves = octaves;
+				Noise noise2d(&np, 1, 80, 80);
+				Noise noise3d(&np, 1, 80, 80, 80);
+				u32 time2d = 0;
+				u32 time3d = 0;
+				{
+					TimeTaker timer("perlinMap2D", &time2d, PRECISION_MICRO);
+					for(u32 i=0; i<maps2d; i++)
+						noise2d.perlinMap2D(i * 80, 0);
+				}
+				{
+					TimeTaker timer("perlinMap3D", &time3d, PRECISION_MICRO);
+					for(u32 i=0; i<maps3d; i++)
+						noise3d.perlinMap3D(i * 80, 0, 0);
+				}
+				infostream<<noise_simd_level_name((NoiseSimdLevel)l)
+						<<" octaves="<<octaves
+						<<": 2D "<<(u64)(80.0 * 80 * maps2d * 1000000
+							/ MYMAX(time2d, 1))<<" nodes/s"
+						<<", 3D "<<(u64)(80.0 * 80 * 80 * maps3d * 1000000
+							/ MYMAX(time3d, 1))<<" nodes/s"<<std::endl;
+			}
+		}
+		noise_set_simd_level(level);
+	}
+
+	{
+		infostream<<"Testing UDP send and receive speed"<<std::endl;
+
+		/*
+			Rounds of UDP_BATCH_MAX packets of 512 bytes over loopback,
+			with one system call per packet and then one per batch.
+		*/
+		const u16 port = 30003;
+		const int packet_size = 512;
+		const int rounds = 1000;
+		UDPSocket socket(false);
+		socket.Bind(port);
+		socket.setTimeoutMs(1000);
+		Address address(127,0,0,1,port);
+
+		u8 header[2];
+		SharedBuffer<u8> sendbuffer(packet_size * UDP_BATCH_MAX);
+		SharedBuffer<u8> rcvbuffer(packet_size * UDP_BATCH_MAX);
+		Address senders[UDP_BATCH_MAX];
+		int sizes[UDP_BATCH_MAX];
+		UDPPacket packets[UDP_BATCH_MAX];
+		for(int i=0; i<UDP_BATCH_MAX; i++){
+			memset(&sendbuffer[i * packet_size], i, packet_size);
+			packets[i].address = address;
+			packets[i].header = header;
+			packets[i].header_size = sizeof(header);
+			packets[i].data = &sendbuffer[i * packet_size];
+			packets[i].size = packet_size - sizeof(header);
+		}
+
+		for(int batched=0; batched<2; batched++){
+			u32 received = 0;
+			clock_t cpu_start = clock();
+			{
+				TimeTaker timer(batched ? "Sending and receiving batches" :
+						"Sending and receiving one packet at a time");
+				for(int r=0; r<rounds; r++){
+					writeU16(header, r);
+					if(batched)
+						socket.SendMany(packets, UDP_BATCH_MAX);
+					else
+						for(int i=0; i<UDP_BATCH_MAX; i++)
+							socket.Send(address, header, sizeof(header),
+									packets[i].data, packets[i].size);
+
+					int count = 0;
+					while(count < UDP_BATCH_MAX){
+						int c;
+						if(batched){
+							c = socket.ReceiveMany(&senders[count],
+									&sizes[count],
+									&rcvbuffer[count * packet_size],
+									packet_size, UDP_BATCH_MAX - count);
+						} else {
+							sizes[count] = socket.Receive(senders[count],
+									&rcvbuffer[count * packet_size],
+									packet_size);
+							c = sizes[count] < 0 ? 0 : 1;
+						}
+						if(c == 0)
+							break;
+						count += c;
+					}
+					received += count;
+				}
+			}
+			float cpu_us = (float)(clock() - cpu_start) * 1000000
+					/ CLOCKS_PER_SEC / rounds / UDP_BATCH_MAX;
+			infostream<<received<<"/"<<(rounds * UDP_BATCH_MAX)
+					<<" packets received, "<<cpu_us<<" us CPU per packet"
+					<<std::endl;
+		}
+	}
+
+	{
+		infostream<<"Testing block send selection speed"<<std::endl;
+
+		/*
+			60 clients with view range 10 that have got everything but
+			a few blocks; each round every client selects up to 10 blocks
+			from the nearest distance, like after moving to a new block.
+		*/
+		const u32 clients = 60;
+		const s16 d_max = 10;
+		const u32 wanted = 10;
+		const u32 rounds = 10;
+		std::vector<std::set<v3s16> > sets(clients);
+		std::vector<BlockSendSet> send_sets(clients);
+		PseudoRandom pr(1234);
+		for(u32 c=0; c<clients; c++){
+			send_sets[c].setCenter(v3s16(0,0,0), d_max);
+			v3s16 p;
+			for(p.Z=-d_max; p.Z<=d_max; p.Z++)
+			for(p.Y=-d_max; p.Y<=d_max; p.Y++)
+			for(p.X=-d_max; p.X<=d_max; p.X++){
+				if(pr.range(0, 99) == 0)
+					continue;
+				sets[c].insert(p);
+				send_sets[c].setSent(p);
+			}
+		}
+
+		u32 found_old = 0;
+		u32 found_new = 0;
+		{
+			TimeTaker timer("Selecting with face positions and std::set");
+			for(u32 r=0; r<rounds; r++)
+			for(u32 c=0; c<clients; c++){
+				u32 n = 0;
+				for(s16 d=0; d<=d_max && n<wanted; d++){
+					std::list<v3s16> list;
+					getFacePositions(list, d);
+					for(std::list<v3s16>::iterator i = list.begin();
+							i != list.end() && n<wanted; ++i)
+						if(sets[c].find(*i) == sets[c].end())
+							n++;
+				}
+				found_old += n;
+			}
+		}
+		{
+			TimeTaker timer("Selecting with BlockSendSet");
+			for(u32 r=0; r<rounds; r++)
+			for(u32 c=0; c<clients; c++){
+				u32 n = 0;
+				for(s16 d=send_sets[c].findUnsentDistance(0);
+						d<=d_max && n<wanted;
+						d=send_sets[c].findUnsentDistance(d+1)){
+					std::list<v3s16> list;
+					send_sets[c].getUnsent(d, list);
+					n = MYMIN(n + list.size(), wanted);
+				}
+				found_new += n;
+			}
+		}
+		infostream<<"Selected "<<found_old<<" and "<<found_new
+				<<" blocks"<<std::endl;
+	}
+
+	{
+		infostream<<"Testing active object radius query speed"<<std::endl;
+
+		/*
+			5000 mobs spread over 320x320x64 nodes, each looking for
+			objects within 2 nodes of itself like collisionMoveSimple()
+			does when stepping.
+		*/
+		const u32 count = 5000;
+		const f32 radius = 2 * BS;
+		std::vector<v3f> positions;
+		ActiveObjectGrid grid(MAP_BLOCKSIZE * BS);
+		PseudoRandom pr(4321);
+		for(u32 i=0; i<count; i++){
+			v3f p(pr.range(0, 3200), pr.range(0, 640), pr.range(0, 3200));
+			positions.push_back(p * BS / 10);
+			grid.insert(i + 1, positions[i]);
+		}
+
+		u32 found_scan = 0;
+		u32 found_grid = 0;
+		u32 time_scan = 0;
+		u32 time_grid = 0;
+		{
+			TimeTaker timer("Scanning all objects", &time_scan);
+			for(u32 i=0; i<count; i++){
+				std::set<u16> objects;
+				for(u32 j=0; j<count; j++)
+					if(positions[j].getDistanceFrom(positions[i]) <= radius)
+						objects.insert(j + 1);
+				found_scan += objects.size();
+			}
+		}
+		{
+			TimeTaker timer("Querying ActiveObjectGrid", &time_grid);
+			for(u32 i=0; i<count; i++){
+				std::vector<u16> near;
+				grid.getNear(positions[i], radius, near);
+				std::set<u16> objects;
+				for(u32 j=0; j<near.size(); j++)
+					if(positions[near[j] - 1].getDistanceFrom(positions[i])
+							<= radius)
+						objects.insert(near[j]);
+				found_grid += objects.size();
+			}
+		}
+		infostream<<count<<" queries: scanning "<<time_scan
+				<<"ms, grid "<<time_grid<<"ms; found "<<found_scan
+				<<" and "<<found_grid<<std::endl;
+	}
+
+	run_map_speedtests();
 }
 
 static void print_worldspecs(const std::vector<WorldSpec> &worldspecs,
@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h"
 #include "filesys.h"
 #include "voxel.h"
+#include "voxelalgorithms.h"
 #include "porting.h"
 #include "serialization.h"
 #include "nodemetadata.h"
@@ -36,7 +37,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "gamedef.h"
 #include "util/directiontables.h"
+#include "util/numeric.h"
 #include "util/mathconstants.h"
+#include "util/string.h"
+#include "util/thread.h"
 #include "rollback_interface.h"
 #include "environment.h"
 #include "emerge.h"
@@ -45,6 +49,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "config.h"
 #include "server.h"
 #include "database.h"
+#include "mapsaver.h"
 #include "database-dummy.h"
 #include "database-sqlite3.h"
 #if USE_LEVELDB
@@ -77,7 +82,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_liquid_updater(NULL),
+	m_block_count(0),
+	m_compact_block_count(0),
+	m_uniform_block_count(0),
+	m_block_node_bytes(0)
 {
 	/*m_sector_mutex.Init();
 	assert(m_sector_mutex.IsInitialized());*/
@@ -85,6 +95,8 @@ Map::Map(std::ostream &dout, IGameDef *gamedef):
 
 Map::~Map()
 {
+	stopLiquidThreads();
+
 	/*
 		Free all MapSectors
 	*/
@@ -210,473 +222,312 @@ MapNode Map::getNode(v3s16 p)
 	return block->getNodeNoCheck(relpos);
 }
 
-// throws InvalidPositionException if not found
-void Map::setNode(v3s16 p, MapNode & n)
+/*
+	Bulk node queries
+*/
+
+// Indexed by content; true for the contents in filter
+static void makeContentLookup(const std::set<content_t> &filter,
+		std::vector<bool> &lookup)
 {
-	v3s16 blockpos = getNodeBlockPos(p);
-	MapBlock *block = getBlockNoCreate(blockpos);
-	v3s16 relpos = p - blockpos*MAP_BLOCKSIZE;
-	// Never allow placing CONTENT_IGNORE, it fucks up stuff
-	if(n.getContent() == CONTENT_IGNORE){
-		errorstream<<"Map::setNode(): Not allowing to place CONTENT_IGNORE"
-				<<" while trying to replace \""
-				<<m_gamedef->ndef()->get(block->getNodeNoCheck(relpos)).name
-				<<"\" at "<<PP(p)<<" (block "<<PP(blockpos)<<")"<<std::endl;
-		debug_stacks_print_to(infostream);
+	lookup.clear();
+	if(filter.empty())
 		return;
-	}
-	block->setNodeNoCheck(relpos, n);
+	lookup.resize(*filter.rbegin() + 1, false);
+	for(std::set<content_t>::const_iterator
+			i = filter.begin(); i != filter.end(); ++i)
+		lookup[*i] = true;
 }
 
+static inline bool isWantedContent(const std::vector<bool> &lookup,
+		content_t c)
+{
+	return c < lookup.size() && lookup[c];
+}
 
-/*
-	Goes recursively through the neighbours of the node.
-
-	Alters only transparent nodes.
-
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
-
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
+// Returns NULL if the block is not loaded
+static MapBlock * getLoadedBlock(Map *map, v3s16 blockpos)
+{
+	MapBlock *block = map->getBlockNoCreateNoEx(blockpos);
+	if(block == NULL || block->isDummy())
+		return NULL;
+	return block;
+}
 
-	values of from_nodes are lighting values.
-*/
-void Map::unspreadLight(enum LightBank bank,
-		std::map<v3s16, u8> & from_nodes,
-		std::set<v3s16> & light_sources,
-		std::map<v3s16, MapBlock*>  & modified_blocks)
+static bool hasWantedContent(MapBlock *block, const std::vector<bool> &lookup)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
+	if(block == NULL)
+		return isWantedContent(lookup, CONTENT_IGNORE);
+	const std::vector<content_t> &contents = block->getContents();
+	for(u32 i=0; i<contents.size(); i++)
+		if(isWantedContent(lookup, contents[i]))
+			return true;
+	return false;
+}
 
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
+// The part of minp...maxp in the block, relative to the block
+static void getAreaInBlock(v3s16 blockpos, v3s16 minp, v3s16 maxp,
+		v3s16 &relmin, v3s16 &relmax)
+{
+	v3s16 blockmin = blockpos * MAP_BLOCKSIZE;
+	v3s16 blockmax = blockmin + v3s16(1,1,1) * (MAP_BLOCKSIZE-1);
+	relmin.X = MYMAX(minp.X, blockmin.X) - blockmin.X;
+	relmin.Y = MYMAX(minp.Y, blockmin.Y) - blockmin.Y;
+	relmin.Z = MYMAX(minp.Z, blockmin.Z) - blockmin.Z;
+	relmax.X = MYMIN(maxp.X, blockmax.X) - blockmin.X;
+	relmax.Y = MYMIN(maxp.Y, blockmax.Y) - blockmin.Y;
+	relmax.Z = MYMIN(maxp.Z, blockmax.Z) - blockmin.Z;
+}
 
-	if(from_nodes.size() == 0)
+void Map::findNodesInArea(v3s16 minp, v3s16 maxp,
+		const std::set<content_t> &filter, std::vector<v3s16> &result)
+{
+	if(minp.X > maxp.X || minp.Y > maxp.Y || minp.Z > maxp.Z)
 		return;
 
-	u32 blockchangecount = 0;
-
-	std::map<v3s16, u8> unlighted_nodes;
+	std::vector<bool> lookup;
+	makeContentLookup(filter, lookup);
+	if(lookup.empty())
+		return;
 
 	/*
-		Initialize block cache
+		Go through the area in slabs of one block along X, so that the
+		nodes are found in the same order as when going node by node
 	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	v3s16 blockmin = getNodeBlockPos(minp);
+	v3s16 blockmax = getNodeBlockPos(maxp);
+	u32 ycount = blockmax.Y - blockmin.Y + 1;
+	u32 zcount = blockmax.Z - blockmin.Z + 1;
+	// NULL if not loaded
+	std::vector<MapBlock*> blocks(ycount * zcount);
+	std::vector<bool> blocks_wanted(ycount * zcount);
+	for(s16 bx=blockmin.X; bx<=blockmax.X; bx++)
 	{
-		v3s16 pos = j->first;
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
+		bool slab_wanted = false;
+		for(u32 i=0; i<blocks.size(); i++)
 		{
-			continue;
+			v3s16 bp(bx, blockmin.Y + i / zcount, blockmin.Z + i % zcount);
+			blocks[i] = getLoadedBlock(this, bp);
+			blocks_wanted[i] = hasWantedContent(blocks[i], lookup);
+			slab_wanted = slab_wanted || blocks_wanted[i];
 		}
-
-		if(block->isDummy())
+		if(!slab_wanted)
 			continue;
 
-		// Calculate relative position in block
-		//v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		//MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j->second;
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
+		v3s16 slabmin(bx, blockmin.Y, blockmin.Z);
+		v3s16 relmin, relmax;
+		getAreaInBlock(slabmin, minp, maxp, relmin, relmax);
+		for(s16 x=relmin.X; x<=relmax.X; x++)
+		for(u32 by=0; by<ycount; by++)
 		{
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
-
-			try
+			v3s16 ymin, ymax;
+			getAreaInBlock(slabmin + v3s16(0,by,0), minp, maxp, ymin, ymax);
+			for(s16 y=ymin.Y; y<=ymax.Y; y++)
+			for(u32 bz=0; bz<zcount; bz++)
 			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
+				u32 i = by * zcount + bz;
+				if(!blocks_wanted[i])
 					continue;
-				}
-
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
-
-				bool changed = false;
-
-				//TODO: Optimize output by optimizing light_sources?
-
-				/*
-					If the neighbor is dimmer than what was specified
-					as oldlight (the light of the previous node)
-				*/
-				if(n2.getLight(bank, nodemgr) < oldlight)
+				MapBlock *block = blocks[i];
+				v3s16 bp = slabmin + v3s16(0,by,bz);
+				v3s16 zmin, zmax;
+				getAreaInBlock(bp, minp, maxp, zmin, zmax);
+				v3s16 blockpos_nodes = bp * MAP_BLOCKSIZE;
+				for(s16 z=zmin.Z; z<=zmax.Z; z++)
 				{
-					/*
-						And the neighbor is transparent and it has some light
-					*/
-					if(nodemgr->get(n2).light_propagates
-							&& n2.getLight(bank, nodemgr) != 0)
-					{
-						/*
-							Set light to 0 and add to queue
-						*/
-
-						u8 current_light = n2.getLight(bank, nodemgr);
-						n2.setLight(bank, 0, nodemgr);
-						block->setNode(relpos, n2);
-
-						unlighted_nodes[n2pos] = current_light;
-						changed = true;
-
-						/*
-							Remove from light_sources if it is there
-							NOTE: This doesn't happen nearly at all
-						*/
-						/*if(light_sources.find(n2pos))
-						{
-							infostream<<"Removed from light_sources"<<std::endl;
-							light_sources.remove(n2pos);
-						}*/
-					}
-
-					/*// DEBUG
-					if(light_sources.find(n2pos) != NULL)
-						light_sources.remove(n2pos);*/
-				}
-				else{
-					light_sources.insert(n2pos);
-				}
-
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
-					{
-						modified_blocks[blockpos] = block;
-					}
-					block_checked_in_modified = true;
+					// Nodes of blocks that are not loaded are ignore
+					if(block == NULL || isWantedContent(lookup,
+							block->getNodeNoCheck(x,y,z).getContent()))
+						result.push_back(blockpos_nodes + v3s16(x,y,z));
 				}
 			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
-			}
 		}
 	}
-
-	/*infostream<<"unspreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(unlighted_nodes.size() > 0)
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
 }
 
-/*
-	A single-node wrapper of the above
-*/
-void Map::unLightNeighbors(enum LightBank bank,
-		v3s16 pos, u8 lightwas,
-		std::set<v3s16> & light_sources,
-		std::map<v3s16, MapBlock*>  & modified_blocks)
+void Map::countNodesInArea(v3s16 minp, v3s16 maxp,
+		const std::set<content_t> &filter,
+		std::map<content_t, u32> &result)
 {
-	std::map<v3s16, u8> from_nodes;
-	from_nodes[pos] = lightwas;
-
-	unspreadLight(bank, from_nodes, light_sources, modified_blocks);
-}
-
-/*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
-*/
-void Map::spreadLight(enum LightBank bank,
-		std::set<v3s16> & from_nodes,
-		std::map<v3s16, MapBlock*> & modified_blocks)
-{
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.size() == 0)
+	if(minp.X > maxp.X || minp.Y > maxp.Y || minp.Z > maxp.Z)
 		return;
 
-	u32 blockchangecount = 0;
-
-	std::set<v3s16> lighted_nodes;
-
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(std::set<v3s16>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
+	std::vector<bool> lookup;
+	makeContentLookup(filter, lookup);
+	bool count_all = filter.empty();
+
+	// Indexed by content
+	std::vector<u32> counts;
+	v3s16 blockmin = getNodeBlockPos(minp);
+	v3s16 blockmax = getNodeBlockPos(maxp);
+	v3s16 bp;
+	for(bp.X=blockmin.X; bp.X<=blockmax.X; bp.X++)
+	for(bp.Y=blockmin.Y; bp.Y<=blockmax.Y; bp.Y++)
+	for(bp.Z=blockmin.Z; bp.Z<=blockmax.Z; bp.Z++)
 	{
-		v3s16 pos = *j;
-		v3s16 blockpos = getNodeBlockPos(pos);
+		MapBlock *block = getLoadedBlock(this, bp);
+		if(!count_all && !hasWantedContent(block, lookup))
+			continue;
 
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		v3s16 relmin, relmax;
+		getAreaInBlock(bp, minp, maxp, relmin, relmax);
+		u32 volume = (u32)(relmax.X - relmin.X + 1)
+				* (relmax.Y - relmin.Y + 1) * (relmax.Z - relmin.Z + 1);
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
+		// Unloaded and uniform blocks are counted at once
+		if(block == NULL){
+			result[CONTENT_IGNORE] += volume;
 			continue;
 		}
-
-		if(block->isDummy())
+		const std::vector<content_t> &contents = block->getContents();
+		if(contents.size() == 1){
+			if(count_all || isWantedContent(lookup, contents[0]))
+				result[contents[0]] += volume;
 			continue;
+		}
 
-		// Calculate relative position in block
-		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
+		if(counts.empty())
+			counts.resize(count_all ? 1 << (8 * sizeof(content_t))
+					: lookup.size(), 0);
+		v3s16 p;
+		for(p.Z=relmin.Z; p.Z<=relmax.Z; p.Z++)
+		for(p.Y=relmin.Y; p.Y<=relmax.Y; p.Y++)
+		for(p.X=relmin.X; p.X<=relmax.X; p.X++)
+		{
+			content_t c = block->getNodeNoCheck(p).getContent();
+			if(c < counts.size())
+				counts[c]++;
+		}
+	}
 
-		u8 oldlight = n.getLight(bank, nodemgr);
-		u8 newlight = diminish_light(oldlight);
+	for(u32 c=0; c<counts.size(); c++)
+		if(counts[c] != 0 && (count_all || lookup[c]))
+			result[c] += counts[c];
+}
 
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++){
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
+bool Map::findNodeNear(v3s16 pos, s16 radius,
+		const std::set<content_t> &filter, v3s16 &result)
+{
+	std::vector<bool> lookup;
+	makeContentLookup(filter, lookup);
+	if(lookup.empty() || radius < 1)
+		return false;
 
-			// Get the block where the node is located
-			v3s16 blockpos = getNodeBlockPos(n2pos);
+	// The cube is cut where pos + radius doesn't fit in s16
+	v3s16 nodemin(
+			MYMAX(pos.X - radius, -32768),
+			MYMAX(pos.Y - radius, -32768),
+			MYMAX(pos.Z - radius, -32768));
+	v3s16 nodemax(
+			MYMIN(pos.X + radius, 32767),
+			MYMIN(pos.Y + radius, 32767),
+			MYMIN(pos.Z + radius, 32767));
 
-			try
+	/*
+		The blocks are looked up as the shells reach them, so that a big
+		radius costs nothing up front. Until a block with one of the
+		contents turns up, the shells are skipped and only the blocks
+		the cube around pos grows by are checked.
+	*/
+	bool found_any = false;
+	bool checked_any = false;
+	v3s16 checkedmin, checkedmax;
+	// int so that d doesn't wrap after 32767
+	for(int d=1; d<=radius; d++)
+	{
+		if(!found_any)
+		{
+			v3s16 blockmin = getNodeBlockPos(v3s16(
+					MYMAX(pos.X - d, nodemin.X),
+					MYMAX(pos.Y - d, nodemin.Y),
+					MYMAX(pos.Z - d, nodemin.Z)));
+			v3s16 blockmax = getNodeBlockPos(v3s16(
+					MYMIN(pos.X + d, nodemax.X),
+					MYMIN(pos.Y + d, nodemax.Y),
+					MYMIN(pos.Z + d, nodemax.Z)));
+			v3s16 bp;
+			for(bp.Z=blockmin.Z; bp.Z<=blockmax.Z && !found_any; bp.Z++)
+			for(bp.Y=blockmin.Y; bp.Y<=blockmax.Y && !found_any; bp.Y++)
 			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
-
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
-
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
-
-				bool changed = false;
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos);
-					changed = true;
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(n2.getLight(bank, nodemgr) < newlight)
+				bool row_checked = checked_any &&
+						bp.Z >= checkedmin.Z && bp.Z <= checkedmax.Z &&
+						bp.Y >= checkedmin.Y && bp.Y <= checkedmax.Y;
+				for(bp.X=blockmin.X; bp.X<=blockmax.X; bp.X++)
 				{
-					if(nodemgr->get(n2).light_propagates)
+					if(row_checked && bp.X == checkedmin.X)
 					{
-						n2.setLight(bank, newlight, nodemgr);
-						block->setNode(relpos, n2);
-						lighted_nodes.insert(n2pos);
-						changed = true;
+						bp.X = checkedmax.X;
+						continue;
 					}
-				}
-
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
+					if(hasWantedContent(getLoadedBlock(this, bp), lookup))
 					{
-						modified_blocks[blockpos] = block;
+						found_any = true;
+						break;
 					}
-					block_checked_in_modified = true;
 				}
 			}
-			catch(InvalidPositionException &e)
-			{
+			checked_any = true;
+			checkedmin = blockmin;
+			checkedmax = blockmax;
+			if(!found_any)
 				continue;
-			}
 		}
-	}
-
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(lighted_nodes.size() > 0)
-		spreadLight(bank, lighted_nodes, modified_blocks);
-}
-
-/*
-	A single-node source variation of the above.
-*/
-void Map::lightNeighbors(enum LightBank bank,
-		v3s16 pos,
-		std::map<v3s16, MapBlock*> & modified_blocks)
-{
-	std::set<v3s16> from_nodes;
-	from_nodes.insert(pos);
-	spreadLight(bank, from_nodes, modified_blocks);
-}
-
-v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
-{
-	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	u8 brightest_light = 0;
-	v3s16 brightest_pos(0,0,0);
-	bool found_something = false;
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++){
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-		MapNode n2;
-		try{
-			n2 = getNode(n2pos);
-		}
-		catch(InvalidPositionException &e)
+		// Blocks of this shell and whether they have any of the contents;
+		// NULL if not loaded, which is ignore
+		std::map<v3s16, std::pair<bool, MapBlock*> > shell_blocks;
+		std::list<v3s16> list;
+		getFacePositions(list, d);
+		for(std::list<v3s16>::iterator j = list.begin();
+				j != list.end(); ++j)
 		{
-			continue;
-		}
-		if(n2.getLight(bank, nodemgr) > brightest_light || found_something == false){
-			brightest_light = n2.getLight(bank, nodemgr);
-			brightest_pos = n2pos;
-			found_something = true;
+			int x = pos.X + j->X, y = pos.Y + j->Y, z = pos.Z + j->Z;
+			if(x < nodemin.X || x > nodemax.X || y < nodemin.Y ||
+					y > nodemax.Y || z < nodemin.Z || z > nodemax.Z)
+				continue;
+			v3s16 p(x, y, z);
+			v3s16 bp = getNodeBlockPos(p);
+			std::map<v3s16, std::pair<bool, MapBlock*> >::iterator
+					b = shell_blocks.find(bp);
+			if(b == shell_blocks.end())
+			{
+				MapBlock *block = getLoadedBlock(this, bp);
+				b = shell_blocks.insert(std::make_pair(bp, std::make_pair(
+						hasWantedContent(block, lookup), block))).first;
+			}
+			if(!b->second.first)
+				continue;
+			MapBlock *block = b->second.second;
+			if(block == NULL || isWantedContent(lookup, block->getNodeNoCheck(
+					p - block->getPosRelative()).getContent()))
+			{
+				result = p;
+				return true;
+			}
 		}
 	}
-
-	if(found_something == false)
-		throw InvalidPositionException();
-
-	return brightest_pos;
+	return false;
 }
 
-/*
-	Propagates sunlight down from a node.
-	Starting point gets sunlight.
-
-	Returns the lowest y value of where the sunlight went.
-
-	Mud is turned into grass in where the sunlight stops.
-*/
-s16 Map::propagateSunlight(v3s16 start,
-		std::map<v3s16, MapBlock*> & modified_blocks)
+// throws InvalidPositionException if not found
+void Map::setNode(v3s16 p, MapNode & n)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	s16 y = start.Y;
-	for(; ; y--)
-	{
-		v3s16 pos(start.X, y, start.Z);
-
-		v3s16 blockpos = getNodeBlockPos(pos);
-		MapBlock *block;
-		try{
-			block = getBlockNoCreate(blockpos);
-		}
-		catch(InvalidPositionException &e)
-		{
-			break;
-		}
-
-		v3s16 relpos = pos - blockpos*MAP_BLOCKSIZE;
-		MapNode n = block->getNode(relpos);
-
-		if(nodemgr->get(n).sunlight_propagates)
-		{
-			n.setLight(LIGHTBANK_DAY, LIGHT_SUN, nodemgr);
-			block->setNode(relpos, n);
-
-			modified_blocks[blockpos] = block;
-		}
-		else
-		{
-			// Sunlight goes no further
-			break;
-		}
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock *block = getBlockNoCreate(blockpos);
+	v3s16 relpos = p - blockpos*MAP_BLOCKSIZE;
+	// Never allow placing CONTENT_IGNORE, it fucks up stuff
+	if(n.getContent() == CONTENT_IGNORE){
+		errorstream<<"Map::setNode(): Not allowing to place CONTENT_IGNORE"
+				<<" while trying to replace \""
+				<<m_gamedef->ndef()->get(block->getNodeNoCheck(relpos)).name
+				<<"\" at "<<PP(p)<<" (block "<<PP(blockpos)<<")"<<std::endl;
+		debug_stacks_print_to(infostream);
+		return;
 	}
-	return y + 1;
+	block->setNodeNoCheck(relpos, n);
 }
 
+
 void Map::updateLighting(enum LightBank bank,
 		std::map<v3s16, MapBlock*> & a_blocks,
 		std::map<v3s16, MapBlock*> & modified_blocks)
@@ -694,9 +545,10 @@ void Map::updateLighting(enum LightBank bank,
 
 	std::map<v3s16, MapBlock*> blocks_to_update;
 
+	// Nodes lit by propagateSunlight()
 	std::set<v3s16> light_sources;
 
-	std::map<v3s16, u8> unlight_from;
+	voxalgo::MapLightUpdater updater(this, nodemgr, bank, modified_blocks);
 
 	int num_bottom_invalid = 0;
 
@@ -723,46 +575,38 @@ void Map::updateLighting(enum LightBank bank,
 			blocks_to_update[pos] = block;
 
 			/*
-				Clear all light from block
+				Clear all light from block; a compact block is only
+				expanded if it has light
 			*/
 			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
-			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			{
-
-				try{
-					v3s16 p(x,y,z);
-					MapNode n = block->getNode(p);
-					u8 oldlight = n.getLight(bank, nodemgr);
+				v3s16 p(x,y,z);
+				u32 i = (z*MAP_BLOCKSIZE + y)*MAP_BLOCKSIZE + x;
+				MapNode n = block->getNodeAt(i);
+				u8 oldlight = n.getLight(bank, nodemgr);
+				if(oldlight != 0)
+				{
 					n.setLight(bank, 0, nodemgr);
-					block->setNode(p, n);
-
-					// If node sources light, add to list
-					u8 source = nodemgr->get(n).light_source;
-					if(source != 0)
-						light_sources.insert(p + posnodes);
-
-					// Collect borders for unlighting
-					if((x==0 || x == MAP_BLOCKSIZE-1
-					|| y==0 || y == MAP_BLOCKSIZE-1
-					|| z==0 || z == MAP_BLOCKSIZE-1)
-					&& oldlight != 0)
-					{
-						v3s16 p_map = p + posnodes;
-						unlight_from[p_map] = oldlight;
-					}
+					block->setNodeAt(i, n);
 				}
-				catch(InvalidPositionException &e)
+
+				// If node sources light, add to list
+				u8 source = nodemgr->get(n).light_source;
+				if(source != 0)
+					updater.addSource(p + posnodes);
+
+				// Collect borders for unlighting
+				if((x==0 || x == MAP_BLOCKSIZE-1
+				|| y==0 || y == MAP_BLOCKSIZE-1
+				|| z==0 || z == MAP_BLOCKSIZE-1)
+				&& oldlight != 0)
 				{
-					/*
-						This would happen when dealing with a
-						dummy block.
-					*/
-					//assert(0);
-					infostream<<"updateLighting(): InvalidPositionException"
-							<<std::endl;
+					updater.addUnlight(p + posnodes, oldlight);
 				}
 			}
+			block->raiseModified(MOD_STATE_WRITE_NEEDED, "updateLighting");
 
 			if(bank == LIGHTBANK_DAY)
 			{
@@ -828,7 +672,7 @@ void Map::updateLighting(enum LightBank bank,
 #if 1
 	{
 		//TimeTaker timer("unspreadLight");
-		unspreadLight(bank, unlight_from, light_sources, modified_blocks);
+		updater.unspread();
 	}
 
 	/*if(debug)
@@ -840,7 +684,10 @@ void Map::updateLighting(enum LightBank bank,
 
 	{
 		//TimeTaker timer("spreadLight");
-		spreadLight(bank, light_sources, modified_blocks);
+		for(std::set<v3s16>::iterator i = light_sources.begin();
+				i != light_sources.end(); ++i)
+			updater.addSource(*i);
+		updater.spread();
 	}
 
 	/*if(debug)
@@ -939,55 +786,12 @@ void Map::updateLighting(std::map<v3s16, MapBlock*> & a_blocks,
 	}
 }
 
-/*
-*/
-void Map::addNodeAndUpdate(v3s16 p, MapNode n,
+void Map::updateLightingNodes(
+		const std::vector<std::pair<v3s16, MapNode> > &oldnodes,
 		std::map<v3s16, MapBlock*> &modified_blocks)
 {
 	INodeDefManager *ndef = m_gamedef->ndef();
 
-	/*PrintInfo(m_dout);
-	m_dout<<DTIME<<"Map::addNodeAndUpdate(): p=("
-			<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
-
-	/*
-		From this node to nodes underneath:
-		If lighting is sunlight (1.0), unlight neighbours and
-		set lighting to 0.
-		Else discontinue.
-	*/
-
-	v3s16 toppos = p + v3s16(0,1,0);
-	//v3s16 bottompos = p + v3s16(0,-1,0);
-
-	bool node_under_sunlight = true;
-	std::set<v3s16> light_sources;
-
-	/*
-		Collect old node for rollback
-	*/
-	RollbackNode rollback_oldnode(this, p, m_gamedef);
-
-	/*
-		If there is a node at top and it doesn't have sunlight,
-		there has not been any sunlight going down.
-
-		Otherwise there probably is.
-	*/
-	try{
-		MapNode topnode = getNode(toppos);
-
-		if(topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
-			node_under_sunlight = false;
-	}
-	catch(InvalidPositionException &e)
-	{
-	}
-
-	/*
-		Remove all light that has come out of this node
-	*/
-
 	enum LightBank banks[] =
 	{
 		LIGHTBANK_DAY,
@@ -996,103 +800,142 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	for(s32 i=0; i<2; i++)
 	{
 		enum LightBank bank = banks[i];
+		voxalgo::MapLightUpdater updater(this, ndef, bank, modified_blocks);
 
-		u8 lightwas = getNode(p).getLight(bank, ndef);
+		// Highest and lowest changed node of each column, for sunlight
+		std::map<v2s16, std::pair<s16, s16> > columns;
 
-		// Add the block of the added node to modified_blocks
-		v3s16 blockpos = getNodeBlockPos(p);
-		MapBlock * block = getBlockNoCreate(blockpos);
-		assert(block != NULL);
-		modified_blocks[blockpos] = block;
+		/*
+			Remove the light of the changed nodes and of everything that
+			got its light from them; the nodes themselves are lit again
+			from their neighbours if they let light through.
+		*/
+		for(u32 j=0; j<oldnodes.size(); j++)
+		{
+			v3s16 p = oldnodes[j].first;
+			v3s16 blockpos = getNodeBlockPos(p);
+			MapBlock *block = getBlockNoCreateNoEx(blockpos);
+			if(block == NULL || block->isDummy())
+				continue;
+			modified_blocks[blockpos] = block;
+
+			v3s16 relpos = p - blockpos*MAP_BLOCKSIZE;
+			MapNode n = block->getNodeNoCheck(relpos);
+			n.setLight(bank, 0, ndef);
+			block->setNodeNoCheck(relpos, n);
 
-		assert(isValidPosition(p));
+			updater.addUnlight(p, oldnodes[j].second.getLight(bank, ndef));
+			updater.addSource(p);
 
-		// Unlight neighbours of node.
-		// This means setting light of all consequent dimmer nodes
-		// to 0.
-		// This also collects the nodes at the border which will spread
-		// light again into this.
-		unLightNeighbors(bank, p, lightwas, light_sources, modified_blocks);
+			if(bank != LIGHTBANK_DAY)
+				continue;
+			v2s16 p2d(p.X, p.Z);
+			std::map<v2s16, std::pair<s16, s16> >::iterator c = columns.find(p2d);
+			if(c == columns.end())
+				columns[p2d] = std::make_pair(p.Y, p.Y);
+			else
+				c->second = std::make_pair(MYMAX(c->second.first, p.Y),
+						MYMIN(c->second.second, p.Y));
+		}
+
+		/*
+			Sunlight goes down through the changed nodes until something
+			stops it. Below the changes the column is followed for as
+			long as its sunlight is not what it should be.
+		*/
+		for(std::map<v2s16, std::pair<s16, s16> >::iterator
+				c = columns.begin(); c != columns.end(); ++c)
+		{
+			v2s16 p2d = c->first;
+			s16 top = c->second.first;
+			s16 bottom = c->second.second;
+
+			// If the node above is not loaded, assume sunlight
+			bool sunlight = true;
+			v3s16 toppos(p2d.X, top + 1, p2d.Y);
+			MapBlock *block = getBlockNoCreateNoEx(getNodeBlockPos(toppos));
+			if(block != NULL && !block->isDummy()
+					&& block->getNodeNoCheck(toppos - block->getPosRelative())
+					.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
+				sunlight = false;
+
+			for(s16 y=top; ; y--)
+			{
+				v3s16 pos(p2d.X, y, p2d.Y);
+				v3s16 blockpos = getNodeBlockPos(pos);
+				MapBlock *block = getBlockNoCreateNoEx(blockpos);
+				if(block == NULL || block->isDummy())
+					break;
+				v3s16 relpos = pos - blockpos*MAP_BLOCKSIZE;
+				MapNode n = block->getNodeNoCheck(relpos);
 
-		n.setLight(bank, 0, ndef);
+				bool had_sunlight = n.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN;
+				sunlight = sunlight && ndef->get(n).sunlight_propagates;
+				if(sunlight == had_sunlight){
+					if(y < bottom)
+						break;
+					continue;
+				}
+				if(sunlight){
+					n.setLight(LIGHTBANK_DAY, LIGHT_SUN, ndef);
+					updater.addSource(pos);
+				}
+				else{
+					updater.addUnlight(pos, LIGHT_SUN);
+					n.setLight(LIGHTBANK_DAY, 0, ndef);
+				}
+				block->setNodeNoCheck(relpos, n);
+				modified_blocks[blockpos] = block;
+			}
+		}
+
+		updater.unspread();
+		updater.spread();
 	}
 
 	/*
-		If node lets sunlight through and is under sunlight, it has
-		sunlight too.
+		Update information about whether day and night light differ
 	*/
-	if(node_under_sunlight && ndef->get(n).sunlight_propagates)
+	for(std::map<v3s16, MapBlock*>::iterator
+			i = modified_blocks.begin();
+			i != modified_blocks.end(); ++i)
 	{
-		n.setLight(LIGHTBANK_DAY, LIGHT_SUN, ndef);
+		i->second->expireDayNightDiff();
 	}
+}
 
-	/*
-		Remove node metadata
-	*/
+/*
+*/
+void Map::addNodeAndUpdate(v3s16 p, MapNode n,
+		std::map<v3s16, MapBlock*> &modified_blocks)
+{
+	INodeDefManager *ndef = m_gamedef->ndef();
 
-	removeNodeMetadata(p);
+	/*PrintInfo(m_dout);
+	m_dout<<DTIME<<"Map::addNodeAndUpdate(): p=("
+			<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
 
 	/*
-		Set the node on the map
+		Collect old node for rollback
 	*/
+	RollbackNode rollback_oldnode(this, p, m_gamedef);
 
-	setNode(p, n);
+	std::vector<std::pair<v3s16, MapNode> > oldnodes;
+	oldnodes.push_back(std::make_pair(p, getNode(p)));
 
 	/*
-		If node is under sunlight and doesn't let sunlight through,
-		take all sunlighted nodes under it and clear light from them
-		and from where the light has been spread.
-		TODO: This could be optimized by mass-unlighting instead
-			  of looping
+		Remove node metadata
 	*/
-	if(node_under_sunlight && !ndef->get(n).sunlight_propagates)
-	{
-		s16 y = p.Y - 1;
-		for(;; y--){
-			//m_dout<<DTIME<<"y="<<y<<std::endl;
-			v3s16 n2pos(p.X, y, p.Z);
-
-			MapNode n2;
-			try{
-				n2 = getNode(n2pos);
-			}
-			catch(InvalidPositionException &e)
-			{
-				break;
-			}
 
-			if(n2.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN)
-			{
-				unLightNeighbors(LIGHTBANK_DAY,
-						n2pos, n2.getLight(LIGHTBANK_DAY, ndef),
-						light_sources, modified_blocks);
-				n2.setLight(LIGHTBANK_DAY, 0, ndef);
-				setNode(n2pos, n2);
-			}
-			else
-				break;
-		}
-	}
-
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Spread light from all nodes that might be capable of doing so
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
-	}
+	removeNodeMetadata(p);
 
 	/*
-		Update information about whether day and night light differ
+		Set the node on the map
 	*/
-	for(std::map<v3s16, MapBlock*>::iterator
-			i = modified_blocks.begin();
-			i != modified_blocks.end(); ++i)
-	{
-		i->second->expireDayNightDiff();
-	}
+
+	setNode(p, n);
+
+	updateLightingNodes(oldnodes, modified_blocks);
 
 	/*
 		Report for rollback
@@ -1149,142 +992,33 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	m_dout<<DTIME<<"Map::removeNodeAndUpdate(): p=("
 			<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
 
-	bool node_under_sunlight = true;
-
-	v3s16 toppos = p + v3s16(0,1,0);
-
 	// Node will be replaced with this
-	content_t replace_material = CONTENT_AIR;
-
-	/*
-		Collect old node for rollback
-	*/
-	RollbackNode rollback_oldnode(this, p, m_gamedef);
-
-	/*
-		If there is a node at top and it doesn't have sunlight,
-		there will be no sunlight going down.
-	*/
-	try{
-		MapNode topnode = getNode(toppos);
-
-		if(topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
-			node_under_sunlight = false;
-	}
-	catch(InvalidPositionException &e)
-	{
-	}
-
-	std::set<v3s16> light_sources;
-
-	enum LightBank banks[] =
-	{
-		LIGHTBANK_DAY,
-		LIGHTBANK_NIGHT
-	};
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Unlight neighbors (in case the node is a light source)
-		*/
-		unLightNeighbors(bank, p,
-				getNode(p).getLight(bank, ndef),
-				light_sources, modified_blocks);
-	}
-
-	/*
-		Remove node metadata
-	*/
-
-	removeNodeMetadata(p);
-
-	/*
-		Remove the node.
-		This also clears the lighting.
-	*/
-
-	MapNode n;
-	n.setContent(replace_material);
-	setNode(p, n);
-
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
-
-		/*
-			Recalculate lighting
-		*/
-		spreadLight(bank, light_sources, modified_blocks);
-	}
-
-	// Add the block of the removed node to modified_blocks
-	v3s16 blockpos = getNodeBlockPos(p);
-	MapBlock * block = getBlockNoCreate(blockpos);
-	assert(block != NULL);
-	modified_blocks[blockpos] = block;
+	content_t replace_material = CONTENT_AIR;
 
 	/*
-		If the removed node was under sunlight, propagate the
-		sunlight down from it and then light all neighbors
-		of the propagated blocks.
+		Collect old node for rollback
 	*/
-	if(node_under_sunlight)
-	{
-		s16 ybottom = propagateSunlight(p, modified_blocks);
-		/*m_dout<<DTIME<<"Node was under sunlight. "
-				"Propagating sunlight";
-		m_dout<<DTIME<<" -> ybottom="<<ybottom<<std::endl;*/
-		s16 y = p.Y;
-		for(; y >= ybottom; y--)
-		{
-			v3s16 p2(p.X, y, p.Z);
-			/*m_dout<<DTIME<<"lighting neighbors of node ("
-					<<p2.X<<","<<p2.Y<<","<<p2.Z<<")"
-					<<std::endl;*/
-			lightNeighbors(LIGHTBANK_DAY, p2, modified_blocks);
-		}
-	}
-	else
-	{
-		// Set the lighting of this node to 0
-		// TODO: Is this needed? Lighting is cleared up there already.
-		try{
-			MapNode n = getNode(p);
-			n.setLight(LIGHTBANK_DAY, 0, ndef);
-			setNode(p, n);
-		}
-		catch(InvalidPositionException &e)
-		{
-			assert(0);
-		}
-	}
+	RollbackNode rollback_oldnode(this, p, m_gamedef);
 
-	for(s32 i=0; i<2; i++)
-	{
-		enum LightBank bank = banks[i];
+	std::vector<std::pair<v3s16, MapNode> > oldnodes;
+	oldnodes.push_back(std::make_pair(p, getNode(p)));
 
-		// Get the brightest neighbour node and propagate light from it
-		v3s16 n2p = getBrightestNeighbour(bank, p);
-		try{
-			//MapNode n2 = getNode(n2p);
-			lightNeighbors(bank, n2p, modified_blocks);
-		}
-		catch(InvalidPositionException &e)
-		{
-		}
-	}
+	/*
+		Remove node metadata
+	*/
+
+	removeNodeMetadata(p);
 
 	/*
-		Update information about whether day and night light differ
+		Remove the node.
+		This also clears the lighting.
 	*/
-	for(std::map<v3s16, MapBlock*>::iterator
-			i = modified_blocks.begin();
-			i != modified_blocks.end(); ++i)
-	{
-		i->second->expireDayNightDiff();
-	}
+
+	MapNode n;
+	n.setContent(replace_material);
+	setNode(p, n);
+
+	updateLightingNodes(oldnodes, modified_blocks);
 
 	/*
 		Report for rollback
@@ -1451,6 +1185,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 		std::list<v3s16> *unloaded_blocks)
 {
 	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
+	static SettingHandle<bool> compact_mapblocks(g_settings, "compact_mapblocks");
 
 	// Profile modified reasons
 	Profiler modprofiler;
@@ -1459,6 +1194,9 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
 	u32 block_count_all = 0;
+	u32 compact_count = 0;
+	u32 uniform_count = 0;
+	u64 node_bytes = 0;
 
 	beginSave();
 	for(std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
@@ -1504,6 +1242,17 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 				all_blocks_deleted = false;
 				block_count_all++;
 
+				// Blocks that haven't been used for a while are likely
+				// to be only read from now on
+				if(compact_mapblocks.get() && !block->isCompact()
+						&& block->getUsageTimer() > 10)
+					block->compact();
+				if(block->isCompact())
+					compact_count++;
+				if(block->isUniform())
+					uniform_count++;
+				node_bytes += block->getNodeMemoryUsage();
+
 /*#ifndef SERVER
 				if(block->refGet() == 0 && block->getUsageTimer() >
 						g_settings->getFloat("unload_unused_meshes_timeout"))
@@ -1527,6 +1276,12 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	// Finally delete the empty sectors
 	deleteSectors(sector_deletion_queue);
 
+	m_block_count = block_count_all;
+	m_compact_block_count = compact_count;
+	m_uniform_block_count = uniform_count;
+	m_block_node_bytes = node_bytes;
+	g_profiler->avg("Map: compact blocks", compact_count);
+
 	if(deleted_blocks_count != 0)
 	{
 		PrintInfo(infostream); // ServerMap/ClientMap:
@@ -1536,6 +1291,8 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 			infostream<<", of which "<<saved_blocks_count<<" were written";
 		infostream<<", "<<block_count_all<<" blocks in memory";
 		infostream<<"."<<std::endl;
+		PrintInfo(infostream); // ServerMap/ClientMap:
+		printBlockMemoryInfo(infostream);
 		if(saved_blocks_count != 0){
 			PrintInfo(infostream); // ServerMap/ClientMap:
 			infostream<<"Blocks modified by: "<<std::endl;
@@ -1626,6 +1383,15 @@ void Map::PrintInfo(std::ostream &out)
 	out<<"Map: ";
 }
 
+void Map::printBlockMemoryInfo(std::ostream &out)
+{
+	out<<"Block nodes use "<<(m_block_node_bytes / 1024)<<" KiB, "
+			<<(m_block_count ? m_block_node_bytes / m_block_count : 0)
+			<<" bytes per block; "<<m_compact_block_count<<" of "
+			<<m_block_count<<" blocks are compact, "
+			<<m_uniform_block_count<<" uniform."<<std::endl;
+}
+
 enum NeighborType {
 	NEIGHBOR_UPPER,
 	NEIGHBOR_SAME_LEVEL,
@@ -1672,39 +1438,120 @@ const s8 liquid_random_map[4][7] = {
 #define D_TOP 6
 #define D_SELF 1
 
-s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
+/*
+	Finite liquids are updated in regions of one MapBlock. Updating a
+	node reads and writes only the node and its face neighbours, so a
+	region needs just its own block and the six blocks next to it, which
+	are looked up once instead of through the sector map for every node.
+
+	Regions are updated in eight passes by the parity of their position.
+	Regions of the same pass are at least one block apart and never touch
+	the same blocks, so they are updated at the same time: each one writes
+	its own block directly and keeps its writes to the neighbouring
+	blocks, which are applied after the pass in region order. The result
+	does not depend on the number of threads.
+*/
+struct LiquidRegion
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
+	LiquidRegion():
+		done(false)
+	{
+		for(u16 i=0; i<7; i++)
+			blocks[i] = NULL;
+	}
 
-	DSTACK(__FUNCTION_NAME);
-	//TimeTaker timer("transformLiquidsFinite()");
+	v3s16 blockpos;
+	// Indexed like liquid_flow_dirs, NULL if not loaded
+	MapBlock *blocks[7];
+	std::vector<v3s16> queue;
+	bool done;
 
-	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
+	// Writes to the neighbouring blocks, applied after the pass
+	std::map<v3s16, MapNode> outside;
+	std::vector<v3s16> must_reflow;
+	std::vector<v3s16> must_reflow_second;
+	// Changed nodes that need a lighting update, with their old nodes
+	std::vector<std::pair<v3s16, MapNode> > lighting_changed;
 
-	u8 relax = g_settings->getS16("liquid_relax");
-	bool fast_flood = g_settings->getS16("liquid_fast_flood");
-	int water_level = g_settings->getS16("water_level");
+	// Index into blocks of the block containing p, -1 if out of reach
+	s16 blockIndex(v3s16 p) const
+	{
+		v3s16 rel = getNodeBlockPos(p) - blockpos;
+		for(u16 i=0; i<7; i++)
+			if(rel == liquid_flow_dirs[i])
+				return i;
+		return -1;
+	}
 
-	// list of nodes that due to viscosity have not reached their max level height
-	UniqueQueue<v3s16> must_reflow, must_reflow_second;
+	MapBlock *getBlock(v3s16 p) const
+	{
+		s16 i = blockIndex(p);
+		return i == -1 ? NULL : blocks[i];
+	}
+
+	MapNode getNode(v3s16 p) const
+	{
+		s16 i = blockIndex(p);
+		if(i == -1 || blocks[i] == NULL)
+			return MapNode(CONTENT_IGNORE);
+		if(i != D_SELF){
+			std::map<v3s16, MapNode>::const_iterator n = outside.find(p);
+			if(n != outside.end())
+				return n->second;
+		}
+		return blocks[i]->getNodeNoCheck(p - blocks[i]->getPosRelative());
+	}
+
+	// Returns false if the block of p is not loaded or n is CONTENT_IGNORE
+	bool setNode(v3s16 p, MapNode &n)
+	{
+		s16 i = blockIndex(p);
+		if(i == -1 || blocks[i] == NULL)
+			return false;
+		// Never allow placing CONTENT_IGNORE, same as Map::setNode()
+		if(n.getContent() == CONTENT_IGNORE){
+			errorstream<<"LiquidRegion::setNode(): Not allowing to place"
+					<<" CONTENT_IGNORE at "<<PP(p)<<std::endl;
+			return false;
+		}
+		if(i == D_SELF)
+			blocks[i]->setNodeNoCheck(p - blocks[i]->getPosRelative(), n);
+		else
+			outside[p] = n;
+		return true;
+	}
+};
+
+struct LiquidFiniteParams
+{
+	INodeDefManager *nodemgr;
+	u32 initial_size;
+	u8 relax;
+	bool fast_flood;
+	int water_level;
+	u16 loop_rand;
+	u32 end_ms;
+};
 
-	// List of MapBlocks that will require a lighting update (due to lava)
-	std::map<v3s16, MapBlock*> lighting_modified_blocks;
-	u16 loop_rand = myrand();
+static void transformLiquidsFiniteRegion(LiquidRegion &region,
+		const LiquidFiniteParams &params)
+{
+	INodeDefManager *nodemgr = params.nodemgr;
+	u32 initial_size = params.initial_size;
+	u8 relax = params.relax;
+	bool fast_flood = params.fast_flood;
+	int water_level = params.water_level;
+	u16 loop_rand = params.loop_rand;
 
-	u32 end_ms = porting::getTimeMs() + 1000 * g_settings->getFloat("dedicated_server_step");
+	u32 loopcount = 0;
 
-	while (m_transforming_liquid.size() > 0)
+	for (u32 q = 0; q < region.queue.size(); q++)
 	{
-		// This should be done here so that it is done when continue is used
-		if (loopcount >= initial_size || porting::getTimeMs() > end_ms)
-			break;
 		loopcount++;
 		/*
 			Get a queued transforming liquid node
 		*/
-		v3s16 p0 = m_transforming_liquid.pop_front();
+		v3s16 p0 = region.queue[q];
 		u16 total_level = 0;
 		//u16 level_max = 0;
 		// surrounding flowing liquid nodes
@@ -1735,7 +1582,7 @@ s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 			}
 			v3s16 npos = p0 + liquid_flow_dirs[i];
 
-			neighbors[i].n = getNodeNoEx(npos);
+			neighbors[i].n = region.getNode(npos);
 			neighbors[i].t = nt;
 			neighbors[i].p = npos;
 			neighbors[i].l = 0;
@@ -1979,7 +1826,7 @@ s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 				for (u16 ir = D_SELF + 1; ir < D_TOP; ++ir) { // only same level
 					u16 ii = liquid_random_map[(loopcount+loop_rand+4)%4][ir];
 					if (neighbors[ii].l)
-						must_reflow_second.push_back(p0 + liquid_flow_dirs[ii]);
+						region.must_reflow_second.push_back(p0 + liquid_flow_dirs[ii]);
 				}
 			}
 
@@ -1992,6 +1839,7 @@ s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 				continue;
 			}
 
+			MapNode n00 = n0;
 			n0.setContent(liquid_kind_flowing);
 			n0.setLevel(nodemgr, new_node_level);
 			/* rollback will stop your server if enabled with liquid_finite
@@ -2016,27 +1864,15 @@ s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 			} else {
 			*/
 				// Set node
-			try{
-				setNode(p0, n0);
-			}
-			catch(InvalidPositionException &e)
-			{
+			if (!region.setNode(p0, n0))
 				infostream<<"transformLiquidsFinite: setNode() failed:"<<PP(p0)<<std::endl;
-			}
 			//}
 
-			// If node emits light, MapBlock requires lighting update
+			// If node emits light, it requires lighting update
 			// or if node removed
-			if (new_node_level <= 0 || nodemgr->get(n0).light_source) { 
-				v3s16 blockpos = getNodeBlockPos(p0);
-				MapBlock *block = getBlockNoCreateNoEx(blockpos);
-				if(block != NULL) {
-					modified_blocks[blockpos] = block;
-					//if(nodemgr->get(n0).light_source != 0) // better ro update always
-					lighting_modified_blocks[block->getPos()] = block;
-				}
-			}
-			must_reflow.push_back(neighbors[i].p);
+			if (new_node_level <= 0 || nodemgr->get(n0).light_source)
+				region.lighting_changed.push_back(std::make_pair(p0, n00));
+			region.must_reflow.push_back(neighbors[i].p);
 		}
 		/* //for better relax  only same level
 		if (changed)  for (u16 ii = D_SELF + 1; ii < D_TOP; ++ii) {
@@ -2044,19 +1880,264 @@ s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 			must_reflow.push_back(p0 + dirs[ii]);
 		}*/
 	}
+	region.done = true;
+}
 
-	s32 ret = loopcount >= initial_size ? 0 : m_transforming_liquid.size();
+/*
+	Runs transformLiquidsFiniteRegion() for the regions of a pass in the
+	calling thread and in the LiquidThreads.
+*/
+class LiquidUpdater
+{
+public:
+	LiquidUpdater():
+		m_jobs(NULL),
+		m_params(NULL),
+		m_next(0),
+		m_running(0)
+	{
+		m_mutex.Init();
+	}
 
-	/*if (loopcount)
-		infostream<<"Map::transformLiquidsFinite(): loopcount="<<loopcount
-		<<" reflow="<<must_reflow.size()
-		<<" queue="<< m_transforming_liquid.size()<< " per="<<timer.getTimerTime()<<" ret="<<ret<<std::endl;*/
+	void setJobs(std::vector<LiquidRegion*> *jobs,
+			const LiquidFiniteParams *params, u32 threadcount)
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_jobs = jobs;
+		m_params = params;
+		m_next = 0;
+		m_running = threadcount;
+	}
 
-	while (must_reflow.size() > 0)
-		m_transforming_liquid.push_back(must_reflow.pop_front());
-	while (must_reflow_second.size() > 0)
-		m_transforming_liquid.push_back(must_reflow_second.pop_front());
-	updateLighting(lighting_modified_blocks, modified_blocks);
+	// Updates regions until there are none left or the time is up;
+	// regions that are not started are left with done == false
+	void run()
+	{
+		for(;;){
+			LiquidRegion *region;
+			{
+				JMutexAutoLock lock(m_mutex);
+				if(m_jobs == NULL || m_next >= m_jobs->size())
+					return;
+				if(porting::getTimeMs() > m_params->end_ms){
+					m_next = m_jobs->size();
+					return;
+				}
+				region = (*m_jobs)[m_next++];
+			}
+			transformLiquidsFiniteRegion(*region, *m_params);
+		}
+	}
+
+	// Called by each of the threads when run() returns
+	void threadDone()
+	{
+		JMutexAutoLock lock(m_mutex);
+		assert(m_running > 0);
+		m_running--;
+		if(m_running == 0)
+			m_done.signal();
+	}
+
+	// Waits for the threads given to setJobs()
+	void waitThreads(u32 threadcount)
+	{
+		if(threadcount != 0)
+			m_done.wait();
+		JMutexAutoLock lock(m_mutex);
+		m_jobs = NULL;
+		m_params = NULL;
+	}
+
+private:
+	std::vector<LiquidRegion*> *m_jobs;
+	const LiquidFiniteParams *m_params;
+	u32 m_next;
+	u32 m_running;
+	JMutex m_mutex;
+	Event m_done;
+};
+
+class LiquidThread : public SimpleThread
+{
+public:
+	LiquidThread(LiquidUpdater *updater, int id):
+		SimpleThread(),
+		m_updater(updater),
+		m_id(id)
+	{
+	}
+
+	void *Thread()
+	{
+		ThreadStarted();
+		log_register_thread("LiquidThread" + itos(m_id));
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		while(getRun())
+		{
+			m_start.wait();
+			if(!getRun())
+				break;
+			m_updater->run();
+			m_updater->threadDone();
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		return NULL;
+	}
+
+	// Signaled once for every setJobs() and for stopping
+	Event m_start;
+
+private:
+	LiquidUpdater *m_updater;
+	int m_id;
+};
+
+void Map::stopLiquidThreads()
+{
+	for(u32 i=0; i<m_liquid_threads.size(); i++){
+		m_liquid_threads[i]->setRun(false);
+		m_liquid_threads[i]->m_start.signal();
+		m_liquid_threads[i]->stop();
+		delete m_liquid_threads[i];
+	}
+	m_liquid_threads.clear();
+	delete m_liquid_updater;
+	m_liquid_updater = NULL;
+}
+
+s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
+{
+	DSTACK(__FUNCTION_NAME);
+	//TimeTaker timer("transformLiquidsFinite()");
+
+	static SettingHandle<s16> liquid_relax(g_settings, "liquid_relax");
+	static SettingHandle<s16> liquid_fast_flood(g_settings, "liquid_fast_flood");
+	static SettingHandle<s16> water_level(g_settings, "water_level");
+	static SettingHandle<float> dedicated_server_step(g_settings,
+			"dedicated_server_step");
+
+	LiquidFiniteParams params;
+	params.nodemgr = m_gamedef->ndef();
+	params.initial_size = m_transforming_liquid.size();
+	params.relax = liquid_relax.get();
+	params.fast_flood = liquid_fast_flood.get();
+	params.water_level = water_level.get();
+	params.loop_rand = myrand();
+	params.end_ms = porting::getTimeMs() + 1000 * dedicated_server_step.get();
+
+	if (params.initial_size == 0)
+		return 0;
+
+	if (m_liquid_updater == NULL) {
+		m_liquid_updater = new LiquidUpdater();
+		u16 liquid_threads = g_settings->getU16("num_liquid_threads");
+		for (u16 i = 0; i < liquid_threads; i++) {
+			LiquidThread *thread = new LiquidThread(m_liquid_updater, i);
+			thread->Start();
+			m_liquid_threads.push_back(thread);
+		}
+	}
+
+	/*
+		Sort the queue into regions
+	*/
+	std::map<v3s16, LiquidRegion> regions;
+	while (m_transforming_liquid.size() > 0) {
+		v3s16 p = m_transforming_liquid.pop_front();
+		regions[getNodeBlockPos(p)].queue.push_back(p);
+	}
+
+	std::vector<LiquidRegion*> passes[8];
+	u32 backlog_max = 0;
+	for (std::map<v3s16, LiquidRegion>::iterator
+			i = regions.begin(); i != regions.end(); ++i) {
+		LiquidRegion &region = i->second;
+		v3s16 p = i->first;
+		region.blockpos = p;
+		backlog_max = MYMAX(backlog_max, region.queue.size());
+		for (u16 d = 0; d < 7; d++) {
+			MapBlock *block = getBlockNoCreateNoEx(p + liquid_flow_dirs[d]);
+			if (block != NULL && !block->isDummy())
+				region.blocks[d] = block;
+		}
+		// Nothing can flow in a block that is not loaded
+		if (region.blocks[D_SELF] == NULL) {
+			region.done = true;
+			continue;
+		}
+		passes[(p.X & 1) | (p.Y & 1) << 1 | (p.Z & 1) << 2].push_back(&region);
+	}
+	g_profiler->avg("Map: liquid regions", regions.size());
+	g_profiler->avg("Map: liquid region backlog max", backlog_max);
+
+	for (u16 pass = 0; pass < 8; pass++) {
+		std::vector<LiquidRegion*> &jobs = passes[pass];
+		if (jobs.empty())
+			continue;
+
+		// The calling thread takes a region too
+		u32 threadcount = MYMIN(m_liquid_threads.size(), jobs.size() - 1);
+		m_liquid_updater->setJobs(&jobs, &params, threadcount);
+		for (u32 i = 0; i < threadcount; i++)
+			m_liquid_threads[i]->m_start.signal();
+		m_liquid_updater->run();
+		m_liquid_updater->waitThreads(threadcount);
+
+		/*
+			Apply the writes across region borders
+		*/
+		for (u32 i = 0; i < jobs.size(); i++) {
+			LiquidRegion &region = *jobs[i];
+			for (std::map<v3s16, MapNode>::iterator
+					j = region.outside.begin(); j != region.outside.end(); ++j) {
+				MapBlock *block = region.getBlock(j->first);
+				block->setNodeNoCheck(j->first - block->getPosRelative(), j->second);
+			}
+			region.outside.clear();
+		}
+	}
+
+	/*
+		Requeue what was left over, then what has to flow again
+	*/
+	u32 regions_left = 0;
+	std::vector<std::pair<v3s16, MapNode> > lighting_changed;
+	for (std::map<v3s16, LiquidRegion>::iterator
+			i = regions.begin(); i != regions.end(); ++i) {
+		LiquidRegion &region = i->second;
+		if (region.done)
+			continue;
+		regions_left++;
+		for (u32 j = 0; j < region.queue.size(); j++)
+			m_transforming_liquid.push_back(region.queue[j]);
+	}
+	g_profiler->avg("Map: liquid regions left", regions_left);
+
+	s32 ret = m_transforming_liquid.size();
+
+	/*if (ret)
+		infostream<<"Map::transformLiquidsFinite(): regions="<<regions.size()
+		<<" left="<<regions_left<<" queue="<< ret<< " per="<<timer.getTimerTime()<<std::endl;*/
+
+	for (std::map<v3s16, LiquidRegion>::iterator
+			i = regions.begin(); i != regions.end(); ++i) {
+		LiquidRegion &region = i->second;
+		for (u32 j = 0; j < region.must_reflow.size(); j++)
+			m_transforming_liquid.push_back(region.must_reflow[j]);
+		lighting_changed.insert(lighting_changed.end(),
+				region.lighting_changed.begin(), region.lighting_changed.end());
+	}
+	for (std::map<v3s16, LiquidRegion>::iterator
+			i = regions.begin(); i != regions.end(); ++i) {
+		LiquidRegion &region = i->second;
+		for (u32 j = 0; j < region.must_reflow_second.size(); j++)
+			m_transforming_liquid.push_back(region.must_reflow_second[j]);
+	}
+	updateLightingNodes(lighting_changed, modified_blocks);
 
 	return ret;
 }
@@ -2065,8 +2146,11 @@ s32 Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 
 s32 Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 {
+	static SettingHandle<bool> liquid_finite(g_settings, "liquid_finite");
+	static SettingHandle<float> dedicated_server_step(g_settings,
+			"dedicated_server_step");
 
-	if (g_settings->getBool("liquid_finite"))
+	if (liquid_finite.get())
 		return Map::transformLiquidsFinite(modified_blocks);
 
 	INodeDefManager *nodemgr = m_gamedef->ndef();
@@ -2083,10 +2167,11 @@ s32 Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	// list of nodes that due to viscosity have not reached their max level height
 	UniqueQueue<v3s16> must_reflow;
 
-	// List of MapBlocks that will require a lighting update (due to lava)
-	std::map<v3s16, MapBlock*> lighting_modified_blocks;
+	// Nodes that will require a lighting update (due to lava), with
+	// the nodes they replaced
+	std::vector<std::pair<v3s16, MapNode> > lighting_changed;
 
-	u32 end_ms = porting::getTimeMs() + 1000 * g_settings->getFloat("dedicated_server_step");
+	u32 end_ms = porting::getTimeMs() + 1000 * dedicated_server_step.get();
 
 	while(m_transforming_liquid.size() != 0)
 	{
@@ -2318,10 +2403,10 @@ s32 Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 		MapBlock *block = getBlockNoCreateNoEx(blockpos);
 		if(block != NULL) {
 			modified_blocks[blockpos] =  block;
-			// If new or old node emits light, MapBlock requires lighting update
+			// If new or old node emits light, it requires lighting update
 			if(nodemgr->get(n0).light_source != 0 ||
 					nodemgr->get(n00).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
+				lighting_changed.push_back(std::make_pair(p0, n00));
 		}
 
 		/*
@@ -2352,7 +2437,7 @@ s32 Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 
 	while (must_reflow.size() > 0)
 		m_transforming_liquid.push_back(must_reflow.pop_front());
-	updateLighting(lighting_modified_blocks, modified_blocks);
+	updateLightingNodes(lighting_changed, modified_blocks);
 
 	return ret;
 }
@@ -2542,6 +2627,16 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 			throw BaseException("Unknown map backend");
 	}
 
+	// The dummy backend is not thread safe
+	m_db_thread_safe = conf.get("backend") != "dummy";
+	m_save_serial = 0;
+	m_saver = NULL;
+	m_save_batch_started = false;
+	if(g_settings->getBool("map_saving_thread") && m_db_thread_safe){
+		m_saver = new MapSaverThread(dbase);
+		m_saver->Start();
+	}
+
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
 
@@ -2631,8 +2726,15 @@ ServerMap::~ServerMap()
 	}
 
 	/*
-		Close database if it was opened
+		Write out everything still queued and close database if it
+		was opened
 	*/
+	if(m_saver)
+	{
+		m_saver->stopAndFlush();
+		delete m_saver;
+		m_saver = NULL;
+	}
 	delete(dbase);
 
 #if 0
@@ -2650,19 +2752,26 @@ ServerMap::~ServerMap()
 	delete m_mgparams;
 }
 
-bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos)
+void ServerMap::getChunkArea(v3s16 blockpos,
+		v3s16 &blockpos_min, v3s16 &blockpos_max)
 {
-	bool enable_mapgen_debug_info = m_emerge->mapgen_debug_info;
-	EMERGE_DBG_OUT("initBlockMake(): " PP(blockpos) " - " PP(blockpos));
-
 	s16 chunksize = m_mgparams->chunksize;
 	s16 coffset = -chunksize / 2;
 	v3s16 chunk_offset(coffset, coffset, coffset);
 	v3s16 blockpos_div = getContainerPos(blockpos - chunk_offset, chunksize);
-	v3s16 blockpos_min = blockpos_div * chunksize;
-	v3s16 blockpos_max = blockpos_div * chunksize + v3s16(1,1,1)*(chunksize-1);
+	blockpos_min = blockpos_div * chunksize;
+	blockpos_max = blockpos_div * chunksize + v3s16(1,1,1)*(chunksize-1);
 	blockpos_min += chunk_offset;
 	blockpos_max += chunk_offset;
+}
+
+bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos)
+{
+	bool enable_mapgen_debug_info = m_emerge->mapgen_debug_info;
+	EMERGE_DBG_OUT("initBlockMake(): " PP(blockpos) " - " PP(blockpos));
+
+	v3s16 blockpos_min, blockpos_max;
+	getChunkArea(blockpos, blockpos_min, blockpos_max);
 
 	v3s16 extra_borders(1,1,1);
 
@@ -3490,6 +3599,16 @@ void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
 				<<"all blocks that are stored in flat files"<<std::endl;
 	}
 	dbase->listAllLoadableBlocks(dst);
+
+	// Add blocks that are only in the write queue yet
+	if(m_saver)
+	{
+		std::set<v3s16> queued;
+		m_saver->getQueuedPositions(queued);
+		for(std::list<v3s16>::iterator i = dst.begin(); i != dst.end(); ++i)
+			queued.erase(*i);
+		dst.insert(dst.end(), queued.begin(), queued.end());
+	}
 }
 
 void ServerMap::listAllLoadedBlocks(std::list<v3s16> &dst)
@@ -3775,16 +3894,69 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 #endif
 
 void ServerMap::beginSave() {
+	if(m_saver){
+		// The saver thread makes its own transactions
+		m_save_batch_started = true;
+		return;
+	}
 	dbase->beginSave();
 }
 
 void ServerMap::endSave() {
+	if(m_saver){
+		m_save_batch_started = false;
+		remodifyFailedSaves();
+		m_saver->trigger();
+		g_profiler->avg("MapSaver: queued blocks", m_saver->getQueueSize());
+		return;
+	}
 	dbase->endSave();
 }
 
 void ServerMap::saveBlock(MapBlock *block)
 {
-  dbase->saveBlock(block);
+	// Data read by readBlocks() before this may now be outdated
+	m_save_serial++;
+	if(!m_chunks_not_in_db.empty())
+	{
+		v3s16 blockpos_min, blockpos_max;
+		getChunkArea(block->getPos(), blockpos_min, blockpos_max);
+		m_chunks_not_in_db.erase(blockpos_min);
+	}
+
+	if(m_saver == NULL){
+		dbase->saveBlock(block);
+		return;
+	}
+
+	// Dummy blocks are not written
+	if(block->isDummy())
+		return;
+
+	// The saver serializes and compresses the copy
+	MapBlockDiskCopy copy;
+	block->copyForDisk(copy, SER_FMT_VER_HIGHEST_WRITE);
+	m_saver->enqueue(block->getPos(), copy);
+	// The saver keeps the copy until it is written; if writing fails,
+	// remodifyFailedSaves() marks the block modified again
+	block->resetModified();
+
+	if(!m_save_batch_started){
+		remodifyFailedSaves();
+		m_saver->trigger();
+	}
+}
+
+void ServerMap::remodifyFailedSaves()
+{
+	std::vector<v3s16> failed;
+	m_saver->takeFailed(failed);
+	for(u32 i=0; i<failed.size(); i++)
+	{
+		MapBlock *block = getBlockNoCreateNoEx(failed[i]);
+		if(block)
+			block->raiseModified(MOD_STATE_WRITE_NEEDED, "failed to save");
+	}
 }
 
 void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load)
@@ -3940,6 +4112,15 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	MapBlock *ret;
 
+	// Data waiting to be written is newer than the database
+	std::string blob;
+	if(m_saver && m_saver->getQueued(blockpos, blob))
+	{
+		MapSector *sector = createSector(p2d);
+		loadBlock(&blob, blockpos, sector);
+		return getBlockNoCreateNoEx(blockpos);
+	}
+
 	ret = dbase->loadBlock(blockpos);
 	if (ret) return (ret);
 	// Not found in database, try the files
@@ -4000,6 +4181,95 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	return getBlockNoCreateNoEx(blockpos);
 }
 
+void ServerMap::listChunkBlocksToRead(v3s16 blockpos,
+		std::vector<v3s16> &dst)
+{
+	if(!m_db_thread_safe)
+		return;
+
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block && !block->isDummy() && block->isGenerated())
+		return;
+
+	v3s16 blockpos_min, blockpos_max;
+	getChunkArea(blockpos, blockpos_min, blockpos_max);
+	if(m_chunks_not_in_db.count(blockpos_min))
+		return;
+
+	v3s16 p;
+	for(p.Z=blockpos_min.Z; p.Z<=blockpos_max.Z; p.Z++)
+	for(p.Y=blockpos_min.Y; p.Y<=blockpos_max.Y; p.Y++)
+	for(p.X=blockpos_min.X; p.X<=blockpos_max.X; p.X++)
+	{
+		block = getBlockNoCreateNoEx(p);
+		if(block == NULL || block->isDummy())
+			dst.push_back(p);
+	}
+}
+
+void ServerMap::readBlocks(const std::vector<v3s16> &blockpos,
+		std::map<v3s16, std::string> &dst)
+{
+	DSTACK(__FUNCTION_NAME);
+	ScopeProfiler sp(g_profiler, "ServerMap: readBlocks", SPT_AVG);
+
+	// Data waiting to be written is newer than the database
+	std::vector<v3s16> from_db;
+	for(std::vector<v3s16>::const_iterator
+			i = blockpos.begin();
+			i != blockpos.end(); ++i)
+	{
+		std::string blob;
+		if(m_saver && m_saver->getQueued(*i, blob))
+			dst[*i] = blob;
+		else
+			from_db.push_back(*i);
+	}
+
+	if(!from_db.empty())
+		dbase->loadBlocks(from_db, dst);
+}
+
+bool ServerMap::loadBlocks(v3s16 blockpos,
+		std::map<v3s16, std::string> &data, u32 save_serial)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	if(save_serial != m_save_serial)
+		return false;
+
+	if(data.empty())
+	{
+		// Only grows with chunks that are read but never generated
+		if(m_chunks_not_in_db.size() > 10000)
+			m_chunks_not_in_db.clear();
+		v3s16 blockpos_min, blockpos_max;
+		getChunkArea(blockpos, blockpos_min, blockpos_max);
+		m_chunks_not_in_db.insert(blockpos_min);
+		return true;
+	}
+
+	for(std::map<v3s16, std::string>::iterator
+			i = data.begin();
+			i != data.end(); ++i)
+	{
+		v3s16 p = i->first;
+		// Loaded by someone else in the meantime
+		MapBlock *block = getBlockNoCreateNoEx(p);
+		if(block && !block->isDummy())
+			continue;
+
+		MapSector *sector = createSector(v2s16(p.X, p.Z));
+		loadBlock(&i->second, p, sector);
+
+		block = getBlockNoCreateNoEx(p);
+		if(block && block->isGenerated())
+			prepareBlock(block);
+	}
+	g_profiler->add("ServerMap: prefetched blocks", data.size());
+	return true;
+}
+
 void ServerMap::PrintInfo(std::ostream &out)
 {
 	out<<"ServerMap: ";
@@ -4022,6 +4292,8 @@ s16 ServerMap::updateBlockHeat(ServerEnvironment *env, v3s16 p, MapBlock *block)
 	//		env->getTimeOfDayF(), gametime * env->getTimeOfDaySpeed(), env->m_use_weather);
 
 	if(block) {
+		if(block->heat != (s16)heat)
+			block->raiseChanged();
 		block->heat = heat;
 		//block->humidity = humidity;
 		if (env->m_use_weather)
@@ -4050,6 +4322,8 @@ s16 ServerMap::updateBlockHumidity(ServerEnvironment *env, v3s16 p, MapBlock *bl
 			
 	if(block) {
 		//block->heat = heat;
+		if(block->humidity != (s16)humidity)
+			block->raiseChanged();
 		block->humidity = humidity;
 		if (env->m_use_weather)
 			block->humidity_last_update = gametime + 10;
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <map>
 #include <list>
+#include <vector>
 
 #include "irrlichttypes_bloated.h"
 #include "mapnode.h"
@@ -46,6 +47,9 @@ class EmergeManager;
 class ServerEnvironment;
 struct BlockMakeData;
 struct MapgenParams;
+class MapSaverThread;
+class LiquidUpdater;
+class LiquidThread;
 
 
 /*
@@ -202,28 +206,28 @@ class Map /*: public NodeContainer*/
 	// Returns a CONTENT_IGNORE node if not found
 	MapNode getNodeNoEx(v3s16 p);
 
-	void unspreadLight(enum LightBank bank,
-			std::map<v3s16, u8> & from_nodes,
-			std::set<v3s16> & light_sources,
-			std::map<v3s16, MapBlock*> & modified_blocks);
-
-	void unLightNeighbors(enum LightBank bank,
-			v3s16 pos, u8 lightwas,
-			std::set<v3s16> & light_sources,
-			std::map<v3s16, MapBlock*> & modified_blocks);
-
-	void spreadLight(enum LightBank bank,
-			std::set<v3s16> & from_nodes,
-			std::map<v3s16, MapBlock*> & modified_blocks);
+	/*
+		Bulk node queries for the scripting API. These go through the
+		nodes one block at a time and skip blocks that have none of the
+		wanted contents. Nodes of blocks that are not loaded are
+		CONTENT_IGNORE.
+	*/
 
-	void lightNeighbors(enum LightBank bank,
-			v3s16 pos,
-			std::map<v3s16, MapBlock*> & modified_blocks);
+	// Finds the nodes in minp...maxp with a content in filter, in the
+	// order of going through the area by X, then Y, then Z
+	void findNodesInArea(v3s16 minp, v3s16 maxp,
+			const std::set<content_t> &filter, std::vector<v3s16> &result);
 
-	v3s16 getBrightestNeighbour(enum LightBank bank, v3s16 p);
+	// Counts the nodes in minp...maxp by content; only the contents in
+	// filter unless it is empty
+	void countNodesInArea(v3s16 minp, v3s16 maxp,
+			const std::set<content_t> &filter,
+			std::map<content_t, u32> &result);
 
-	s16 propagateSunlight(v3s16 start,
-			std::map<v3s16, MapBlock*> & modified_blocks);
+	// Finds the first node with a content in filter in the order of
+	// getFacePositions() for distances 1...radius from pos
+	bool findNodeNear(v3s16 pos, s16 radius,
+			const std::set<content_t> &filter, v3s16 &result);
 
 	void updateLighting(enum LightBank bank,
 			std::map<v3s16, MapBlock*>  & a_blocks,
@@ -232,6 +236,15 @@ class Map /*: public NodeContainer*/
 	void updateLighting(std::map<v3s16, MapBlock*>  & a_blocks,
 			std::map<v3s16, MapBlock*> & modified_blocks);
 
+	/*
+		Relights around nodes that have been changed with setNode();
+		oldnodes holds their positions and the nodes they replaced.
+		Any number of changes is relit in one pass per light bank.
+	*/
+	void updateLightingNodes(
+			const std::vector<std::pair<v3s16, MapNode> > &oldnodes,
+			std::map<v3s16, MapBlock*> & modified_blocks);
+
 	/*
 		These handle lighting but not faces.
 	*/
@@ -297,6 +310,9 @@ class Map /*: public NodeContainer*/
 
 	// For debug printing. Prints "Map: ", "ServerMap: " or "ClientMap: "
 	virtual void PrintInfo(std::ostream &out);
+	// Prints the memory used by the nodes of the loaded blocks, as
+	// counted by the last timerUpdate()
+	void printBlockMemoryInfo(std::ostream &out);
 
 	s32 transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks);
 	s32 transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks);
@@ -355,6 +371,18 @@ class Map /*: public NodeContainer*/
 
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+
+	void stopLiquidThreads();
+
+	// For transformLiquidsFinite(), created on first use
+	LiquidUpdater *m_liquid_updater;
+	std::vector<LiquidThread*> m_liquid_threads;
+
+	// Counted in timerUpdate(), see printBlockMemoryInfo()
+	u32 m_block_count;
+	u32 m_compact_block_count;
+	u32 m_uniform_block_count;
+	u64 m_block_node_bytes;
 };
 
 /*
@@ -389,6 +417,9 @@ class ServerMap : public Map
 		Blocks are generated by using these and makeBlock().
 	*/
 	bool initBlockMake(BlockMakeData *data, v3s16 blockpos);
+	// The area of the mapgen chunk that contains the block
+	void getChunkArea(v3s16 blockpos,
+			v3s16 &blockpos_min, v3s16 &blockpos_max);
 	MapBlock *finishBlockMake(BlockMakeData *data,
 			std::map<v3s16, MapBlock*> &changed_blocks);
 
@@ -472,6 +503,29 @@ class ServerMap : public Map
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Loading the blocks of a whole chunk at once, reading the
+		database without holding the environment lock:
+		- listChunkBlocksToRead() and getSaveSerial() with the lock
+		- readBlocks() without the lock
+		- loadBlocks() with the lock; it does nothing and returns
+		  false if any block has been saved since getSaveSerial(),
+		  because the data read may then be outdated.
+		A chunk of which nothing was found is not listed again until
+		one of its blocks is saved, so that emerging ungenerated chunks
+		doesn't read the database for nothing every time.
+	*/
+	// Adds the blocks of the chunk of blockpos that are not in memory,
+	// or nothing if blockpos is loaded already, the chunk is not in the
+	// database or the database is not thread safe
+	void listChunkBlocksToRead(v3s16 blockpos, std::vector<v3s16> &dst);
+	u32 getSaveSerial(){ return m_save_serial; }
+	void readBlocks(const std::vector<v3s16> &blockpos,
+			std::map<v3s16, std::string> &dst);
+	// blockpos is the one given to listChunkBlocksToRead()
+	bool loadBlocks(v3s16 blockpos, std::map<v3s16, std::string> &data,
+			u32 save_serial);
+
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
 
@@ -517,6 +571,25 @@ class ServerMap : public Map
 	*/
 	bool m_map_metadata_changed;
 	Database *dbase;
+	// Can be read from other threads than the one writing to it
+	bool m_db_thread_safe;
+	// Incremented by saveBlock()
+	u32 m_save_serial;
+	// Minimum blocks of the chunks that have no blocks in the database,
+	// see listChunkBlocksToRead()
+	std::set<v3s16> m_chunks_not_in_db;
+
+	// Marks the loaded blocks that m_saver failed to write modified
+	void remodifyFailedSaves();
+
+	/*
+		Writes blocks to dbase in the background if not NULL.
+		saveBlock() queues a copy of the block for it and endSave()
+		starts writing the queued blocks.
+	*/
+	MapSaverThread *m_saver;
+	// Set between beginSave() and endSave()
+	bool m_save_batch_started;
 };
 
 #define VMANIP_BLOCK_DATA_INEXIST     1
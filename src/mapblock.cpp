@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <algorithm>
 #include "map.h"
 #include "light.h"
 #include "nodedef.h"
@@ -35,6 +36,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #endif
 #include "util/string.h"
 #include "util/serialize.h"
+#include "main.h" // For g_settings
+#include "settings.h"
+#include <string.h>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -50,9 +54,15 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_parent(parent),
 		m_pos(pos),
 		m_gamedef(gamedef),
+		m_index_bits(0),
+		m_compact_failed_serial(0),
+		m_compact_failed(false),
 		m_modified(MOD_STATE_WRITE_NEEDED),
 		m_modified_reason("initial"),
 		m_modified_reason_too_long(false),
+		m_changed_serial(0),
+		m_contents_serial(0),
+		m_contents_valid(false),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
@@ -70,6 +80,8 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 #ifndef SERVER
 	//mesh_mutex.Init();
 	mesh = NULL;
+	occluded = false;
+	occluded_serial = 0;
 #endif
 }
 
@@ -110,9 +122,7 @@ MapNode MapBlock::getNodeParent(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return getNodeNoCheck(p);
 	}
 }
 
@@ -124,9 +134,7 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	}
 	else
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		setNodeAt(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X, n);
 	}
 }
 
@@ -144,11 +152,11 @@ MapNode MapBlock::getNodeParentNoEx(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 		{
 			return MapNode(CONTENT_IGNORE);
 		}
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return getNodeNoCheck(p);
 	}
 }
 
@@ -348,6 +356,14 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
 	// Copy from data to VoxelManipulator
+	if(data == NULL && isCompact())
+	{
+		MapNode nodes[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		copyNodesTo(nodes);
+		dst.copyFrom(nodes, data_area, v3s16(0,0,0),
+				getPosRelative(), data_size);
+		return;
+	}
 	dst.copyFrom(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
 }
@@ -358,8 +374,12 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
 	// Copy from VoxelManipulator to data
+	if(data == NULL)
+		expand();
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	raiseChanged();
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -368,20 +388,29 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
 	}
 
+	// A compact block has each of its different nodes in the palette
+	MapNode *nodes = data;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data == NULL)
+	{
+		nodes = &m_palette[0];
+		nodecount = m_palette.size();
+	}
+
 	bool differs = false;
 
 	/*
 		Check if any lighting value differs
 	*/
-	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	for(u32 i=0; i<nodecount; i++)
 	{
-		MapNode &n = data[i];
+		MapNode &n = nodes[i];
 		if(n.getLight(LIGHTBANK_DAY, nodemgr) != n.getLight(LIGHTBANK_NIGHT, nodemgr))
 		{
 			differs = true;
@@ -396,9 +425,9 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	if(differs)
 	{
 		bool only_air = true;
-		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+		for(u32 i=0; i<nodecount; i++)
 		{
-			MapNode &n = data[i];
+			MapNode &n = nodes[i];
 			if(n.getContent() != CONTENT_AIR)
 			{
 				only_air = false;
@@ -417,7 +446,7 @@ void MapBlock::expireDayNightDiff()
 {
 	//INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -426,6 +455,60 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+const std::vector<content_t> & MapBlock::getContents()
+{
+	if(m_contents_valid && m_contents_serial == m_changed_serial)
+		return m_contents;
+
+	m_contents.clear();
+	m_contents_serial = m_changed_serial;
+	m_contents_valid = true;
+	if(isDummy())
+		return m_contents;
+
+	if(data == NULL)
+	{
+		for(u32 i=0; i<m_palette.size(); i++)
+			m_contents.push_back(m_palette[i].getContent());
+		std::sort(m_contents.begin(), m_contents.end());
+		m_contents.erase(std::unique(m_contents.begin(), m_contents.end()),
+				m_contents.end());
+		return m_contents;
+	}
+
+	// Blocks usually have only a few contents that come in long runs
+	content_t last = CONTENT_IGNORE;
+	bool have_last = false;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		content_t c = data[i].getContent();
+		if(have_last && c == last)
+			continue;
+		last = c;
+		have_last = true;
+		std::vector<content_t>::iterator j = std::lower_bound(
+				m_contents.begin(), m_contents.end(), c);
+		if(j == m_contents.end() || *j != c)
+			m_contents.insert(j, c);
+	}
+	return m_contents;
+}
+
+bool MapBlock::isFullyOpaque()
+{
+	if(isDummy())
+		return false;
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+	const std::vector<content_t> &contents = getContents();
+	for(u32 i=0; i<contents.size(); i++)
+	{
+		if(nodemgr->get(contents[i]).drawtype != NDT_NORMAL)
+			return false;
+	}
+	return true;
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -435,7 +518,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNodeNoCheck(p2d.X, y, p2d.Y);
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -547,12 +630,26 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	}
 }
 
+u8 MapBlock::getFlags()
+{
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(getDayNightDiff())
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(m_generated == false)
+		flags |= 0x08;
+	return flags;
+}
+
 void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -563,44 +660,34 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		throw SerializationError("MapBlock::serialize: serialization to "
 				"version < 24 not possible");
 		
+	if(disk)
+	{
+		MapBlockDiskCopy copy;
+		copyForDisk(copy, version);
+		serializeDiskCopy(os, copy);
+		return;
+	}
+
 	// First byte
-	u8 flags = 0;
-	if(is_underground)
-		flags |= 0x01;
-	if(getDayNightDiff())
-		flags |= 0x02;
-	if(m_lighting_expired)
-		flags |= 0x04;
-	if(m_generated == false)
-		flags |= 0x08;
-	writeU8(os, flags);
+	writeU8(os, getFlags());
 	
 	/*
 		Bulk node data
 	*/
-	NameIdMapping nimap;
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-	if(disk)
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	if(data == NULL)
 	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
-		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
-
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
+		MapNode nodes[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		copyNodesTo(nodes);
+		MapNode::serializeBulk(os, version, nodes, nodecount,
 				content_width, params_width, true);
-		delete[] tmp_nodes;
 	}
 	else
 	{
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
 		MapNode::serializeBulk(os, version, data, nodecount,
 				content_width, params_width, true);
 	}
@@ -611,36 +698,86 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	std::ostringstream oss(std::ios_base::binary);
 	m_node_metadata.serialize(oss);
 	compressZlib(oss.str(), os);
+}
+
+void MapBlock::copyForDisk(MapBlockDiskCopy &dst, u8 version)
+{
+	if(isDummy())
+		throw SerializationError("ERROR: Not writing dummy block.");
+
+	dst.version = version;
+	dst.flags = getFlags();
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	dst.nodes.resize(nodecount);
+	copyNodesTo(&dst.nodes[0]);
+	NameIdMapping nimap;
+	getBlockNodeIdMapping(&nimap, &dst.nodes[0], m_gamedef->ndef());
+	std::ostringstream os_nimap(std::ios_base::binary);
+	nimap.serialize(os_nimap);
+	dst.name_id_mapping = os_nimap.str();
+
+	std::ostringstream os_meta(std::ios_base::binary);
+	m_node_metadata.serialize(os_meta);
+	dst.node_metadata = os_meta.str();
+
+	std::ostringstream os_timers(std::ios_base::binary);
+	m_node_timers.serialize(os_timers, version);
+	dst.node_timers = os_timers.str();
+
+	std::ostringstream os_objects(std::ios_base::binary);
+	m_static_objects.serialize(os_objects);
+	dst.static_objects = os_objects.str();
+
+	dst.timestamp = getTimestamp();
+}
+
+void MapBlock::serializeDiskCopy(std::ostream &os, const MapBlockDiskCopy &src)
+{
+	// First byte
+	writeU8(os, src.flags);
+
+	/*
+		Bulk node data
+	*/
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	MapNode::serializeBulk(os, src.version, &src.nodes[0], src.nodes.size(),
+			content_width, params_width, true);
+
+	/*
+		Node metadata
+	*/
+	compressZlib(src.node_metadata, os);
 
 	/*
 		Data that goes to disk, but not the network
 	*/
-	if(disk)
-	{
-		if(version <= 24){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+	if(src.version <= 24){
+		// Node timers
+		os<<src.node_timers;
+	}
 
-		// Static objects
-		m_static_objects.serialize(os);
+	// Static objects
+	os<<src.static_objects;
 
-		// Timestamp
-		writeU32(os, getTimestamp());
+	// Timestamp
+	writeU32(os, src.timestamp);
 
-		// Write block-specific node definition id mapping
-		nimap.serialize(os);
-		
-		if(version >= 25){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+	// Write block-specific node definition id mapping
+	os<<src.name_id_mapping;
+
+	if(src.version >= 25){
+		// Node timers
+		os<<src.node_timers;
 	}
 }
 
 void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 {
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -660,11 +797,16 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
 
+	raiseChanged();
 	m_day_night_differs_expired = false;
 
+	if(data == NULL)
+		expand();
+
 	if(version <= 21)
 	{
 		deSerialize_pre22(is, version, disk);
+		compactLoaded();
 		return;
 	}
 
@@ -754,6 +896,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		}
 	}
 		
+	compactLoaded();
+
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Done."<<std::endl);
 }
@@ -1011,6 +1155,117 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 
 }
 
+void MapBlock::copyNodesTo(MapNode *dst)
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data != NULL)
+	{
+		std::copy(data, data + nodecount, dst);
+	}
+	else if(m_index_bits == 0)
+	{
+		for(u32 i=0; i<nodecount; i++)
+			dst[i] = m_palette[0];
+	}
+	else
+	{
+		for(u32 i=0; i<nodecount; i++)
+			dst[i] = getCompactNode(i);
+	}
+}
+
+void MapBlock::clearCompact()
+{
+	std::vector<MapNode>().swap(m_palette);
+	std::vector<u8>().swap(m_indices);
+	m_index_bits = 0;
+}
+
+bool MapBlock::compact()
+{
+	if(data == NULL)
+		return false;
+	// Don't retry a block that didn't fit until it changes
+	if(m_compact_failed && m_compact_failed_serial == m_changed_serial)
+		return false;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	std::vector<MapNode> palette;
+	std::vector<u8> indices(nodecount);
+	palette.push_back(data[0]);
+	// Nodes come in long runs, so the last index is tried first
+	u32 last = 0;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		if(!(palette[last] == data[i]))
+		{
+			for(last=0; last<palette.size(); last++)
+				if(palette[last] == data[i])
+					break;
+			if(last == palette.size())
+			{
+				if(palette.size() == 256)
+				{
+					m_compact_failed = true;
+					m_compact_failed_serial = m_changed_serial;
+					return false;
+				}
+				palette.push_back(data[i]);
+			}
+		}
+		indices[i] = last;
+	}
+
+	u8 bits = 8;
+	if(palette.size() == 1)
+		bits = 0;
+	else if(palette.size() <= 2)
+		bits = 1;
+	else if(palette.size() <= 4)
+		bits = 2;
+	else if(palette.size() <= 16)
+		bits = 4;
+
+	m_indices.assign(nodecount * bits / 8, 0);
+	for(u32 i=0; bits != 0 && i<nodecount; i++)
+	{
+		u32 bit = i * bits;
+		m_indices[bit >> 3] |= indices[i] << (bit & 7);
+	}
+	m_index_bits = bits;
+	// Copy to drop the extra capacity
+	std::vector<MapNode>(palette).swap(m_palette);
+
+	delete[] data;
+	data = NULL;
+	m_compact_failed = false;
+	return true;
+}
+
+void MapBlock::expand()
+{
+	if(!isCompact())
+		return;
+	MapNode *nodes = new MapNode[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	copyNodesTo(nodes);
+	clearCompact();
+	data = nodes;
+}
+
+void MapBlock::compactLoaded()
+{
+	static SettingHandle<bool> compact_mapblocks(g_settings, "compact_mapblocks");
+	if(compact_mapblocks.get())
+		compact();
+}
+
+u32 MapBlock::getNodeMemoryUsage()
+{
+	if(data != NULL)
+		return MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE * sizeof(MapNode);
+	return m_palette.size() * sizeof(MapNode) + m_indices.size();
+}
+
 void MapBlock::incrementUsageTimer(float dtime)
 {
 	m_usage_timer += dtime;
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAPBLOCK_HEADER
 
 #include <set>
+#include <vector>
 #include "debug.h"
 #include "irr_v3d.h"
 #include "mapnode.h"
@@ -97,6 +98,27 @@ class NodeContainer
 };
 #endif
 
+/*
+	What MapBlock::serialize() writes to disk, copied from a block by
+	MapBlock::copyForDisk(). Writing it in the disk format, which packs
+	and compresses the nodes and metadata, is done by
+	MapBlock::serializeDiskCopy(). That needs neither the block nor the
+	node definitions, so it can run in another thread.
+*/
+struct MapBlockDiskCopy
+{
+	u8 version;
+	u8 flags;
+	// With the block-specific ids of name_id_mapping
+	std::vector<MapNode> nodes;
+	std::string name_id_mapping;
+	// Serialized but not compressed
+	std::string node_metadata;
+	std::string node_timers;
+	std::string static_objects;
+	u32 timestamp;
+};
+
 /*
 	MapBlock itself
 */
@@ -119,6 +141,7 @@ class MapBlock /*: public NodeContainer*/
 
 	void reallocate()
 	{
+		clearCompact();
 		if(data != NULL)
 			delete[] data;
 		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
@@ -136,7 +159,7 @@ class MapBlock /*: public NodeContainer*/
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_palette.empty());
 	}
 	void unDummify()
 	{
@@ -147,6 +170,7 @@ class MapBlock /*: public NodeContainer*/
 	// m_modified methods
 	void raiseModified(u32 mod, const std::string &reason="unknown")
 	{
+		raiseChanged();
 		if(mod > m_modified){
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -180,6 +204,55 @@ class MapBlock /*: public NodeContainer*/
 		m_modified_reason = "none";
 		m_modified_reason_too_long = false;
 	}
+
+	/*
+		Change serial; bumped on every change of the block contents,
+		including ones that don't need the block to be saved.
+		Used for validating caches of data derived from the block.
+	*/
+	void raiseChanged()
+	{
+		m_changed_serial++;
+	}
+	u32 getChangedSerial()
+	{
+		return m_changed_serial;
+	}
+
+	/*
+		The different contents of the nodes in the block, sorted.
+		Recalculated if the block has changed since the previous call.
+	*/
+	const std::vector<content_t> & getContents();
+
+	/*
+		True if all nodes are plain opaque cubes (drawtype normal), so
+		nothing behind the block can be seen through it.
+	*/
+	bool isFullyOpaque();
+
+	/*
+		Compact storage of the nodes, for blocks that are only read.
+
+		A compact block keeps its different nodes in a palette and the
+		palette index of every node packed in 0 (uniform block), 1, 2, 4
+		or 8 bits. Reading a compact block decodes the node, writing to
+		it expands it back to the plain node array first.
+	*/
+	// Returns true if the block was made compact. Fails for dummy
+	// blocks and blocks of more than 256 different nodes.
+	bool compact();
+	void expand();
+	bool isCompact()
+	{
+		return !m_palette.empty();
+	}
+	bool isUniform()
+	{
+		return m_palette.size() == 1;
+	}
+	// Bytes used for the nodes of the block
+	u32 getNodeMemoryUsage();
 	
 	// is_underground getter/setter
 	bool getIsUnderground()
@@ -220,7 +293,7 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -253,7 +326,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	bool isValidPosition(v3s16 p)
 	{
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return (p.X >= 0 && p.X < MAP_BLOCKSIZE
 				&& p.Y >= 0 && p.Y < MAP_BLOCKSIZE
@@ -262,12 +335,10 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNode(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return getNodeNoCheck(x, y, z);
 	}
 	
 	MapNode getNode(v3s16 p)
@@ -286,12 +357,10 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -306,9 +375,7 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNodeNoCheck(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return getNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	MapNode getNodeNoCheck(v3s16 p)
@@ -318,9 +385,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		setNodeAt(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -329,6 +394,34 @@ class MapBlock /*: public NodeContainer*/
 		setNodeNoCheck(p.X, p.Y, p.Z, n);
 	}
 
+	/*
+		By index z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x.
+		Reading doesn't expand a compact block, writing only does if the
+		node changes. setNodeAt() doesn't call raiseModified().
+	*/
+
+	MapNode getNodeAt(u32 i)
+	{
+		if(data != NULL)
+			return data[i];
+		if(m_palette.empty())
+			throw InvalidPositionException();
+		return getCompactNode(i);
+	}
+
+	void setNodeAt(u32 i, MapNode &n)
+	{
+		if(data == NULL)
+		{
+			if(m_palette.empty())
+				throw InvalidPositionException();
+			if(getCompactNode(i) == n)
+				return;
+			expand();
+		}
+		data[i] = n;
+	}
+
 	/*
 		These functions consult the parent container if the position
 		is not valid on this MapBlock.
@@ -466,6 +559,10 @@ class MapBlock /*: public NodeContainer*/
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
 	void serialize(std::ostream &os, u8 version, bool disk);
+	// serialize(os, version, true) in two steps, see MapBlockDiskCopy
+	void copyForDisk(MapBlockDiskCopy &dst, u8 version);
+	static void serializeDiskCopy(std::ostream &os,
+			const MapBlockDiskCopy &src);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
 	void deSerialize(std::istream &is, u8 version, bool disk);
@@ -479,6 +576,24 @@ class MapBlock /*: public NodeContainer*/
 	*/
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
+	// The first byte of the serialized block
+	u8 getFlags();
+
+	// Copies all nodes of a non-dummy block to dst
+	void copyNodesTo(MapNode *dst);
+	void clearCompact();
+	// Compacts a block that was just loaded if compact_mapblocks is set
+	void compactLoaded();
+
+	MapNode getCompactNode(u32 i)
+	{
+		if(m_index_bits == 0)
+			return m_palette[0];
+		u32 bit = i * m_index_bits;
+		u8 index = (m_indices[bit >> 3] >> (bit & 7))
+				& ((1 << m_index_bits) - 1);
+		return m_palette[index];
+	}
 
 	/*
 		Used only internally, because changes can't be tracked
@@ -486,6 +601,8 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode & getNodeRef(s16 x, s16 y, s16 z)
 	{
+		if(data == NULL)
+			expand();
 		if(data == NULL)
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
@@ -505,6 +622,14 @@ class MapBlock /*: public NodeContainer*/
 
 #ifndef SERVER // Only on client
 	MapBlockMesh *mesh;
+	/*
+		Result of the last occlusion test in ClientMap::updateDrawList().
+		It holds while the camera is in the same node and the serial
+		matches ClientMap's occlusion serial.
+	*/
+	bool occluded;
+	v3s16 occluded_camera_pos;
+	u32 occluded_serial;
 #endif
 	
 	NodeMetadataList m_node_metadata;
@@ -529,11 +654,20 @@ class MapBlock /*: public NodeContainer*/
 	IGameDef *m_gamedef;
 	
 	/*
-		If NULL, block is a dummy block.
+		If NULL and the block is not compact, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode * data;
 
+	// Compact storage, see compact(). The palette is empty if the
+	// block is not compact.
+	std::vector<MapNode> m_palette;
+	std::vector<u8> m_indices;
+	u8 m_index_bits;
+	// m_changed_serial when compact() last failed
+	u32 m_compact_failed_serial;
+	bool m_compact_failed;
+
 	/*
 		- On the server, this is used for telling whether the
 		  block has been modified from the one on disk.
@@ -543,6 +677,14 @@ class MapBlock /*: public NodeContainer*/
 	std::string m_modified_reason;
 	bool m_modified_reason_too_long;
 
+	// See raiseChanged()
+	u32 m_changed_serial;
+
+	// See getContents()
+	std::vector<content_t> m_contents;
+	u32 m_contents_serial;
+	bool m_contents_valid;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
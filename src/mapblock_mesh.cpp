@@ -51,6 +51,7 @@ MeshMakeData::MeshMakeData(IGameDef *gamedef):
 	m_blockpos(-1337,-1337,-1337),
 	m_crack_pos_relative(-1337, -1337, -1337),
 	m_smooth_lighting(false),
+	m_low_detail(false),
 	m_gamedef(gamedef)
 {}
 
@@ -141,6 +142,11 @@ void MeshMakeData::setSmoothLighting(bool smooth_lighting)
 	m_smooth_lighting = smooth_lighting;
 }
 
+void MeshMakeData::setLowDetail(bool low_detail)
+{
+	m_low_detail = low_detail;
+}
+
 /*
 	Light and vertex color functions
 */
@@ -809,7 +815,7 @@ static void getTileInfo(
 	if(equivalent)
 		tile.material_flags |= MATERIAL_FLAG_BACKFACE_CULLING;
 
-	if(data->m_smooth_lighting == false)
+	if(data->m_smooth_lighting == false || data->m_low_detail)
 	{
 		lights[0] = lights[1] = lights[2] = lights[3] =
 				getFaceLight(n0, n1, face_dir, data);
@@ -1032,8 +1038,10 @@ static void updateAllFastFaceRows(MeshMakeData *data,
 
 MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 	clearHardwareBuffer(false),
+	detailUpdateRequested(false),
 	m_mesh(new scene::SMesh()),
 	m_gamedef(data->m_gamedef),
+	m_low_detail(data->m_low_detail),
 	m_animation_force_timer(0), // force initial animation
 	m_last_crack(-1),
 	m_crack_materials(),
@@ -1111,8 +1119,14 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 	/*
 		Convert MeshCollector to SMesh
 	*/
-	bool enable_shaders = g_settings->getBool("enable_shaders");
-	bool enable_bumpmapping = g_settings->getBool("enable_bumpmapping");
+	static SettingHandle<bool> enable_shaders_setting(g_settings,
+			"enable_shaders");
+	static SettingHandle<bool> enable_bumpmapping_setting(g_settings,
+			"enable_bumpmapping");
+	static SettingHandle<bool> desynchronize_animation(g_settings,
+			"desynchronize_mapblock_texture_animation");
+	bool enable_shaders = enable_shaders_setting.get();
+	bool enable_bumpmapping = enable_bumpmapping_setting.get();
 
 	video::E_MATERIAL_TYPE  shadermat1, shadermat2, shadermat3, bumpmaps1, bumpmaps2;
 	shadermat1 = shadermat2 = shadermat3 = bumpmaps1 = bumpmaps2 = video::EMT_SOLID;
@@ -1159,7 +1173,7 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 			// Add to MapBlockMesh in order to animate these tiles
 			m_animation_tiles[i] = p.tile;
 			m_animation_frames[i] = 0;
-			if(g_settings->getBool("desynchronize_mapblock_texture_animation")){
+			if(desynchronize_animation.get()){
 				// Get starting position from noise
 				m_animation_frame_offsets[i] = 100000 * (2.0 + noise3d(
 						data->m_blockpos.X, data->m_blockpos.Y,
@@ -1282,6 +1296,12 @@ MapBlockMesh::MapBlockMesh(MeshMakeData *data):
 	
 	//std::cout<<"added "<<fastfaces.getSize()<<" faces."<<std::endl;
 
+	u32 triangle_count = 0;
+	for(u32 i = 0; i < collector.prebuffers.size(); i++)
+		triangle_count += collector.prebuffers[i].indices.size() / 3;
+	g_profiler->avg(m_low_detail ? "Meshgen: triangles (low detail)" :
+			"Meshgen: triangles", triangle_count);
+
 	// Check if animation is required for this mesh
 	m_has_animation =
 		!m_crack_materials.empty() ||
@@ -1302,7 +1322,8 @@ MapBlockMesh::~MapBlockMesh()
 
 void MapBlockMesh::setStatic()
 {
-	if(g_settings->getBool("enable_vbo")){
+	static SettingHandle<bool> enable_vbo(g_settings, "enable_vbo");
+	if(enable_vbo.get()){
 		m_mesh->setHardwareMappingHint(scene::EHM_STATIC);
 		clearHardwareBuffer = true;
 	}
@@ -1310,8 +1331,13 @@ void MapBlockMesh::setStatic()
 
 bool MapBlockMesh::animate(bool faraway, float time, int crack, u32 daynight_ratio)
 {
-	bool enable_shaders = g_settings->getBool("enable_shaders");
-	bool enable_bumpmapping = g_settings->getBool("enable_bumpmapping");
+	// Called for every drawn block on every frame
+	static SettingHandle<bool> enable_shaders_setting(g_settings,
+			"enable_shaders");
+	static SettingHandle<bool> enable_bumpmapping_setting(g_settings,
+			"enable_bumpmapping");
+	bool enable_shaders = enable_shaders_setting.get();
+	bool enable_bumpmapping = enable_bumpmapping_setting.get();
 	
 	if(!m_has_animation)
 	{
@@ -40,6 +40,7 @@ struct MeshMakeData
 	v3s16 m_blockpos;
 	v3s16 m_crack_pos_relative;
 	bool m_smooth_lighting;
+	bool m_low_detail;
 	IGameDef *m_gamedef;
 
 	MeshMakeData(IGameDef *gamedef);
@@ -64,6 +65,13 @@ struct MeshMakeData
 		Enable or disable smooth lighting
 	*/
 	void setSmoothLighting(bool smooth_lighting);
+
+	/*
+		Make a mesh for a block far away: without smooth lighting, so
+		that more faces are merged, and without small nodes like plants
+		and torches or the faces between leaves
+	*/
+	void setLowDetail(bool low_detail);
 };
 
 /*
@@ -120,11 +128,19 @@ class MapBlockMesh
 
 	void setStatic();
 
+	bool isLowDetail() const
+	{
+		return m_low_detail;
+	}
+
 	bool clearHardwareBuffer;
+	// Set when a mesh with the other level of detail has been queued
+	bool detailUpdateRequested;
 
 private:
 	scene::SMesh *m_mesh;
 	IGameDef *m_gamedef;
+	bool m_low_detail;
 
 	// Must animate() be called before rendering?
 	bool m_has_animation;
@@ -859,6 +859,7 @@ Mapgen::Mapgen() {
 	ndef        = NULL;
 	heightmap   = NULL;
 	biomemap    = NULL;
+	lighting_time_us = 0;
 }
 
 
@@ -988,7 +989,7 @@ void Mapgen::calcLighting(v3s16 nmin, v3s16 nmax) {
 	bool block_is_underground = (water_level >= nmax.Y);
 
 	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen lighting update", SPT_AVG);
-	//TimeTaker t("updateLighting");
+	TimeTaker t("updateLighting", &lighting_time_us, PRECISION_MICRO);
 
 	// first, send vertical rays of sunshine downward
 	v3s16 em = vm->m_area.getExtent();
@@ -102,6 +102,9 @@ class Mapgen {
 	u8 *biomemap;
 	v3s16 csize;
 
+	// Total time spent in calcLighting()
+	u32 lighting_time_us;
+
 	Mapgen();
 	virtual ~Mapgen() {}
 
@@ -55,9 +55,14 @@ MapNode::MapNode(INodeDefManager *ndef, const std::string &name,
 }
 
 void MapNode::setLight(enum LightBank bank, u8 a_light, INodeDefManager *nodemgr)
+{
+	setLight(bank, a_light, nodemgr->get(*this));
+}
+
+void MapNode::setLight(enum LightBank bank, u8 a_light, const ContentFeatures &f)
 {
 	// If node doesn't contain light data, ignore this
-	if(nodemgr->get(*this).param_type != CPT_LIGHT)
+	if(f.param_type != CPT_LIGHT)
 		return;
 	if(bank == LIGHTBANK_DAY)
 	{
@@ -74,9 +79,13 @@ void MapNode::setLight(enum LightBank bank, u8 a_light, INodeDefManager *nodemgr
 }
 
 u8 MapNode::getLight(enum LightBank bank, INodeDefManager *nodemgr) const
+{
+	return getLight(bank, nodemgr->get(*this));
+}
+
+u8 MapNode::getLight(enum LightBank bank, const ContentFeatures &f) const
 {
 	// Select the brightest of [light source, propagated light]
-	const ContentFeatures &f = nodemgr->get(*this);
 	u8 light = 0;
 	if(f.param_type == CPT_LIGHT)
 	{
@@ -28,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <vector>
 
 class INodeDefManager;
+struct ContentFeatures;
 
 /*
 	Naming scheme:
@@ -188,6 +189,9 @@ struct MapNode
 	
 	void setLight(enum LightBank bank, u8 a_light, INodeDefManager *nodemgr);
 	u8 getLight(enum LightBank bank, INodeDefManager *nodemgr) const;
+	// Same as above, with the features of the node already looked up
+	void setLight(enum LightBank bank, u8 a_light, const ContentFeatures &f);
+	u8 getLight(enum LightBank bank, const ContentFeatures &f) const;
 	bool getLightBanks(u8 &lightday, u8 &lightnight, INodeDefManager *nodemgr) const;
 	
 	// 0 <= daylight_factor <= 1000
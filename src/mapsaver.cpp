@@ -0,0 +1,185 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapsaver.h"
+#include "database.h"
+#include "main.h"
+#include "profiler.h"
+#include "log.h"
+#include "debug.h"
+
+MapSaverThread::MapSaverThread(Database *db):
+	SimpleThread(),
+	m_db(db)
+{
+	m_queue_mutex.Init();
+}
+
+MapSaverThread::~MapSaverThread()
+{
+	stopAndFlush();
+}
+
+void MapSaverThread::enqueue(v3s16 blockpos, const MapBlockDiskCopy &copy)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	m_queue[blockpos] = copy;
+}
+
+void MapSaverThread::trigger()
+{
+	m_queue_event.signal();
+}
+
+bool MapSaverThread::getQueued(v3s16 blockpos, std::string &data)
+{
+	MapBlockDiskCopy copy;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		std::map<v3s16, MapBlockDiskCopy>::iterator i = m_queue.find(blockpos);
+		if(i == m_queue.end()){
+			i = m_writing.find(blockpos);
+			if(i == m_writing.end())
+				return false;
+		}
+		copy = i->second;
+	}
+	// Serialize without blocking the saver
+	data = Database::serializeBlock(copy);
+	return true;
+}
+
+void MapSaverThread::takeFailed(std::vector<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	dst.insert(dst.end(), m_failed.begin(), m_failed.end());
+	m_failed.clear();
+}
+
+void MapSaverThread::getQueuedPositions(std::set<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	for(std::map<v3s16, MapBlockDiskCopy>::iterator
+			i = m_queue.begin(); i != m_queue.end(); ++i)
+		dst.insert(i->first);
+	for(std::map<v3s16, MapBlockDiskCopy>::iterator
+			i = m_writing.begin(); i != m_writing.end(); ++i)
+		dst.insert(i->first);
+}
+
+u32 MapSaverThread::getQueueSize()
+{
+	JMutexAutoLock lock(m_queue_mutex);
+	return m_queue.size() + m_writing.size();
+}
+
+void MapSaverThread::stopAndFlush()
+{
+	if(IsRunning()){
+		setRun(false);
+		trigger();
+		stop();
+	}
+	// Write whatever got queued after the thread exited
+	writeQueued();
+
+	JMutexAutoLock lock(m_queue_mutex);
+	if(!m_queue.empty())
+		errorstream<<"MapSaver: "<<m_queue.size()<<" blocks could not be "
+				<<"saved"<<std::endl;
+}
+
+u32 MapSaverThread::writeQueued()
+{
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		if(m_queue.empty())
+			return 0;
+		m_writing.swap(m_queue);
+	}
+
+	u32 time_start = porting::getTimeMs();
+	u32 bytes = 0;
+
+	// m_writing is only modified by this thread, so it can be read
+	// without locking
+	std::map<v3s16, std::string> data;
+	{
+		ScopeProfiler sp(g_profiler, "MapSaver: serialize", SPT_AVG);
+		for(std::map<v3s16, MapBlockDiskCopy>::iterator
+				i = m_writing.begin();
+				i != m_writing.end(); ++i)
+		{
+			std::string &blob = data[i->first];
+			blob = Database::serializeBlock(i->second);
+			bytes += blob.size();
+		}
+	}
+	bool ok = m_db->saveBlocks(data);
+
+	u32 count;
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		count = m_writing.size();
+		if(!ok){
+			// Keep them for the next write unless there is newer data
+			for(std::map<v3s16, MapBlockDiskCopy>::iterator
+					i = m_writing.begin();
+					i != m_writing.end(); ++i)
+			{
+				m_queue.insert(*i);
+				m_failed.insert(i->first);
+			}
+		}
+		m_writing.clear();
+	}
+
+	if(!ok){
+		errorstream<<"MapSaver: Writing "<<count<<" blocks failed, they "
+				<<"are written again with the next save"<<std::endl;
+		return 0;
+	}
+
+	float dtime = (float)(porting::getTimeMs() - time_start) / 1000.0;
+	g_profiler->add("MapSaver: blocks written", count);
+	g_profiler->add("MapSaver: bytes written", bytes);
+	if(dtime > 0.001)
+		g_profiler->avg("MapSaver: bytes/s", bytes / dtime);
+	verbosestream<<"MapSaver: Wrote "<<count<<" blocks ("<<bytes
+			<<" bytes) in "<<dtime<<"s"<<std::endl;
+	return count;
+}
+
+void *MapSaverThread::Thread()
+{
+	ThreadStarted();
+	log_register_thread("MapSaverThread");
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		m_queue_event.wait();
+		writeQueued();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+	return NULL;
+}
+
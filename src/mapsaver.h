@@ -0,0 +1,92 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPSAVER_HEADER
+#define MAPSAVER_HEADER
+
+#include "irr_v3d.h"
+#include "porting.h" // sleep_ms
+#include "mapblock.h" // MapBlockDiskCopy
+#include "util/container.h"
+#include "util/thread.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class Database;
+
+/*
+	Serializes and writes MapBlocks to the database in the background,
+	so that the server thread doesn't compress blocks or wait for the
+	database while holding the environment lock.
+
+	The caller queues a MapBlockDiskCopy of the block; every trigger()
+	serializes everything queued so far and writes it with one
+	Database::saveBlocks() call. Data stays available through
+	getQueued() until it has been written, so that a block that is
+	unloaded and loaded again is not read back stale from the database.
+	If the write fails, the blocks stay queued for the next trigger()
+	and are listed by takeFailed().
+*/
+class MapSaverThread : public SimpleThread
+{
+public:
+	MapSaverThread(Database *db);
+	~MapSaverThread();
+
+	void *Thread();
+
+	// Replaces older queued data of the same block
+	void enqueue(v3s16 blockpos, const MapBlockDiskCopy &copy);
+	// Wakes up the thread to write what has been queued
+	void trigger();
+	// Gets the newest data of a block that has not been written yet,
+	// serialized like Database::serializeBlock()
+	bool getQueued(v3s16 blockpos, std::string &data);
+	// Moves the positions of the blocks that failed to be written
+	// since the last call to dst
+	void takeFailed(std::vector<v3s16> &dst);
+
+	// Adds positions of the blocks that have not been written yet
+	void getQueuedPositions(std::set<v3s16> &dst);
+	// Number of blocks queued or being written
+	u32 getQueueSize();
+
+	// Stops the thread after writing everything that has been queued
+	void stopAndFlush();
+
+private:
+	// Returns the number of blocks written
+	u32 writeQueued();
+
+	Database *m_db;
+
+	JMutex m_queue_mutex;
+	Event m_queue_event;
+	// Waiting for the next write (behind m_queue_mutex)
+	std::map<v3s16, MapBlockDiskCopy> m_queue;
+	// Being written right now (behind m_queue_mutex)
+	std::map<v3s16, MapBlockDiskCopy> m_writing;
+	// Failed to be written (behind m_queue_mutex)
+	std::set<v3s16> m_failed;
+};
+
+#endif
+
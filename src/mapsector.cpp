@@ -161,6 +161,24 @@ void MapSector::getBlocks(std::list<MapBlock*> &dest)
 	}
 }
 
+void MapSector::getBlocks(s16 y_min, s16 y_max, std::vector<MapBlock*> &dest)
+{
+	for(std::map<s16, MapBlock*>::iterator bi = m_blocks.lower_bound(y_min);
+		bi != m_blocks.end() && bi->first <= y_max; ++bi)
+	{
+		dest.push_back(bi->second);
+	}
+}
+
+bool MapSector::getBlockRange(s16 &y_min, s16 &y_max)
+{
+	if(m_blocks.empty())
+		return false;
+	y_min = m_blocks.begin()->first;
+	y_max = m_blocks.rbegin()->first;
+	return true;
+}
+
 /*
 	ServerMapSector
 */
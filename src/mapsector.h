@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <ostream>
 #include <map>
 #include <list>
+#include <vector>
 
 class MapBlock;
 class Map;
@@ -62,6 +63,11 @@ class MapSector
 	void deleteBlock(MapBlock *block);
 	
 	void getBlocks(std::list<MapBlock*> &dest);
+	// Gets the blocks with y_min <= Y <= y_max, lowest first
+	void getBlocks(s16 y_min, s16 y_max, std::vector<MapBlock*> &dest);
+	// Gets the Y of the lowest and the highest block.
+	// Returns false if there are no blocks.
+	bool getBlockRange(s16 &y_min, s16 &y_max);
 	
 	// Always false at the moment, because sector contains no metadata.
 	bool differs_from_disk;
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string.h> // memset
 #include "debug.h"
 #include "util/numeric.h"
+#include "config.h"
 
 #define NOISE_MAGIC_X    1619
 #define NOISE_MAGIC_Y    31337
@@ -293,6 +294,8 @@ void Noise::init(NoiseParams *np, int seed, int sx, int sy, int sz) {
 
 	this->buf    = new float[sx * sy * sz];
 	this->result = new float[sx * sy * sz];
+	this->row_t  = new float[sx];
+	this->row_n  = new int[sx];
 }
 
 
@@ -300,6 +303,8 @@ Noise::~Noise() {
 	delete[] buf;
 	delete[] result;
 	delete[] noisebuf;
+	delete[] row_t;
+	delete[] row_n;
 }
 
 
@@ -318,8 +323,12 @@ void Noise::setSize(int sx, int sy, int sz) {
 
 	delete[] buf;
 	delete[] result;
+	delete[] row_t;
+	delete[] row_n;
 	this->buf    = new float[sx * sy * sz];
 	this->result = new float[sx * sy * sz];
+	this->row_t  = new float[sx];
+	this->row_n  = new int[sx];
 }
 
 
@@ -358,6 +367,410 @@ void Noise::resizeNoiseBuf(bool is3d) {
 }
 
 
+///////////////////////// [ Vectorized map kernels ] //////////////////////////
+
+/*
+ * The map functions below spend nearly all of their time interpolating the
+ * noise lattice and summing octaves, so those inner loops have SSE2 and AVX2
+ * versions selected at runtime next to the scalar reference.  They perform
+ * exactly the same float operations in the same order (no FMA), and the
+ * ease curve weights are computed once outside the kernels and shared by all
+ * paths, so results are bit-identical even with -ffast-math.  Only x86-64 is
+ * handled: there SSE is the scalar float unit as well, whereas i386 builds
+ * may use x87.  SSE2 is part of the x86-64 baseline; the AVX2 kernels are
+ * only built when the build system found a compiler that supports them
+ * (USE_NOISE_AVX2).
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+	#define NOISE_SIMD_X86 1
+	#include <emmintrin.h>
+#else
+	#define NOISE_SIMD_X86 0
+#endif
+
+#if NOISE_SIMD_X86 && USE_NOISE_AVX2
+	#define NOISE_SIMD_AVX2_BUILT 1
+	#include <immintrin.h>
+	#define NOISE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+	#define NOISE_SIMD_AVX2_BUILT 0
+#endif
+
+
+static NoiseSimdLevel noise_detect_simd_level()
+{
+#if NOISE_SIMD_AVX2_BUILT
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return NOISE_SIMD_AVX2;
+	return NOISE_SIMD_SSE2;
+#elif NOISE_SIMD_X86
+	return NOISE_SIMD_SSE2;
+#else
+	return NOISE_SIMD_NONE;
+#endif
+}
+
+static const NoiseSimdLevel noise_max_simd_level = noise_detect_simd_level();
+static NoiseSimdLevel noise_simd_level = noise_max_simd_level;
+
+
+NoiseSimdLevel noise_get_max_simd_level()
+{
+	return noise_max_simd_level;
+}
+
+
+NoiseSimdLevel noise_get_simd_level()
+{
+	return noise_simd_level;
+}
+
+
+NoiseSimdLevel noise_set_simd_level(NoiseSimdLevel level)
+{
+	if (level > noise_max_simd_level)
+		level = noise_max_simd_level;
+	noise_simd_level = level;
+	return level;
+}
+
+
+const char *noise_simd_level_name(NoiseSimdLevel level)
+{
+	switch (level) {
+	case NOISE_SIMD_SSE2:
+		return "SSE2";
+	case NOISE_SIMD_AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
+
+
+#if NOISE_SIMD_X86
+
+/*
+ * Rows of the lattice are interpolated against per-column tables holding the
+ * x weight (tx) and lattice column (nx) of every output point.
+ */
+
+static void interpRow2D_sse2(float *dst, int n,
+		const float *tx, const int *nx,
+		const float *r0, const float *r1, float ty)
+{
+	__m128 vty = _mm_set1_ps(ty);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		int a = nx[i], b = nx[i + 1], c = nx[i + 2], d = nx[i + 3];
+		__m128 v00 = _mm_setr_ps(r0[a],     r0[b],     r0[c],     r0[d]);
+		__m128 v10 = _mm_setr_ps(r0[a + 1], r0[b + 1], r0[c + 1], r0[d + 1]);
+		__m128 v01 = _mm_setr_ps(r1[a],     r1[b],     r1[c],     r1[d]);
+		__m128 v11 = _mm_setr_ps(r1[a + 1], r1[b + 1], r1[c + 1], r1[d + 1]);
+		__m128 t = _mm_loadu_ps(tx + i);
+		__m128 u = _mm_add_ps(v00, _mm_mul_ps(_mm_sub_ps(v10, v00), t));
+		__m128 v = _mm_add_ps(v01, _mm_mul_ps(_mm_sub_ps(v11, v01), t));
+		_mm_storeu_ps(dst + i, _mm_add_ps(u, _mm_mul_ps(_mm_sub_ps(v, u), vty)));
+	}
+	for (; i != n; i++) {
+		float u = linearInterpolation(r0[nx[i]], r0[nx[i] + 1], tx[i]);
+		float v = linearInterpolation(r1[nx[i]], r1[nx[i] + 1], tx[i]);
+		dst[i] = linearInterpolation(u, v, ty);
+	}
+}
+
+
+#if NOISE_SIMD_AVX2_BUILT
+static NOISE_TARGET_AVX2 void interpRow2D_avx2(float *dst, int n,
+		const float *tx, const int *nx,
+		const float *r0, const float *r1, float ty)
+{
+	__m256 vty = _mm256_set1_ps(ty);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i ix = _mm256_loadu_si256((const __m256i *)(nx + i));
+		__m256 v00 = _mm256_i32gather_ps(r0,     ix, 4);
+		__m256 v10 = _mm256_i32gather_ps(r0 + 1, ix, 4);
+		__m256 v01 = _mm256_i32gather_ps(r1,     ix, 4);
+		__m256 v11 = _mm256_i32gather_ps(r1 + 1, ix, 4);
+		__m256 t = _mm256_loadu_ps(tx + i);
+		__m256 u = _mm256_add_ps(v00, _mm256_mul_ps(_mm256_sub_ps(v10, v00), t));
+		__m256 v = _mm256_add_ps(v01, _mm256_mul_ps(_mm256_sub_ps(v11, v01), t));
+		_mm256_storeu_ps(dst + i,
+			_mm256_add_ps(u, _mm256_mul_ps(_mm256_sub_ps(v, u), vty)));
+	}
+	for (; i != n; i++) {
+		float u = linearInterpolation(r0[nx[i]], r0[nx[i] + 1], tx[i]);
+		float v = linearInterpolation(r1[nx[i]], r1[nx[i] + 1], tx[i]);
+		dst[i] = linearInterpolation(u, v, ty);
+	}
+}
+#endif
+
+
+// r00/r10 are rows y and y + 1 of slice z, r01/r11 the same rows of z + 1
+static void interpRow3D_sse2(float *dst, int n,
+		const float *tx, const int *nx,
+		const float *r00, const float *r10,
+		const float *r01, const float *r11, float ty, float tz)
+{
+	__m128 vty = _mm_set1_ps(ty);
+	__m128 vtz = _mm_set1_ps(tz);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		int a = nx[i], b = nx[i + 1], c = nx[i + 2], d = nx[i + 3];
+		__m128 t = _mm_loadu_ps(tx + i);
+		__m128 v000 = _mm_setr_ps(r00[a],     r00[b],     r00[c],     r00[d]);
+		__m128 v100 = _mm_setr_ps(r00[a + 1], r00[b + 1], r00[c + 1], r00[d + 1]);
+		__m128 v010 = _mm_setr_ps(r10[a],     r10[b],     r10[c],     r10[d]);
+		__m128 v110 = _mm_setr_ps(r10[a + 1], r10[b + 1], r10[c + 1], r10[d + 1]);
+		__m128 u0 = _mm_add_ps(v000, _mm_mul_ps(_mm_sub_ps(v100, v000), t));
+		__m128 v0 = _mm_add_ps(v010, _mm_mul_ps(_mm_sub_ps(v110, v010), t));
+		__m128 u = _mm_add_ps(u0, _mm_mul_ps(_mm_sub_ps(v0, u0), vty));
+		__m128 v001 = _mm_setr_ps(r01[a],     r01[b],     r01[c],     r01[d]);
+		__m128 v101 = _mm_setr_ps(r01[a + 1], r01[b + 1], r01[c + 1], r01[d + 1]);
+		__m128 v011 = _mm_setr_ps(r11[a],     r11[b],     r11[c],     r11[d]);
+		__m128 v111 = _mm_setr_ps(r11[a + 1], r11[b + 1], r11[c + 1], r11[d + 1]);
+		__m128 u1 = _mm_add_ps(v001, _mm_mul_ps(_mm_sub_ps(v101, v001), t));
+		__m128 v1 = _mm_add_ps(v011, _mm_mul_ps(_mm_sub_ps(v111, v011), t));
+		__m128 v = _mm_add_ps(u1, _mm_mul_ps(_mm_sub_ps(v1, u1), vty));
+		_mm_storeu_ps(dst + i, _mm_add_ps(u, _mm_mul_ps(_mm_sub_ps(v, u), vtz)));
+	}
+	for (; i != n; i++) {
+		int a = nx[i];
+		dst[i] = triLinearInterpolation(
+			r00[a], r00[a + 1], r10[a], r10[a + 1],
+			r01[a], r01[a + 1], r11[a], r11[a + 1],
+			tx[i], ty, tz);
+	}
+}
+
+
+#if NOISE_SIMD_AVX2_BUILT
+static NOISE_TARGET_AVX2 void interpRow3D_avx2(float *dst, int n,
+		const float *tx, const int *nx,
+		const float *r00, const float *r10,
+		const float *r01, const float *r11, float ty, float tz)
+{
+	__m256 vty = _mm256_set1_ps(ty);
+	__m256 vtz = _mm256_set1_ps(tz);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i ix = _mm256_loadu_si256((const __m256i *)(nx + i));
+		__m256 t = _mm256_loadu_ps(tx + i);
+		__m256 v000 = _mm256_i32gather_ps(r00,     ix, 4);
+		__m256 v100 = _mm256_i32gather_ps(r00 + 1, ix, 4);
+		__m256 v010 = _mm256_i32gather_ps(r10,     ix, 4);
+		__m256 v110 = _mm256_i32gather_ps(r10 + 1, ix, 4);
+		__m256 u0 = _mm256_add_ps(v000, _mm256_mul_ps(_mm256_sub_ps(v100, v000), t));
+		__m256 v0 = _mm256_add_ps(v010, _mm256_mul_ps(_mm256_sub_ps(v110, v010), t));
+		__m256 u = _mm256_add_ps(u0, _mm256_mul_ps(_mm256_sub_ps(v0, u0), vty));
+		__m256 v001 = _mm256_i32gather_ps(r01,     ix, 4);
+		__m256 v101 = _mm256_i32gather_ps(r01 + 1, ix, 4);
+		__m256 v011 = _mm256_i32gather_ps(r11,     ix, 4);
+		__m256 v111 = _mm256_i32gather_ps(r11 + 1, ix, 4);
+		__m256 u1 = _mm256_add_ps(v001, _mm256_mul_ps(_mm256_sub_ps(v101, v001), t));
+		__m256 v1 = _mm256_add_ps(v011, _mm256_mul_ps(_mm256_sub_ps(v111, v011), t));
+		__m256 v = _mm256_add_ps(u1, _mm256_mul_ps(_mm256_sub_ps(v1, u1), vty));
+		_mm256_storeu_ps(dst + i,
+			_mm256_add_ps(u, _mm256_mul_ps(_mm256_sub_ps(v, u), vtz)));
+	}
+	for (; i != n; i++) {
+		int a = nx[i];
+		dst[i] = triLinearInterpolation(
+			r00[a], r00[a + 1], r10[a], r10[a + 1],
+			r01[a], r01[a + 1], r11[a], r11[a + 1],
+			tx[i], ty, tz);
+	}
+}
+#endif
+
+
+static void accumulateOctave_sse2(float *result, const float *buf,
+		float g, int n)
+{
+	__m128 vg = _mm_set1_ps(g);
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 r = _mm_loadu_ps(result + i);
+		__m128 b = _mm_loadu_ps(buf + i);
+		_mm_storeu_ps(result + i, _mm_add_ps(r, _mm_mul_ps(vg, b)));
+	}
+	for (; i != n; i++)
+		result[i] += g * buf[i];
+}
+
+
+#if NOISE_SIMD_AVX2_BUILT
+static NOISE_TARGET_AVX2 void accumulateOctave_avx2(float *result,
+		const float *buf, float g, int n)
+{
+	__m256 vg = _mm256_set1_ps(g);
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 r = _mm256_loadu_ps(result + i);
+		__m256 b = _mm256_loadu_ps(buf + i);
+		_mm256_storeu_ps(result + i, _mm256_add_ps(r, _mm256_mul_ps(vg, b)));
+	}
+	for (; i != n; i++)
+		result[i] += g * buf[i];
+}
+#endif
+
+
+static void accumulateOctaveModulated_sse2(float *result, const float *buf,
+		float *g, const float *persist, int n)
+{
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 r = _mm_loadu_ps(result + i);
+		__m128 b = _mm_loadu_ps(buf + i);
+		__m128 vg = _mm_loadu_ps(g + i);
+		_mm_storeu_ps(result + i, _mm_add_ps(r, _mm_mul_ps(vg, b)));
+		_mm_storeu_ps(g + i, _mm_mul_ps(vg, _mm_loadu_ps(persist + i)));
+	}
+	for (; i != n; i++) {
+		result[i] += g[i] * buf[i];
+		g[i] *= persist[i];
+	}
+}
+
+
+#if NOISE_SIMD_AVX2_BUILT
+static NOISE_TARGET_AVX2 void accumulateOctaveModulated_avx2(float *result,
+		const float *buf, float *g, const float *persist, int n)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 r = _mm256_loadu_ps(result + i);
+		__m256 b = _mm256_loadu_ps(buf + i);
+		__m256 vg = _mm256_loadu_ps(g + i);
+		_mm256_storeu_ps(result + i, _mm256_add_ps(r, _mm256_mul_ps(vg, b)));
+		_mm256_storeu_ps(g + i, _mm256_mul_ps(vg, _mm256_loadu_ps(persist + i)));
+	}
+	for (; i != n; i++) {
+		result[i] += g[i] * buf[i];
+		g[i] *= persist[i];
+	}
+}
+#endif
+
+#endif // NOISE_SIMD_X86
+
+
+/*
+ * Steps along x through the lattice and records the weight and lattice column
+ * used for each output column; the same for every row of a map.
+ */
+static void noiseColumnTable(float *tx, int *nx, int sx,
+		float u, float step_x, bool ease)
+{
+	int noisex = 0;
+	for (int i = 0; i != sx; i++) {
+		tx[i] = ease ? easeCurve(u) : u;
+		nx[i] = noisex;
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+}
+
+
+static void interpRow2D(float *dst, int n,
+		const float *tx, const int *nx,
+		const float *r0, const float *r1, float ty)
+{
+#if NOISE_SIMD_X86
+#if NOISE_SIMD_AVX2_BUILT
+	if (noise_simd_level == NOISE_SIMD_AVX2) {
+		interpRow2D_avx2(dst, n, tx, nx, r0, r1, ty);
+		return;
+	}
+#endif
+	if (noise_simd_level == NOISE_SIMD_SSE2) {
+		interpRow2D_sse2(dst, n, tx, nx, r0, r1, ty);
+		return;
+	}
+#endif
+	for (int i = 0; i != n; i++) {
+		float u = linearInterpolation(r0[nx[i]], r0[nx[i] + 1], tx[i]);
+		float v = linearInterpolation(r1[nx[i]], r1[nx[i] + 1], tx[i]);
+		dst[i] = linearInterpolation(u, v, ty);
+	}
+}
+
+
+static void interpRow3D(float *dst, int n,
+		const float *tx, const int *nx,
+		const float *r00, const float *r10,
+		const float *r01, const float *r11, float ty, float tz)
+{
+#if NOISE_SIMD_X86
+#if NOISE_SIMD_AVX2_BUILT
+	if (noise_simd_level == NOISE_SIMD_AVX2) {
+		interpRow3D_avx2(dst, n, tx, nx, r00, r10, r01, r11, ty, tz);
+		return;
+	}
+#endif
+	if (noise_simd_level == NOISE_SIMD_SSE2) {
+		interpRow3D_sse2(dst, n, tx, nx, r00, r10, r01, r11, ty, tz);
+		return;
+	}
+#endif
+	for (int i = 0; i != n; i++) {
+		int a = nx[i];
+		dst[i] = triLinearInterpolation(
+			r00[a], r00[a + 1], r10[a], r10[a + 1],
+			r01[a], r01[a + 1], r11[a], r11[a + 1],
+			tx[i], ty, tz);
+	}
+}
+
+
+static void accumulateOctave(float *result, const float *buf, float g, int n)
+{
+#if NOISE_SIMD_X86
+#if NOISE_SIMD_AVX2_BUILT
+	if (noise_simd_level == NOISE_SIMD_AVX2) {
+		accumulateOctave_avx2(result, buf, g, n);
+		return;
+	}
+#endif
+	if (noise_simd_level == NOISE_SIMD_SSE2) {
+		accumulateOctave_sse2(result, buf, g, n);
+		return;
+	}
+#endif
+	for (int i = 0; i != n; i++)
+		result[i] += g * buf[i];
+}
+
+
+static void accumulateOctaveModulated(float *result, const float *buf,
+		float *g, const float *persist, int n)
+{
+#if NOISE_SIMD_X86
+#if NOISE_SIMD_AVX2_BUILT
+	if (noise_simd_level == NOISE_SIMD_AVX2) {
+		accumulateOctaveModulated_avx2(result, buf, g, persist, n);
+		return;
+	}
+#endif
+	if (noise_simd_level == NOISE_SIMD_SSE2) {
+		accumulateOctaveModulated_sse2(result, buf, g, persist, n);
+		return;
+	}
+#endif
+	for (int i = 0; i != n; i++) {
+		result[i] += g[i] * buf[i];
+		g[i] *= persist[i];
+	}
+}
+
+
 /*
  * NB:  This algorithm is not optimal in terms of space complexity.  The entire
  * integer lattice of noise points could be done as 2 lines instead, and for 3D,
@@ -371,15 +784,14 @@ void Noise::resizeNoiseBuf(bool is3d) {
  */
 #define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed) {
-	float v00, v01, v10, v11, u, v, orig_u;
-	int index, i, j, x0, y0, noisex, noisey;
+	float u, v;
+	int index, i, j, x0, y0, noisey;
 	int nlx, nly;
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (int)(u + sx * step_x) + 2;
@@ -390,28 +802,14 @@ void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed
 			noisebuf[index++] = noise2d(x0 + i, y0 + j, seed);
 
 	//calculate interpolations
-	index  = 0;
+	noiseColumnTable(row_t, row_n, sx, u, step_x, true);
+
 	noisey = 0;
 	for (j = 0; j != sy; j++) {
-		v00 = noisebuf[idx(0, noisey)];
-		v10 = noisebuf[idx(1, noisey)];
-		v01 = noisebuf[idx(0, noisey + 1)];
-		v11 = noisebuf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			buf[index++] = biLinearInterpolation(v00, v10, v01, v11, u, v);
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noisebuf[idx(noisex + 1, noisey)];
-				v11 = noisebuf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+		interpRow2D(&buf[j * sx], sx, row_t, row_n,
+			&noisebuf[idx(0, noisey)],
+			&noisebuf[idx(0, noisey + 1)],
+			easeCurve(v));
 
 		v += step_y;
 		if (v >= 1.0) {
@@ -427,10 +825,8 @@ void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed
 void Noise::gradientMap3D(float x, float y, float z,
 						  float step_x, float step_y, float step_z,
 						  int seed) {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	int index, i, j, k, x0, y0, z0, noisex, noisey, noisez;
+	float u, v, w, orig_v;
+	int index, i, j, k, x0, y0, z0, noisey, noisez;
 	int nlx, nly, nlz;
 
 	x0 = floor(x);
@@ -439,7 +835,6 @@ void Noise::gradientMap3D(float x, float y, float z,
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
 	orig_v = v;
 
 	//calculate noise point lattice
@@ -453,43 +848,21 @@ void Noise::gradientMap3D(float x, float y, float z,
 				noisebuf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
 
 	//calculate interpolations
+	noiseColumnTable(row_t, row_n, sx, u, step_x, false);
+
 	index  = 0;
-	noisey = 0;
 	noisez = 0;
 	for (k = 0; k != sz; k++) {
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
-			v000 = noisebuf[idx(0, noisey,     noisez)];
-			v100 = noisebuf[idx(1, noisey,     noisez)];
-			v010 = noisebuf[idx(0, noisey + 1, noisez)];
-			v110 = noisebuf[idx(1, noisey + 1, noisez)];
-			v001 = noisebuf[idx(0, noisey,     noisez + 1)];
-			v101 = noisebuf[idx(1, noisey,     noisez + 1)];
-			v011 = noisebuf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noisebuf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				buf[index++] = triLinearInterpolation(
-									v000, v100, v010, v110,
-									v001, v101, v011, v111,
-									u, v, w);
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noisebuf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noisebuf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noisebuf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noisebuf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
+			interpRow3D(&buf[index], sx, row_t, row_n,
+				&noisebuf[idx(0, noisey,     noisez)],
+				&noisebuf[idx(0, noisey + 1, noisez)],
+				&noisebuf[idx(0, noisey,     noisez + 1)],
+				&noisebuf[idx(0, noisey + 1, noisez + 1)],
+				v, w);
+			index += sx;
 
 			v += step_y;
 			if (v >= 1.0) {
@@ -510,7 +883,7 @@ void Noise::gradientMap3D(float x, float y, float z,
 
 float *Noise::perlinMap2D(float x, float y) {
 	float f = 1.0, g = 1.0;
-	int i, j, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -522,13 +895,7 @@ float *Noise::perlinMap2D(float x, float y) {
 			f / np->spread.X, f / np->spread.Y,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (j = 0; j != sy; j++) {
-			for (i = 0; i != sx; i++) {
-				result[index] += g * buf[index];
-				index++;
-			}
-		}
+		accumulateOctave(result, buf, g, sx * sy);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -540,7 +907,7 @@ float *Noise::perlinMap2D(float x, float y) {
 
 float *Noise::perlinMap2DModulated(float x, float y, float *persist_map) {
 	float f = 1.0;
-	int i, j, index, oct;
+	int index, oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -556,14 +923,7 @@ float *Noise::perlinMap2DModulated(float x, float y, float *persist_map) {
 			f / np->spread.X, f / np->spread.Y,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (j = 0; j != sy; j++) {
-			for (i = 0; i != sx; i++) {
-				result[index] += g[index] * buf[index];
-				g[index] *= persist_map[index];
-				index++;
-			}
-		}
+		accumulateOctaveModulated(result, buf, g, persist_map, sx * sy);
 
 		f *= 2.0;
 	}
@@ -575,7 +935,7 @@ float *Noise::perlinMap2DModulated(float x, float y, float *persist_map) {
 
 float *Noise::perlinMap3D(float x, float y, float z) {
 	float f = 1.0, g = 1.0;
-	int i, j, k, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -588,15 +948,7 @@ float *Noise::perlinMap3D(float x, float y, float z) {
 			f / np->spread.X, f / np->spread.Y, f / np->spread.Z,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (k = 0; k != sz; k++) {
-			for (j = 0; j != sy; j++) {
-				for (i = 0; i != sx; i++) {
-					result[index] += g * buf[index];
-					index++;
-				}
-			}
-		}
+		accumulateOctave(result, buf, g, sx * sy * sz);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -71,6 +71,22 @@ struct NoiseParams {
 };
 
 
+// Instruction set used by the Noise map functions.  The vectorized paths
+// produce bit-identical results to the scalar one (NOISE_SIMD_NONE).
+enum NoiseSimdLevel {
+	NOISE_SIMD_NONE,
+	NOISE_SIMD_SSE2,
+	NOISE_SIMD_AVX2
+};
+
+// Best level supported by both the build and the CPU
+NoiseSimdLevel noise_get_max_simd_level();
+NoiseSimdLevel noise_get_simd_level();
+// Clamped to noise_get_max_simd_level(); returns the level actually set
+NoiseSimdLevel noise_set_simd_level(NoiseSimdLevel level);
+const char *noise_simd_level_name(NoiseSimdLevel level);
+
+
 // Convenience macros for getting/setting NoiseParams in Settings
 #define getNoiseParams(x, y) getStruct((x), "f,f,v3,s32,s32,f", &(y), sizeof(y))
 #define setNoiseParams(x, y) setStruct((x), "f,f,v3,s32,s32,f", &(y))
@@ -85,6 +101,10 @@ class Noise {
 	float *noisebuf;
 	float *buf;
 	float *result;
+	// Interpolation weights and lattice steps of a row, see
+	// noiseColumnTable()
+	float *row_t;
+	int *row_n;
 
 	Noise(NoiseParams *np, int seed, int sx, int sy);
 	Noise(NoiseParams *np, int seed, int sx, int sy, int sz);
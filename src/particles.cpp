@@ -43,14 +43,23 @@ v3f random_v3f(v3f min, v3f max)
 			rand()/(float)RAND_MAX*(max.Z-min.Z)+min.Z);
 }
 
-std::vector<Particle*> all_particles;
+ParticleSystem *particle_system = NULL;
 std::map<u32, ParticleSpawner*> all_particlespawners;
 
-Particle::Particle(
-	IGameDef *gamedef,
-	scene::ISceneManager* smgr,
-	LocalPlayer *player,
-	ClientEnvironment &env,
+ParticleSystem::ParticleSystem(IGameDef *gamedef, scene::ISceneManager* smgr):
+	scene::ISceneNode(smgr->getRootSceneNode(), smgr)
+{
+	m_gamedef = gamedef;
+
+	// The particles are all over the place
+	this->setAutomaticCulling(scene::EAC_OFF);
+}
+
+ParticleSystem::~ParticleSystem()
+{
+}
+
+void ParticleSystem::add(ClientEnvironment &env,
 	v3f pos,
 	v3f velocity,
 	v3f acceleration,
@@ -59,117 +68,180 @@ Particle::Particle(
 	bool collisiondetection,
 	video::ITexture *texture,
 	v2f texpos,
-	v2f texsize
-):
-	scene::ISceneNode(smgr->getRootSceneNode(), smgr)
+	v2f texsize)
 {
-	// Misc
-	m_gamedef = gamedef;
-
-	// Texture
-	m_material.setFlag(video::EMF_LIGHTING, false);
-	m_material.setFlag(video::EMF_BACK_FACE_CULLING, false);
-	m_material.setFlag(video::EMF_BILINEAR_FILTER, false);
-	m_material.setFlag(video::EMF_FOG_ENABLE, true);
-	m_material.MaterialType = video::EMT_TRANSPARENT_ALPHA_CHANNEL;
-	m_material.setTexture(0, texture);
-	m_texpos = texpos;
-	m_texsize = texsize;
-
-
-	// Particle related
-	m_pos = pos;
-	m_velocity = velocity;
-	m_acceleration = acceleration;
-	m_expiration = expirationtime;
-	m_time = 0;
-	m_player = player;
-	m_size = size;
-	m_collisiondetection = collisiondetection;
-
-	// Irrlicht stuff
-	m_collisionbox = core::aabbox3d<f32>
-			(-size/2,-size/2,-size/2,size/2,size/2,size/2);
-	this->setAutomaticCulling(scene::EAC_OFF);
-
-	// Init lighting
-	updateLight(env);
-
-	// Init model
-	updateVertices();
-
-	all_particles.push_back(this);
+	u16 t = getTextureIndex(texture);
+	m_texture_counts[t]++;
+
+	m_pos.push_back(pos);
+	m_velocity.push_back(velocity);
+	m_acceleration.push_back(acceleration);
+	m_time.push_back(0);
+	m_expiration.push_back(expirationtime);
+	m_size.push_back(size);
+	m_texpos.push_back(texpos);
+	m_texsize.push_back(texsize);
+	m_light.push_back(getLight(pos, env));
+	m_collisiondetection.push_back(collisiondetection);
+	m_texture.push_back(t);
 }
 
-Particle::~Particle()
+u16 ParticleSystem::getTextureIndex(video::ITexture *texture)
 {
+	std::map<video::ITexture*, u16>::iterator i =
+			m_texture_indices.find(texture);
+	if (i != m_texture_indices.end())
+		return i->second;
+
+	video::SMaterial material;
+	material.setFlag(video::EMF_LIGHTING, false);
+	material.setFlag(video::EMF_BACK_FACE_CULLING, false);
+	material.setFlag(video::EMF_BILINEAR_FILTER, false);
+	material.setFlag(video::EMF_FOG_ENABLE, true);
+	material.MaterialType = video::EMT_TRANSPARENT_ALPHA_CHANNEL;
+	material.setTexture(0, texture);
+
+	u16 t = m_materials.size();
+	m_materials.push_back(material);
+	m_texture_counts.push_back(0);
+	m_vertices.push_back(std::vector<video::S3DVertex>());
+	m_texture_indices[texture] = t;
+	return t;
 }
 
-void Particle::OnRegisterSceneNode()
+// Moves the last particle in place of particle i
+void ParticleSystem::removeParticle(u32 i)
 {
-	if (IsVisible)
+	m_texture_counts[m_texture[i]]--;
+
+	u32 last = m_pos.size() - 1;
+	if (i != last)
 	{
-		SceneManager->registerNodeForRendering
-				(this, scene::ESNRP_TRANSPARENT);
-		SceneManager->registerNodeForRendering
-				(this, scene::ESNRP_SOLID);
+		m_pos[i] = m_pos[last];
+		m_velocity[i] = m_velocity[last];
+		m_acceleration[i] = m_acceleration[last];
+		m_time[i] = m_time[last];
+		m_expiration[i] = m_expiration[last];
+		m_size[i] = m_size[last];
+		m_texpos[i] = m_texpos[last];
+		m_texsize[i] = m_texsize[last];
+		m_light[i] = m_light[last];
+		m_collisiondetection[i] = m_collisiondetection[last];
+		m_texture[i] = m_texture[last];
 	}
+	m_pos.pop_back();
+	m_velocity.pop_back();
+	m_acceleration.pop_back();
+	m_time.pop_back();
+	m_expiration.pop_back();
+	m_size.pop_back();
+	m_texpos.pop_back();
+	m_texsize.pop_back();
+	m_light.pop_back();
+	m_collisiondetection.pop_back();
+	m_texture.pop_back();
+}
+
+void ParticleSystem::OnRegisterSceneNode()
+{
+	// Drawn with the solid nodes so that water is drawn over them
+	if (IsVisible)
+		SceneManager->registerNodeForRendering(this, scene::ESNRP_SOLID);
 
 	ISceneNode::OnRegisterSceneNode();
 }
 
-void Particle::render()
+void ParticleSystem::render()
 {
 	// TODO: Render particles in front of water and the selectionbox
 
+	// The same quad indices are used for every draw
+	static std::vector<u16> indices;
+	if (indices.empty())
+	{
+		indices.reserve(MAX_PARTICLES_PER_DRAW * 6);
+		for (u32 i = 0; i < MAX_PARTICLES_PER_DRAW * 4; i += 4)
+		{
+			indices.push_back(i);
+			indices.push_back(i + 1);
+			indices.push_back(i + 2);
+			indices.push_back(i + 2);
+			indices.push_back(i + 3);
+			indices.push_back(i);
+		}
+	}
+
 	video::IVideoDriver* driver = SceneManager->getVideoDriver();
-	driver->setMaterial(m_material);
 	driver->setTransform(video::ETS_WORLD, AbsoluteTransformation);
 
-	u16 indices[] = {0,1,2, 2,3,0};
-	driver->drawVertexPrimitiveList(m_vertices, 4,
-			indices, 2, video::EVT_STANDARD,
-			scene::EPT_TRIANGLES, video::EIT_16BIT);
+	u32 draw_calls = 0;
+	for (u16 t = 0; t < m_materials.size(); t++)
+	{
+		u32 count = m_vertices[t].size() / 4;
+		if (count == 0)
+			continue;
+		driver->setMaterial(m_materials[t]);
+		for (u32 first = 0; first < count; first += MAX_PARTICLES_PER_DRAW)
+		{
+			u32 n = MYMIN(count - first, (u32)MAX_PARTICLES_PER_DRAW);
+			driver->drawVertexPrimitiveList(&m_vertices[t][first * 4], n * 4,
+					&indices[0], n * 2, video::EVT_STANDARD,
+					scene::EPT_TRIANGLES, video::EIT_16BIT);
+			draw_calls++;
+		}
+	}
+	g_profiler->avg("Particles: draw calls", draw_calls);
 }
 
-void Particle::step(float dtime, ClientEnvironment &env)
+void ParticleSystem::step(float dtime, ClientEnvironment &env)
 {
-	m_time += dtime;
-	if (m_collisiondetection)
+	for (u32 i = 0; i < m_pos.size();)
 	{
-		core::aabbox3d<f32> box = m_collisionbox;
-		v3f p_pos = m_pos*BS;
-		v3f p_velocity = m_velocity*BS;
-		v3f p_acceleration = m_acceleration*BS;
-		collisionMoveSimple(&env, m_gamedef,
-			BS*0.5, box,
-			0, dtime,
-			p_pos, p_velocity, p_acceleration);
-		m_pos = p_pos/BS;
-		m_velocity = p_velocity/BS;
-		m_acceleration = p_acceleration/BS;
-	}
-	else
-	{
-		m_velocity += m_acceleration * dtime;
-		m_pos += m_velocity * dtime;
-	}
+		if (m_expiration[i] < m_time[i])
+		{
+			removeParticle(i);
+			continue;
+		}
+
+		m_time[i] += dtime;
+		if (m_collisiondetection[i])
+		{
+			float size = m_size[i];
+			core::aabbox3d<f32> box
+					(-size/2,-size/2,-size/2,size/2,size/2,size/2);
+			v3f p_pos = m_pos[i]*BS;
+			v3f p_velocity = m_velocity[i]*BS;
+			v3f p_acceleration = m_acceleration[i]*BS;
+			collisionMoveSimple(&env, m_gamedef,
+				BS*0.5, box,
+				0, dtime,
+				p_pos, p_velocity, p_acceleration);
+			m_pos[i] = p_pos/BS;
+			m_velocity[i] = p_velocity/BS;
+			m_acceleration[i] = p_acceleration/BS;
+		}
+		else
+		{
+			m_velocity[i] += m_acceleration[i] * dtime;
+			m_pos[i] += m_velocity[i] * dtime;
+		}
 
-	// Update lighting
-	updateLight(env);
+		m_light[i] = getLight(m_pos[i], env);
+		i++;
+	}
+	g_profiler->avg("Particles: live", m_pos.size());
 
-	// Update model
-	updateVertices();
+	updateVertices(env.getLocalPlayer());
 }
 
-void Particle::updateLight(ClientEnvironment &env)
+u8 ParticleSystem::getLight(v3f pos, ClientEnvironment &env)
 {
 	u8 light = 0;
 	try{
 		v3s16 p = v3s16(
-			floor(m_pos.X+0.5),
-			floor(m_pos.Y+0.5),
-			floor(m_pos.Z+0.5)
+			floor(pos.X+0.5),
+			floor(pos.Y+0.5),
+			floor(pos.Z+0.5)
 		);
 		MapNode n = env.getClientMap().getNode(p);
 		light = n.getLightBlend(env.getDayNightRatio(), m_gamedef->ndef());
@@ -177,32 +249,51 @@ void Particle::updateLight(ClientEnvironment &env)
 	catch(InvalidPositionException &e){
 		light = blend_light(env.getDayNightRatio(), LIGHT_SUN, 0);
 	}
-	m_light = decode_light(light);
+	return decode_light(light);
 }
 
-void Particle::updateVertices()
+void ParticleSystem::updateVertices(LocalPlayer *player)
 {
-	video::SColor c(255, m_light, m_light, m_light);
-	f32 tx0 = m_texpos.X;
-	f32 tx1 = m_texpos.X + m_texsize.X;
-	f32 ty0 = m_texpos.Y;
-	f32 ty1 = m_texpos.Y + m_texsize.Y;
-
-	m_vertices[0] = video::S3DVertex(-m_size/2,-m_size/2,0, 0,0,0,
-			c, tx0, ty1);
-	m_vertices[1] = video::S3DVertex(m_size/2,-m_size/2,0, 0,0,0,
-			c, tx1, ty1);
-	m_vertices[2] = video::S3DVertex(m_size/2,m_size/2,0, 0,0,0,
-			c, tx1, ty0);
-	m_vertices[3] = video::S3DVertex(-m_size/2,m_size/2,0, 0,0,0,
-			c, tx0, ty0);
-
-	for(u16 i=0; i<4; i++)
+	// The corners of a quad of size 1 facing the player
+	v3f corners[4] = {
+		v3f(-0.5,-0.5,0),
+		v3f(0.5,-0.5,0),
+		v3f(0.5,0.5,0),
+		v3f(-0.5,0.5,0)
+	};
+	for (u16 j = 0; j < 4; j++)
 	{
-		m_vertices[i].Pos.rotateYZBy(m_player->getPitch());
-		m_vertices[i].Pos.rotateXZBy(m_player->getYaw());
-		m_box.addInternalPoint(m_vertices[i].Pos);
-		m_vertices[i].Pos += m_pos*BS;
+		corners[j].rotateYZBy(player->getPitch());
+		corners[j].rotateXZBy(player->getYaw());
+	}
+
+	for (u16 t = 0; t < m_vertices.size(); t++)
+		m_vertices[t].resize(m_texture_counts[t] * 4);
+	std::vector<u32> filled(m_vertices.size(), 0);
+
+	for (u32 i = 0; i < m_pos.size(); i++)
+	{
+		u16 t = m_texture[i];
+		video::S3DVertex *v = &m_vertices[t][filled[t]];
+		filled[t] += 4;
+
+		u8 l = m_light[i];
+		video::SColor c(255, l, l, l);
+		f32 tx0 = m_texpos[i].X;
+		f32 tx1 = m_texpos[i].X + m_texsize[i].X;
+		f32 ty0 = m_texpos[i].Y;
+		f32 ty1 = m_texpos[i].Y + m_texsize[i].Y;
+		v3f pos = m_pos[i]*BS;
+		float size = m_size[i];
+
+		v[0] = video::S3DVertex(pos + corners[0]*size, v3f(0,0,0),
+				c, v2f(tx0, ty1));
+		v[1] = video::S3DVertex(pos + corners[1]*size, v3f(0,0,0),
+				c, v2f(tx1, ty1));
+		v[2] = video::S3DVertex(pos + corners[2]*size, v3f(0,0,0),
+				c, v2f(tx1, ty0));
+		v[3] = video::S3DVertex(pos + corners[3]*size, v3f(0,0,0),
+				c, v2f(tx0, ty0));
 	}
 }
 
@@ -211,24 +302,23 @@ void Particle::updateVertices()
 	Helpers
 */
 
+void addParticle(IGameDef* gamedef, scene::ISceneManager* smgr,
+		ClientEnvironment &env, v3f pos, v3f velocity, v3f acceleration,
+		float expirationtime, float size, bool collisiondetection,
+		video::ITexture *texture, v2f texpos, v2f texsize)
+{
+	if (particle_system == NULL)
+		particle_system = new ParticleSystem(gamedef, smgr);
+
+	particle_system->add(env, pos, velocity, acceleration,
+			expirationtime, size, collisiondetection,
+			texture, texpos, texsize);
+}
 
 void allparticles_step (float dtime, ClientEnvironment &env)
 {
-	for(std::vector<Particle*>::iterator i = all_particles.begin();
-			i != all_particles.end();)
-	{
-		if ((*i)->get_expired())
-		{
-			(*i)->remove();
-			delete *i;
-			all_particles.erase(i);
-		}
-		else
-		{
-			(*i)->step(dtime, env);
-			i++;
-		}
-	}
+	if (particle_system != NULL)
+		particle_system->step(dtime, env);
 }
 
 void addDiggingParticles(IGameDef* gamedef, scene::ISceneManager* smgr,
@@ -282,10 +372,9 @@ void addNodeParticle(IGameDef* gamedef, scene::ISceneManager* smgr,
 		(f32)pos.Z+rand()%100/200.-0.25
 	);
 
-	new Particle(
+	addParticle(
 		gamedef,
 		smgr,
-		player,
 		env,
 		particlepos,
 		velocity,
@@ -361,10 +450,9 @@ void ParticleSpawner::step(float dtime, ClientEnvironment &env)
 						*(m_maxsize-m_minsize)
 						+m_minsize;
 
-				new Particle(
+				addParticle(
 					m_gamedef,
 					m_smgr,
-					m_player,
 					env,
 					pos,
 					vel,
@@ -375,7 +463,7 @@ void ParticleSpawner::step(float dtime, ClientEnvironment &env)
 					m_texture,
 					v2f(0.0, 0.0),
 					v2f(1.0, 1.0));
-				m_spawntimes.erase(i);
+				i = m_spawntimes.erase(i);
 			}
 			else
 			{
@@ -399,10 +487,9 @@ void ParticleSpawner::step(float dtime, ClientEnvironment &env)
 						*(m_maxsize-m_minsize)
 						+m_minsize;
 
-				new Particle(
+				addParticle(
 					m_gamedef,
 					m_smgr,
-					m_player,
 					env,
 					pos,
 					vel,
@@ -456,12 +543,10 @@ void clear_particles ()
 		all_particlespawners.erase(i++);
 	}
 
-	for(std::vector<Particle*>::iterator i =
-			all_particles.begin();
-			i != all_particles.end();)
+	if (particle_system != NULL)
 	{
-		(*i)->remove();
-		delete *i;
-		all_particles.erase(i);
-	}	
+		particle_system->remove();
+		particle_system->drop();
+		particle_system = NULL;
+	}
 }
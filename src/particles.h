@@ -21,32 +21,28 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define PARTICLES_HEADER
 
 #define DIGGING_PARTICLES_AMOUNT 10
+// Quads drawn with one call, limited by the 16-bit indices
+#define MAX_PARTICLES_PER_DRAW 16384
 
 #include <iostream>
+#include <map>
+#include <vector>
 #include "irrlichttypes_extrabloated.h"
 #include "tile.h"
 #include "localplayer.h"
 #include "environment.h"
 
-class Particle : public scene::ISceneNode
+/*
+	All particles are kept in one scene node, in arrays of their
+	properties that are stepped in one pass. The particles of a texture
+	are put in one vertex array and drawn with one draw call for every
+	MAX_PARTICLES_PER_DRAW of them.
+*/
+class ParticleSystem : public scene::ISceneNode
 {
 	public:
-	Particle(
-		IGameDef* gamedef,
-		scene::ISceneManager* mgr,
-		LocalPlayer *player,
-		ClientEnvironment &env,
-		v3f pos,
-		v3f velocity,
-		v3f acceleration,
-		float expirationtime,
-		float size,
-		bool collisiondetection,
-		video::ITexture *texture,
-		v2f texpos,
-		v2f texsize
-	);
-	~Particle();
+	ParticleSystem(IGameDef* gamedef, scene::ISceneManager* mgr);
+	~ParticleSystem();
 
 	virtual const core::aabbox3d<f32>& getBoundingBox() const
 	{
@@ -55,43 +51,60 @@ class Particle : public scene::ISceneNode
 
 	virtual u32 getMaterialCount() const
 	{
-		return 1;
+		return m_materials.size();
 	}
 
 	virtual video::SMaterial& getMaterial(u32 i)
 	{
-		return m_material;
+		return m_materials[i];
 	}
 
 	virtual void OnRegisterSceneNode();
 	virtual void render();
 
+	void add(ClientEnvironment &env,
+		v3f pos,
+		v3f velocity,
+		v3f acceleration,
+		float expirationtime,
+		float size,
+		bool collisiondetection,
+		video::ITexture *texture,
+		v2f texpos,
+		v2f texsize);
+
 	void step(float dtime, ClientEnvironment &env);
 
-	bool get_expired ()
-	{ return m_expiration < m_time; }
+	u32 getCount() const
+	{ return m_pos.size(); }
 
 private:
-	void updateLight(ClientEnvironment &env);
-	void updateVertices();
-
-	video::S3DVertex m_vertices[4];
-	float m_time;
-	float m_expiration;
+	u16 getTextureIndex(video::ITexture *texture);
+	void removeParticle(u32 i);
+	u8 getLight(v3f pos, ClientEnvironment &env);
+	void updateVertices(LocalPlayer *player);
 
 	IGameDef *m_gamedef;
 	core::aabbox3d<f32> m_box;
-	core::aabbox3d<f32> m_collisionbox;
-	video::SMaterial m_material;
-	v2f m_texpos;
-	v2f m_texsize;
-	v3f m_pos;
-	v3f m_velocity;
-	v3f m_acceleration;
-	LocalPlayer *m_player;
-	float m_size;
-	u8 m_light;
-	bool m_collisiondetection;
+
+	// Properties of the particles, indexed by particle
+	std::vector<v3f> m_pos;
+	std::vector<v3f> m_velocity;
+	std::vector<v3f> m_acceleration;
+	std::vector<float> m_time;
+	std::vector<float> m_expiration;
+	std::vector<float> m_size;
+	std::vector<v2f> m_texpos;
+	std::vector<v2f> m_texsize;
+	std::vector<u8> m_light;
+	std::vector<u8> m_collisiondetection;
+	std::vector<u16> m_texture;
+
+	// Indexed by the texture index of the particles
+	std::map<video::ITexture*, u16> m_texture_indices;
+	std::vector<video::SMaterial> m_materials;
+	std::vector<u32> m_texture_counts;
+	std::vector<std::vector<video::S3DVertex> > m_vertices;
 };
 
 class ParticleSpawner
@@ -140,6 +153,11 @@ class ParticleSpawner
 	bool m_collisiondetection;
 };
 
+void addParticle(IGameDef* gamedef, scene::ISceneManager* smgr,
+	ClientEnvironment &env, v3f pos, v3f velocity, v3f acceleration,
+	float expirationtime, float size, bool collisiondetection,
+	video::ITexture *texture, v2f texpos, v2f texsize);
+
 void allparticles_step (float dtime, ClientEnvironment &env);
 void allparticlespawners_step (float dtime, ClientEnvironment &env);
 
@@ -500,6 +500,24 @@ int ModApiEnvMod::l_get_gametime(lua_State *L)
 }
 
 
+// Reads nodenames like {"ignore", "group:tree"} or "default:dirt"
+static void read_content_filter(lua_State *L, int index,
+		INodeDefManager *ndef, std::set<content_t> &filter)
+{
+	if(lua_istable(L, index)){
+		lua_pushnil(L);
+		while(lua_next(L, index) != 0){
+			// key at index -2 and value at index -1
+			luaL_checktype(L, -1, LUA_TSTRING);
+			ndef->getIds(lua_tostring(L, -1), filter);
+			// removes value, keeps key for next iteration
+			lua_pop(L, 1);
+		}
+	} else if(lua_isstring(L, index)){
+		ndef->getIds(lua_tostring(L, index), filter);
+	}
+}
+
 // minetest.find_node_near(pos, radius, nodenames) -> pos or nil
 // nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 int ModApiEnvMod::l_find_node_near(lua_State *L)
@@ -509,33 +527,15 @@ int ModApiEnvMod::l_find_node_near(lua_State *L)
 	INodeDefManager *ndef = getServer(L)->ndef();
 	v3s16 pos = read_v3s16(L, 1);
 	int radius = luaL_checkinteger(L, 2);
+	// findNodeNear() takes an s16
+	radius = rangelim(radius, 0, MAP_GENERATION_LIMIT);
 	std::set<content_t> filter;
-	if(lua_istable(L, 3)){
-		int table = 3;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0){
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
-		}
-	} else if(lua_isstring(L, 3)){
-		ndef->getIds(lua_tostring(L, 3), filter);
-	}
+	read_content_filter(L, 3, ndef, filter);
 
-	for(int d=1; d<=radius; d++){
-		std::list<v3s16> list;
-		getFacePositions(list, d);
-		for(std::list<v3s16>::iterator i = list.begin();
-				i != list.end(); ++i){
-			v3s16 p = pos + (*i);
-			content_t c = env->getMap().getNodeNoEx(p).getContent();
-			if(filter.count(c) != 0){
-				push_v3s16(L, p);
-				return 1;
-			}
-		}
+	v3s16 p;
+	if(env->getMap().findNodeNear(pos, radius, filter, p)){
+		push_v3s16(L, p);
+		return 1;
 	}
 	return 0;
 }
@@ -550,40 +550,50 @@ int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 	v3s16 minp = read_v3s16(L, 1);
 	v3s16 maxp = read_v3s16(L, 2);
 	std::set<content_t> filter;
-	if(lua_istable(L, 3)){
-		int table = 3;
-		lua_pushnil(L);
-		while(lua_next(L, table) != 0){
-			// key at index -2 and value at index -1
-			luaL_checktype(L, -1, LUA_TSTRING);
-			ndef->getIds(lua_tostring(L, -1), filter);
-			// removes value, keeps key for next iteration
-			lua_pop(L, 1);
-		}
-	} else if(lua_isstring(L, 3)){
-		ndef->getIds(lua_tostring(L, 3), filter);
+	read_content_filter(L, 3, ndef, filter);
+
+	std::vector<v3s16> found;
+	env->getMap().findNodesInArea(minp, maxp, filter, found);
+
+	lua_createtable(L, found.size(), 0);
+	for(u32 i=0; i<found.size(); i++){
+		push_v3s16(L, found[i]);
+		lua_rawseti(L, -2, i + 1);
 	}
+	return 1;
+}
 
-	// Get the table insert function
-	lua_getglobal(L, "table");
-	lua_getfield(L, -1, "insert");
-	int table_insert = lua_gettop(L);
+// minetest.count_nodes_in_area(minp, maxp, nodenames) -> {name = count, ...}
+// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"; all if nil
+int ModApiEnvMod::l_count_nodes_in_area(lua_State *L)
+{
+	GET_ENV_PTR;
+
+	INodeDefManager *ndef = getServer(L)->ndef();
+	v3s16 minp = read_v3s16(L, 1);
+	v3s16 maxp = read_v3s16(L, 2);
+	std::set<content_t> filter;
+	read_content_filter(L, 3, ndef, filter);
+	// Nothing to count if none of the names are known
+	if(filter.empty() && !lua_isnoneornil(L, 3)){
+		lua_newtable(L);
+		return 1;
+	}
+
+	std::map<content_t, u32> counts;
+	env->getMap().countNodesInArea(minp, maxp, filter, counts);
+
+	// Several ids can have the same name, eg. unknown nodes
+	std::map<std::string, u32> name_counts;
+	for(std::map<content_t, u32>::iterator
+			i = counts.begin(); i != counts.end(); ++i)
+		name_counts[ndef->get(i->first).name] += i->second;
 
 	lua_newtable(L);
-	int table = lua_gettop(L);
-	for(s16 x=minp.X; x<=maxp.X; x++)
-	for(s16 y=minp.Y; y<=maxp.Y; y++)
-	for(s16 z=minp.Z; z<=maxp.Z; z++)
-	{
-		v3s16 p(x,y,z);
-		content_t c = env->getMap().getNodeNoEx(p).getContent();
-		if(filter.count(c) != 0){
-			lua_pushvalue(L, table_insert);
-			lua_pushvalue(L, table);
-			push_v3s16(L, p);
-			if(lua_pcall(L, 2, 0, 0))
-				script_error(L);
-		}
+	for(std::map<std::string, u32>::iterator
+			i = name_counts.begin(); i != name_counts.end(); ++i){
+		lua_pushnumber(L, i->second);
+		lua_setfield(L, -2, i->first.c_str());
 	}
 	return 1;
 }
@@ -844,6 +854,7 @@ void ModApiEnvMod::Initialize(lua_State *L, int top)
 	API_FCT(get_gametime);
 	API_FCT(find_node_near);
 	API_FCT(find_nodes_in_area);
+	API_FCT(count_nodes_in_area);
 	API_FCT(get_perlin);
 	API_FCT(get_perlin_map);
 	API_FCT(get_voxel_manip);
@@ -115,6 +115,10 @@ class ModApiEnvMod : public ModApiBase {
 	// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 	static int l_find_nodes_in_area(lua_State *L);
 
+	// minetest.count_nodes_in_area(minp, maxp, nodenames) -> {name = count, ...}
+	// nodenames: eg. {"ignore", "group:tree"} or "default:dirt"; all if nil
+	static int l_count_nodes_in_area(lua_State *L);
+
 	// minetest.get_perlin(seeddiff, octaves, persistence, scale)
 	// returns world-specific PerlinNoise
 	static int l_get_perlin(lua_State *L);
@@ -54,48 +54,154 @@ int LuaVoxelManip::l_read_from_map(lua_State *L)
 	return 2;
 }
 
-int LuaVoxelManip::l_get_data(lua_State *L)
+/*
+	The fields of the nodes are exchanged with Lua as flat arrays that
+	are indexed like VoxelArea
+*/
+enum NodeField
 {
-	NO_MAP_LOCK_REQUIRED;
+	NODE_CONTENT,
+	NODE_PARAM1,
+	NODE_PARAM2
+};
 
-	LuaVoxelManip *o = checkobject(L, 1);
-	ManualMapVoxelManipulator *vm = o->vm;
-	
+static inline lua_Integer get_node_field(const MapNode &n, int field)
+{
+	switch (field) {
+	case NODE_PARAM1:
+		return n.param1;
+	case NODE_PARAM2:
+		return n.param2;
+	default:
+		return n.getContent();
+	}
+}
+
+static inline void set_node_field(MapNode &n, int field, lua_Integer value)
+{
+	switch (field) {
+	case NODE_PARAM1:
+		n.param1 = value;
+		break;
+	case NODE_PARAM2:
+		n.param2 = value;
+		break;
+	default:
+		n.setContent(value);
+	}
+}
+
+// Leaves the field of all nodes on top of stack, in the table at buffer
+// if there is one there so that mapgens don't need a new table for every
+// chunk
+static int push_node_fields(lua_State *L, int buffer,
+		ManualMapVoxelManipulator *vm, int field)
+{
 	int volume = vm->m_area.getVolume();
-	
-	lua_newtable(L);
+
+	if (lua_istable(L, buffer))
+		lua_pushvalue(L, buffer);
+	else
+		lua_createtable(L, volume, 0);
 	for (int i = 0; i != volume; i++) {
-		lua_Integer cid = vm->m_data[i].getContent();
-		lua_pushinteger(L, cid);
+		lua_pushinteger(L, get_node_field(vm->m_data[i], field));
 		lua_rawseti(L, -2, i + 1);
 	}
-	
+
 	return 1;
 }
 
-int LuaVoxelManip::l_set_data(lua_State *L)
+static int read_node_fields(lua_State *L, int table,
+		ManualMapVoxelManipulator *vm, int field)
 {
-	NO_MAP_LOCK_REQUIRED;
-	
-	LuaVoxelManip *o = checkobject(L, 1);
-	ManualMapVoxelManipulator *vm = o->vm;
-	
-	if (!lua_istable(L, 2))
+	if (!lua_istable(L, table))
 		return 0;
-	
+
 	int volume = vm->m_area.getVolume();
 	for (int i = 0; i != volume; i++) {
-		lua_rawgeti(L, 2, i + 1);
-		content_t c = lua_tointeger(L, -1);
-		
-		vm->m_data[i].setContent(c);
-
+		lua_rawgeti(L, table, i + 1);
+		set_node_field(vm->m_data[i], field, lua_tointeger(L, -1));
 		lua_pop(L, 1);
 	}
-		
+
 	return 0;
 }
 
+int LuaVoxelManip::l_get_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	return push_node_fields(L, 2, o->vm, NODE_CONTENT);
+}
+
+int LuaVoxelManip::l_set_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+	
+	LuaVoxelManip *o = checkobject(L, 1);
+	return read_node_fields(L, 2, o->vm, NODE_CONTENT);
+}
+
+int LuaVoxelManip::l_get_light_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	return push_node_fields(L, 2, o->vm, NODE_PARAM1);
+}
+
+int LuaVoxelManip::l_set_light_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	return read_node_fields(L, 2, o->vm, NODE_PARAM1);
+}
+
+int LuaVoxelManip::l_get_param2_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	return push_node_fields(L, 2, o->vm, NODE_PARAM2);
+}
+
+int LuaVoxelManip::l_set_param2_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	return read_node_fields(L, 2, o->vm, NODE_PARAM2);
+}
+
+int LuaVoxelManip::l_get_data_view(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	LuaVoxelManipView::create(L, 1, o->vm, NODE_CONTENT);
+	return 1;
+}
+
+int LuaVoxelManip::l_get_light_data_view(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	LuaVoxelManipView::create(L, 1, o->vm, NODE_PARAM1);
+	return 1;
+}
+
+int LuaVoxelManip::l_get_param2_data_view(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+	LuaVoxelManipView::create(L, 1, o->vm, NODE_PARAM2);
+	return 1;
+}
+
 int LuaVoxelManip::l_write_to_map(lua_State *L)
 {
 	LuaVoxelManip *o = checkobject(L, 1);
@@ -294,6 +400,13 @@ const luaL_reg LuaVoxelManip::methods[] = {
 	luamethod(LuaVoxelManip, read_from_map),
 	luamethod(LuaVoxelManip, get_data),
 	luamethod(LuaVoxelManip, set_data),
+	luamethod(LuaVoxelManip, get_light_data),
+	luamethod(LuaVoxelManip, set_light_data),
+	luamethod(LuaVoxelManip, get_param2_data),
+	luamethod(LuaVoxelManip, set_param2_data),
+	luamethod(LuaVoxelManip, get_data_view),
+	luamethod(LuaVoxelManip, get_light_data_view),
+	luamethod(LuaVoxelManip, get_param2_data_view),
 	luamethod(LuaVoxelManip, write_to_map),
 	luamethod(LuaVoxelManip, update_map),
 	luamethod(LuaVoxelManip, update_liquids),
@@ -301,3 +414,120 @@ const luaL_reg LuaVoxelManip::methods[] = {
 	luamethod(LuaVoxelManip, set_lighting),
 	{0,0}
 };
+
+/*
+	LuaVoxelManipView
+
+	The metamethods are called for every node, so they leave out the
+	profiling and the type check of the view
+*/
+
+// garbage collector
+int LuaVoxelManipView::gc_object(lua_State *L)
+{
+	LuaVoxelManipView *o = *(LuaVoxelManipView **)(lua_touserdata(L, 1));
+	delete o;
+
+	return 0;
+}
+
+// view[i] -> value, or nil if i is out of the VoxelManip
+int LuaVoxelManipView::mt_index(lua_State *L)
+{
+	LuaVoxelManipView *o = *(LuaVoxelManipView **)(lua_touserdata(L, 1));
+	ManualMapVoxelManipulator *vm = o->vm;
+
+	if (!lua_isnumber(L, 2))
+		return 0;
+	int i = lua_tointeger(L, 2);
+	if (i < 1 || i > vm->m_area.getVolume())
+		return 0;
+
+	lua_pushinteger(L, get_node_field(vm->m_data[i - 1], o->field));
+	return 1;
+}
+
+// view[i] = value
+int LuaVoxelManipView::mt_newindex(lua_State *L)
+{
+	LuaVoxelManipView *o = *(LuaVoxelManipView **)(lua_touserdata(L, 1));
+	ManualMapVoxelManipulator *vm = o->vm;
+
+	int i = luaL_checkint(L, 2);
+	if (i < 1 || i > vm->m_area.getVolume())
+		return luaL_error(L, "VoxelManip view index %d out of range", i);
+
+	set_node_field(vm->m_data[i - 1], o->field, luaL_checkinteger(L, 3));
+	return 0;
+}
+
+// #view -> volume of the VoxelManip
+int LuaVoxelManipView::mt_len(lua_State *L)
+{
+	LuaVoxelManipView *o = *(LuaVoxelManipView **)(lua_touserdata(L, 1));
+	lua_pushinteger(L, o->vm->m_area.getVolume());
+	return 1;
+}
+
+LuaVoxelManipView::LuaVoxelManipView(ManualMapVoxelManipulator *vm, int field)
+{
+	this->vm    = vm;
+	this->field = field;
+}
+
+void LuaVoxelManipView::create(lua_State *L, int vm_index,
+		ManualMapVoxelManipulator *vm, int field)
+{
+	LuaVoxelManipView *o = new LuaVoxelManipView(vm, field);
+
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+
+	// Referenced from the environment of the view
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, vm_index);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+}
+
+LuaVoxelManipView *LuaVoxelManipView::checkobject(lua_State *L, int narg)
+{
+	luaL_checktype(L, narg, LUA_TUSERDATA);
+
+	void *ud = luaL_checkudata(L, narg, className);
+	if (!ud)
+		luaL_typerror(L, narg, className);
+
+	return *(LuaVoxelManipView **)ud;  // unbox pointer
+}
+
+void LuaVoxelManipView::Register(lua_State *L)
+{
+	luaL_newmetatable(L, className);
+	int metatable = lua_gettop(L);
+
+	lua_pushliteral(L, "__metatable");
+	lua_pushboolean(L, false);
+	lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+	lua_pushliteral(L, "__index");
+	lua_pushcfunction(L, mt_index);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__newindex");
+	lua_pushcfunction(L, mt_newindex);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__len");
+	lua_pushcfunction(L, mt_len);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__gc");
+	lua_pushcfunction(L, gc_object);
+	lua_settable(L, metatable);
+
+	lua_pop(L, 1);  // drop metatable
+}
+
+const char LuaVoxelManipView::className[] = "VoxelManipView";
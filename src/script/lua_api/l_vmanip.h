@@ -45,6 +45,13 @@ class LuaVoxelManip : public ModApiBase {
 	static int l_read_from_map(lua_State *L);
 	static int l_get_data(lua_State *L);
 	static int l_set_data(lua_State *L);
+	static int l_get_light_data(lua_State *L);
+	static int l_set_light_data(lua_State *L);
+	static int l_get_param2_data(lua_State *L);
+	static int l_set_param2_data(lua_State *L);
+	static int l_get_data_view(lua_State *L);
+	static int l_get_light_data_view(lua_State *L);
+	static int l_get_param2_data_view(lua_State *L);
 	static int l_write_to_map(lua_State *L);
 
 	static int l_update_map(lua_State *L);
@@ -66,4 +73,35 @@ class LuaVoxelManip : public ModApiBase {
 	static void Register(lua_State *L);
 };
 
+/*
+  VoxelManipView: one field of the nodes of a VoxelManip, indexed like
+  the arrays of VoxelManip:get_data() but read and written in place
+ */
+class LuaVoxelManipView : public ModApiBase {
+private:
+	ManualMapVoxelManipulator *vm;
+	// See NodeField in l_vmanip.cpp
+	int field;
+
+	static const char className[];
+
+	static int gc_object(lua_State *L);
+
+	static int mt_index(lua_State *L);
+	static int mt_newindex(lua_State *L);
+	static int mt_len(lua_State *L);
+
+public:
+	LuaVoxelManipView(ManualMapVoxelManipulator *vm, int field);
+
+	// Creates a view of the VoxelManip at vm_index and leaves it on top
+	// of stack; the view keeps the VoxelManip from being collected
+	static void create(lua_State *L, int vm_index,
+			ManualMapVoxelManipulator *vm, int field);
+
+	static LuaVoxelManipView *checkobject(lua_State *L, int narg);
+
+	static void Register(lua_State *L);
+};
+
 #endif /* L_VMANIP_H_ */
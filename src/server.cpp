@@ -165,6 +165,59 @@ v3f ServerSoundParams::getPos(ServerEnvironment *env, bool *pos_exists) const
 	return v3f(0,0,0);
 }
 
+/*
+	Estimates whether a block is hidden from camera_pos, by walking the
+	blocks on the line from the camera to the center of the block and
+	looking for a loaded, fully opaque one.
+*/
+static bool isBlockOccluded(Map &map, v3f camera_pos, v3s16 blockpos)
+{
+	// Positions in units of blocks, block p spanning [p, p + 1)
+	v3f start_f = (camera_pos / BS + v3f(0.5, 0.5, 0.5)) / MAP_BLOCKSIZE;
+	f32 start[3] = {start_f.X, start_f.Y, start_f.Z};
+	f32 dir[3] = {blockpos.X + 0.5f - start[0], blockpos.Y + 0.5f - start[1],
+			blockpos.Z + 0.5f - start[2]};
+
+	s16 p[3];
+	s16 step[3];
+	// Line parameter of the next block boundary on each axis and the
+	// distance between boundaries; the line reaches blockpos at 1
+	f32 t_max[3];
+	f32 t_delta[3];
+	for(u8 i=0; i<3; i++)
+	{
+		p[i] = floor(start[i]);
+		step[i] = dir[i] > 0 ? 1 : -1;
+		if(fabs(dir[i]) < 0.0001)
+		{
+			t_max[i] = 2;
+			t_delta[i] = 2;
+			continue;
+		}
+		t_max[i] = ((dir[i] > 0 ? p[i] + 1 : p[i]) - start[i]) / dir[i];
+		t_delta[i] = fabs(1.0 / dir[i]);
+	}
+
+	for(;;)
+	{
+		u8 i = t_max[0] < t_max[1]
+				? (t_max[0] < t_max[2] ? 0 : 2)
+				: (t_max[1] < t_max[2] ? 1 : 2);
+		if(t_max[i] > 1)
+			break;
+		p[i] += step[i];
+		t_max[i] += t_delta[i];
+
+		v3s16 pos(p[0], p[1], p[2]);
+		if(pos == blockpos)
+			break;
+		MapBlock *block = map.getBlockNoCreateNoEx(pos);
+		if(block && block->isFullyOpaque())
+			return true;
+	}
+	return false;
+}
+
 void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		std::vector<PrioritySortedBlockTransfer> &dest)
 {
@@ -173,6 +226,18 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	/*u32 timer_result;
 	TimeTaker timer("RemoteClient::GetNextBlocks", &timer_result);*/
 
+	// Called for every client on every step
+	static SettingHandle<u16> max_simul_sends_setting(g_settings,
+			"max_simultaneous_block_sends_per_client");
+	static SettingHandle<float> full_send_min_time_from_building(g_settings,
+			"full_block_send_enable_min_time_from_building");
+	static SettingHandle<s16> max_send_distance(g_settings,
+			"max_block_send_distance");
+	static SettingHandle<s16> max_generate_distance(g_settings,
+			"max_block_generate_distance");
+	static SettingHandle<bool> block_send_defer_occluded(g_settings,
+			"block_send_defer_occluded");
+
 	// Increment timers
 	m_nothing_to_send_pause_timer -= dtime;
 	m_nearest_unsent_reset_timer += dtime;
@@ -186,8 +251,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		return;
 
 	// Won't send anything if already sending
-	if(m_blocks_sending.size() >= g_settings->getU16
-			("max_simultaneous_block_sends_per_client"))
+	if(m_blocks_sending.size() >= max_simul_sends_setting.get())
 	{
 		//infostream<<"Not sending any blocks, Queue full."<<std::endl;
 		return;
@@ -224,7 +288,13 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	{
 		m_nearest_unsent_d = 0;
 		m_last_center = center;
+		m_send_occluded = false;
+
+		// Don't make the emerge threads work on blocks left behind
+		server->m_emerge->cancelBlockEmerges(peer_id, center,
+				max_send_distance.get());
 	}
+	m_blocks_sent.setCenter(center, max_send_distance.get());
 
 	/*infostream<<"m_nearest_unsent_reset_timer="
 			<<m_nearest_unsent_reset_timer<<std::endl;*/
@@ -234,18 +304,27 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	{
 		m_nearest_unsent_reset_timer = 0;
 		m_nearest_unsent_d = 0;
+		m_blocks_sent.clearSkipped();
 		//infostream<<"Resetting m_nearest_unsent_d for "
 		//		<<server->getPlayerName(peer_id)<<std::endl;
 	}
 
+	f32 speed_in_blocks = (playerspeed/(MAP_BLOCKSIZE*BS)).getLength();
+
 	//s16 last_nearest_unsent_d = m_nearest_unsent_d;
 	s16 d_start = m_nearest_unsent_d;
 
+	/*
+		Distances with nothing left to send don't count against the
+		per-call limit. When moving fast the nearest distances are
+		searched along the movement instead, so they are always visited.
+	*/
+	if(speed_in_blocks <= 0.8 || d_start > 2)
+		d_start = m_blocks_sent.findUnsentDistance(d_start);
+
 	//infostream<<"d_start="<<d_start<<std::endl;
 
-	u16 max_simul_sends_setting = g_settings->getU16
-			("max_simultaneous_block_sends_per_client");
-	u16 max_simul_sends_usually = max_simul_sends_setting;
+	u16 max_simul_sends_usually = max_simul_sends_setting.get();
 
 	/*
 		Check the time from last addNode/removeNode.
@@ -253,8 +332,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		Decrease send rate if player is building stuff.
 	*/
 	m_time_from_building += dtime;
-	if(m_time_from_building < g_settings->getFloat(
-				"full_block_send_enable_min_time_from_building"))
+	if(m_time_from_building < full_send_min_time_from_building.get())
 	{
 		max_simul_sends_usually
 			= LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS;
@@ -274,8 +352,10 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	*/
 	s32 new_nearest_unsent_d = -1;
 
-	s16 d_max = g_settings->getS16("max_block_send_distance");
-	s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
+	s16 d_max = max_send_distance.get();
+	s16 d_max_gen = max_generate_distance.get();
+	bool defer_occluded = !m_send_occluded
+			&& block_send_defer_occluded.get();
 
 	// Don't loop very much at a time
 	s16 max_d_increment_at_time = 2;
@@ -291,8 +371,6 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	s32 nearest_sent_d = -1;
 	bool queue_is_full = false;
 
-	f32 speed_in_blocks = (playerspeed/(MAP_BLOCKSIZE*BS)).getLength();
-
 	s16 d;
 	for(d = d_start; d <= d_max; d++)
 	{
@@ -337,10 +415,10 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 			}
 		} else {
 		/*
-			Get the border/face dot coordinates of a "d-radiused"
-			box
+			Get the unsent border/face dot coordinates of a
+			"d-radiused" box
 		*/
-			getFacePositions(list, d);
+			m_blocks_sent.getUnsent(d, list);
 		}
 
 		std::list<v3s16>::iterator li;
@@ -361,7 +439,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 
 			// If block is very close, allow full maximum
 			if(d <= BLOCK_SEND_DISABLE_LIMITS_MAX_D)
-				max_simul_dynamic = max_simul_sends_setting;
+				max_simul_dynamic = max_simul_sends_setting.get();
 
 			// Don't select too many blocks for sending
 			if(num_blocks_selected >= max_simul_dynamic)
@@ -383,7 +461,10 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 			|| p.Y > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
 			|| p.Z < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
 			|| p.Z > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE)
+			{
+				m_blocks_sent.setSkipped(p);
 				continue;
+			}
 
 			// If this is true, inexistent block will be made from scratch
 			bool generate = d <= d_max_gen;
@@ -448,7 +529,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				Don't send already sent blocks
 			*/
 			{
-				if(m_blocks_sent.find(p) != m_blocks_sent.end())
+				if(m_blocks_sent.isSent(p))
 				{
 					continue;
 				}
@@ -504,17 +585,39 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				if(d >= 4)
 				{
 					if(block->getDayNightDiff() == false)
+					{
+						// Until it is modified or the center moves
+						m_blocks_sent.setSkipped(p);
 						continue;
+					}
 				}
 #endif
 			}
 
+			/*
+				Leave blocks that are probably hidden behind opaque
+				blocks for after everything else in range.
+				Blocks in the open are likely seen soon from somewhere
+				close by, so only underground or unknown ones are
+				looked at.
+			*/
+			if(defer_occluded && can_skip
+					&& d > BLOCK_SEND_DISABLE_LIMITS_MAX_D
+					&& (block == NULL || surely_not_found_on_disk
+						|| block->getIsUnderground())
+					&& isBlockOccluded(server->m_env->getMap(), camera_pos, p))
+			{
+				m_blocks_sent.setDeferred(p);
+				continue;
+			}
+
 			/*
 				If block has been marked to not exist on disk (dummy)
 				and generating new ones is not wanted, skip block.
 			*/
 			if(generate == false && surely_not_found_on_disk == true)
 			{
+				m_blocks_sent.setSkipped(p);
 				// get next one.
 				continue;
 			}
@@ -555,7 +658,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				}
 			*/
 
-				if (server->m_emerge->enqueueBlockEmerge(peer_id, p, generate)) {
+				if (server->m_emerge->enqueueBlockEmerge(peer_id, p, generate, d)) {
 					if (nearest_emerged_d == -1)
 						nearest_emerged_d = d;
 				} else {
@@ -596,9 +699,26 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	} else if(nearest_emergefull_d != -1){
 		new_nearest_unsent_d = nearest_emergefull_d;
 	} else {
-		if(d > g_settings->getS16("max_block_send_distance")){
+		if(d > max_send_distance.get()){
 			new_nearest_unsent_d = 0;
-			m_nothing_to_send_pause_timer = 2.0;
+
+			if(!m_complete_view_reported){
+				m_complete_view_reported = true;
+				infostream<<"Server: Client "<<peer_id
+						<<" has a complete view after "<<m_sent_count
+						<<" blocks"<<std::endl;
+				g_profiler->avg("Server: blocks sent before complete view",
+						m_sent_count);
+			}
+
+			// Go through the occluded blocks before pausing
+			u32 deferred = m_blocks_sent.clearDeferred();
+			if(deferred != 0){
+				m_send_occluded = true;
+				g_profiler->avg("Server: deferred occluded blocks", deferred);
+			} else {
+				m_nothing_to_send_pause_timer = 2.0;
+			}
 			/*infostream<<"GetNextBlocks(): d wrapped around for "
 					<<server->getPlayerName(peer_id)
 					<<"; setting to 0 and pausing"<<std::endl;*/
@@ -628,11 +748,13 @@ void RemoteClient::GotBlock(v3s16 p)
 				" m_blocks_sending"<<std::endl;*/
 		m_excess_gotblocks++;
 	}
-	m_blocks_sent.insert(p);
+	m_blocks_sent.setSent(p);
 }
 
 void RemoteClient::SentBlock(v3s16 p)
 {
+	m_sent_count++;
+
 	if(m_blocks_sending.find(p) == m_blocks_sending.end())
 		m_blocks_sending[p] = 0.0;
 	else
@@ -646,8 +768,7 @@ void RemoteClient::SetBlockNotSent(v3s16 p)
 
 	if(m_blocks_sending.find(p) != m_blocks_sending.end())
 		m_blocks_sending.erase(p);
-	if(m_blocks_sent.find(p) != m_blocks_sent.end())
-		m_blocks_sent.erase(p);
+	m_blocks_sent.setNotSent(p);
 }
 
 void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks, bool no_d_reset)
@@ -663,8 +784,7 @@ void RemoteClient::SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks, bool no_
 
 		if(m_blocks_sending.find(p) != m_blocks_sending.end())
 			m_blocks_sending.erase(p);
-		if(m_blocks_sent.find(p) != m_blocks_sent.end())
-			m_blocks_sent.erase(p);
+		m_blocks_sent.setNotSent(p);
 	}
 }
 
@@ -1082,6 +1202,11 @@ void Server::AsyncRunStep()
 
 	g_profiler->add("Server::AsyncRunStep with dtime (num)", 1);
 
+	static SettingHandle<float> time_speed_setting(g_settings, "time_speed");
+	static SettingHandle<bool> enable_damage(g_settings, "enable_damage");
+	static SettingHandle<s16> active_object_send_range_blocks(g_settings,
+			"active_object_send_range_blocks");
+
 	//infostream<<"Server steps "<<dtime<<std::endl;
 	//infostream<<"Server::AsyncRunStep(): dtime="<<dtime<<std::endl;
 
@@ -1116,7 +1241,7 @@ void Server::AsyncRunStep()
 	{
 		JMutexAutoLock envlock(m_env_mutex);
 
-		m_env->setTimeOfDaySpeed(g_settings->getFloat("time_speed"));
+		m_env->setTimeOfDaySpeed(time_speed_setting.get());
 
 		/*
 			Send to clients at constant intervals
@@ -1131,7 +1256,7 @@ void Server::AsyncRunStep()
 			JMutexAutoLock conlock(m_con_mutex);
 
 			u16 time = m_env->getTimeOfDay();
-			float time_speed = g_settings->getFloat("time_speed");
+			float time_speed = time_speed_setting.get();
 
 			for(std::map<u16, RemoteClient*>::iterator
 				i = m_clients.begin();
@@ -1167,8 +1292,20 @@ void Server::AsyncRunStep()
 		JMutexAutoLock lock(m_env_mutex);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
+		float unload_timeout =
+				g_settings->getFloat("server_unload_unused_data_timeout");
+		std::list<v3s16> unloaded_blocks;
 		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
-				g_settings->getFloat("server_unload_unused_data_timeout"));
+				unload_timeout, &unloaded_blocks);
+
+		// Forget serialized data of unloaded and unused blocks
+		for(std::list<v3s16>::iterator
+				i = unloaded_blocks.begin();
+				i != unloaded_blocks.end(); ++i)
+			m_block_data_cache.invalidate(*i);
+		m_block_data_cache.step(map_timer_and_unload_dtime, unload_timeout);
+		g_profiler->avg("Server: block data cache size",
+				m_block_data_cache.size());
 	}
 
 	/*
@@ -1196,7 +1333,7 @@ void Server::AsyncRunStep()
 			/*
 				Handle player HPs (die if hp=0)
 			*/
-			if(playersao->m_hp_not_sent && g_settings->getBool("enable_damage"))
+			if(playersao->m_hp_not_sent && enable_damage.get())
 			{
 				if(playersao->getHP() == 0)
 					DiePlayer(client->peer_id);
@@ -1327,7 +1464,7 @@ void Server::AsyncRunStep()
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
 
 		// Radius inside which objects are active
-		s16 radius = g_settings->getS16("active_object_send_range_blocks");
+		s16 radius = active_object_send_range_blocks.get();
 		radius *= MAP_BLOCKSIZE;
 
 		for(std::map<u16, RemoteClient*>::iterator
@@ -1614,6 +1751,11 @@ void Server::AsyncRunStep()
 		{
 			MapEditEvent* event = m_unsent_map_edit_queue.pop_front();
 
+			for(std::set<v3s16>::iterator
+					i = event->modified_blocks.begin();
+					i != event->modified_blocks.end(); ++i)
+				m_block_data_cache.invalidate(*i);
+
 			// Players far away from the change are stored here.
 			// Instead of sending the changes, MapBlocks are set not sent
 			// for them.
@@ -4199,25 +4341,32 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 #endif
 
 	/*
-		Create a packet with the block in the right format
+		Create a packet with the block in the right format,
+		or reuse the one made earlier for another client
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	block->serializeNetworkSpecific(os, net_proto_version);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
+	SharedBuffer<u8> reply;
+	if(m_block_data_cache.get(block, ver, net_proto_version, reply))
+	{
+		g_profiler->add("Server: block data cache hits", 1);
+	}
+	else
+	{
+		g_profiler->add("Server: block data cache misses", 1);
 
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+		std::ostringstream os(std::ios_base::binary);
+		writeU16(os, TOCLIENT_BLOCKDATA);
+		writeV3S16(os, p);
+		block->serialize(os, ver, false);
+		block->serializeNetworkSpecific(os, net_proto_version);
+		std::string s = os.str();
+		reply = SharedBuffer<u8>((u8*)s.c_str(), s.size());
+
+		m_block_data_cache.set(block, ver, net_proto_version, reply);
+	}
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
-			<<":  \tpacket size: "<<replysize<<std::endl;*/
+			<<":  \tpacket size: "<<reply.getSize()<<std::endl;*/
 
 	/*
 		Send packet
@@ -4225,6 +4374,79 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 	m_con.Send(peer_id, 1, reply, true);
 }
 
+/*
+	BlockDataCache
+*/
+
+bool BlockDataCache::get(MapBlock *block, u8 ver, u16 net_proto_version,
+		SharedBuffer<u8> &data)
+{
+	std::pair<std::multimap<v3s16, Entry>::iterator,
+			std::multimap<v3s16, Entry>::iterator> range =
+			m_entries.equal_range(block->getPos());
+	for(std::multimap<v3s16, Entry>::iterator
+			i = range.first; i != range.second; ++i)
+	{
+		Entry &e = i->second;
+		if(e.ver != ver || e.net_proto_version != net_proto_version)
+			continue;
+		if(e.block != block || e.changed_serial != block->getChangedSerial())
+			return false;
+		e.unused_time = 0;
+		data = e.data;
+		return true;
+	}
+	return false;
+}
+
+void BlockDataCache::set(MapBlock *block, u8 ver, u16 net_proto_version,
+		SharedBuffer<u8> data)
+{
+	std::pair<std::multimap<v3s16, Entry>::iterator,
+			std::multimap<v3s16, Entry>::iterator> range =
+			m_entries.equal_range(block->getPos());
+	std::multimap<v3s16, Entry>::iterator i = range.first;
+	for(; i != range.second; ++i)
+	{
+		if(i->second.ver == ver &&
+				i->second.net_proto_version == net_proto_version)
+			break;
+	}
+	if(i == range.second)
+		i = m_entries.insert(std::make_pair(block->getPos(), Entry()));
+
+	Entry &e = i->second;
+	e.block = block;
+	e.changed_serial = block->getChangedSerial();
+	e.ver = ver;
+	e.net_proto_version = net_proto_version;
+	e.unused_time = 0;
+	e.data = data;
+}
+
+void BlockDataCache::invalidate(v3s16 p)
+{
+	m_entries.erase(p);
+}
+
+void BlockDataCache::clear()
+{
+	m_entries.clear();
+}
+
+void BlockDataCache::step(float dtime, float max_unused_time)
+{
+	for(std::multimap<v3s16, Entry>::iterator
+			i = m_entries.begin(); i != m_entries.end();)
+	{
+		i->second.unused_time += dtime;
+		if(i->second.unused_time > max_unused_time)
+			m_entries.erase(i++);
+		else
+			++i;
+	}
+}
+
 void Server::SendBlocks(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
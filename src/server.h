@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "util/thread.h"
 #include "environment.h"
+#include "blocksendset.h"
 #include <string>
 #include <list>
 #include <map>
@@ -153,6 +154,48 @@ struct PrioritySortedBlockTransfer
 	u16 peer_id;
 };
 
+/*
+	Cache of ready-to-send TOCLIENT_BLOCKDATA packets, shared by all
+	clients that use the same serialization and protocol versions.
+
+	An entry is valid as long as the MapBlock it was made of is loaded
+	and its change serial (MapBlock::getChangedSerial()) is unchanged.
+
+	Behind m_env_mutex.
+*/
+class BlockDataCache
+{
+public:
+	// Returns false and leaves data untouched if there is no valid entry
+	bool get(MapBlock *block, u8 ver, u16 net_proto_version,
+			SharedBuffer<u8> &data);
+	void set(MapBlock *block, u8 ver, u16 net_proto_version,
+			SharedBuffer<u8> data);
+
+	void invalidate(v3s16 p);
+	void clear();
+
+	// Drops entries that have not been used for max_unused_time seconds
+	void step(float dtime, float max_unused_time);
+
+	u32 size()
+	{
+		return m_entries.size();
+	}
+
+private:
+	struct Entry
+	{
+		MapBlock *block;
+		u32 changed_serial;
+		u8 ver;
+		u16 net_proto_version;
+		float unused_time;
+		SharedBuffer<u8> data;
+	};
+	std::multimap<v3s16, Entry> m_entries;
+};
+
 struct MediaRequest
 {
 	std::string name;
@@ -241,6 +284,9 @@ class RemoteClient
 		m_nearest_unsent_reset_timer = 0.0;
 		m_nothing_to_send_counter = 0;
 		m_nothing_to_send_pause_timer = 0;
+		m_send_occluded = false;
+		m_sent_count = 0;
+		m_complete_view_reported = false;
 	}
 	~RemoteClient()
 	{
@@ -304,10 +350,9 @@ class RemoteClient
 		- A block is cleared from here when client says it has
 		  deleted it from it's memory
 
-		Key is position, value is dummy.
 		No MapBlock* is stored here because the blocks can get deleted.
 	*/
-	std::set<v3s16> m_blocks_sent;
+	BlockSendSet m_blocks_sent;
 	s16 m_nearest_unsent_d;
 	v3s16 m_last_center;
 	float m_nearest_unsent_reset_timer;
@@ -334,6 +379,17 @@ class RemoteClient
 	// CPU usage optimization
 	u32 m_nothing_to_send_counter;
 	float m_nothing_to_send_pause_timer;
+
+	/*
+		Set when a pass through the send range is over and the blocks
+		deferred as occluded are being sent; cleared when moving to
+		another block.
+	*/
+	bool m_send_occluded;
+	// Blocks sent in total, and whether the count at the end of the
+	// first pass has been reported
+	u32 m_sent_count;
+	bool m_complete_view_reported;
 };
 
 class Server : public con::PeerHandler, public MapEventReceiver,
@@ -826,6 +882,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	std::vector<u32> m_particlespawner_ids;
 
 	std::map<v3s16, MapBlock*> m_modified_blocks;
+
+	// Serialized block packets (behind m_env_mutex)
+	BlockDataCache m_block_data_cache;
 };
 
 /*
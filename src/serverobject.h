@@ -82,7 +82,8 @@ class ServerActiveObject : public ActiveObject
 		Some simple getters/setters
 	*/
 	v3f getBasePosition(){ return m_base_position; }
-	void setBasePosition(v3f pos){ m_base_position = pos; }
+	// Also updates the position in the environment's object index
+	void setBasePosition(v3f pos);
 	ServerEnvironment* getEnv(){ return m_env; }
 	
 	/*
@@ -56,6 +56,18 @@ struct ValueSpec
 	const char *help;
 };
 
+/*
+	See SettingHandle
+*/
+class SettingHandleBase
+{
+public:
+	virtual ~SettingHandleBase() {}
+	// Called with the mutex of the Settings locked; value is NULL if
+	// the setting is not set
+	virtual void update(const std::string *value) = 0;
+};
+
 class Settings
 {
 public:
@@ -93,7 +105,11 @@ class Settings
 	// remove a setting
 	bool remove(const std::string& name)
 	{
-		return m_settings.erase(name);
+		JMutexAutoLock lock(m_mutex);
+
+		bool removed = m_settings.erase(name);
+		updateHandles(name);
+		return removed;
 	}
 
 
@@ -124,6 +140,7 @@ class Settings
 				<<value<<"\""<<std::endl;*/
 
 		m_settings[name] = value;
+		updateHandles(name);
 
 		return true;
 	}
@@ -427,6 +444,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_settings[name] = value;
+		updateHandles(name);
 	}
 
 	void set(std::string name, const char *value)
@@ -434,6 +452,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_settings[name] = value;
+		updateHandles(name);
 	}
 
 
@@ -442,6 +461,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_defaults[name] = value;
+		updateHandles(name);
 	}
 
 	bool exists(std::string name)
@@ -916,6 +936,7 @@ class Settings
 
 		m_settings.clear();
 		m_defaults.clear();
+		updateAllHandles();
 	}
 
 	void updateValue(Settings &other, const std::string &name)
@@ -928,6 +949,7 @@ class Settings
 		try{
 			std::string val = other.get(name);
 			m_settings[name] = val;
+			updateHandles(name);
 		} catch(SettingNotFoundException &e){
 		}
 
@@ -944,6 +966,7 @@ class Settings
 
 		m_settings.insert(other.m_settings.begin(), other.m_settings.end());
 		m_defaults.insert(other.m_defaults.begin(), other.m_defaults.end());
+		updateAllHandles();
 
 		return;
 	}
@@ -976,11 +999,151 @@ class Settings
 		return *this;
 	}
 
+	/*
+		Called by SettingHandle
+	*/
+
+	void registerHandle(const std::string &name, SettingHandleBase *handle)
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		m_handles.insert(std::make_pair(name, handle));
+		handle->update(findValue(name));
+	}
+
+	void unregisterHandle(const std::string &name, SettingHandleBase *handle)
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		std::multimap<std::string, SettingHandleBase*>::iterator i, end;
+		for(i = m_handles.lower_bound(name), end = m_handles.upper_bound(name);
+				i != end; ++i)
+		{
+			if(i->second == handle)
+			{
+				m_handles.erase(i);
+				return;
+			}
+		}
+	}
+
 private:
+	// Returns NULL if not found; m_mutex must be locked
+	const std::string * findValue(const std::string &name)
+	{
+		std::map<std::string, std::string>::iterator n;
+		n = m_settings.find(name);
+		if(n != m_settings.end())
+			return &n->second;
+		n = m_defaults.find(name);
+		if(n != m_defaults.end())
+			return &n->second;
+		return NULL;
+	}
+
+	// Call after changing a setting; m_mutex must be locked
+	void updateHandles(const std::string &name)
+	{
+		std::multimap<std::string, SettingHandleBase*>::iterator i, end;
+		for(i = m_handles.lower_bound(name), end = m_handles.upper_bound(name);
+				i != end; ++i)
+			i->second->update(findValue(name));
+	}
+
+	void updateAllHandles()
+	{
+		for(std::multimap<std::string, SettingHandleBase*>::iterator
+				i = m_handles.begin(); i != m_handles.end(); ++i)
+			i->second->update(findValue(i->first));
+	}
+
 	std::map<std::string, std::string> m_settings;
 	std::map<std::string, std::string> m_defaults;
 	// All methods that access m_settings/m_defaults directly should lock this.
 	JMutex m_mutex;
+	// Not copied with the settings
+	std::multimap<std::string, SettingHandleBase*> m_handles;
+};
+
+inline void parseSettingValue(const std::string &s, bool &value)
+{
+	value = is_yes(s);
+}
+
+inline void parseSettingValue(const std::string &s, u16 &value)
+{
+	value = stoi(s, 0, 65535);
+}
+
+inline void parseSettingValue(const std::string &s, s16 &value)
+{
+	value = stoi(s, -32768, 32767);
+}
+
+inline void parseSettingValue(const std::string &s, s32 &value)
+{
+	value = stoi(s);
+}
+
+inline void parseSettingValue(const std::string &s, float &value)
+{
+	value = stof(s);
+}
+
+/*
+	A setting that is parsed once and then read without locking and
+	without looking it up by name, for code that reads it all the time:
+
+		static SettingHandle<u16> max_sends(g_settings,
+				"max_simultaneous_block_sends_per_client");
+		if(sending >= max_sends.get())
+			...
+
+	The Settings parse it again whenever it is changed. The value is at
+	most 32 bits and is written whole, so it can be read by other threads
+	while that happens. A setting that is not set reads as 0.
+*/
+template <typename T>
+class SettingHandle : public SettingHandleBase
+{
+public:
+	SettingHandle(Settings *settings, const std::string &name):
+		m_settings(settings),
+		m_name(name),
+		m_value(T())
+	{
+		m_settings->registerHandle(m_name, this);
+	}
+
+	~SettingHandle()
+	{
+		m_settings->unregisterHandle(m_name, this);
+	}
+
+	T get() const
+	{
+		return m_value;
+	}
+
+	void update(const std::string *value)
+	{
+		T parsed = T();
+		if(value != NULL)
+			parseSettingValue(*value, parsed);
+		m_value = parsed;
+	}
+
+private:
+	// Fails to compile for values that might not be written whole
+	typedef char value_fits_in_a_word[sizeof(T) <= 4 ? 1 : -1];
+
+	// Not copyable
+	SettingHandle(const SettingHandle &);
+	SettingHandle & operator=(const SettingHandle &);
+
+	Settings *m_settings;
+	std::string m_name;
+	volatile T m_value;
 };
 
 #endif
@@ -340,6 +340,9 @@ class ShaderSource : public IWritableShaderSource, public IShaderConstantSetterR
 
 	// Queued shader fetches (to be processed by the main thread)
 	RequestQueue<std::string, u32, u8, u8> m_get_shader_queue;
+	// Lets one thread at a time wait for a queued fetch; the mesh
+	// update threads share the same result queue
+	JMutex m_get_shader_wait_mutex;
 
 	// Global constant setters
 	// TODO: Delete these in the destructor
@@ -374,6 +377,7 @@ ShaderSource::ShaderSource(IrrlichtDevice *device):
 	m_shader_callback = new ShaderCallback(this, "default");
 
 	m_shaderinfo_cache_mutex.Init();
+	m_get_shader_wait_mutex.Init();
 
 	m_main_thread = get_current_thread_id();
 
@@ -419,6 +423,8 @@ u32 ShaderSource::getShaderId(const std::string &name)
 	} else {
 		/*errorstream<<"getShaderId(): Queued: name=\""<<name<<"\""<<std::endl;*/
 
+		JMutexAutoLock lock(m_get_shader_wait_mutex);
+
 		// We're gonna ask the result to be put into here
 
 		static ResultQueue<std::string, u32, u8, u8> result_queue;
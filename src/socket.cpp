@@ -46,6 +46,13 @@ typedef int socklen_t;
 typedef int socket_t;
 #endif
 
+// sendmmsg() and recvmmsg() are in glibc since 2.14
+#if defined(__linux__) && defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+	#if __GLIBC_PREREQ(2, 14)
+		#define HAVE_SENDMMSG_RECVMMSG
+	#endif
+#endif
+
 #include "constants.h"
 #include "debug.h"
 #include "settings.h"
@@ -115,7 +122,7 @@ Address::Address(const IPv6AddressBytes * ipv6_bytes, u16 port)
 }
 
 // Equality (address family, address and port must be equal)
-bool Address::operator==(Address &address)
+bool Address::operator==(const Address &address) const
 {
 	if(address.m_addr_family != m_addr_family || address.m_port != m_port)
 		return false;
@@ -133,7 +140,7 @@ bool Address::operator==(Address &address)
 		return false;
 }
 
-bool Address::operator!=(Address &address)
+bool Address::operator!=(const Address &address) const
 {
 	return !(*this == address);
 }
@@ -317,6 +324,8 @@ UDPSocket::UDPSocket(bool ipv6)
 	}
 
 	setTimeoutMs(0);
+	setPacketLoss(0);
+	m_no_mmsg = false;
 }
 
 UDPSocket::~UDPSocket()
@@ -378,18 +387,55 @@ void UDPSocket::Bind(u16 port)
 	}
 }
 
-void UDPSocket::Send(const Address & destination, const void * data, int size)
+static socklen_t makeSockaddr(int family, const Address & address,
+		struct sockaddr_storage *result)
 {
-	bool dumping_packet = false; // for INTERNET_SIMULATOR
+	memset(result, 0, sizeof(*result));
+	if(family == AF_INET6)
+	{
+		struct sockaddr_in6 *address6 = (struct sockaddr_in6 *) result;
+		*address6 = address.getAddress6();
+		address6->sin6_port = htons(address.getPort());
+		return sizeof(struct sockaddr_in6);
+	}
+	else
+	{
+		struct sockaddr_in *address4 = (struct sockaddr_in *) result;
+		*address4 = address.getAddress();
+		address4->sin_port = htons(address.getPort());
+		return sizeof(struct sockaddr_in);
+	}
+}
 
-	if(INTERNET_SIMULATOR)
-		dumping_packet = (myrand() % INTERNET_SIMULATOR_PACKET_LOSS == 0);
+static Address makeAddress(int family, const struct sockaddr_storage *address)
+{
+	if(family == AF_INET6)
+	{
+		const struct sockaddr_in6 *address6 =
+				(const struct sockaddr_in6 *) address;
+		u16 address_port = ntohs(address6->sin6_port);
+		IPv6AddressBytes bytes;
+		memcpy(bytes.bytes, address6->sin6_addr.s6_addr, 16);
+		return Address(&bytes, address_port);
+	}
+	else
+	{
+		const struct sockaddr_in *address4 =
+				(const struct sockaddr_in *) address;
+		u32 address_ip = ntohl(address4->sin_addr.s_addr);
+		u16 address_port = ntohs(address4->sin_port);
+		return Address(address_ip, address_port);
+	}
+}
 
+static void printReceived(int handle, const Address & sender,
+		const void * data, int size)
+{
 	if(socket_enable_debug_output)
 	{
-		// Print packet destination and size
-		dstream << (int) m_handle << " -> ";
-		destination.print(&dstream);
+		// Print packet sender and size
+		dstream << handle << " <- ";
+		sender.print(&dstream);
 		dstream << ", size=" << size;
 		
 		// Print packet contents
@@ -402,48 +448,131 @@ void UDPSocket::Send(const Address & destination, const void * data, int size)
 			dstream << std::hex << std::setw(2) << std::setfill('0')
 				<< a;
 		}
-		
 		if(size > 20)
 			dstream << "...";
 		
-		if(dumping_packet)
-			dstream << " (DUMPED BY INTERNET_SIMULATOR)";
-		
 		dstream << std::endl;
 	}
+}
 
-	if(dumping_packet)
-	{
-		// Lol let's forget it
-		dstream << "UDPSocket::Send(): "
-				   "INTERNET_SIMULATOR: dumping packet."
-				<< std::endl;
-		return;
-	}
-
-	if(destination.getFamily() != m_addr_family)
-		throw SendFailedException("Address family mismatch");
-
+static bool sendOne(socket_t handle, const UDPPacket &packet,
+		struct sockaddr *address, socklen_t address_len)
+{
 	int sent;
-	if(m_addr_family == AF_INET6)
-	{
-		struct sockaddr_in6 address = destination.getAddress6();
-		address.sin6_port = htons(destination.getPort());
-		sent = sendto(m_handle, (const char *) data, size,
-			0, (struct sockaddr *) &address, sizeof(struct sockaddr_in6));
-	}
+#ifdef _WIN32
+	WSABUF buffers[2];
+	buffers[0].buf = (char *) packet.header;
+	buffers[0].len = packet.header_size;
+	buffers[1].buf = (char *) packet.data;
+	buffers[1].len = packet.size;
+	DWORD sent_bytes = 0;
+	if(WSASendTo(handle, buffers, packet.size != 0 ? 2 : 1, &sent_bytes,
+			0, address, address_len, NULL, NULL) != 0)
+		sent = -1;
 	else
+		sent = sent_bytes;
+#else
+	struct iovec buffers[2];
+	buffers[0].iov_base = (void *) packet.header;
+	buffers[0].iov_len = packet.header_size;
+	buffers[1].iov_base = (void *) packet.data;
+	buffers[1].iov_len = packet.size;
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_name = address;
+	message.msg_namelen = address_len;
+	message.msg_iov = buffers;
+	message.msg_iovlen = packet.size != 0 ? 2 : 1;
+	sent = sendmsg(handle, &message, 0);
+#endif
+	return sent == packet.header_size + packet.size;
+}
+
+void UDPSocket::Send(const Address & destination, const void * data, int size)
+{
+	Send(destination, data, size, NULL, 0);
+}
+
+void UDPSocket::Send(const Address & destination, const void * header,
+		int header_size, const void * data, int size)
+{
+	UDPPacket packet;
+	packet.address = destination;
+	packet.header = header;
+	packet.header_size = header_size;
+	packet.data = data;
+	packet.size = size;
+	SendMany(&packet, 1);
+}
+
+void UDPSocket::SendMany(const UDPPacket *packets, int count)
+{
+	struct sockaddr_storage addresses[UDP_BATCH_MAX];
+	socklen_t address_lens[UDP_BATCH_MAX];
+	const UDPPacket *sending[UDP_BATCH_MAX];
+	bool failed = false;
+
+	while(count > 0)
 	{
-		struct sockaddr_in address = destination.getAddress();
-		address.sin_port = htons(destination.getPort());
-		sent = sendto(m_handle, (const char *) data, size,
-			0, (struct sockaddr *) &address, sizeof(struct sockaddr_in));
+		// Leave out the packets that the packet loss simulation drops
+		int n = 0;
+		for(; count > 0 && n < UDP_BATCH_MAX; packets++, count--)
+		{
+			if(!checkSend(*packets))
+				continue;
+			address_lens[n] = makeSockaddr(m_addr_family, packets->address,
+					&addresses[n]);
+			sending[n] = packets;
+			n++;
+		}
+
+		int sent = 0;
+#ifdef HAVE_SENDMMSG_RECVMMSG
+		if(!m_no_mmsg && n > 1)
+		{
+			struct mmsghdr messages[UDP_BATCH_MAX];
+			struct iovec buffers[UDP_BATCH_MAX][2];
+			memset(messages, 0, sizeof(struct mmsghdr) * n);
+			for(int i = 0; i < n; i++)
+			{
+				buffers[i][0].iov_base = (void *) sending[i]->header;
+				buffers[i][0].iov_len = sending[i]->header_size;
+				buffers[i][1].iov_base = (void *) sending[i]->data;
+				buffers[i][1].iov_len = sending[i]->size;
+				messages[i].msg_hdr.msg_name = &addresses[i];
+				messages[i].msg_hdr.msg_namelen = address_lens[i];
+				messages[i].msg_hdr.msg_iov = buffers[i];
+				messages[i].msg_hdr.msg_iovlen = sending[i]->size != 0 ? 2 : 1;
+			}
+			while(sent < n)
+			{
+				int result = sendmmsg(m_handle, &messages[sent], n - sent, 0);
+				if(result < 0 && errno == ENOSYS)
+				{
+					// Older kernel; send the rest one by one
+					m_no_mmsg = true;
+					break;
+				}
+				if(result <= 0)
+				{
+					// The first one of the rest failed; skip it
+					failed = true;
+					result = 1;
+				}
+				sent += result;
+			}
+		}
+#endif
+		for(; sent < n; sent++)
+		{
+			if(!sendOne(m_handle, *sending[sent],
+					(struct sockaddr *) &addresses[sent], address_lens[sent]))
+				failed = true;
+		}
 	}
 
-	if(sent != size)
-	{
+	if(failed)
 		throw SendFailedException("Failed to send packet");
-	}
 }
 
 int UDPSocket::Receive(Address & sender, void * data, int size)
@@ -454,77 +583,154 @@ int UDPSocket::Receive(Address & sender, void * data, int size)
 		return -1;
 	}
 
-	int received;
-	if(m_addr_family == AF_INET6)
-	{
-		struct sockaddr_in6 address;
-		memset(&address, 0, sizeof(address));
-		socklen_t address_len = sizeof(address);
-
-		received = recvfrom(m_handle, (char *) data,
-				size, 0, (struct sockaddr *) &address, &address_len);
+	return receiveOne(sender, data, size);
+}
 
-		if(received < 0)
-			return -1;
+int UDPSocket::ReceiveMany(Address * senders, int * sizes, void * data,
+		int size_max, int count)
+{
+	// Return on timeout
+	if(WaitData(m_timeout_ms) == false)
+	{
+		return 0;
+	}
 
-		u16 address_port = ntohs(address.sin6_port);
-		IPv6AddressBytes bytes;
-		memcpy(bytes.bytes, address.sin6_addr.s6_addr, 16);
-		sender = Address(&bytes, address_port);
+	int received = 0;
+#ifdef HAVE_SENDMMSG_RECVMMSG
+	if(!m_no_mmsg)
+	{
+		struct mmsghdr messages[UDP_BATCH_MAX];
+		struct iovec buffers[UDP_BATCH_MAX];
+		struct sockaddr_storage addresses[UDP_BATCH_MAX];
+		if(count > UDP_BATCH_MAX)
+			count = UDP_BATCH_MAX;
+		memset(messages, 0, sizeof(struct mmsghdr) * count);
+		for(int i = 0; i < count; i++)
+		{
+			buffers[i].iov_base = (char *) data + i * size_max;
+			buffers[i].iov_len = size_max;
+			messages[i].msg_hdr.msg_name = &addresses[i];
+			messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			messages[i].msg_hdr.msg_iov = &buffers[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+		// Takes only what is there already
+		received = recvmmsg(m_handle, messages, count, MSG_DONTWAIT, NULL);
+		if(received >= 0)
+		{
+			for(int i = 0; i < received; i++)
+			{
+				senders[i] = makeAddress(m_addr_family, &addresses[i]);
+				sizes[i] = messages[i].msg_len;
+				printReceived(m_handle, senders[i], buffers[i].iov_base, sizes[i]);
+			}
+			return received;
+		}
+		if(errno != ENOSYS)
+			return 0;
+		// Older kernel; receive one by one
+		m_no_mmsg = true;
 	}
-	else
+#endif
+	for(; received < count; received++)
 	{
-		struct sockaddr_in address;
-		memset(&address, 0, sizeof(address));
+		if(received != 0 && WaitData(0) == false)
+			break;
+		sizes[received] = receiveOne(senders[received],
+				(char *) data + received * size_max, size_max);
+		if(sizes[received] < 0)
+			break;
+	}
+	return received;
+}
 
-		socklen_t address_len = sizeof(address);
+int UDPSocket::GetHandle()
+{
+	return m_handle;
+}
 
-		received = recvfrom(m_handle, (char *) data,
-				size, 0, (struct sockaddr *) &address, &address_len);
+void UDPSocket::setTimeoutMs(int timeout_ms)
+{
+	m_timeout_ms = timeout_ms;
+}
 
-		if(received < 0)
-			return -1;
+void UDPSocket::setPacketLoss(int one_in, int seed)
+{
+	m_packet_loss = one_in;
+	m_packet_loss_random.seed(seed);
+}
 
-		u32 address_ip = ntohl(address.sin_addr.s_addr);
-		u16 address_port = ntohs(address.sin_port);
+bool UDPSocket::checkSend(const UDPPacket &packet)
+{
+	bool dumping_packet = false; // for INTERNET_SIMULATOR
 
-		sender = Address(address_ip, address_port);
-	}
+	if(INTERNET_SIMULATOR)
+		dumping_packet = (myrand() % INTERNET_SIMULATOR_PACKET_LOSS == 0);
+	else if(m_packet_loss != 0)
+		dumping_packet = (m_packet_loss_random.next() % m_packet_loss == 0);
 
+	int size = packet.header_size + packet.size;
 	if(socket_enable_debug_output)
 	{
-		// Print packet sender and size
-		dstream << (int) m_handle << " <- ";
-		sender.print(&dstream);
-		dstream << ", size=" << received;
+		// Print packet destination and size
+		dstream << (int) m_handle << " -> ";
+		packet.address.print(&dstream);
+		dstream << ", size=" << size;
 		
 		// Print packet contents
 		dstream << ", data=";
-		for(int i = 0; i < received && i < 20; i++)
+		for(int i = 0; i < size && i < 20; i++)
 		{
 			if(i % 2 == 0)
 				dstream << " ";
-			unsigned int a = ((const unsigned char *) data)[i];
+			unsigned int a = i < packet.header_size ?
+					((const unsigned char *) packet.header)[i] :
+					((const unsigned char *) packet.data)[i - packet.header_size];
 			dstream << std::hex << std::setw(2) << std::setfill('0')
 				<< a;
 		}
-		if(received > 20)
+		
+		if(size > 20)
 			dstream << "...";
 		
+		if(dumping_packet)
+			dstream << " (DUMPED BY INTERNET_SIMULATOR)";
+		
 		dstream << std::endl;
 	}
 
-	return received;
-}
+	if(dumping_packet)
+	{
+		// Lol let's forget it
+		if(INTERNET_SIMULATOR)
+			dstream << "UDPSocket::Send(): "
+					   "INTERNET_SIMULATOR: dumping packet."
+					<< std::endl;
+		return false;
+	}
 
-int UDPSocket::GetHandle()
-{
-	return m_handle;
+	if(packet.address.getFamily() != m_addr_family)
+		throw SendFailedException("Address family mismatch");
+
+	return true;
 }
 
-void UDPSocket::setTimeoutMs(int timeout_ms)
+int UDPSocket::receiveOne(Address & sender, void * data, int size)
 {
-	m_timeout_ms = timeout_ms;
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	socklen_t address_len = sizeof(address);
+
+	int received = recvfrom(m_handle, (char *) data,
+			size, 0, (struct sockaddr *) &address, &address_len);
+
+	if(received < 0)
+		return -1;
+
+	sender = makeAddress(m_addr_family, &address);
+	printReceived(m_handle, sender, data, received);
+
+	return received;
 }
 
 bool UDPSocket::WaitData(int timeout_ms)
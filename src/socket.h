@@ -39,6 +39,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string.h>
 #include "irrlichttypes.h"
 #include "exceptions.h"
+#include "noise.h" // PseudoRandom
 
 extern bool socket_enable_debug_output;
 
@@ -86,8 +87,8 @@ class Address
 	Address(u32 address, u16 port);
 	Address(u8 a, u8 b, u8 c, u8 d, u16 port);
 	Address(const IPv6AddressBytes * ipv6_bytes, u16 port);
-	bool operator==(Address &address);
-	bool operator!=(Address &address);
+	bool operator==(const Address &address) const;
+	bool operator!=(const Address &address) const;
 	void Resolve(const char *name);
 	struct sockaddr_in getAddress() const;
 	unsigned short getPort() const;
@@ -110,6 +111,19 @@ class Address
 	u16 m_port; // Port is separate from sockaddr structures
 };
 
+// Most packets UDPSocket::SendMany() and ReceiveMany() handle in one call
+#define UDP_BATCH_MAX 64
+
+// A packet for UDPSocket::SendMany(), sent as header followed by data
+struct UDPPacket
+{
+	Address address;
+	const void * header;
+	int header_size;
+	const void * data;
+	int size;
+};
+
 class UDPSocket
 {
 public:
@@ -119,16 +133,46 @@ class UDPSocket
 	//void Close();
 	//bool IsOpen();
 	void Send(const Address & destination, const void * data, int size);
+	// Sends header and data as one packet without copying them together
+	void Send(const Address & destination, const void * header,
+			int header_size, const void * data, int size);
+	// Sends the packets with as few system calls as possible (sendmmsg()
+	// on Linux). Throws SendFailedException after the others are sent
+	// if some failed.
+	void SendMany(const UDPPacket * packets, int count);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	/*
+		Receives up to count packets into data, one every size_max bytes.
+		Waits for the first one like Receive() and takes the ones that
+		are there already after it, with one recvmmsg() on Linux.
+		Sets senders and sizes and returns the number of packets, 0 if
+		there is no data.
+	*/
+	int ReceiveMany(Address * senders, int * sizes, void * data,
+			int size_max, int count);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
 	bool WaitData(int timeout_ms);
+	// Drops one in this many sent packets at random, 0 drops none.
+	// Like INTERNET_SIMULATOR but for a single socket, for testing; the
+	// packets dropped only depend on seed and the order of the sends.
+	void setPacketLoss(int one_in, int seed = 0);
 private:
+	// Prints the packet for debugging and returns false if the packet
+	// loss simulation drops it
+	bool checkSend(const UDPPacket & packet);
+	// Receives a packet that is there already
+	int receiveOne(Address & sender, void * data, int size);
+
 	int m_handle;
 	int m_timeout_ms;
 	int m_addr_family;
+	int m_packet_loss;
+	PseudoRandom m_packet_loss_random;
+	// Set if the system doesn't have sendmmsg() and recvmmsg()
+	bool m_no_mmsg;
 };
 
 #endif
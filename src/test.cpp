@@ -39,12 +39,24 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "filesys.h"
 #include "voxelalgorithms.h"
 #include "inventory.h"
+#include "blocksendset.h"
+#include "gamedef.h"
+#include "itemdef.h"
+#include "mapblock.h"
 #include "util/numeric.h"
 #include "util/serialize.h"
+#include "util/timetaker.h"
 #include "noise.h" // PseudoRandom used for random data for compression
 #include "clientserver.h" // LATEST_PROTOCOL_VERSION
+#include "lua_api/l_vmanip.h"
+#include "database.h"
+#include "mapsaver.h"
 #include <algorithm>
 
+extern "C" {
+#include "lualib.h"
+}
+
 /*
 	Asserts that the exception occurs
 */
@@ -73,6 +85,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 static content_t CONTENT_STONE;
 static content_t CONTENT_GRASS;
 static content_t CONTENT_TORCH;
+static content_t CONTENT_WATER;
+static content_t CONTENT_WATER_FLOWING;
 
 void define_some_nodes(IWritableItemDefManager *idef, IWritableNodeDefManager *ndef)
 {
@@ -135,6 +149,32 @@ void define_some_nodes(IWritableItemDefManager *idef, IWritableNodeDefManager *n
 	f.light_source = LIGHT_MAX-1;
 	idef->registerItem(itemdef);
 	CONTENT_TORCH = ndef->set(f.name, f);
+
+	/*
+		Water (minimal definitions for liquid tests)
+	*/
+	itemdef = ItemDefinition();
+	itemdef.type = ITEM_NODE;
+	itemdef.name = "default:water_source";
+	f = ContentFeatures();
+	f.name = itemdef.name;
+	f.param_type = CPT_LIGHT;
+	f.light_propagates = true;
+	f.walkable = false;
+	f.buildable_to = true;
+	f.liquid_type = LIQUID_SOURCE;
+	f.liquid_alternative_flowing = "default:water_flowing";
+	f.liquid_alternative_source = "default:water_source";
+	f.liquid_renewable = false;
+	idef->registerItem(itemdef);
+	CONTENT_WATER = ndef->set(f.name, f);
+
+	itemdef.name = "default:water_flowing";
+	f.name = itemdef.name;
+	f.param_type_2 = CPT2_FLOWINGLIQUID;
+	f.liquid_type = LIQUID_FLOWING;
+	idef->registerItem(itemdef);
+	CONTENT_WATER_FLOWING = ndef->set(f.name, f);
 }
 
 struct TestBase
@@ -171,6 +211,32 @@ struct TestUtilities: public TestBase
 		UASSERT(removeStringEnd("bc", ends) == "b");
 		UASSERT(removeStringEnd("12c", ends) == "12");
 		UASSERT(removeStringEnd("foo", ends) == "");
+
+		// An area is in sight if any of its blocks is
+		PseudoRandom pr(13);
+		for(u32 i=0; i<1000; i++)
+		{
+			v3f camera_pos(pr.range(-150,150), pr.range(-150,150),
+					pr.range(-150,150));
+			v3f camera_dir(pr.range(-100,100), pr.range(-100,100),
+					pr.range(-100,100));
+			camera_dir.normalize();
+			f32 fov = pr.range(30,120) * M_PI / 180;
+			f32 range = pr.range(16,200) * BS;
+			v3s16 area_min(pr.range(-4,4), pr.range(-4,4), pr.range(-4,4));
+			v3s16 area_max = area_min + v3s16(pr.range(0,2),
+					pr.range(0,8), pr.range(0,2));
+			bool block_in_sight = false;
+			v3s16 p;
+			for(p.X=area_min.X; p.X<=area_max.X; p.X++)
+			for(p.Y=area_min.Y; p.Y<=area_max.Y; p.Y++)
+			for(p.Z=area_min.Z; p.Z<=area_max.Z; p.Z++)
+				if(isBlockInSight(p, camera_pos * BS, camera_dir, fov, range))
+					block_in_sight = true;
+			if(block_in_sight)
+				UASSERT(isBlockAreaInSight(area_min, area_max,
+						camera_pos * BS, camera_dir, fov, range));
+		}
 	}
 };
 
@@ -409,6 +475,29 @@ struct TestSettings: public TestBase
 		UASSERT(fabs(s.getV3F("coord2").X - 1.0) < 0.001);
 		UASSERT(fabs(s.getV3F("coord2").Y - 2.0) < 0.001);
 		UASSERT(fabs(s.getV3F("coord2").Z - 3.3) < 0.001);
+
+		// Handles follow the setting and fall back to the default
+		{
+			SettingHandle<s16> leet(&s, "leet");
+			SettingHandle<s16> leet2(&s, "leet");
+			SettingHandle<float> floaty(&s, "floaty_thing_2");
+			SettingHandle<bool> flag(&s, "flag");
+			UASSERT(leet.get() == 1337);
+			UASSERT(fabs(floaty.get() - 1.2) < 0.001);
+			UASSERT(flag.get() == false);
+			s.setS16("leet", 42);
+			s.setBool("flag", true);
+			UASSERT(leet.get() == 42 && leet2.get() == 42);
+			UASSERT(flag.get() == true);
+			s.setDefault("leet", "7");
+			s.remove("leet");
+			UASSERT(leet.get() == 7);
+			s.clear();
+			UASSERT(leet.get() == 0 && flag.get() == false);
+
+			s.setFloat("floaty_thing_2", 1.2);
+			UASSERT(floaty.get() == s.getFloat("floaty_thing_2"));
+		}
 	}
 };
 
@@ -923,6 +1012,650 @@ struct TestVoxelAlgorithms: public TestBase
 	}
 };
 
+class TestGameDef : public IGameDef
+{
+public:
+	TestGameDef(IItemDefManager *idef, INodeDefManager *ndef):
+		m_idef(idef),
+		m_ndef(ndef)
+	{
+	}
+	virtual IItemDefManager* getItemDefManager(){ return m_idef; }
+	virtual INodeDefManager* getNodeDefManager(){ return m_ndef; }
+	virtual ICraftDefManager* getCraftDefManager(){ return NULL; }
+	virtual ITextureSource* getTextureSource(){ return NULL; }
+	virtual IShaderSource* getShaderSource(){ return NULL; }
+	virtual u16 allocateUnknownNodeId(const std::string &name){ return 0; }
+	virtual ISoundManager* getSoundManager(){ return NULL; }
+	virtual MtEventManager* getEventManager(){ return NULL; }
+private:
+	IItemDefManager *m_idef;
+	INodeDefManager *m_ndef;
+};
+
+// A map of 4x4x4 blank blocks around the origin
+class TestMap : public Map
+{
+public:
+	TestMap(IGameDef *gamedef):
+		Map(dout_server, gamedef)
+	{
+		for(s16 x=-2; x<2; x++)
+		for(s16 z=-2; z<2; z++)
+		{
+			MapSector *sector = new ServerMapSector(this, v2s16(x,z), gamedef);
+			m_sectors[v2s16(x,z)] = sector;
+			for(s16 y=-2; y<2; y++)
+			{
+				MapBlock *block = sector->createBlankBlock(y);
+				m_blocks[block->getPos()] = block;
+			}
+		}
+	}
+
+	void build()
+	{
+		PseudoRandom pr(7);
+		v3s16 p;
+		for(p.Z=-32; p.Z<32; p.Z++)
+		for(p.X=-32; p.X<32; p.X++)
+		for(p.Y=-32; p.Y<32; p.Y++)
+		{
+			s16 h = (p.X*p.X/3 + p.Z*p.Z/5)/40 - 6;
+			MapNode n(p.Y < h ? CONTENT_STONE : CONTENT_AIR);
+			// A roof and some torches in caves
+			if(p.Y == h + 4 && abs(p.X) < 8 && abs(p.Z) < 8)
+				n = MapNode(CONTENT_STONE);
+			if(p.Y < h - 3 && p.Y > h - 9 && (p.X + p.Z + 64) / 6 % 3 == 0)
+				n = MapNode(pr.range(0,60) == 0 ? CONTENT_TORCH : CONTENT_AIR);
+			setNode(p, n);
+		}
+		std::map<v3s16, MapBlock*> modified_blocks;
+		updateLighting(m_blocks, modified_blocks);
+	}
+
+	std::vector<u8> getLight()
+	{
+		std::vector<u8> light;
+		v3s16 p;
+		for(p.Z=-32; p.Z<32; p.Z++)
+		for(p.Y=-32; p.Y<32; p.Y++)
+		for(p.X=-32; p.X<32; p.X++)
+			light.push_back(getNode(p).param1);
+		return light;
+	}
+
+	std::map<v3s16, MapBlock*> m_blocks;
+};
+
+struct TestMapLighting: public TestBase
+{
+	typedef std::vector<std::pair<v3s16, MapNode> > EditList;
+
+	// Random digging and placing around the surface
+	static EditList makeEdits(IGameDef *gamedef, u32 count)
+	{
+		EditList edits;
+		TestMap map(gamedef);
+		map.build();
+		PseudoRandom pr(99);
+		for(u32 i=0; i<count; i++)
+		{
+			v3s16 p(pr.range(-24,23), pr.range(-20,20), pr.range(-24,23));
+			if(map.getNode(p).getContent() != CONTENT_AIR)
+				edits.push_back(std::make_pair(p, MapNode(CONTENT_AIR)));
+			else if(pr.range(0,4) == 0)
+				edits.push_back(std::make_pair(p, MapNode(CONTENT_TORCH)));
+			else
+				edits.push_back(std::make_pair(p, MapNode(CONTENT_STONE)));
+			map.setNode(p, edits.back().second);
+		}
+		return edits;
+	}
+
+	// Updates the light after each edit
+	static void editSingle(TestMap &map, EditList &edits)
+	{
+		for(u32 i=0; i<edits.size(); i++)
+		{
+			std::map<v3s16, MapBlock*> modified_blocks;
+			if(edits[i].second.getContent() == CONTENT_AIR)
+				map.removeNodeAndUpdate(edits[i].first, modified_blocks);
+			else
+				map.addNodeAndUpdate(edits[i].first, edits[i].second,
+						modified_blocks);
+		}
+	}
+
+	// Updates the light after all edits at once
+	static void editBatch(TestMap &map, EditList &edits)
+	{
+		EditList oldnodes;
+		for(u32 i=0; i<edits.size(); i++)
+		{
+			oldnodes.push_back(std::make_pair(edits[i].first,
+					map.getNode(edits[i].first)));
+			map.setNode(edits[i].first, edits[i].second);
+		}
+		std::map<v3s16, MapBlock*> modified_blocks;
+		map.updateLightingNodes(oldnodes, modified_blocks);
+	}
+
+	// Makes the edits without updating the light
+	static void editNoLight(TestMap &map, EditList &edits)
+	{
+		for(u32 i=0; i<edits.size(); i++)
+			map.setNode(edits[i].first, edits[i].second);
+	}
+
+	static void relight(TestMap &map)
+	{
+		std::map<v3s16, MapBlock*> modified_blocks;
+		map.updateLighting(map.m_blocks, modified_blocks);
+	}
+
+	void Run(IItemDefManager *idef, INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(idef, ndef);
+		EditList edits = makeEdits(&gamedef, 500);
+
+		/*
+			Updating after each edit, after all of them at once and from
+			scratch have to give the same light
+		*/
+		TestMap single(&gamedef);
+		single.build();
+		editSingle(single, edits);
+
+		TestMap batch(&gamedef);
+		batch.build();
+		editBatch(batch, edits);
+
+		TestMap scratch(&gamedef);
+		scratch.build();
+		editNoLight(scratch, edits);
+		relight(scratch);
+
+		std::vector<u8> light = scratch.getLight();
+		UASSERT(single.getLight() == light);
+		UASSERT(batch.getLight() == light);
+	}
+};
+
+struct TestMapFind: public TestBase
+{
+	// The nodes of content c in minp...maxp, found node by node
+	static void findNodesSlow(Map &map, v3s16 minp, v3s16 maxp, content_t c,
+			std::vector<v3s16> &result)
+	{
+		v3s16 p;
+		for(p.X=minp.X; p.X<=maxp.X; p.X++)
+		for(p.Y=minp.Y; p.Y<=maxp.Y; p.Y++)
+		for(p.Z=minp.Z; p.Z<=maxp.Z; p.Z++)
+			if(map.getNodeNoEx(p).getContent() == c)
+				result.push_back(p);
+	}
+
+	// The first node found going through the area node by node
+	bool findNodeNearSlow(Map &map, v3s16 pos, s16 radius, content_t c,
+			v3s16 &result)
+	{
+		for(s16 d=1; d<=radius; d++)
+		{
+			std::list<v3s16> list;
+			getFacePositions(list, d);
+			for(std::list<v3s16>::iterator i = list.begin();
+					i != list.end(); ++i)
+			{
+				if(map.getNodeNoEx(pos + *i).getContent() == c)
+				{
+					result = pos + *i;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	void Run(IItemDefManager *idef, INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(idef, ndef);
+		TestMap map(&gamedef);
+		map.build();
+
+		// Reaches out of the map, which is ignore there
+		v3s16 minp(-40,-40,-40);
+		v3s16 maxp(39,39,39);
+		content_t contents[] = {CONTENT_TORCH, CONTENT_STONE, CONTENT_IGNORE};
+		for(u32 k=0; k<sizeof(contents)/sizeof(contents[0]); k++)
+		{
+			content_t c = contents[k];
+			std::set<content_t> filter;
+			filter.insert(c);
+
+			std::vector<v3s16> expected;
+			findNodesSlow(map, minp, maxp, c, expected);
+			std::vector<v3s16> found;
+			map.findNodesInArea(minp, maxp, filter, found);
+			UASSERT(found == expected);
+
+			std::map<content_t, u32> counts;
+			map.countNodesInArea(minp, maxp, filter, counts);
+			UASSERT(counts.size() == 1 && counts[c] == expected.size());
+
+			PseudoRandom pr(k);
+			for(u32 i=0; i<50; i++)
+			{
+				v3s16 pos(pr.range(-40,40), pr.range(-40,40), pr.range(-40,40));
+				v3s16 p1(0,0,0), p2(0,0,0);
+				bool found1 = findNodeNearSlow(map, pos, 12, c, p1);
+				bool found2 = map.findNodeNear(pos, 12, filter, p2);
+				UASSERT(found1 == found2 && p1 == p2);
+			}
+		}
+
+		std::map<content_t, u32> counts;
+		map.countNodesInArea(minp, maxp, std::set<content_t>(), counts);
+		u32 total = 0;
+		for(std::map<content_t, u32>::iterator
+				i = counts.begin(); i != counts.end(); ++i)
+			total += i->second;
+		UASSERT(total == 80*80*80);
+		UASSERT(counts[CONTENT_IGNORE] == 80*80*80 - 64*64*64);
+
+		// pos + radius doesn't fit in s16
+		std::set<content_t> filter;
+		filter.insert(CONTENT_STONE);
+		v3s16 p;
+		UASSERT(!map.findNodeNear(v3s16(32760,0,0), 30, filter, p));
+		UASSERT(!map.findNodeNear(v3s16(-32760,0,0), 30, filter, p));
+
+		// The blocks of a big radius are only looked up when reached
+		v3s16 p1(0,0,0), p2(0,0,0);
+		UASSERT(map.findNodeNear(v3s16(0,20,0), 40, filter, p1));
+		UASSERT(map.findNodeNear(v3s16(0,20,0), 32767, filter, p2));
+		UASSERT(p1 == p2);
+	}
+};
+
+struct TestMapBlockCompact: public TestBase
+{
+	static std::vector<MapNode> getNodes(std::map<v3s16, MapBlock*> &blocks)
+	{
+		std::vector<MapNode> nodes;
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = blocks.begin(); i != blocks.end(); ++i)
+		{
+			v3s16 p;
+			for(p.Z=0; p.Z<MAP_BLOCKSIZE; p.Z++)
+			for(p.Y=0; p.Y<MAP_BLOCKSIZE; p.Y++)
+			for(p.X=0; p.X<MAP_BLOCKSIZE; p.X++)
+				nodes.push_back(i->second->getNodeNoCheck(p));
+		}
+		return nodes;
+	}
+
+	// Index in getNodes() of node p of block
+	u32 getNodeIndex(std::map<v3s16, MapBlock*> &blocks, MapBlock *block,
+			v3s16 p)
+	{
+		u32 k = 0;
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = blocks.begin(); i->second != block; ++i)
+			k++;
+		return k * MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+				+ (p.Z*MAP_BLOCKSIZE + p.Y)*MAP_BLOCKSIZE + p.X;
+	}
+
+	void Run(IItemDefManager *idef, INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(idef, ndef);
+		TestMap map(&gamedef);
+		map.build();
+		std::map<v3s16, MapBlock*> &blocks = map.m_blocks;
+
+		std::vector<MapNode> nodes_before = getNodes(blocks);
+		std::vector<std::string> data_before;
+		std::vector<std::vector<content_t> > contents_before;
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = blocks.begin(); i != blocks.end(); ++i)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			i->second->serialize(os, SER_FMT_VER_HIGHEST_WRITE, false);
+			data_before.push_back(os.str());
+			contents_before.push_back(i->second->getContents());
+		}
+
+		u32 compact_count = 0;
+		u32 uniform_count = 0;
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = blocks.begin(); i != blocks.end(); ++i)
+		{
+			MapBlock *block = i->second;
+			if(block->compact())
+				compact_count++;
+			if(block->isUniform())
+				uniform_count++;
+		}
+		UASSERT(compact_count == blocks.size());
+		UASSERT(uniform_count > 0 && uniform_count < compact_count);
+
+		// Reads give the same as before
+		std::vector<MapNode> nodes_after = getNodes(blocks);
+		UASSERT(nodes_after.size() == nodes_before.size());
+		for(u32 i=0; i<nodes_before.size(); i++)
+			UASSERT(nodes_after[i] == nodes_before[i]);
+		u32 k = 0;
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = blocks.begin(); i != blocks.end(); ++i, k++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			i->second->serialize(os, SER_FMT_VER_HIGHEST_WRITE, false);
+			UASSERT(os.str() == data_before[k]);
+			UASSERT(i->second->getContents() == contents_before[k]);
+			UASSERT(i->second->isCompact());
+		}
+
+		// Spreading light that is already there reads the nodes but
+		// doesn't write or expand them
+		std::map<v3s16, MapBlock*> modified_blocks;
+		voxalgo::MapLightUpdater updater(&map, ndef, LIGHTBANK_DAY,
+				modified_blocks);
+		v3s16 p2;
+		for(p2.Z=-16; p2.Z<0; p2.Z++)
+		for(p2.Y=-16; p2.Y<0; p2.Y++)
+		for(p2.X=-16; p2.X<0; p2.X++)
+			updater.addSource(p2);
+		updater.spread();
+		UASSERT(modified_blocks.empty());
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = blocks.begin(); i != blocks.end(); ++i)
+			UASSERT(i->second->isCompact());
+
+		// Writing a node that is already there keeps the block compact
+		MapBlock *block = blocks[v3s16(0,-1,0)];
+		v3s16 p(3,4,5);
+		MapNode n = block->getNode(p);
+		block->setNode(p, n);
+		UASSERT(block->isCompact());
+		MapNode n2(n.getContent() == CONTENT_STONE ?
+				CONTENT_AIR : CONTENT_STONE);
+		block->setNode(p, n2);
+		UASSERT(!block->isCompact());
+		UASSERT(block->getNode(p) == n2);
+		UASSERT(block->getNode(v3s16(3,4,6))
+				== nodes_before[getNodeIndex(blocks, block, v3s16(3,4,6))]);
+	}
+};
+
+struct TestMapLiquid: public TestBase
+{
+	// A lake of water sources hanging above the ground
+	static void flood(TestMap &map)
+	{
+		v3s16 p;
+		for(p.Z=-20; p.Z<20; p.Z++)
+		for(p.X=-20; p.X<20; p.X++)
+		for(p.Y=8; p.Y<12; p.Y++)
+		{
+			if(map.getNode(p).getContent() != CONTENT_AIR)
+				continue;
+			MapNode n(CONTENT_WATER);
+			map.setNode(p, n);
+			map.transforming_liquid_add(p);
+		}
+	}
+
+	// Runs up to count liquid steps; returns the number of steps run
+	static u32 transform(TestMap &map, u16 threads, u32 count)
+	{
+		std::string old_threads = g_settings->get("num_liquid_threads");
+		std::string old_step = g_settings->get("dedicated_server_step");
+		// The threads are started on the first step; no step may run out
+		// of time
+		g_settings->set("num_liquid_threads", itos(threads));
+		g_settings->setFloat("dedicated_server_step", 1000);
+		u32 steps = 0;
+		while(steps < count && map.transforming_liquid_size() != 0)
+		{
+			// The liquid code randomizes the flow directions per step
+			mysrand(steps);
+			std::map<v3s16, MapBlock*> modified_blocks;
+			map.transformLiquidsFinite(modified_blocks);
+			steps++;
+		}
+		g_settings->set("num_liquid_threads", old_threads);
+		g_settings->set("dedicated_server_step", old_step);
+		return steps;
+	}
+
+	static std::vector<MapNode> getNodes(TestMap &map)
+	{
+		std::vector<MapNode> nodes;
+		v3s16 p;
+		for(p.Z=-32; p.Z<32; p.Z++)
+		for(p.Y=-32; p.Y<32; p.Y++)
+		for(p.X=-32; p.X<32; p.X++)
+			nodes.push_back(map.getNode(p));
+		return nodes;
+	}
+
+	void Run(IItemDefManager *idef, INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(idef, ndef);
+
+		// Blocks of the same parity are updated in parallel; the result
+		// must not depend on the number of threads
+		TestMap single(&gamedef);
+		single.build();
+		flood(single);
+		u32 steps = transform(single, 0, 100);
+		std::vector<MapNode> nodes = getNodes(single);
+
+		u32 wet = 0;
+		for(u32 i=0; i<nodes.size(); i++)
+			if(nodes[i].getContent() == CONTENT_WATER_FLOWING)
+				wet++;
+		UASSERT(wet != 0);
+
+		TestMap threaded(&gamedef);
+		threaded.build();
+		flood(threaded);
+		UASSERT(transform(threaded, 3, 100) == steps);
+		std::vector<MapNode> nodes_threaded = getNodes(threaded);
+		UASSERT(nodes_threaded.size() == nodes.size());
+		for(u32 i=0; i<nodes.size(); i++)
+			UASSERT(nodes_threaded[i] == nodes[i]);
+		UASSERT(threaded.transforming_liquid_size() ==
+				single.transforming_liquid_size());
+	}
+};
+
+struct TestMapSaver: public TestBase
+{
+	// Keeps the blocks in memory; writes fail while fail is set
+	class TDatabase : public Database
+	{
+	public:
+		TDatabase(): fail(false) {}
+		void beginSave() {}
+		void endSave() {}
+		bool saveBlock(v3s16 blockpos, const std::string &data)
+		{
+			if(fail)
+				return false;
+			blocks[blockpos] = data;
+			return true;
+		}
+		MapBlock* loadBlock(v3s16 blockpos) { return NULL; }
+		void loadBlocks(const std::vector<v3s16> &blockpos,
+				std::map<v3s16, std::string> &dst) {}
+		void listAllLoadableBlocks(std::list<v3s16> &dst) {}
+		int Initialized() { return 1; }
+
+		bool fail;
+		std::map<v3s16, std::string> blocks;
+	};
+
+	void Run(IItemDefManager *idef, INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(idef, ndef);
+		TestMap map(&gamedef);
+		map.build();
+		MapBlock *block = map.m_blocks[v3s16(0,-1,0)];
+		v3s16 pos = block->getPos();
+
+		// A copy serializes the same as the block
+		std::string expected = Database::serializeBlock(block);
+		MapBlockDiskCopy copy;
+		block->copyForDisk(copy, SER_FMT_VER_HIGHEST_WRITE);
+		UASSERT(Database::serializeBlock(copy) == expected);
+
+		// The thread is not started, stopAndFlush() writes right away
+		TDatabase db;
+		MapSaverThread saver(&db);
+		saver.enqueue(pos, copy);
+
+		// A failed write keeps the block queued and lists it
+		db.fail = true;
+		saver.stopAndFlush();
+		std::vector<v3s16> failed;
+		saver.takeFailed(failed);
+		UASSERT(failed.size() == 1 && failed[0] == pos);
+		std::string data;
+		UASSERT(saver.getQueued(pos, data) && data == expected);
+		UASSERT(db.blocks.empty());
+
+		db.fail = false;
+		saver.stopAndFlush();
+		UASSERT(db.blocks.size() == 1 && db.blocks[pos] == expected);
+		UASSERT(!saver.getQueued(pos, data));
+		failed.clear();
+		saver.takeFailed(failed);
+		UASSERT(failed.empty());
+	}
+};
+
+struct TestLuaVoxelManip: public TestBase
+{
+	// A Lua mapgen that turns stone into air and everything else into
+	// stone, every node or every step'th node, through a table or a view
+	static const char *script()
+	{
+		return
+			"function gen_table(vm, buffer, step)\n"
+			"	local data = vm:get_data(buffer)\n"
+			"	for i = 1, #data, step do\n"
+			"		if data[i] == c_stone then data[i] = c_air\n"
+			"		else data[i] = c_stone end\n"
+			"	end\n"
+			"	vm:set_data(data)\n"
+			"end\n"
+			"function gen_view(vm, buffer, step)\n"
+			"	local data = vm:get_data_view()\n"
+			"	for i = 1, #data, step do\n"
+			"		if data[i] == c_stone then data[i] = c_air\n"
+			"		else data[i] = c_stone end\n"
+			"	end\n"
+			"end\n"
+			"function set_param2(vm)\n"
+			"	local param2 = vm:get_param2_data()\n"
+			"	for i = 1, #param2 do param2[i] = i % 4 end\n"
+			"	vm:set_param2_data(param2)\n"
+			"end\n";
+	}
+
+	// A Lua state with the script and vm, or NULL if the script fails.
+	// The state owns the VoxelManip in both cases.
+	static lua_State *newState(ManualMapVoxelManipulator *vm)
+	{
+		lua_State *L = luaL_newstate();
+		luaL_openlibs(L);
+		LuaVoxelManip::Register(L);
+		LuaVoxelManipView::Register(L);
+		LuaVoxelManip *o = new LuaVoxelManip(vm, false);
+		*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+		luaL_getmetatable(L, "VoxelManip");
+		lua_setmetatable(L, -2);
+		lua_setglobal(L, "vm");
+		lua_newtable(L);
+		lua_setglobal(L, "buffer");
+		lua_pushinteger(L, CONTENT_STONE);
+		lua_setglobal(L, "c_stone");
+		lua_pushinteger(L, CONTENT_AIR);
+		lua_setglobal(L, "c_air");
+		if(luaL_dostring(L, script()) != 0){
+			lua_close(L);
+			return NULL;
+		}
+		return L;
+	}
+
+	// Calls a global function of the script with the VoxelManip, the
+	// buffer table or nil and step
+	static void call(lua_State *L, const char *name, bool buffer, int step)
+	{
+		lua_getglobal(L, name);
+		lua_getglobal(L, "vm");
+		if(buffer)
+			lua_getglobal(L, "buffer");
+		else
+			lua_pushnil(L);
+		lua_pushinteger(L, step);
+		if(lua_pcall(L, 3, 0, 0)){
+			errorstream<<"TestLuaVoxelManip: "<<lua_tostring(L, -1)
+					<<std::endl;
+			lua_pop(L, 1);
+		}
+	}
+
+	static content_t flip(content_t c)
+	{
+		return c == CONTENT_STONE ? CONTENT_AIR : CONTENT_STONE;
+	}
+
+	void Run(IItemDefManager *idef, INodeDefManager *ndef)
+	{
+		TestGameDef gamedef(idef, ndef);
+		TestMap map(&gamedef);
+		map.build();
+		// Deleted with the VoxelManip object
+		ManualMapVoxelManipulator *vm = new ManualMapVoxelManipulator(&map);
+		vm->initialEmerge(v3s16(-2,-2,-2), v3s16(1,1,1));
+		u32 volume = vm->m_area.getVolume();
+		std::vector<content_t> contents(volume);
+		for(u32 i=0; i<volume; i++)
+			contents[i] = vm->m_data[i].getContent();
+
+		lua_State *L = newState(vm);
+		UASSERT(L != NULL);
+
+		// Every node
+		call(L, "gen_table", false, 1);
+		for(u32 i=0; i<volume; i++)
+			contents[i] = flip(contents[i]);
+		call(L, "gen_table", true, 1);
+		call(L, "gen_table", true, 1);
+		call(L, "gen_view", false, 1);
+		for(u32 i=0; i<volume; i++)
+			contents[i] = flip(contents[i]);
+		for(u32 i=0; i<volume; i++)
+			UASSERT(vm->m_data[i].getContent() == contents[i]);
+
+		// Every 100th node
+		call(L, "gen_table", true, 100);
+		call(L, "gen_view", false, 100);
+		for(u32 i=0; i<volume; i++)
+			UASSERT(vm->m_data[i].getContent() == contents[i]);
+
+		call(L, "set_param2", false, 1);
+		for(u32 i=0; i<volume; i++)
+			UASSERT(vm->m_data[i].param2 == (i + 1) % 4);
+
+		lua_close(L);
+	}
+};
+
 struct TestInventory: public TestBase
 {
 	void Run(IItemDefManager *idef)
@@ -1350,6 +2083,121 @@ struct TestMapSector: public TestBase
 };
 #endif
 
+struct TestNoise: public TestBase
+{
+	// Compare a map computed with the vectorized kernels against the
+	// scalar reference; the results must match bit for bit.
+	void compareMaps(Noise &noise, bool is3d, float x, float y, float z)
+	{
+		int n = noise.sx * noise.sy * noise.sz;
+		NoiseSimdLevel level = noise_get_simd_level();
+
+		noise_set_simd_level(NOISE_SIMD_NONE);
+		if (is3d)
+			noise.perlinMap3D(x, y, z);
+		else
+			noise.perlinMap2D(x, y);
+		std::vector<float> reference(noise.result, noise.result + n);
+
+		for (int l = NOISE_SIMD_SSE2; l <= noise_get_max_simd_level(); l++) {
+			noise_set_simd_level((NoiseSimdLevel)l);
+			if (is3d)
+				noise.perlinMap3D(x, y, z);
+			else
+				noise.perlinMap2D(x, y);
+			UTEST(memcmp(noise.result, &reference[0], n * sizeof(float)) == 0,
+				"%s map differs from scalar", noise_simd_level_name((NoiseSimdLevel)l));
+		}
+
+		noise_set_simd_level(level);
+	}
+
+	void Run()
+	{
+		NoiseParams np2d = {0, 1, v3f(250, 250, 250), 82341, 5, 0.6};
+		NoiseParams np3d = {0, 1, v3f(12, 10, 12), 52534, 4, 0.5};
+
+		// Odd sizes exercise the scalar tails of the vector loops
+		Noise noise2d(&np2d, 1, 83, 37);
+		compareMaps(noise2d, false, -1234, 567, 0);
+
+		Noise noise3d(&np3d, 1, 21, 17, 13);
+		compareMaps(noise3d, true, -35, 9, 4021);
+	}
+};
+
+struct TestBlockSendSet: public TestBase
+{
+	void Run()
+	{
+		BlockSendSet s;
+		s.setCenter(v3s16(0,0,0), 2);
+		UASSERT(s.getUnsentCount(0) == 1);
+		UASSERT(s.getUnsentCount(1) == 26);
+		UASSERT(s.getUnsentCount(2) == 98);
+
+		s.setSent(v3s16(1,0,0));
+		s.setSkipped(v3s16(0,2,0));
+		UASSERT(s.isSent(v3s16(1,0,0)));
+		UASSERT(!s.isSent(v3s16(0,2,0)));
+		UASSERT(s.getUnsentCount(1) == 25);
+		std::list<v3s16> list;
+		s.getUnsent(2, list);
+		UASSERT(list.size() == 97);
+		UASSERT(std::find(list.begin(), list.end(), v3s16(0,2,0)) == list.end());
+
+		// Moving drops the skips and keeps what has been sent
+		s.setCenter(v3s16(1,0,0), 2);
+		UASSERT(s.getUnsentCount(0) == 0);
+		UASSERT(s.findUnsentDistance(0) == 1);
+		UASSERT(s.getUnsentCount(2) == 98);
+
+		// Blocks out of range are remembered when coming back
+		s.setCenter(v3s16(10,0,0), 2);
+		UASSERT(s.isSent(v3s16(1,0,0)));
+		s.setCenter(v3s16(0,0,0), 2);
+		UASSERT(s.getUnsentCount(1) == 25);
+
+		s.setNotSent(v3s16(1,0,0));
+		UASSERT(s.getUnsentCount(1) == 26);
+		UASSERT(s.size() == 0);
+
+		// Deferred blocks come back with clearDeferred()
+		s.setDeferred(v3s16(0,0,2));
+		s.setSkipped(v3s16(0,0,-2));
+		UASSERT(s.getUnsentCount(2) == 96);
+		UASSERT(s.clearDeferred() == 1);
+		UASSERT(s.getUnsentCount(2) == 97);
+		UASSERT(s.clearDeferred() == 0);
+
+		// Moving around refills the cube like setting it up anew
+		PseudoRandom pr(3);
+		BlockSendSet a;
+		std::vector<v3s16> sent;
+		v3s16 center(0,0,0);
+		for(u32 i=0; i<200; i++)
+		{
+			center += v3s16(pr.range(-1,1), pr.range(-1,1), pr.range(-1,1));
+			if(pr.range(0,20) == 0)
+				center += v3s16(pr.range(-9,9), 0, 0);
+			a.setCenter(center, 3);
+			v3s16 p = center + v3s16(pr.range(-3,3), pr.range(-3,3), pr.range(-3,3));
+			a.setSent(p);
+			sent.push_back(p);
+			a.setDeferred(center + v3s16(pr.range(-3,3), 0, 0));
+			if(i % 2 == 0)
+				a.getUnsentCount(0);
+		}
+		a.clearDeferred();
+		BlockSendSet b;
+		b.setCenter(center, 3);
+		for(u32 i=0; i<sent.size(); i++)
+			b.setSent(sent[i]);
+		for(s16 d=0; d<=3; d++)
+			UASSERT(a.getUnsentCount(d) == b.getUnsentCount(d));
+	}
+};
+
 struct TestCollision: public TestBase
 {
 	void Run()
@@ -1560,6 +2408,84 @@ struct TestSocket: public TestBase
 			UASSERT(strncmp(sendbuffer, rcvbuffer, sizeof(sendbuffer))==0);
 			UASSERT(sender.getAddress().sin_addr.s_addr == Address(127,0,0,1, 0).getAddress().sin_addr.s_addr);
 		}
+
+		// Batched send and receive test
+		{
+			UDPSocket socket(false);
+			socket.Bind(port);
+			socket.setTimeoutMs(1000);
+			Address address(127,0,0,1,port);
+
+			const int packet_size = 512;
+			const int rounds = 10;
+			u8 header[2];
+			SharedBuffer<u8> sendbuffer(packet_size * UDP_BATCH_MAX);
+			SharedBuffer<u8> rcvbuffer(packet_size * UDP_BATCH_MAX);
+			Address senders[UDP_BATCH_MAX];
+			int sizes[UDP_BATCH_MAX];
+			UDPPacket packets[UDP_BATCH_MAX];
+			for(int i=0; i<UDP_BATCH_MAX; i++)
+			{
+				for(int j=0; j<packet_size; j++)
+					sendbuffer[i * packet_size + j] = (i + j) & 0xff;
+				packets[i].address = address;
+				packets[i].header = header;
+				packets[i].header_size = sizeof(header);
+				packets[i].data = &sendbuffer[i * packet_size];
+				packets[i].size = packet_size - sizeof(header);
+			}
+
+			/*
+				Send UDP_BATCH_MAX packets at a time, one call per packet
+				and then one call per batch, and check what arrives.
+			*/
+			for(int batched=0; batched<2; batched++)
+			{
+				u32 received = 0;
+				bool ok = true;
+				for(int r=0; r<rounds; r++)
+				{
+					writeU16(header, r);
+					if(batched)
+						socket.SendMany(packets, UDP_BATCH_MAX);
+					else
+						for(int i=0; i<UDP_BATCH_MAX; i++)
+							socket.Send(address, header, sizeof(header),
+									packets[i].data, packets[i].size);
+
+					int count = 0;
+					while(count < UDP_BATCH_MAX)
+					{
+						int c;
+						if(batched)
+						{
+							c = socket.ReceiveMany(&senders[count], &sizes[count],
+									&rcvbuffer[count * packet_size], packet_size,
+									UDP_BATCH_MAX - count);
+						}
+						else
+						{
+							sizes[count] = socket.Receive(senders[count],
+									&rcvbuffer[count * packet_size], packet_size);
+							c = sizes[count] < 0 ? 0 : 1;
+						}
+						if(c == 0)
+							break;
+						count += c;
+					}
+					for(int i=0; i<count; i++)
+					{
+						u8 *p = &rcvbuffer[i * packet_size];
+						if(sizes[i] != packet_size || readU16(p) != r
+								|| memcmp(p + 2, packets[i].data, packets[i].size) != 0)
+							ok = false;
+					}
+					received += count;
+				}
+				UASSERT(received == (u32)rounds * UDP_BATCH_MAX);
+				UASSERT(ok);
+			}
+		}
 	}
 };
 
@@ -1610,6 +2536,78 @@ struct TestConnection: public TestBase
 		UASSERT(readU8(&p2[0]) == TYPE_RELIABLE);
 		UASSERT(readU16(&p2[1]) == seqnum);
 		UASSERT(readU8(&p2[3]) == data1[0]);
+
+		UASSERT(con::seqnum_higher(2, 1));
+		UASSERT(con::seqnum_higher(0, 65535));
+		UASSERT(!con::seqnum_higher(65535, 0));
+		UASSERT(!con::seqnum_higher(65534, 2));
+
+		/*
+			ReliablePacketBuffer, across the seqnum wrap around and
+			growing over its initial size
+		*/
+		{
+			con::ReliablePacketBuffer buf;
+			for(u16 i=0; i<40; i++)
+			{
+				u16 s = 65520 + (i * 7) % 40;
+				SharedBuffer<u8> r = con::makeReliablePacket(data1, s);
+				con::BufferedPacket p = con::makePacket(a, r,
+						proto_id, peer_id, channel);
+				buf.insert(p);
+			}
+			UASSERT(buf.size() == 40);
+			u16 first = 0;
+			UASSERT(buf.getFirstSeqnum(&first) && first == 65520);
+			UASSERT(buf.findPacket(3) != NULL);
+			UASSERT(buf.findPacket(24) == NULL);
+			buf.popSeqnum(65520);
+			buf.popSeqnum(65521);
+			UASSERT(buf.getFirstSeqnum(&first) && first == 65522);
+			for(u16 s = 65522; s != 24; s++)
+			{
+				con::BufferedPacket p = buf.popFirst();
+				UASSERT(readU16(&p.data[BASE_HEADER_SIZE+1]) == s);
+			}
+			UASSERT(buf.empty());
+		}
+
+		/*
+			Split packets refer to parts of the data instead of copies
+		*/
+		{
+			SharedBuffer<u8> data(1000);
+			u16 split_seqnum = 5;
+			std::list<con::OutgoingPacket> chunks;
+			con::makeAutoSplitPacket(peer_id, channel, data, true, 400,
+					split_seqnum, chunks);
+			UASSERT(chunks.size() == 3);
+			UASSERT(split_seqnum == 6);
+			u32 offset = 0;
+			u16 chunk_num = 0;
+			for(std::list<con::OutgoingPacket>::iterator
+					i = chunks.begin(); i != chunks.end(); ++i)
+			{
+				UASSERT(*i->data == *data);
+				UASSERT(i->offset == offset);
+				UASSERT(i->header_size == SPLIT_HEADER_SIZE);
+				UASSERT(readU8(&i->header[0]) == TYPE_SPLIT);
+				UASSERT(readU16(&i->header[1]) == 5);
+				UASSERT(readU16(&i->header[3]) == 3);
+				UASSERT(readU16(&i->header[5]) == chunk_num);
+				offset += i->size;
+				chunk_num++;
+			}
+			UASSERT(offset == data.getSize());
+
+			chunks.clear();
+			con::makeAutoSplitPacket(peer_id, channel, data1, true, 400,
+					split_seqnum, chunks);
+			UASSERT(chunks.size() == 1);
+			UASSERT(split_seqnum == 6);
+			UASSERT(chunks.front().header_size == ORIGINAL_HEADER_SIZE);
+			UASSERT(chunks.front().size == data1.getSize());
+		}
 	}
 
 	struct Handler : public con::PeerHandler
@@ -1960,6 +2958,45 @@ struct TestConnection: public TestBase
 			UASSERT(peer_id == PEER_ID_SERVER);
 		}
 		
+		/*
+			Send a stream of packets over a lossy link. Lost packets
+			have to be re-sent without stalling the stream.
+		*/
+		{
+			const int count = 10;
+			const int datasize = 2000;
+			// Seeded so that the same packets are lost on every run
+			server.SetPacketLoss(10, 1);
+			client.SetPacketLoss(10, 2);
+			u32 timems0 = porting::getTimeMs();
+			for(int i=0; i<count; i++)
+			{
+				SharedBuffer<u8> data1(datasize);
+				for(int j=0; j<datasize; j++)
+					data1[j] = i + j;
+				server.Send(peer_id_client, 0, data1, true);
+			}
+			int received = 0;
+			bool in_order = true;
+			while(received < count && porting::getTimeMs() - timems0 < 5000)
+			{
+				SharedBuffer<u8> recvdata;
+				u16 peer_id = 132;
+				try{
+					u32 size = client.Receive(peer_id, recvdata);
+					if(size != datasize || recvdata[0] != (u8)received)
+						in_order = false;
+					received++;
+				}catch(con::NoIncomingDataException &e){
+					sleep_ms(1);
+				}
+			}
+			UASSERT(received == count);
+			UASSERT(in_order);
+			server.SetPacketLoss(0);
+			client.SetPacketLoss(0);
+		}
+
 		// Check peer handlers
 		UASSERT(hand_client.count == 1);
 		UASSERT(hand_client.last_id == 1);
@@ -1988,6 +3025,193 @@ struct TestConnection: public TestBase
 	tests_failed += x.test_failed ? 1 : 0;\
 }
 
+/*
+	Speed tests of the map code, using the test node definitions
+*/
+
+static void speedtestMapLighting(IItemDefManager *idef, INodeDefManager *ndef)
+{
+	infostream<<"Testing map lighting speed"<<std::endl;
+
+	TestGameDef gamedef(idef, ndef);
+	TestMapLighting::EditList edits =
+			TestMapLighting::makeEdits(&gamedef, 2000);
+	infostream<<edits.size()<<" edits on a 4x4x4 block map"<<std::endl;
+
+	TestMap single(&gamedef);
+	single.build();
+	{
+		TimeTaker timer("Updating light after each edit");
+		TestMapLighting::editSingle(single, edits);
+	}
+
+	TestMap batch(&gamedef);
+	batch.build();
+	{
+		TimeTaker timer("Updating light after all edits");
+		TestMapLighting::editBatch(batch, edits);
+	}
+
+	TestMap scratch(&gamedef);
+	scratch.build();
+	TestMapLighting::editNoLight(scratch, edits);
+	{
+		TimeTaker timer("Updating light from scratch");
+		TestMapLighting::relight(scratch);
+	}
+}
+
+static void speedtestMapFind(IItemDefManager *idef, INodeDefManager *ndef)
+{
+	infostream<<"Testing map find speed"<<std::endl;
+
+	TestGameDef gamedef(idef, ndef);
+	TestMap map(&gamedef);
+	map.build();
+
+	v3s16 minp(-40,-40,-40);
+	v3s16 maxp(39,39,39);
+	content_t contents[] = {CONTENT_TORCH, CONTENT_STONE, CONTENT_IGNORE};
+	for(u32 k=0; k<sizeof(contents)/sizeof(contents[0]); k++)
+	{
+		content_t c = contents[k];
+		std::set<content_t> filter;
+		filter.insert(c);
+		infostream<<"Finding "<<ndef->get(c).name<<std::endl;
+		{
+			TimeTaker timer("Node by node");
+			std::vector<v3s16> found;
+			TestMapFind::findNodesSlow(map, minp, maxp, c, found);
+		}
+		{
+			TimeTaker timer("findNodesInArea()");
+			std::vector<v3s16> found;
+			map.findNodesInArea(minp, maxp, filter, found);
+		}
+	}
+}
+
+static void speedtestMapBlockCompact(IItemDefManager *idef,
+		INodeDefManager *ndef)
+{
+	infostream<<"Testing compact block speed"<<std::endl;
+
+	TestGameDef gamedef(idef, ndef);
+	TestMap map(&gamedef);
+	map.build();
+	std::map<v3s16, MapBlock*> &blocks = map.m_blocks;
+
+	u32 bytes_before = 0;
+	for(std::map<v3s16, MapBlock*>::iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+		bytes_before += i->second->getNodeMemoryUsage();
+	{
+		TimeTaker timer("Reading all nodes of plain blocks");
+		TestMapBlockCompact::getNodes(blocks);
+	}
+
+	{
+		TimeTaker timer("Compacting the blocks");
+		for(std::map<v3s16, MapBlock*>::iterator
+				i = blocks.begin(); i != blocks.end(); ++i)
+			i->second->compact();
+	}
+	u32 bytes_after = 0;
+	for(std::map<v3s16, MapBlock*>::iterator
+			i = blocks.begin(); i != blocks.end(); ++i)
+		bytes_after += i->second->getNodeMemoryUsage();
+	infostream<<bytes_before<<" bytes of nodes before, "<<bytes_after
+			<<" after"<<std::endl;
+	{
+		TimeTaker timer("Reading all nodes of compact blocks");
+		TestMapBlockCompact::getNodes(blocks);
+	}
+}
+
+static void speedtestMapLiquid(IItemDefManager *idef, INodeDefManager *ndef)
+{
+	infostream<<"Testing map liquid speed"<<std::endl;
+
+	TestGameDef gamedef(idef, ndef);
+	u16 threads[] = {0, 1, 3};
+	for(u32 i=0; i<sizeof(threads)/sizeof(threads[0]); i++)
+	{
+		TestMap map(&gamedef);
+		map.build();
+		TestMapLiquid::flood(map);
+		u32 queued = map.transforming_liquid_size();
+		std::string desc = "100 liquid steps with " + itos(threads[i])
+				+ " threads";
+		u32 steps;
+		{
+			TimeTaker timer(desc.c_str());
+			steps = TestMapLiquid::transform(map, threads[i], 100);
+		}
+		infostream<<queued<<" nodes queued, "<<steps<<" steps run, "
+				<<map.transforming_liquid_size()<<" nodes left"<<std::endl;
+	}
+}
+
+static void speedtestLuaVoxelManip(IItemDefManager *idef,
+		INodeDefManager *ndef)
+{
+	infostream<<"Testing Lua VoxelManip speed"<<std::endl;
+
+	TestGameDef gamedef(idef, ndef);
+	TestMap map(&gamedef);
+	map.build();
+	ManualMapVoxelManipulator *vm = new ManualMapVoxelManipulator(&map);
+	vm->initialEmerge(v3s16(-2,-2,-2), v3s16(1,1,1));
+	infostream<<vm->m_area.getVolume()<<" nodes"<<std::endl;
+	// Deleted with the VoxelManip object, also if this fails
+	lua_State *L = TestLuaVoxelManip::newState(vm);
+	if(L == NULL)
+		return;
+	{
+		TimeTaker timer("Every node with a new table");
+		TestLuaVoxelManip::call(L, "gen_table", false, 1);
+	}
+	{
+		TimeTaker timer("Every node reusing the table");
+		TestLuaVoxelManip::call(L, "gen_table", true, 1);
+	}
+	{
+		TimeTaker timer("Every node reusing the table again");
+		TestLuaVoxelManip::call(L, "gen_table", true, 1);
+	}
+	{
+		TimeTaker timer("Every node with a view");
+		TestLuaVoxelManip::call(L, "gen_view", false, 1);
+	}
+	{
+		TimeTaker timer("Every 100th node with a table");
+		TestLuaVoxelManip::call(L, "gen_table", true, 100);
+	}
+	{
+		TimeTaker timer("Every 100th node with a view");
+		TestLuaVoxelManip::call(L, "gen_view", false, 100);
+	}
+	lua_close(L);
+}
+
+void run_map_speedtests()
+{
+	DSTACK(__FUNCTION_NAME);
+
+	IWritableItemDefManager *idef = createItemDefManager();
+	IWritableNodeDefManager *ndef = createNodeDefManager();
+	define_some_nodes(idef, ndef);
+
+	speedtestMapLighting(idef, ndef);
+	speedtestMapFind(idef, ndef);
+	speedtestMapBlockCompact(idef, ndef);
+	speedtestMapLiquid(idef, ndef);
+	speedtestLuaVoxelManip(idef, ndef);
+
+	delete idef;
+	delete ndef;
+}
+
 void run_tests()
 {
 	DSTACK(__FUNCTION_NAME);
@@ -2010,10 +3234,18 @@ void run_tests()
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
 	TESTPARAMS(TestVoxelAlgorithms, ndef);
+	TESTPARAMS(TestMapLighting, idef, ndef);
+	TESTPARAMS(TestMapFind, idef, ndef);
+	TESTPARAMS(TestMapBlockCompact, idef, ndef);
+	TESTPARAMS(TestMapLiquid, idef, ndef);
+	TESTPARAMS(TestMapSaver, idef, ndef);
+	TESTPARAMS(TestLuaVoxelManip, idef, ndef);
 	TESTPARAMS(TestInventory, idef);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	TEST(TestCollision);
+	TEST(TestNoise);
+	TEST(TestBlockSendSet);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
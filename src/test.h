@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define TEST_HEADER
 
 void run_tests();
+// Map speed tests that need the test node definitions, see SpeedTests()
+void run_map_speedtests();
 
 #endif
 
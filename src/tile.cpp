@@ -412,6 +412,9 @@ class TextureSource : public IWritableTextureSource
 
 	// Queued texture fetches (to be processed by the main thread)
 	RequestQueue<std::string, u32, u8, u8> m_get_texture_queue;
+	// Lets one thread at a time wait for a queued fetch; the mesh
+	// update threads share the same result queue
+	JMutex m_get_texture_wait_mutex;
 
 	// Textures that have been overwritten with other ones
 	// but can't be deleted because the ITexture* might still be used
@@ -434,6 +437,7 @@ TextureSource::TextureSource(IrrlichtDevice *device):
 	assert(m_device);
 
 	m_textureinfo_cache_mutex.Init();
+	m_get_texture_wait_mutex.Init();
 
 	m_main_thread = get_current_thread_id();
 
@@ -511,6 +515,8 @@ u32 TextureSource::getTextureId(const std::string &name)
 	{
 		infostream<<"getTextureId(): Queued: name=\""<<name<<"\""<<std::endl;
 
+		JMutexAutoLock lock(m_get_texture_wait_mutex);
+
 		// We're gonna ask the result to be put into here
 		static ResultQueue<std::string, u32, u8, u8> result_queue;
 
@@ -183,6 +183,41 @@ u64 murmur_hash_64_ua(const void *key, int len, unsigned int seed)
 } 
 
 
+/*
+	Whether a sphere that is d away from the camera may be seen; it is
+	if any part of it is inside the field of view.
+*/
+static bool isSphereInView(v3f center, f32 radius, f32 d,
+		v3f camera_pos, v3f camera_dir, f32 camera_fov)
+{
+	// If the sphere is (nearly) touching the camera, don't
+	// bother validating further (that is, render it anyway)
+	if(d < radius)
+		return true;
+
+	// Adjust camera position, for purposes of computing the angle,
+	// such that a sphere that has any portion visible with the
+	// current camera position will have the center visible at the
+	// adjusted postion
+	f32 adjdist = radius / cos((M_PI - camera_fov) / 2);
+
+	// Sphere position relative to adjusted camera
+	v3f center_adj = center - (camera_pos - camera_dir * adjdist);
+
+	// Distance in camera direction (+=front, -=back)
+	f32 dforward = center_adj.dotProduct(camera_dir);
+
+	// Cosine of the angle between the camera direction
+	// and the sphere direction (camera_dir is an unit vector)
+	f32 cosangle = dforward / center_adj.getLength();
+	
+	// If the sphere is not in the field of view, skip it
+	if(cosangle < cos(camera_fov / 2))
+		return false;
+
+	return true;
+}
+
 /*
 	blockpos: position of block in block coordinates
 	camera_pos: position of camera in nodes
@@ -218,31 +253,37 @@ bool isBlockInSight(v3s16 blockpos_b, v3f camera_pos, v3f camera_dir,
 	// sqrt(3.0) / 2.0 in literal form.
 	f32 block_max_radius = 0.866025403784 * MAP_BLOCKSIZE * BS;
 	
-	// If block is (nearly) touching the camera, don't
-	// bother validating further (that is, render it anyway)
-	if(d < block_max_radius)
-		return true;
+	return isSphereInView(blockpos, block_max_radius, d,
+			camera_pos, camera_dir, camera_fov);
+}
 
-	// Adjust camera position, for purposes of computing the angle,
-	// such that a block that has any portion visible with the
-	// current camera position will have the center visible at the
-	// adjusted postion
-	f32 adjdist = block_max_radius / cos((M_PI - camera_fov) / 2);
+/*
+	Like isBlockInSight(), for the box of blocks from blockpos_min to
+	blockpos_max. Returns false only if isBlockInSight() is false for
+	every block in it.
+*/
+bool isBlockAreaInSight(v3s16 blockpos_min, v3s16 blockpos_max,
+		v3f camera_pos, v3f camera_dir, f32 camera_fov, f32 range)
+{
+	v3f min_nodes(blockpos_min.X, blockpos_min.Y, blockpos_min.Z);
+	v3f max_nodes(blockpos_max.X + 1, blockpos_max.Y + 1, blockpos_max.Z + 1);
+	min_nodes *= MAP_BLOCKSIZE;
+	max_nodes *= MAP_BLOCKSIZE;
 
-	// Block position relative to adjusted camera
-	v3f blockpos_adj = blockpos - (camera_pos - camera_dir * adjdist);
+	v3f center = (min_nodes + max_nodes) * (0.5 * BS);
+	// The centers of the blocks are at most this far from the center
+	v3f block_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	f32 centers_radius = (max_nodes - min_nodes - block_size).getLength()
+			* (0.5 * BS);
 
-	// Distance in camera direction (+=front, -=back)
-	f32 dforward = blockpos_adj.dotProduct(camera_dir);
+	f32 d = (center - camera_pos).getLength();
 
-	// Cosine of the angle between the camera direction
-	// and the block direction (camera_dir is an unit vector)
-	f32 cosangle = dforward / blockpos_adj.getLength();
-	
-	// If block is not in the field of view, skip it
-	if(cosangle < cos(camera_fov / 2))
+	if(d - centers_radius > range)
 		return false;
 
-	return true;
+	// Contains the spheres isBlockInSight() uses for the blocks
+	f32 block_max_radius = 0.866025403784 * MAP_BLOCKSIZE * BS;
+	return isSphereInView(center, centers_radius + block_max_radius, d,
+			camera_pos, camera_dir, camera_fov);
 }
 
@@ -24,6 +24,20 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../debug.h" // For assert()
 #include <cstring>
 
+/*
+	The reference count of SharedBuffer is changed atomically, so copies
+	of one can be made and dropped in different threads as long as the
+	data is not written to after it is shared.
+*/
+#ifdef _MSC_VER
+	#include <intrin.h>
+	#define SHAREDBUFFER_GRAB(x) _InterlockedIncrement(x)
+	#define SHAREDBUFFER_DROP(x) _InterlockedDecrement(x)
+#else
+	#define SHAREDBUFFER_GRAB(x) __sync_add_and_fetch(x, 1)
+	#define SHAREDBUFFER_DROP(x) __sync_sub_and_fetch(x, 1)
+#endif
+
 template <typename T>
 class SharedPtr
 {
@@ -186,8 +200,8 @@ class SharedBuffer
 	{
 		m_size = 0;
 		data = NULL;
-		refcount = new unsigned int;
-		(*refcount) = 1;
+		// Nothing to count until it is assigned to
+		refcount = NULL;
 	}
 	SharedBuffer(unsigned int size)
 	{
@@ -196,7 +210,7 @@ class SharedBuffer
 			data = new T[m_size];
 		else
 			data = NULL;
-		refcount = new unsigned int;
+		refcount = new long;
 		memset(data,0,sizeof(T)*m_size);
 		(*refcount) = 1;
 	}
@@ -206,7 +220,8 @@ class SharedBuffer
 		m_size = buffer.m_size;
 		data = buffer.data;
 		refcount = buffer.refcount;
-		(*refcount)++;
+		if(refcount)
+			SHAREDBUFFER_GRAB(refcount);
 	}
 	SharedBuffer & operator=(const SharedBuffer & buffer)
 	{
@@ -217,7 +232,8 @@ class SharedBuffer
 		m_size = buffer.m_size;
 		data = buffer.data;
 		refcount = buffer.refcount;
-		(*refcount)++;
+		if(refcount)
+			SHAREDBUFFER_GRAB(refcount);
 		return *this;
 	}
 	/*
@@ -233,7 +249,7 @@ class SharedBuffer
 		}
 		else
 			data = NULL;
-		refcount = new unsigned int;
+		refcount = new long;
 		(*refcount) = 1;
 	}
 	/*
@@ -249,7 +265,7 @@ class SharedBuffer
 		}
 		else
 			data = NULL;
-		refcount = new unsigned int;
+		refcount = new long;
 		(*refcount) = 1;
 	}
 	~SharedBuffer()
@@ -276,9 +292,10 @@ class SharedBuffer
 private:
 	void drop()
 	{
+		if(refcount == NULL)
+			return;
 		assert((*refcount) > 0);
-		(*refcount)--;
-		if(*refcount == 0)
+		if(SHAREDBUFFER_DROP(refcount) == 0)
 		{
 			if(data)
 				delete[] data;
@@ -287,7 +304,7 @@ class SharedBuffer
 	}
 	T *data;
 	unsigned int m_size;
-	unsigned int *refcount;
+	volatile long *refcount;
 };
 
 inline SharedBuffer<u8> SharedBufferFromString(const char *string)
@@ -19,6 +19,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "voxelalgorithms.h"
 #include "nodedef.h"
+#include "map.h"
+#include "mapblock.h"
+#include <algorithm>
 
 namespace voxalgo
 {
@@ -153,5 +156,199 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 	return SunlightPropagateResult(bottom_sunlight_valid);
 }
 
+static const v3s16 light_dirs[6] = {
+	v3s16(0,0,1), // back
+	v3s16(0,1,0), // top
+	v3s16(1,0,0), // right
+	v3s16(0,0,-1), // front
+	v3s16(0,-1,0), // bottom
+	v3s16(-1,0,0), // left
+};
+
+MapLightUpdater::MapLightUpdater(Map *map, INodeDefManager *ndef,
+		enum LightBank bank, std::map<v3s16, MapBlock*> &modified_blocks):
+	m_map(map),
+	m_ndef(ndef),
+	m_bank(bank),
+	m_modified_blocks(modified_blocks)
+{
+}
+
+void MapLightUpdater::addUnlight(v3s16 p, u8 oldlight)
+{
+	QueuedNode n;
+	if(getQueuedNode(p, n))
+		m_unlight[oldlight].push_back(n);
+}
+
+void MapLightUpdater::addSource(v3s16 p)
+{
+	QueuedNode n;
+	if(getQueuedNode(p, n))
+		m_sources.push_back(n);
+}
+
+void MapLightUpdater::unspread()
+{
+	// Unlighting only queues nodes with less light than the current one,
+	// so each level is done when it is reached
+	for(s16 level=LIGHT_SUN; level>=0; level--)
+	{
+		std::vector<QueuedNode> &queue = m_unlight[level];
+		while(!queue.empty())
+		{
+			QueuedNode n = queue.back();
+			queue.pop_back();
+			for(u16 i=0; i<6; i++)
+			{
+				QueuedNode n2;
+				if(!getNeighbour(n, i, n2))
+					continue;
+				MapNode node2 = getNode(n2);
+				const ContentFeatures &f2 = m_ndef->get(node2);
+				u8 light2 = node2.getLight(m_bank, f2);
+				/*
+					If the neighbour is dimmer, it may have got its light
+					from here; otherwise it lights the area again.
+				*/
+				if(light2 >= level){
+					m_sources.push_back(n2);
+				}
+				else if(light2 != 0 && f2.light_propagates){
+					setLight(n2, node2, 0, f2);
+					m_unlight[light2].push_back(n2);
+				}
+			}
+		}
+	}
+	flushModified();
+}
+
+void MapLightUpdater::spread()
+{
+	std::sort(m_sources.begin(), m_sources.end());
+	m_sources.erase(std::unique(m_sources.begin(), m_sources.end()),
+			m_sources.end());
+	for(u32 i=0; i<m_sources.size(); i++)
+	{
+		u8 light = getNode(m_sources[i]).getLight(m_bank, m_ndef);
+		m_spread[light].push_back(m_sources[i]);
+	}
+	m_sources.clear();
+
+	s16 level = LIGHT_SUN;
+	for(;;)
+	{
+		while(level >= 0 && m_spread[level].empty())
+			level--;
+		if(level < 0)
+			break;
+		QueuedNode n = m_spread[level].back();
+		m_spread[level].pop_back();
+
+		u8 light = getNode(n).getLight(m_bank, m_ndef);
+		// Got brighter since queued; it is queued again at that level
+		if(light != level)
+			continue;
+		u8 newlight = diminish_light(light);
+
+		for(u16 i=0; i<6; i++)
+		{
+			QueuedNode n2;
+			if(!getNeighbour(n, i, n2))
+				continue;
+			MapNode node2 = getNode(n2);
+			const ContentFeatures &f2 = m_ndef->get(node2);
+			u8 light2 = node2.getLight(m_bank, f2);
+			/*
+				If the neighbour would light the current node, it has
+				to be spread from again
+			*/
+			if(diminish_light(light2) > light){
+				m_spread[light2].push_back(n2);
+				level = MYMAX(level, light2);
+			}
+			/*
+				If the neighbour is dimmer than how much light this node
+				would spread on it, light it
+			*/
+			else if(light2 < newlight && f2.light_propagates){
+				setLight(n2, node2, newlight, f2);
+				m_spread[newlight].push_back(n2);
+			}
+		}
+	}
+	flushModified();
+}
+
+bool MapLightUpdater::getQueuedNode(v3s16 p, QueuedNode &result)
+{
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock *block = m_map->getBlockNoCreateNoEx(blockpos);
+	if(block == NULL || block->isDummy())
+		return false;
+	v3s16 rel = p - blockpos * MAP_BLOCKSIZE;
+	result.block = block;
+	result.index = (rel.Z * MAP_BLOCKSIZE + rel.Y) * MAP_BLOCKSIZE + rel.X;
+	return true;
+}
+
+bool MapLightUpdater::getNeighbour(const QueuedNode &from, u16 dir,
+		QueuedNode &result)
+{
+	v3s16 rel(from.index % MAP_BLOCKSIZE,
+			from.index / MAP_BLOCKSIZE % MAP_BLOCKSIZE,
+			from.index / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+	rel += light_dirs[dir];
+	result.block = from.block;
+	if(rel.X < 0 || rel.X >= MAP_BLOCKSIZE
+			|| rel.Y < 0 || rel.Y >= MAP_BLOCKSIZE
+			|| rel.Z < 0 || rel.Z >= MAP_BLOCKSIZE)
+	{
+		result.block = m_map->getBlockNoCreateNoEx(
+				from.block->getPos() + light_dirs[dir]);
+		if(result.block == NULL || result.block->isDummy())
+			return false;
+		rel.X = (rel.X + MAP_BLOCKSIZE) % MAP_BLOCKSIZE;
+		rel.Y = (rel.Y + MAP_BLOCKSIZE) % MAP_BLOCKSIZE;
+		rel.Z = (rel.Z + MAP_BLOCKSIZE) % MAP_BLOCKSIZE;
+	}
+	result.index = (rel.Z * MAP_BLOCKSIZE + rel.Y) * MAP_BLOCKSIZE + rel.X;
+	return true;
+}
+
+MapNode MapLightUpdater::getNode(const QueuedNode &n)
+{
+	return n.block->getNodeAt(n.index);
+}
+
+void MapLightUpdater::setLight(const QueuedNode &n, MapNode &node, u8 light,
+		const ContentFeatures &f)
+{
+	node.setLight(m_bank, light, f);
+	n.block->setNodeAt(n.index, node);
+	setModified(n.block);
+}
+
+void MapLightUpdater::setModified(MapBlock *block)
+{
+	if(m_changed_blocks.empty() || m_changed_blocks.back() != block)
+		m_changed_blocks.push_back(block);
+}
+
+void MapLightUpdater::flushModified()
+{
+	std::sort(m_changed_blocks.begin(), m_changed_blocks.end());
+	m_changed_blocks.erase(std::unique(m_changed_blocks.begin(),
+			m_changed_blocks.end()), m_changed_blocks.end());
+	for(u32 i=0; i<m_changed_blocks.size(); i++)
+	{
+		MapBlock *block = m_changed_blocks[i];
+		block->raiseModified(MOD_STATE_WRITE_NEEDED, "updateLighting");
+		m_modified_blocks[block->getPos()] = block;
+	}
+	m_changed_blocks.clear();
+}
+
 } // namespace voxalgo
 
@@ -24,6 +24,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include <set>
 #include <map>
+#include <vector>
+
+class Map;
+class MapBlock;
 
 namespace voxalgo
 {
@@ -52,6 +56,71 @@ SunlightPropagateResult propagateSunlight(VoxelManipulator &v, VoxelArea a,
 		std::set<v3s16> & light_sources,
 		INodeDefManager *ndef);
 
+/*
+	Spreads and unspreads light on the Map, with one queue per light
+	level so that every node is handled about once per change of its
+	light. Queued nodes are a block and an index into its node array;
+	other blocks are only looked up when crossing a block border.
+
+	Changed blocks are added to modified_blocks and raised modified at
+	the end of unspread() and spread().
+*/
+class MapLightUpdater
+{
+public:
+	MapLightUpdater(Map *map, INodeDefManager *ndef, enum LightBank bank,
+			std::map<v3s16, MapBlock*> &modified_blocks);
+
+	// Queues p to remove the light it had, oldlight, from around it
+	void addUnlight(v3s16 p, u8 oldlight);
+	// Queues p to spread its light and take light from its neighbours
+	void addSource(v3s16 p);
+
+	// Sets the light of the nodes that got their light from the queued
+	// unlight positions to 0; the lit nodes around them become sources
+	void unspread();
+	void spread();
+
+private:
+	struct QueuedNode
+	{
+		MapBlock *block;
+		u16 index;
+
+		bool operator<(const QueuedNode &other) const
+		{
+			if(block != other.block)
+				return block < other.block;
+			return index < other.index;
+		}
+		bool operator==(const QueuedNode &other) const
+		{
+			return block == other.block && index == other.index;
+		}
+	};
+
+	bool getQueuedNode(v3s16 p, QueuedNode &result);
+	bool getNeighbour(const QueuedNode &from, u16 dir, QueuedNode &result);
+	MapNode getNode(const QueuedNode &n);
+	// Sets the light of node, which is the node at n, and writes it back
+	void setLight(const QueuedNode &n, MapNode &node, u8 light,
+			const ContentFeatures &f);
+	void setModified(MapBlock *block);
+	void flushModified();
+
+	Map *m_map;
+	INodeDefManager *m_ndef;
+	enum LightBank m_bank;
+	std::map<v3s16, MapBlock*> &m_modified_blocks;
+
+	// Indexed by the light the queued nodes had before unlighting
+	std::vector<QueuedNode> m_unlight[LIGHT_SUN + 1];
+	// Indexed by the light of the queued nodes
+	std::vector<QueuedNode> m_spread[LIGHT_SUN + 1];
+	std::vector<QueuedNode> m_sources;
+	std::vector<MapBlock*> m_changed_blocks;
+};
+
 } // namespace voxalgo
 
 #endif